@@ -90,7 +90,7 @@ void listNetworks()
   // print the network number and name for each network found:
   for (int thisNet = 0; thisNet < numSsid; thisNet++) {
 
-    char ssid[32];
+    char ssid[WL_SSID_MAX_LENGTH + 1];
     int32_t rssi;
     uint8_t enc;
 
@@ -23,14 +23,24 @@
  * Alternatively you can directly send the REST command by typing
  * on a browser the board's address and the desired command.
  * e.g. http://yourIpAddress:8080/jolly/digital/9/1
+ *
+ * The requests are parsed by WiFiHttpRequest right in the receive
+ * buffer of the socket, and WiFiHttpResponse sends each answer as a
+ * single packet. A browser keeping the connection open gets all its
+ * requests served on it.
  */
 
 
 #include "WiFi.h"
+#include "WiFiHttp.h"
 
 // server will listen on port 8080
 WiFiServer server(8080);
-WiFiClient client;
+// request parser, reused by all the connections
+WiFiHttpRequest request;
+
+// time a kept open connection can stay idle before being closed
+#define IDLE_TIMEOUT  2000
 
 
 void setup() {
@@ -84,9 +94,28 @@ void setup() {
 void loop() {
   // listen for incoming clients
   WiFiClient client = server.available();
-  while (client.connected()) {
-    // Process request
-    process(client);
+  if (client) {
+    request.reset();
+    unsigned long last = millis();
+
+    // serve the requests of the connection until the browser asks to close it
+    while (client.connected() && millis() - last < IDLE_TIMEOUT) {
+      teHttpParse ret = request.parse(client);
+      if (ret == HTTP_MORE)
+        continue;
+
+      WiFiHttpResponse response(client);
+      if (ret == HTTP_ERROR) {
+        // malformed or too long request
+        response.begin(request.error());
+        response.end();
+        break;
+      }
+      process(response);
+      if (!request.keepAlive())
+        break;
+      last = millis();
+    }
     // Close connection and free resources.
     delay(1);
     client.stop();
@@ -129,180 +158,114 @@ void printWifiStatus()
   Serial.println(" dBm");
 }
 
-bool listen_service(WiFiClient client, String service)
-{
-  //check service
-  String currentLine = "";
-  while (client.connected()) {
-    if (client.available() > 0) {
-      char c = client.read();
-      currentLine += c;
-      if (c == '\n') {
-        client.println("HTTP/1.1 200 OK");
-        client.println();
-        return 0;
-      }
-      else if (currentLine.endsWith(service + "/")) {
-        return 1;
-      }
-    }
-  }
-}
-
 // -----------------------------------------------------------------
-void digitalCommand(WiFiClient client) {
-  int pin, value;
-
-  // Read pin number
-  String pinNumber;
-  char c = client.read();
-  // If the next character is a '/' it means we have an URL
-  // with a value like: "/digital/9/1"
-  // If the next character is a ' ' it means we have an URL
-  // with a value like: "/digital/9"
-
-  while (c != ' ' && c != '/') {
-    pinNumber += c;
-    c = client.read();
-  }
-  pin = pinNumber.toInt();
+void digitalCommand(WiFiHttpResponse &response, int pin) {
+  int value;
 
-  if (c == '/') {
-    value = client.parseInt();
-    //value = 1;
+  // "/jolly/digital/9/1" has a value, "/jolly/digital/9" hasn't
+  if (request.segment(3) != NULL) {
+    value = atoi(request.segment(3));
     digitalWrite(pin, value);
 
-    // flush input before replying - needed by some browser
-    client.flush();
     // Send feedback to client
-    client.print("HTTP/1.1 200 OK\r\nAccess-Control-Allow-Origin: *\r\n\r\nPin D" + String(pin) + " set to: " + String(value));
+    response.print(F("Pin D"));
+    response.print(pin);
+    response.print(F(" set to: "));
+    response.print(value);
   }
   else {
     value = digitalRead(pin);
 
-    // flush input before replying - needed by some browser
-    client.flush();
     // Send feedback to client
-    client.print("HTTP/1.1 200 OK\r\nAccess-Control-Allow-Origin: *\r\n\r\nPin D" + String(pin) + " reads: " + String(value));
+    response.print(F("Pin D"));
+    response.print(pin);
+    response.print(F(" reads: "));
+    response.print(value);
   }
 }
 
 // -----------------------------------------------------------------
-void analogCommand(WiFiClient client) {
-  int pin, value;
-  // Read pin number
-  String pinNumber;
-
-  char c = client.read();
-
-  // If the next character is a '/' it means we have an URL
-  // with a value like: "/analog/5/120"
-  // If the next character is a ' ' it means we have an URL
-  // with a value like: "/analog/13"
-  while (c != ' ' && c != '/') {
-    pinNumber += c;
-    c = client.read();
-  }
-  pin = pinNumber.toInt();
-  // If the next character is a '/' it means we have an URL
-  // with a value like: "/analog/5/120"
-  if (c == '/') {
-    // Read value and execute command
-    String analogValue;
-    char c = client.read();
-    while (c != ' ' && c != '/') {
-      analogValue += c;
-      c = client.read();
-    }
-    value = analogValue.toInt();
+void analogCommand(WiFiHttpResponse &response, int pin) {
+  int value;
+
+  // "/jolly/analog/5/120" has a value, "/jolly/analog/13" hasn't
+  if (request.segment(3) != NULL) {
+    value = atoi(request.segment(3));
     analogWrite(pin, value);
 
-    // flush input before replying - needed by some browser
-    client.flush();
     // Send feedback to client
-    client.print("HTTP/1.1 200 OK\r\nAccess-Control-Allow-Origin: *\r\n\r\nPin A" + String(pin) + " set to: " + String(value));
+    response.print(F("Pin A"));
+    response.print(pin);
+    response.print(F(" set to: "));
+    response.print(value);
   }
   else {
     // Read analog pin
     value = analogRead(pin);
 
-    // flush input before replying - needed by some browser
-    client.flush();
     // Send feedback to client
-    client.print("HTTP/1.1 200 OK\r\nAccess-Control-Allow-Origin: *\r\n\r\nPin A" + String(pin) + " reads: " + String(value));
+    response.print(F("Pin A"));
+    response.print(pin);
+    response.print(F(" reads: "));
+    response.print(value);
   }
 }
 
 // -----------------------------------------------------------------
-void modeCommand(WiFiClient client) {
-  int pin;
-  char feedback[100];
-
-  // Read pin number
-  String pinNumber;
-  char c = client.read();
-  while (c != ' ' && c != '/') {
-    pinNumber += c;
-    c = client.read();
-  }
-  pin = pinNumber.toInt();
-  // If the next character is not a '/' we have a malformed URL
-  if (c != '/') {
-    // flush input before replying - needed by some browser
-    client.flush();
-    client.print("HTTP/1.1 200 OK\r\n\r\nError!\r\n\r\n");
-
-    return;
-  }
-
-  String mode = client.readStringUntil(' ');
-
-  if (mode == "input") {
+void modeCommand(WiFiHttpResponse &response, int pin) {
+  // "/jolly/mode/9/input" or "/jolly/mode/9/output"
+  if (request.segmentIs(3, F("input"))) {
     pinMode(pin, INPUT);
 
-    // flush input before replying - needed by some browser
-    client.flush();
     // Send feedback to client
-    client.print("HTTP/1.1 200 OK\r\nAccess-Control-Allow-Origin: *\r\n\r\nPin D" + String(pin) + " configured as INPUT!");
-
-    return;
+    response.print(F("Pin D"));
+    response.print(pin);
+    response.print(F(" configured as INPUT!"));
   }
-
-  if (mode == "output") {
+  else if (request.segmentIs(3, F("output"))) {
     pinMode(pin, OUTPUT);
 
-    // flush input before replying - needed by some browser
-    client.flush();
     // Send feedback to client
-    client.print("HTTP/1.1 200 OK\r\nAccess-Control-Allow-Origin: *\r\n\r\nPin D" + String(pin) + " configured as OUTPUT!\r\n");
-    return;
+    response.print(F("Pin D"));
+    response.print(pin);
+    response.print(F(" configured as OUTPUT!"));
+  }
+  else {
+    response.print(F("Error!\r\nInvalid mode "));
+    if (request.segment(3) != NULL)
+      response.print(request.segment(3));
   }
-
-  // flush input before replying - needed by some browser
-  client.flush();
-  client.print(String("HTTP/1.1 200 OK\r\n\r\nError!\r\nInvalid mode" + mode + "\r\n"));
 }
 
 // -----------------------------------------------------------------
-void process(WiFiClient client)
+void process(WiFiHttpResponse &response)
 {
-  // read the command//
-  if (listen_service(client, "jolly")) {
-    String command = client.readStringUntil('/');
+  // "/jolly/<command>/<pin>[/<value>]"
+  if (!request.segmentIs(0, F("jolly"))) {
+    response.begin(404, request.keepAlive());
+    response.end();
+    return;
+  }
 
-    if (command == "mode") {
-      modeCommand(client);
-    }
-    else if (command == "digital") {
-      digitalCommand(client);
-    }
-    else if (command == "analog") {
-      analogCommand(client);
-    }
-    else {
-      // flush input before replying - needed by some browser
-      client.flush();
-      client.print(String("HTTP/1.1 200 OK\r\n\r\nError!\r\nUnknown command : " + command + "\r\n\r\n"));
-    }
+  response.begin(200, request.keepAlive());
+  response.header(F("Access-Control-Allow-Origin: *"));
+
+  if (request.segment(2) == NULL) {
+    // no pin number
+    response.print(F("Error!"));
+  }
+  else if (request.segmentIs(1, F("mode"))) {
+    modeCommand(response, atoi(request.segment(2)));
+  }
+  else if (request.segmentIs(1, F("digital"))) {
+    digitalCommand(response, atoi(request.segment(2)));
+  }
+  else if (request.segmentIs(1, F("analog"))) {
+    analogCommand(response, atoi(request.segment(2)));
+  }
+  else {
+    response.print(F("Error!\r\nUnknown command : "));
+    response.print(request.segment(1));
   }
+  response.end();
 }
@@ -0,0 +1,303 @@
+/*
+  This library is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Lesser General Public
+  License as published by the Free Software Foundation; either
+  version 2.1 of the License, or (at your option) any later version.
+
+  This library is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with this library; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+#include <stdio.h>
+#include <map>
+
+#include "Arduino.h"
+#include <SPI.h>
+#include "esp_sim.h"
+
+/* -----------------------------------------------------------------
+* Virtual time of the 328. It moves forward only when the library calls
+* a timing, pin or SPI function, so the results don't depend on the host.
+*/
+tsSimTiming simTiming = {
+	2500,		// spiByteNs
+	1000,		// callNs
+	150000,		// espCmdNs
+	20000,		// espFrameNs
+	5000,		// ackPulseNs
+};
+tsSimStats simStats;
+
+static uint64_t nowNs = 0;
+static std::multimap<uint64_t, std::function<void(void)> > events;
+
+// interrupt controller
+static bool irqEnabled = true;
+static bool inIsr = false;
+static bool pcintPending = false;
+static bool stcPending = false;
+
+static uint8_t srLevel = LOW;
+static uint8_t ssLevel = HIGH;
+
+volatile uint8_t SPCR0;
+volatile uint8_t SPSR0;
+volatile uint8_t PCICR;
+volatile uint8_t PCMSK3;
+SimSpiDataReg SPDR0;
+static uint8_t spdrIn;
+
+extern "C" void PCINT3_vect(void);
+extern "C" void SPI0_STC_vect(void);
+
+SPIClass SPI;
+HardwareSerial Serial;
+
+/* -----------------------------------------------------------------
+* Runs the pending interrupts, one at a time and never nested
+*/
+static void dispatch(void)
+{
+	while(irqEnabled && !inIsr){
+		if(pcintPending && (PCICR & _BV(PCIE3))){
+			pcintPending = false;
+			inIsr = true;
+			PCINT3_vect();
+			inIsr = false;
+		}
+		else if(stcPending && (SPCR0 & _BV(SPIE))){
+			stcPending = false;
+			inIsr = true;
+			SPI0_STC_vect();
+			inIsr = false;
+		}
+		else
+			break;
+	}
+}
+
+// -----------------------------------------------------------------
+uint64_t sim_nanos(void)
+{
+	return nowNs;
+}
+
+/* -----------------------------------------------------------------
+* Moves the time forward running the esp actions that fall in the interval.
+* Interrupts are delivered after each action, so that every SR edge gets
+* its own pin change interrupt when the 328 is able to take it.
+*/
+void sim_advance(uint64_t ns)
+{
+	uint64_t target = nowNs + ns;
+
+	while(!events.empty() && events.begin()->first <= target){
+		std::multimap<uint64_t, std::function<void(void)> >::iterator it = events.begin();
+		std::function<void(void)> fn = it->second;
+		if(it->first > nowNs)
+			nowNs = it->first;
+		events.erase(it);
+		fn();
+		dispatch();
+	}
+	// an interrupt served above could have moved the time further
+	if(target > nowNs)
+		nowNs = target;
+	dispatch();
+}
+
+// -----------------------------------------------------------------
+void sim_schedule(uint64_t delayNs, std::function<void(void)> fn)
+{
+	events.insert(std::make_pair(nowNs + delayNs, fn));
+}
+
+// -----------------------------------------------------------------
+void sim_setSR(uint8_t level)
+{
+	if(level != srLevel){
+		srLevel = level;
+		pcintPending = true;
+	}
+}
+
+// -----------------------------------------------------------------
+void sim_cli(void)
+{
+	irqEnabled = false;
+}
+
+// -----------------------------------------------------------------
+void sim_sei(void)
+{
+	irqEnabled = true;
+	dispatch();
+}
+
+/* -----------------------------------------------------------------
+* Arduino core functions
+*/
+unsigned long millis(void)
+{
+	sim_advance(simTiming.callNs);
+	return (unsigned long)(nowNs / 1000000);
+}
+
+unsigned long micros(void)
+{
+	sim_advance(simTiming.callNs);
+	return (unsigned long)(nowNs / 1000);
+}
+
+void delay(unsigned long ms)
+{
+	sim_advance((uint64_t)ms * 1000000);
+}
+
+void delayMicroseconds(unsigned int us)
+{
+	sim_advance((uint64_t)us * 1000);
+}
+
+void yield(void)
+{
+}
+
+void pinMode(uint8_t pin, uint8_t mode)
+{
+	(void)pin;
+	(void)mode;
+}
+
+void digitalWrite(uint8_t pin, uint8_t val)
+{
+	if(pin == SLAVESELECT && val != ssLevel){
+		ssLevel = val;
+		espSim.csChanged(val);
+	}
+	sim_advance(simTiming.callNs);
+}
+
+int digitalRead(uint8_t pin)
+{
+	sim_advance(simTiming.callNs);
+	if(pin == SLAVEREADY)
+		return srLevel;
+	return LOW;
+}
+
+/* -----------------------------------------------------------------
+* SPI master
+*/
+static uint8_t spiExchange(uint8_t b)
+{
+	simStats.spiBytes++;
+	if(ssLevel == HIGH)
+		return 0xFF;
+	return espSim.exchange(b);
+}
+
+void SPIClass::begin()
+{
+}
+
+void SPIClass::end()
+{
+}
+
+uint8_t SPIClass::transfer(uint8_t data)
+{
+	uint8_t ret = spiExchange(data);
+	sim_advance(simTiming.spiByteNs);
+	return ret;
+}
+
+void SPIClass::transfer(void *buf, size_t count)
+{
+	uint8_t* p = (uint8_t*)buf;
+	while(count--){
+		*p = transfer(*p);
+		p++;
+	}
+}
+
+SimSpiDataReg& SimSpiDataReg::operator=(uint8_t b)
+{
+	spdrIn = spiExchange(b);
+	// transfer complete flag after one byte time
+	sim_schedule(simTiming.spiByteNs, [](){
+		if(SPCR0 & _BV(SPIE))
+			stcPending = true;
+	});
+	return *this;
+}
+
+SimSpiDataReg::operator uint8_t() const
+{
+	return spdrIn;
+}
+
+/* -----------------------------------------------------------------
+* Serial port and avr-libc extensions
+*/
+size_t HardwareSerial::write(uint8_t c)
+{
+	putchar(c);
+	return 1;
+}
+
+static char* _toa(unsigned long value, char* str, int radix, bool neg)
+{
+	char tmp[33];
+	int i = 0;
+	int j = 0;
+
+	do{
+		int d = value % radix;
+		tmp[i++] = (d < 10) ? '0' + d : 'a' + d - 10;
+		value /= radix;
+	}while(value && i < 32);
+
+	if(neg)
+		str[j++] = '-';
+	while(i)
+		str[j++] = tmp[--i];
+	str[j] = 0;
+	return str;
+}
+
+extern "C" char* itoa(int value, char* str, int radix)
+{
+	if(value < 0 && radix == 10)
+		return _toa(-(long)value, str, radix, true);
+	return _toa((unsigned int)value, str, radix, false);
+}
+
+extern "C" char* ltoa(long value, char* str, int radix)
+{
+	if(value < 0 && radix == 10)
+		return _toa(-value, str, radix, true);
+	return _toa((unsigned long)value, str, radix, false);
+}
+
+extern "C" char* utoa(unsigned int value, char* str, int radix)
+{
+	return _toa(value, str, radix, false);
+}
+
+extern "C" char* ultoa(unsigned long value, char* str, int radix)
+{
+	return _toa(value, str, radix, false);
+}
+
+extern "C" char* dtostrf(double val, signed char width, unsigned char prec, char* s)
+{
+	sprintf(s, "%*.*f", width, prec, val);
+	return s;
+}
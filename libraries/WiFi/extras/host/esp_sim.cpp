@@ -0,0 +1,1164 @@
+/*
+  This library is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Lesser General Public
+  License as published by the Free Software Foundation; either
+  version 2.1 of the License, or (at your option) any later version.
+
+  This library is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with this library; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+// library headers first, the host socket and time headers define some of its names as macros
+#include "Arduino.h"
+#include "utility/packager.h"
+#include "esp_sim.h"
+
+#include <util/crc16.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+
+
+// same length as the real firmware strings, the library keeps WL_FW_VER_LENGTH bytes
+#define SIM_FW_VERSION		"0.1.0"
+#define SIM_SOCK_RX_MAX		65536
+// the firmware looks at the sockets every millisecond to push their events
+#define SIM_EV_POLL_NS		1000000
+
+EspSim espSim;
+
+/* -----------------------------------------------------------------
+* Reply packet builder: START_CMD, cmd|REPLY_FLAG, len, nParam, [len, param]..., END_CMD
+*/
+class SimReply
+{
+	public:
+	std::vector<uint8_t> b;
+
+	SimReply(uint8_t cmd)
+	{
+		b.push_back(START_CMD);
+		b.push_back(cmd | REPLY_FLAG);
+		b.push_back(0);
+		b.push_back(0);
+	}
+
+	void param(const void* p, uint8_t len)
+	{
+		b.push_back(len);
+		b.insert(b.end(), (const uint8_t*)p, (const uint8_t*)p + len);
+		b[3]++;
+	}
+
+	void param8(uint8_t v)
+	{
+		param(&v, 1);
+	}
+
+	std::vector<uint8_t>& done(void)
+	{
+		b.push_back(END_CMD);
+		b[2] = (uint8_t)b.size();
+		return b;
+	}
+};
+
+/* -----------------------------------------------------------------
+* Data packet sent by the esp: DATA_PKT, cmd|REPLY_FLAG, len (4 bytes), payload, END_CMD
+*/
+static std::vector<uint8_t> dataReply(uint8_t cmd, const std::vector<uint8_t>& payload)
+{
+	std::vector<uint8_t> b;
+	uint32_t n = payload.size();
+
+	b.push_back(DATA_PKT);
+	b.push_back(cmd | REPLY_FLAG);
+	b.push_back(n & 0xFF);
+	b.push_back((n >> 8) & 0xFF);
+	b.push_back((n >> 16) & 0xFF);
+	b.push_back((n >> 24) & 0xFF);
+	b.insert(b.end(), payload.begin(), payload.end());
+	b.push_back(END_CMD);
+	return b;
+}
+
+// networks found by the simulated scan
+static const struct{
+	const char* ssid;
+	int8_t rssi;
+	uint8_t enc;
+}simNetworks[] = {
+	{ "jolly-sim", -40, ENC_TYPE_CCMP },
+	{ "guest", -52, ENC_TYPE_NONE },
+	{ "office-2.4GHz", -61, ENC_TYPE_CCMP },
+	{ "lab", -67, ENC_TYPE_TKIP },
+	{ "a-network-name-of-32-characters!", -70, ENC_TYPE_CCMP },
+	{ "printer-setup", -74, ENC_TYPE_NONE },
+	{ "", -77, ENC_TYPE_CCMP },
+	{ "neighbour", -81, ENC_TYPE_AUTO },
+	{ "old-router", -85, ENC_TYPE_WEP },
+	{ "far-away", -90, ENC_TYPE_CCMP },
+};
+#define SIM_NETWORKS	(sizeof(simNetworks) / sizeof(simNetworks[0]))
+
+static void setNonBlocking(int fd)
+{
+	fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK);
+}
+
+// -----------------------------------------------------------------
+EspSim::EspSim()
+{
+	for(uint8_t i = 0; i < MAX_SOCK_NUM; i++){
+		_sock[i].fd = -1;
+		_sock[i].listenFd = -1;
+	}
+	_evTimer = 0;
+	reset();
+}
+
+// -----------------------------------------------------------------
+void EspSim::reset(void)
+{
+	_spiState = spi_cmd;
+	_spiIdx = 0;
+	_cs = HIGH;
+	_frameIdx = 0;
+	_duplexOut = false;
+	_in.clear();
+	_inLen = 0;
+	_out.clear();
+	_outReady.clear();
+	_outPos = 0;
+	_srHigh = false;
+	_srRaisedNs = 0;
+	_replyArmed = false;
+	_caps = 0;
+	_winXid = 0;
+	_winInOrder = 0;
+	_winAhead.clear();
+	_winStream.clear();
+	_winDone = false;
+	_winCount = 0;
+	_status = 0;
+	_evTimer++;
+
+	for(uint8_t i = 0; i < 128; i++)
+		supported[i] = true;
+	fwCaps = WIFI_CAP_VARLEN | WIFI_CAP_WINDOW | WIFI_CAP_DUPLEX | WIFI_CAP_SOCK_EVENTS | WIFI_CAP_SEND_MULTI | WIFI_CAP_STOP_SERVER |
+			 WIFI_CAP_UDP_PARSE | WIFI_CAP_BATCH | WIFI_CAP_SCAN_LIST;
+	winDropEvery = 0;
+
+	for(uint8_t i = 0; i < MAX_SOCK_NUM; i++){
+		if(_sock[i].listenFd >= 0)
+			close(_sock[i].listenFd);
+		_sock[i].listenFd = -1;
+		_sockClose(i, false);
+		_sock[i].sent = false;
+		_sock[i].evState = CLOSED;
+		_sock[i].evAvail = 0;
+	}
+}
+
+/* -----------------------------------------------------------------
+* SS line of the SPI slave. A new transaction starts on the falling edge,
+* queued replies are announced only while the bus is released.
+*/
+void EspSim::csChanged(uint8_t level)
+{
+	_cs = level;
+	if(level == LOW){
+		_spiState = spi_cmd;
+		_spiIdx = 0;
+		_frameIdx = 0;
+		return;
+	}
+
+	if(_caps & WIFI_CAP_VARLEN)
+		_frameEnd();
+
+	if(!_out.empty() && !_srHigh && !_replyArmed){
+		_armReply(simTiming.espFrameNs);
+	}
+}
+
+/* -----------------------------------------------------------------
+* One byte of the SPI slave: the first byte of a transaction selects the
+* operation, data read and write are followed by a dummy byte and a frame.
+*/
+uint8_t EspSim::exchange(uint8_t mosi)
+{
+	uint8_t miso = 0;
+
+	switch(_spiState){
+		case spi_cmd:
+			_spiIdx = 0;
+			if(mosi == 0x02)
+				_spiState = spi_write;
+			else if(mosi == 0x03)
+				_spiState = spi_read;
+			else if(mosi == 0x04)
+				_spiState = spi_status_read;
+			else if(mosi == 0x01)
+				_spiState = spi_status_write;
+		break;
+		case spi_write:
+			if(_spiIdx++ == 0){	// dummy byte
+				// the MISO buffer holds the first frame of the pending packet while SR is HIGH
+				_duplexOut = (_caps & WIFI_CAP_DUPLEX) && _srHigh && !_out.empty() && _outPos == 0;
+				if(_duplexOut)
+					_readStarted();
+				break;
+			}
+			if(_duplexOut)
+				miso = _out.front()[_outPos + _frameIdx];
+			_frame[_frameIdx++] = mosi;
+			if(_frameIdx == SPI_BUF_LEN)
+				_writeDone(SPI_BUF_LEN);
+		break;
+		case spi_read:
+			if(_spiIdx++ == 0){	// dummy byte
+				if(_srHigh)
+					_readStarted();
+				break;
+			}
+			if(!_out.empty() && _srHigh){
+				miso = _out.front()[_outPos++];
+				if((_outPos % SPI_BUF_LEN) == 0){
+					_spiState = spi_cmd;
+					simStats.frames++;
+					_frameRead();
+				}
+			}
+			else if(_spiIdx == SPI_BUF_LEN + 1)
+				_spiState = spi_cmd;
+		break;
+		case spi_status_read:
+			// little-endian, the register is read without the esp cpu
+			miso = (_status >> (8 * _spiIdx)) & 0xFF;
+			if(++_spiIdx == 4)
+				_spiState = spi_cmd;
+		break;
+		case spi_status_write:
+			if(++_spiIdx == 4)
+				_spiState = spi_cmd;
+		break;
+	}
+	return miso;
+}
+
+/* -----------------------------------------------------------------
+* CS rising edge in the middle of a frame: a short write is zero filled,
+* a short read skips the rest of the frame.
+*/
+void EspSim::_frameEnd(void)
+{
+	if(_spiState == spi_write && _frameIdx > 0){
+		uint8_t written = _frameIdx;
+		memset(_frame + _frameIdx, 0, SPI_BUF_LEN - _frameIdx);
+		_writeDone(written);
+	}
+	else if(_spiState == spi_read && _spiIdx > 1 && !_out.empty() && _srHigh && (_outPos % SPI_BUF_LEN) != 0){
+		_outPos += SPI_BUF_LEN - (_outPos % SPI_BUF_LEN);
+		_spiState = spi_cmd;
+		simStats.frames++;
+		_frameRead();
+	}
+}
+
+/* -----------------------------------------------------------------
+* End of a written frame. The frame shifted out on MISO is taken as read
+* when the written one is a whole packet and the write clocked all the bytes
+* of the esp packet, as the 328 only captures in that case.
+*/
+void EspSim::_writeDone(uint8_t written)
+{
+	bool single = false;
+	uint32_t outLen = SPI_BUF_LEN;
+
+	if(_duplexOut && (_caps & WIFI_CAP_VARLEN)){
+		const std::vector<uint8_t>& o = _out.front();
+		if(o[0] == START_CMD)
+			outLen = o[2];
+		else
+			outLen = (o[2] | ((uint32_t)o[3] << 8) | ((uint32_t)o[4] << 16) | ((uint32_t)o[5] << 24)) + DATA_PKT_HDR_LEN;
+		if(outLen > SPI_BUF_LEN)
+			outLen = SPI_BUF_LEN;
+	}
+
+	if(_in.empty() && _frame[0] == START_CMD)
+		single = (_frame[2] <= SPI_BUF_LEN);
+	else if(_in.empty() && _frame[0] == DATA_PKT)
+		single = ((_frame[2] | ((uint32_t)_frame[3] << 8) | ((uint32_t)_frame[4] << 16) | ((uint32_t)_frame[5] << 24)) <= SPI_BUF_LEN);
+
+	_frameIdx = 0;
+	_spiState = spi_cmd;
+	simStats.frames++;
+
+	if(_duplexOut && single && written >= outLen){
+		_outPos += SPI_BUF_LEN;
+		simStats.frames++;
+		_frameRead();
+	}
+	_duplexOut = false;
+
+	_frameReceived();
+}
+
+/* -----------------------------------------------------------------
+* A frame has been read by the 328: SR goes low, then high again if
+* the packet has more frames or another reply is waiting.
+*/
+void EspSim::_frameRead(void)
+{
+	_srHigh = false;
+	sim_schedule(1000, [](){ sim_setSR(LOW); });
+
+	if(_outPos >= _out.front().size()){
+		_out.pop_front();
+		_outReady.pop_front();
+		_outPos = 0;
+		if(!_out.empty() && _cs == HIGH)
+			_armReply(simTiming.espFrameNs);
+	}
+	else
+		_armReply(simTiming.espFrameNs, true);
+}
+
+// -----------------------------------------------------------------
+void EspSim::_armReply(uint32_t delayNs, bool anyCs)
+{
+	uint64_t now = sim_nanos();
+
+	// the first frame of a reply can't be ready before the command is executed
+	if(_outPos == 0 && !_outReady.empty() && _outReady.front() > now + delayNs)
+		delayNs = _outReady.front() - now;
+
+	_replyArmed = true;
+	sim_schedule(delayNs, [this, anyCs](){
+		_replyArmed = false;
+		if(!_out.empty() && !_srHigh && (anyCs || _cs == HIGH))
+			_raiseSR();
+	});
+}
+
+// -----------------------------------------------------------------
+void EspSim::_raiseSR(void)
+{
+	_srHigh = true;
+	_srRaisedNs = sim_nanos();
+	sim_setSR(HIGH);
+}
+
+/* -----------------------------------------------------------------
+* The 328 starts reading the frame announced by the SR: the esp has been
+* waiting for it since the rising edge
+*/
+void EspSim::_readStarted(void)
+{
+	if(_srRaisedNs == 0)
+		return;
+
+	uint64_t ns = sim_nanos() - _srRaisedNs;
+	simStats.srWaits++;
+	simStats.srWaitNs += ns;
+	if(ns > simStats.srWaitMaxNs)
+		simStats.srWaitMaxNs = ns;
+	_srRaisedNs = 0;
+}
+
+/* -----------------------------------------------------------------
+* Short SR pulse telling the 328 that the next frame of a packet can be sent
+*/
+void EspSim::_ackFrame(void)
+{
+	sim_schedule(simTiming.espFrameNs, [](){
+		sim_setSR(HIGH);
+		sim_schedule(simTiming.ackPulseNs, [](){ sim_setSR(LOW); });
+	});
+}
+
+// -----------------------------------------------------------------
+void EspSim::_queueReply(const std::vector<uint8_t>& pkt)
+{
+	std::vector<uint8_t> frames(pkt);
+
+	// whole frames, zero filled
+	frames.resize((pkt.size() + SPI_BUF_LEN - 1) / SPI_BUF_LEN * SPI_BUF_LEN, 0);
+	_out.push_back(frames);
+	_outReady.push_back(sim_nanos() + simTiming.espCmdNs);
+
+	if(_out.size() == 1 && !_srHigh && !_replyArmed && _cs == HIGH)
+		_armReply(simTiming.espCmdNs);
+}
+
+/* -----------------------------------------------------------------
+* Collects the frames of a packet, using the length in its header
+*/
+void EspSim::_frameReceived(void)
+{
+	// transfer ids of the windowed frames are 1..0x7f, packets start with 0xe0 or 0xf0
+	if(_in.empty() && (_caps & WIFI_CAP_WINDOW) && _frame[0] != 0 && _frame[0] < 0x80){
+		_winFrame();
+		return;
+	}
+
+	if(_in.empty()){
+		if(_frame[0] == START_CMD)
+			_inLen = _frame[2];
+		else if(_frame[0] == DATA_PKT)
+			_inLen = _frame[2] | ((uint32_t)_frame[3] << 8) | ((uint32_t)_frame[4] << 16) | ((uint32_t)_frame[5] << 24);
+		else
+			return;	// not the start of a packet: drop it
+
+		if(_inLen < 5 || _inLen > 0x10000)
+			return;
+	}
+
+	_in.insert(_in.end(), _frame, _frame + SPI_BUF_LEN);
+
+	if(_in.size() < _inLen){
+		_ackFrame();
+		return;
+	}
+
+	_packetReceived();
+	_in.clear();
+}
+
+/* -----------------------------------------------------------------
+* Frame of a windowed transfer: xid, seq, WIN_FRAME_DATA packet bytes, CRC-8.
+* No ack pulse, the status register tells the 328 what has been received.
+*/
+void EspSim::_winFrame(void)
+{
+	uint8_t crc = 0;
+
+	for(uint8_t i = 0; i < SPI_BUF_LEN - 1; i++)
+		crc = _crc8_ccitt_update(crc, _frame[i]);
+
+	// overrun of the slave buffer, the frame never reaches the firmware
+	if(winDropEvery && (++_winCount % winDropEvery) == 0)
+		return;
+	if(crc != _frame[SPI_BUF_LEN - 1])
+		return;
+
+	// a new transfer id starts a new packet
+	if(_frame[0] != _winXid){
+		_winXid = _frame[0];
+		_winInOrder = 0;
+		_winAhead.clear();
+		_winStream.clear();
+		_winDone = false;
+	}
+
+	// frames already received or beyond the ack bitmap are dropped
+	uint16_t idx = _winInOrder + (uint8_t)(_frame[1] - (uint8_t)_winInOrder);
+	if(idx <= _winInOrder + 8 && !_winDone)
+		_winAhead[idx].assign(_frame + 2, _frame + 2 + WIN_FRAME_DATA);
+
+	while(_winAhead.count(_winInOrder)){
+		std::vector<uint8_t>& f = _winAhead[_winInOrder];
+		_winStream.insert(_winStream.end(), f.begin(), f.end());
+		_winAhead.erase(_winInOrder);
+		_winInOrder++;
+	}
+
+	if(!_winDone && _winStream.size() >= 6 && _winStream[0] == DATA_PKT){
+		uint32_t len = _winStream[2] | ((uint32_t)_winStream[3] << 8) | ((uint32_t)_winStream[4] << 16) | ((uint32_t)_winStream[5] << 24);
+		if(_winStream.size() >= len){
+			_winDone = true;
+			_in.assign(_winStream.begin(), _winStream.begin() + len);
+			_inLen = len;
+			_packetReceived();
+			_in.clear();
+		}
+	}
+
+	uint8_t ahead = 0;
+	for(uint8_t k = 0; k < 8; k++)
+		if(_winAhead.count(_winInOrder + 1 + k))
+			ahead |= 1 << k;
+	_status = _winXid | ((uint32_t)_winInOrder << 8) | ((uint32_t)ahead << 24);
+}
+
+/* -----------------------------------------------------------------
+* Capability of the firmware that adds the command, 0 for the commands of
+* the basic protocol
+*/
+static uint16_t cmdCap(uint8_t cmd)
+{
+	switch(cmd){
+		case PARSE_PACKET_UDP:
+			return WIFI_CAP_UDP_PARSE;
+		case BATCH_CMD:
+			return WIFI_CAP_BATCH;
+		case GET_SCAN_LIST_CMD:
+			return WIFI_CAP_SCAN_LIST;
+		default:
+			return 0;
+	}
+}
+
+// -----------------------------------------------------------------
+void EspSim::_packetReceived(void)
+{
+	uint8_t cmd = _in[1] & ~(REPLY_FLAG);
+
+	simStats.packets++;
+	simStats.cmdCount[cmd & 0x7F]++;
+
+	// a firmware without the capability doesn't know the command either
+	if(!supported[cmd & 0x7F] || (cmdCap(cmd & 0x7F) & ~fwCaps))
+		return;
+
+	pollNetwork();
+
+	if(_in[0] == START_CMD){
+		if(_in[_inLen - 1] != END_CMD)
+			return;
+		_execCmd(cmd, _in[3], &_in[4], &_in[_inLen - 1]);
+	}
+	else{
+		if(_in[_inLen - 1] != END_CMD)
+			return;
+		_execData(cmd, &_in[0], _inLen);
+	}
+
+	// the events follow the reply
+	_sockEvents();
+}
+
+/* -----------------------------------------------------------------
+* Splits the [len, param] list of a command
+*/
+static uint8_t splitParams(const uint8_t* p, const uint8_t* end, uint8_t nParam, const uint8_t** param, uint8_t* len)
+{
+	uint8_t n = 0;
+
+	while(n < nParam && n < MAX_PARAM_NUMS && p < end){
+		len[n] = p[0];
+		param[n] = p + 1;
+		if(param[n] + len[n] > end)
+			break;
+		p += len[n] + 1;
+		n++;
+	}
+	return n;
+}
+
+// -----------------------------------------------------------------
+void EspSim::_execCmd(uint8_t cmd, uint8_t nParam, const uint8_t* params, const uint8_t* end)
+{
+	const uint8_t* param[MAX_PARAM_NUMS];
+	uint8_t len[MAX_PARAM_NUMS];
+	SimReply reply(cmd);
+	uint8_t s;
+
+	if(cmd == BATCH_CMD){
+		// nParam is the number of commands: [cmd, nParam, [len, param]...]...
+		const uint8_t* p = params;
+		for(uint8_t i = 0; i < nParam && p + 2 <= end; i++){
+			uint8_t subCmd = p[0];
+			uint8_t subN = p[1];
+			const uint8_t* q = p + 2;
+			for(uint8_t k = 0; k < subN && q < end; k++)
+				q += q[0] + 1;
+			if(q > end)
+				break;
+
+			std::vector<uint8_t> item;
+			_batchItem(subCmd, p + 2, subN, item);
+			if(reply.b.size() + item.size() + 1 > SPI_BUF_LEN)
+				break;	// replies that don't fit are dropped
+			reply.b.insert(reply.b.end(), item.begin(), item.end());
+			reply.b[3]++;
+			p = q;
+		}
+		_queueReply(reply.done());
+		return;
+	}
+
+	uint8_t n = splitParams(params, end, nParam, param, len);
+
+	switch(cmd){
+		case GET_CONN_STATUS:
+		case CONNECT_OPEN_AP:
+		case CONNECT_SECURED_AP:
+		case SET_KEY_CMD:
+			reply.param8(WL_CONNECTED);
+		break;
+		case DISCONNECT_CMD:
+			reply.param8(WL_DISCONNECTED);
+		break;
+		case GET_CAPS_CMD:{
+			// little endian caps, replied with as many bytes as offered (1 or 2).
+			// The new frame format starts with the next transaction
+			uint8_t size = (n == 1 && len[0] == 2) ? 2 : 1;
+			uint16_t offered = 0;
+			if(n == 1 && len[0] == size)
+				offered = param[0][0] | ((size == 2) ? (uint16_t)param[0][1] << 8 : 0);
+			_caps = offered & fwCaps;
+			uint8_t capsLE[2] = { (uint8_t)(_caps & 0xFF), (uint8_t)(_caps >> 8) };
+			reply.param(capsLE, size);
+			if(_caps & WIFI_CAP_SOCK_EVENTS){
+				uint32_t timer = ++_evTimer;
+				sim_schedule(SIM_EV_POLL_NS, [this, timer](){ _evPoll(timer); });
+			}
+		}break;
+		case GET_FW_VERSION_CMD:
+			reply.param(SIM_FW_VERSION, strlen(SIM_FW_VERSION));
+		break;
+		case GET_HOSTNAME:
+		case SET_HOSTNAME:
+			reply.param("jolly-sim", 9);
+		break;
+		case GET_MACADDR_CMD:{
+			uint8_t mac[WL_MAC_ADDR_LENGTH] = { 0x02, 0x00, 0x00, 0x00, 0x00, 0x01 };
+			reply.param(mac, WL_MAC_ADDR_LENGTH);
+		}break;
+		case GET_IPADDR_CMD:{
+			uint8_t ip[4] = { 127, 0, 0, 1 };
+			uint8_t mask[4] = { 255, 0, 0, 0 };
+			reply.param(ip, 4);
+			reply.param(mask, 4);
+			reply.param(ip, 4);
+		}break;
+		case GET_CURR_RSSI_CMD:{
+			int32_t rssi = -40;
+			reply.param(&rssi, 4);
+		}break;
+		case DISABLE_WEBPANEL:
+			reply.param8(1);
+		break;
+		case START_SCAN_NETWORKS:
+			reply.param8(SIM_NETWORKS);
+		break;
+		case GET_SCAN_LIST_CMD:{
+			// count, then [rssi, enc, ssid len, ssid] for each network
+			uint8_t max = (n > 0 && len[0] > 0) ? param[0][0] : 0;
+			std::vector<uint8_t> list;
+			if(max > SIM_NETWORKS)
+				max = SIM_NETWORKS;
+			list.push_back(max);
+			for(uint8_t i = 0; i < max; i++){
+				list.push_back((uint8_t)simNetworks[i].rssi);
+				list.push_back(simNetworks[i].enc);
+				list.push_back(strlen(simNetworks[i].ssid));
+				list.insert(list.end(), simNetworks[i].ssid, simNetworks[i].ssid + strlen(simNetworks[i].ssid));
+			}
+			_queueReply(dataReply(cmd, list));
+		}return;
+		case SCAN_NETWORKS_RESULT:{
+			// which, rssi (4 bytes), enc, ssid len, ssid
+			uint8_t i = (n > 0 && len[0] > 0) ? param[0][0] : 0;
+			std::vector<uint8_t> net;
+			if(i >= SIM_NETWORKS)
+				return;
+			int32_t rssi = simNetworks[i].rssi;
+			net.push_back(i);
+			net.insert(net.end(), (uint8_t*)&rssi, (uint8_t*)&rssi + 4);
+			net.push_back(simNetworks[i].enc);
+			net.push_back(strlen(simNetworks[i].ssid));
+			net.insert(net.end(), simNetworks[i].ssid, simNetworks[i].ssid + strlen(simNetworks[i].ssid));
+			_queueReply(dataReply(cmd, net));
+		}return;
+		case GET_IDX_RSSI_CMD:{
+			uint8_t i = (n > 0 && len[0] > 0) ? param[0][0] : 0;
+			int32_t rssi = (i < SIM_NETWORKS) ? simNetworks[i].rssi : 0;
+			reply.param(&rssi, 4);
+		}break;
+		case GET_IDX_ENCT_CMD:{
+			uint8_t i = (n > 0 && len[0] > 0) ? param[0][0] : 0;
+			reply.param8((i < SIM_NETWORKS) ? simNetworks[i].enc : (uint8_t)ENC_TYPE_UNKNOW);
+		}break;
+		case GET_HOST_BY_NAME_CMD:{
+			char name[256] = { 0 };
+			struct in_addr addr;
+			if(n > 0)
+				memcpy(name, param[0], len[0]);
+			// no name resolution in the simulation: numeric addresses and local names only
+			if(inet_pton(AF_INET, name, &addr) == 1 || !strcmp(name, "localhost") ||
+			   (strlen(name) > 4 && !strcmp(name + strlen(name) - 4, ".sim"))){
+				if(inet_pton(AF_INET, name, &addr) != 1)
+					addr.s_addr = htonl(INADDR_LOOPBACK);
+				reply.param(&addr.s_addr, 4);
+			}
+			else
+				reply.param8(0);
+		}break;
+		case START_SERVER_TCP_CMD:{
+			if(n < 3 || (s = param[1][0]) >= MAX_SOCK_NUM){
+				reply.param8(0);
+				break;
+			}
+			uint16_t port = (param[0][0] << 8) | param[0][1];
+			uint8_t mode = param[2][0];
+			struct sockaddr_in sa;
+			int one = 1;
+			int fd = socket(AF_INET, (mode == UDP_MODE) ? SOCK_DGRAM : SOCK_STREAM, 0);
+
+			_sockClose(s, false);
+			if(_sock[s].listenFd >= 0)
+				close(_sock[s].listenFd);
+			_sock[s].listenFd = -1;
+
+			// more sockets listening on a port take a client each
+			int shared = -1;
+			for(uint8_t i = 0; i < MAX_SOCK_NUM && mode != UDP_MODE; i++){
+				if(i != s && _sock[i].listenFd >= 0 && _sock[i].localPort == port)
+					shared = _sock[i].listenFd;
+			}
+			memset(&sa, 0, sizeof(sa));
+			sa.sin_family = AF_INET;
+			sa.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+			sa.sin_port = htons(port);
+			setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+			if(shared >= 0){
+				close(fd);
+				fd = dup(shared);
+			}
+			else if(bind(fd, (struct sockaddr*)&sa, sizeof(sa)) != 0 || (mode != UDP_MODE && listen(fd, MAX_SOCK_NUM) != 0)){
+				close(fd);
+				reply.param8(0);
+				break;
+			}
+			setNonBlocking(fd);
+			_sock[s].mode = mode;
+			_sock[s].localPort = port;
+			if(mode == UDP_MODE){
+				_sock[s].fd = fd;
+				_sock[s].state = ESTABLISHED;
+			}
+			else{
+				_sock[s].listenFd = fd;
+				_sock[s].state = LISTEN;
+			}
+			reply.param8(1);
+		}break;
+		case START_CLIENT_TCP_CMD:{
+			if(n < 4 || (s = param[2][0]) >= MAX_SOCK_NUM){
+				reply.param8(0);
+				break;
+			}
+			uint8_t mode = param[3][0];
+			struct sockaddr_in sa;
+			memset(&sa, 0, sizeof(sa));
+			sa.sin_family = AF_INET;
+			memcpy(&sa.sin_addr.s_addr, param[0], 4);
+			sa.sin_port = htons((param[1][0] << 8) | param[1][1]);
+
+			if(mode == UDP_MODE){
+				// beginPacket: keep the socket of begin() if any
+				if(_sock[s].fd < 0){
+					_sock[s].fd = socket(AF_INET, SOCK_DGRAM, 0);
+					setNonBlocking(_sock[s].fd);
+				}
+				_sock[s].mode = UDP_MODE;
+				_sock[s].state = ESTABLISHED;
+				_sock[s].dstIp = sa.sin_addr.s_addr;
+				_sock[s].dstPort = ntohs(sa.sin_port);
+				_sock[s].tx.clear();
+				reply.param8(1);
+				break;
+			}
+
+			_sockClose(s, false);
+			int fd = socket(AF_INET, SOCK_STREAM, 0);
+			if(connect(fd, (struct sockaddr*)&sa, sizeof(sa)) != 0){
+				close(fd);
+				reply.param8(0);
+				break;
+			}
+			setNonBlocking(fd);
+			_sock[s].fd = fd;
+			_sock[s].mode = TCP_MODE;
+			_sock[s].state = ESTABLISHED;
+			_sock[s].remoteIp = sa.sin_addr.s_addr;
+			_sock[s].remotePort = ntohs(sa.sin_port);
+			// the 328 marks the socket established when the reply arrives
+			_sock[s].evState = ESTABLISHED;
+			_sock[s].evAvail = 0;
+			reply.param8(1);
+		}break;
+		case STOP_CLIENT_TCP_CMD:
+			if(n > 0 && param[0][0] < MAX_SOCK_NUM){
+				// a server socket goes back to listening, unless WiFiServer::end() asks to close it
+				bool stopServer = (_caps & WIFI_CAP_STOP_SERVER) && n > 1 && len[1] > 0 && param[1][0] == 1;
+				_sockClose(param[0][0], !stopServer);
+				_sock[param[0][0]].evState = CLOSED;
+				_sock[param[0][0]].evAvail = 0;
+			}
+			reply.param8(1);
+		break;
+		case GET_STATE_TCP_CMD:
+			s = (n > 0) ? param[0][0] : 0;
+			reply.param8((s < MAX_SOCK_NUM) ? _sock[s].state : (uint8_t)CLOSED);
+		break;
+		case GET_CLIENT_STATE_TCP_CMD:
+		case AVAIL_DATA_TCP_CMD:
+			s = (n > 0) ? param[0][0] : NO_SOCKET_AVAIL;
+			reply.param8(s);
+			_batchItem(cmd, params, nParam, reply.b);
+			// _batchItem appended [len, value]: count it as a parameter
+			reply.b[3]++;
+		break;
+		case GET_DATA_TCP_CMD:{
+			s = (n > 0) ? param[0][0] : NO_SOCKET_AVAIL;
+			uint8_t b = 0;
+			if(s < MAX_SOCK_NUM && _sockReady(s) && !_sock[s].rx.empty()){
+				b = _sock[s].rx.front();
+				if(n < 2 || len[1] < 2 || param[1][1] == 0)
+					_sock[s].rx.pop_front();
+				simStats.rxPayload++;
+			}
+			reply.param8(b);
+		}break;
+		case SEND_DATA_UDP_CMD:{
+			s = (n > 0) ? param[0][0] : NO_SOCKET_AVAIL;
+			if(s >= MAX_SOCK_NUM || _sock[s].fd < 0 || _sock[s].mode != UDP_MODE){
+				reply.param8(0);
+				break;
+			}
+			struct sockaddr_in sa;
+			memset(&sa, 0, sizeof(sa));
+			sa.sin_family = AF_INET;
+			sa.sin_addr.s_addr = _sock[s].dstIp;
+			sa.sin_port = htons(_sock[s].dstPort);
+			ssize_t ret = sendto(_sock[s].fd, _sock[s].tx.data(), _sock[s].tx.size(), 0, (struct sockaddr*)&sa, sizeof(sa));
+			_sock[s].tx.clear();
+			reply.param8(ret >= 0);
+		}break;
+		case PARSE_PACKET_UDP:{
+			// the rest of the current datagram is dropped
+			s = (n > 0) ? param[0][0] : NO_SOCKET_AVAIL;
+			uint8_t maxFirst = (n > 1) ? param[1][0] : 0;
+			uint16_t size = 0;
+			uint32_t ip = 0;
+			uint8_t portBE[2] = { 0, 0 };
+			std::vector<uint8_t> first;
+
+			if(s < MAX_SOCK_NUM && _sock[s].mode == UDP_MODE){
+				_sock[s].rx.clear();
+				_sockReady(s);
+				size = _sockAvail(s);
+				if(size > 0){
+					ip = _sock[s].remoteIp;
+					portBE[0] = _sock[s].remotePort >> 8;
+					portBE[1] = _sock[s].remotePort & 0xFF;
+				}
+				while(first.size() < maxFirst && first.size() < SPI_BUF_LEN - 17 && !_sock[s].rx.empty()){
+					first.push_back(_sock[s].rx.front());
+					_sock[s].rx.pop_front();
+				}
+				simStats.rxPayload += first.size();
+			}
+			uint8_t sizeLE[2] = { (uint8_t)(size & 0xFF), (uint8_t)(size >> 8) };
+			reply.param(sizeLE, 2);
+			reply.param(&ip, 4);
+			reply.param(portBE, 2);
+			reply.param(first.data(), first.size());
+		}break;
+		case GET_REMOTE_DATA_CMD:{
+			s = (n > 0) ? param[0][0] : NO_SOCKET_AVAIL;
+			uint32_t ip = (s < MAX_SOCK_NUM) ? _sock[s].remoteIp : 0;
+			uint16_t port = (s < MAX_SOCK_NUM) ? _sock[s].remotePort : 0;
+			uint8_t portBE[2] = { (uint8_t)(port >> 8), (uint8_t)port };
+			reply.param(&ip, 4);
+			reply.param(portBE, 2);
+		}break;
+		default:
+			// unknown command: the firmware doesn't answer
+			return;
+	}
+	_queueReply(reply.done());
+}
+
+/* -----------------------------------------------------------------
+* Reply of a socket query, as [len, value], used both by the single
+* commands (after the socket number) and by BATCH_CMD
+*/
+uint8_t EspSim::_batchItem(uint8_t cmd, const uint8_t* params, uint8_t nParam, std::vector<uint8_t>& out)
+{
+	uint8_t s = (nParam > 0 && params[0] == 1) ? params[1] : NO_SOCKET_AVAIL;
+
+	if(cmd == GET_CLIENT_STATE_TCP_CMD){
+		out.push_back(1);
+		out.push_back((s < MAX_SOCK_NUM) ? _sock[s].state : (uint8_t)CLOSED);
+		if(s < MAX_SOCK_NUM)
+			_sock[s].evState = _sock[s].state;
+		return 2;
+	}
+	if(cmd == AVAIL_DATA_TCP_CMD){
+		uint16_t avail = 0;
+		if(s < MAX_SOCK_NUM){
+			avail = _sockAvail(s);
+			_sock[s].evAvail = avail;
+		}
+		out.push_back(2);
+		out.push_back(avail & 0xFF);
+		out.push_back(avail >> 8);
+		return 3;
+	}
+	out.push_back(0);
+	return 1;
+}
+
+// -----------------------------------------------------------------
+void EspSim::_execData(uint8_t cmd, const uint8_t* pkt, uint32_t len)
+{
+	switch(cmd){
+		case SEND_DATA_TCP_CMD:{
+			// DATA_PKT, cmd, len (4 bytes), sock, payload, END_CMD
+			uint8_t s = pkt[6];
+			uint32_t n = len - 8;
+			if(s >= MAX_SOCK_NUM)
+				break;
+			simStats.txPayload += n;
+			_sockSend(s, pkt + 7, n);
+		}break;
+		case SEND_DATA_MULTI_CMD:{
+			// DATA_PKT, cmd, len (4 bytes), socket mask, payload, END_CMD
+			uint8_t mask = pkt[6];
+			uint32_t n = len - 8;
+			simStats.txPayload += n;
+			for(uint8_t s = 0; s < MAX_SOCK_NUM; s++){
+				if(mask & (1 << s))
+					_sockSend(s, pkt + 7, n);
+			}
+		}break;
+		case GET_DATABUF_TCP_CMD:{
+			// DATA_PKT, cmd, len (4 bytes), nParam, [1, sock], [2, size (big-endian)], END_CMD
+			uint8_t s = pkt[8];
+			uint16_t want = (pkt[10] << 8) | pkt[11];
+			std::vector<uint8_t> payload;
+			uint32_t n = 0;
+
+			if(s < MAX_SOCK_NUM && _sockReady(s))
+				n = (_sock[s].rx.size() < want) ? _sock[s].rx.size() : want;
+
+			for(uint32_t i = 0; i < n; i++){
+				payload.push_back(_sock[s].rx.front());
+				_sock[s].rx.pop_front();
+			}
+			// the 328 takes the bytes off its count, an empty reply clears it
+			if(s < MAX_SOCK_NUM)
+				_sock[s].evAvail = (n > 0 && _sock[s].evAvail > n) ? _sock[s].evAvail - n : 0;
+			simStats.rxPayload += n;
+			_queueReply(dataReply(cmd, payload));
+		}break;
+	}
+}
+
+/* -----------------------------------------------------------------
+* Sends TCP data to the peer, or adds it to the UDP datagram being built
+*/
+void EspSim::_sockSend(uint8_t s, const uint8_t* p, uint32_t n)
+{
+	if(_sock[s].mode == UDP_MODE){
+		_sock[s].tx.insert(_sock[s].tx.end(), p, p + n);
+		return;
+	}
+	if(_sock[s].fd < 0)
+		return;
+
+	_sock[s].sent = true;
+	while(n > 0){
+		ssize_t ret = send(_sock[s].fd, p, n, MSG_NOSIGNAL);
+		if(ret < 0 && errno == EAGAIN){
+			pollNetwork();
+			continue;
+		}
+		if(ret <= 0)
+			break;
+		p += ret;
+		n -= ret;
+	}
+}
+
+/* -----------------------------------------------------------------
+* Makes the next UDP datagram current when the previous one has been read
+*/
+bool EspSim::_sockReady(uint8_t s)
+{
+	tsSimSock* sk = &_sock[s];
+
+	if(sk->mode == UDP_MODE && sk->rx.empty() && !sk->rxDgram.empty()){
+		std::vector<uint8_t>& d = sk->rxDgram.front();
+		memcpy(&sk->remoteIp, &d[0], 4);
+		sk->remotePort = (d[4] << 8) | d[5];
+		sk->rx.insert(sk->rx.end(), d.begin() + 6, d.end());
+		sk->rxDgram.pop_front();
+	}
+	return true;
+}
+
+// -----------------------------------------------------------------
+void EspSim::_sockPoll(uint8_t s)
+{
+	tsSimSock* sk = &_sock[s];
+	uint8_t buf[2048];
+
+	// incoming connection on a server socket
+	if(sk->listenFd >= 0 && sk->fd < 0){
+		struct sockaddr_in sa;
+		socklen_t saLen = sizeof(sa);
+		int fd = accept(sk->listenFd, (struct sockaddr*)&sa, &saLen);
+		if(fd >= 0){
+			setNonBlocking(fd);
+			sk->fd = fd;
+			sk->state = ESTABLISHED;
+			sk->peerClosed = false;
+			sk->remoteIp = sa.sin_addr.s_addr;
+			sk->remotePort = ntohs(sa.sin_port);
+		}
+	}
+
+	if(sk->fd < 0)
+		return;
+
+	if(sk->mode == UDP_MODE){
+		while(sk->rxDgram.size() < 16){
+			struct sockaddr_in sa;
+			socklen_t saLen = sizeof(sa);
+			ssize_t ret = recvfrom(sk->fd, buf, sizeof(buf), 0, (struct sockaddr*)&sa, &saLen);
+			if(ret < 0)
+				break;
+			std::vector<uint8_t> d(6);
+			uint16_t port = ntohs(sa.sin_port);
+			memcpy(&d[0], &sa.sin_addr.s_addr, 4);
+			d[4] = port >> 8;
+			d[5] = port & 0xFF;
+			d.insert(d.end(), buf, buf + ret);
+			sk->rxDgram.push_back(d);
+		}
+		return;
+	}
+
+	while(!sk->peerClosed && sk->rx.size() < SIM_SOCK_RX_MAX){
+		ssize_t ret = recv(sk->fd, buf, sizeof(buf), 0);
+		if(ret == 0)
+			sk->peerClosed = true;
+		if(ret <= 0)
+			break;
+		sk->rx.insert(sk->rx.end(), buf, buf + ret);
+	}
+	if(sk->peerClosed && sk->rx.empty() && sk->state == ESTABLISHED)
+		sk->state = CLOSE_WAIT;
+}
+
+/* -----------------------------------------------------------------
+* Closes a socket. A TCP server goes back to listen for the next client.
+*/
+void EspSim::_sockClose(uint8_t s, bool keepListen)
+{
+	tsSimSock* sk = &_sock[s];
+
+	if(sk->fd >= 0)
+		close(sk->fd);
+	sk->fd = -1;
+	sk->peerClosed = false;
+	sk->rx.clear();
+	sk->rxDgram.clear();
+	sk->tx.clear();
+	sk->remoteIp = 0;
+	sk->remotePort = 0;
+
+	if(keepListen && sk->listenFd >= 0)
+		sk->state = LISTEN;
+	else{
+		if(sk->listenFd >= 0)
+			close(sk->listenFd);
+		sk->listenFd = -1;
+		sk->state = CLOSED;
+		sk->mode = TCP_MODE;
+	}
+}
+
+// -----------------------------------------------------------------
+void EspSim::pollNetwork(void)
+{
+	if(netHook)
+		netHook();
+
+	for(uint8_t i = 0; i < MAX_SOCK_NUM; i++)
+		_sockPoll(i);
+}
+
+/* -----------------------------------------------------------------
+* Bytes the 328 can read from a socket
+*/
+uint16_t EspSim::_sockAvail(uint8_t s)
+{
+	if(!_sockReady(s))
+		return 0;
+	return (_sock[s].rx.size() > 0xFFFF) ? 0xFFFF : _sock[s].rx.size();
+}
+
+/* -----------------------------------------------------------------
+* Queues a SOCK_EVENT_NOTIFY for every TCP socket whose state or
+* available bytes differ from what the 328 knows
+*/
+void EspSim::_sockEvents(void)
+{
+	if(!(_caps & WIFI_CAP_SOCK_EVENTS))
+		return;
+
+	for(uint8_t i = 0; i < MAX_SOCK_NUM; i++){
+		tsSimSock* sk = &_sock[i];
+		if(sk->mode != TCP_MODE)
+			continue;
+
+		uint16_t avail = _sockAvail(i);
+		if(sk->state == sk->evState && avail == sk->evAvail)
+			continue;
+
+		uint8_t flags = 0;
+		if(avail > sk->evAvail)
+			flags |= SOCK_EV_DATA;
+		if(sk->evState == ESTABLISHED && (sk->state == CLOSE_WAIT || sk->state == CLOSED))
+			flags |= SOCK_EV_CLOSED;
+		if(sk->listenFd >= 0 && sk->state == ESTABLISHED && sk->evState != ESTABLISHED)
+			flags |= SOCK_EV_ACCEPTED;
+		// send completion rides on the next event of the socket
+		if(sk->sent)
+			flags |= SOCK_EV_SENT;
+
+		SimReply ev(SOCK_EVENT_NOTIFY);
+		uint8_t availLE[2] = { (uint8_t)(avail & 0xFF), (uint8_t)(avail >> 8) };
+		ev.param8(i);
+		ev.param8(flags);
+		ev.param8(sk->state);
+		ev.param(availLE, 2);
+		_queueReply(ev.done());
+
+		sk->evState = sk->state;
+		sk->evAvail = avail;
+		sk->sent = false;
+	}
+}
+
+/* -----------------------------------------------------------------
+* Periodic look at the network while the 328 doesn't send commands
+*/
+void EspSim::_evPoll(uint32_t timer)
+{
+	// stopped by reset() or by a new GET_CAPS_CMD
+	if(timer != _evTimer)
+		return;
+
+	pollNetwork();
+	_sockEvents();
+	sim_schedule(SIM_EV_POLL_NS, [this, timer](){ _evPoll(timer); });
+}
@@ -0,0 +1,176 @@
+/*
+  This library is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Lesser General Public
+  License as published by the Free Software Foundation; either
+  version 2.1 of the License, or (at your option) any later version.
+
+  This library is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with this library; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+#ifndef ESP_SIM_H
+#define ESP_SIM_H
+
+#include <stdint.h>
+#include <deque>
+#include <functional>
+#include <map>
+#include <vector>
+
+#include "utility/spi/spi_drv.h"
+
+/*  -----------------------------------------------------------------
+* Timing model of the simulation, all the values are in nanoseconds
+*/
+typedef struct{
+	uint32_t spiByteNs;		// one SPI byte, clock and loop overhead (4MHz SCK)
+	uint32_t callNs;		// cost of a millis(), micros() or digitalRead() call
+	uint32_t espCmdNs;		// esp time to execute a command before its reply is ready
+	uint32_t espFrameNs;	// esp time to accept a frame or to prepare the next one
+	uint32_t ackPulseNs;	// length of the SR pulse acknowledging a frame
+}tsSimTiming;
+
+/*  -----------------------------------------------------------------
+* Counters of the simulated link
+*/
+typedef struct{
+	uint64_t spiBytes;		// bytes clocked on the bus, both directions together
+	uint64_t txPayload;		// socket payload bytes written by the 328
+	uint64_t rxPayload;		// socket payload bytes read by the 328
+	uint32_t frames;		// frames written or read, full or ended by the CS
+	uint32_t packets;		// command and data packets received by the esp
+	uint32_t cmdCount[128];	// packets received for each command
+	uint32_t srWaits;		// frames announced by the SR signal and read
+	uint64_t srWaitNs;		// time from the SR rising edge to the start of the read
+	uint64_t srWaitMaxNs;
+}tsSimStats;
+
+/*  -----------------------------------------------------------------
+* Virtual time and interrupt controller (arduino_sim.cpp)
+*/
+uint64_t sim_nanos(void);
+void sim_advance(uint64_t ns);
+void sim_schedule(uint64_t delayNs, std::function<void(void)> fn);
+void sim_setSR(uint8_t level);
+
+extern tsSimTiming simTiming;
+extern tsSimStats simStats;
+
+/*  -----------------------------------------------------------------
+* Socket of the simulated esp, backed by a loopback socket of the host
+*/
+typedef struct{
+	int fd;				// connected (TCP) or bound (UDP) socket, -1 if unused
+	int listenFd;		// listening socket of a TCP server
+	uint8_t mode;		// TCP_MODE or UDP_MODE
+	uint8_t state;		// wl_tcp_state
+	uint16_t localPort;
+	uint32_t remoteIp;	// network order
+	uint16_t remotePort;
+	uint32_t dstIp;		// destination of the UDP datagram being built
+	uint16_t dstPort;
+	bool peerClosed;
+	bool sent;			// data written since the last event (SOCK_EV_SENT)
+	uint8_t evState;	// state and available bytes as known by the 328
+	uint16_t evAvail;
+	std::deque<uint8_t> rx;					// TCP stream or current UDP datagram
+	std::deque<std::vector<uint8_t> > rxDgram;	// UDP datagrams waiting, sender ip and port first
+	std::vector<uint8_t> tx;				// UDP datagram being built
+}tsSimSock;
+
+/*  -----------------------------------------------------------------
+* esp8285 SPI slave running the jolly firmware protocol: 32 byte frames,
+* SR pin handshake, START_CMD command packets and DATA_PKT data packets.
+* Once variable length frames are enabled a frame also ends when the CS goes high.
+* With WIFI_CAP_SOCK_EVENTS the TCP sockets are polled every millisecond and
+* SOCK_EVENT_NOTIFY is queued when the 328 view of a socket is out of date.
+*/
+class EspSim
+{
+	private:
+	// SPI slave
+	enum { spi_cmd, spi_write, spi_read, spi_status_read, spi_status_write } _spiState;
+	uint8_t _spiIdx;
+	bool _cs;
+	uint8_t _frame[SPI_BUF_LEN];
+	uint8_t _frameIdx;
+	bool _duplexOut;		// the first frame of the pending packet is shifted out during the write
+
+	// incoming packet
+	std::vector<uint8_t> _in;
+	uint32_t _inLen;
+
+	// outgoing packets, padded to whole frames
+	std::deque<std::vector<uint8_t> > _out;
+	std::deque<uint64_t> _outReady;
+	uint32_t _outPos;
+	bool _srHigh;
+	uint64_t _srRaisedNs;	// 0 once the 328 started reading the frame
+	bool _replyArmed;
+
+	// capabilities enabled by GET_CAPS_CMD (WIFI_CAP_xxx)
+	uint16_t _caps;
+
+	// windowed transfer: frames received in order, the following ones and the ack
+	uint8_t _winXid;
+	uint16_t _winInOrder;
+	std::map<uint16_t, std::vector<uint8_t> > _winAhead;
+	std::vector<uint8_t> _winStream;
+	bool _winDone;
+	uint32_t _winCount;
+	uint32_t _status;
+
+	// socket events: generation of the periodic network poll
+	uint32_t _evTimer;
+
+	tsSimSock _sock[MAX_SOCK_NUM];
+
+	void _frameReceived(void);
+	void _packetReceived(void);
+	void _execCmd(uint8_t cmd, uint8_t nParam, const uint8_t* params, const uint8_t* end);
+	void _execData(uint8_t cmd, const uint8_t* pkt, uint32_t len);
+	void _queueReply(const std::vector<uint8_t>& pkt);
+	void _armReply(uint32_t delayNs, bool anyCs = false);
+	void _frameRead(void);
+	void _frameEnd(void);
+	void _winFrame(void);
+	void _writeDone(uint8_t written);
+	void _raiseSR(void);
+	void _readStarted(void);
+	void _ackFrame(void);
+
+	uint8_t _batchItem(uint8_t cmd, const uint8_t* params, uint8_t nParam, std::vector<uint8_t>& out);
+	bool _sockReady(uint8_t s);
+	void _sockPoll(uint8_t s);
+	void _sockClose(uint8_t s, bool keepListen);
+	void _sockSend(uint8_t s, const uint8_t* p, uint32_t n);
+	uint16_t _sockAvail(uint8_t s);
+	void _sockEvents(void);
+	void _evPoll(uint32_t timer);
+
+	public:
+	// set to false to model a firmware that doesn't know the command
+	bool supported[128];
+	// capabilities the firmware accepts in GET_CAPS_CMD
+	uint16_t fwCaps;
+	// every winDropEvery-th frame of a windowed transfer is lost (0: none)
+	uint32_t winDropEvery;
+	// called every time the esp looks at the network, used by the test peers
+	std::function<void(void)> netHook;
+
+	EspSim();
+	void reset(void);
+	void csChanged(uint8_t level);
+	uint8_t exchange(uint8_t mosi);
+	void pollNetwork(void);
+};
+
+extern EspSim espSim;
+
+#endif
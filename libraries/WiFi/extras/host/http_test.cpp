@@ -0,0 +1,461 @@
+/*
+This library is free software; you can redistribute it and/or
+modify it under the terms of the GNU Lesser General Public
+License as published by the Free Software Foundation; either
+version 2.1 of the License, or (at your option) any later version.
+
+This library is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public
+License along with this library; if not, write to the Free Software
+Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+/* -----------------------------------------------------------------
+* Tests of the HTTP request parser and response writer (WiFiHttp.cpp), see
+* README.md
+*
+* Only WiFiHttp.cpp of the library is built. WiFiClient is replaced by an
+* in-memory connection that hands the request over a few bytes at a time
+* and collects the response, so no SPI transfer is involved. Every request
+* test runs with several span sizes, down to a byte per peekSpan().
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+
+#include "WiFiHttp.h"
+
+static uint32_t checks;
+static uint32_t failed;
+
+#define CHECK(cond)		do{ checks++; if(!(cond)){ failed++; fprintf(stderr, "http_test: %s failed at line %d (span %u)\n", #cond, __LINE__, (unsigned)span); } }while(0)
+
+/*  -----------------------------------------------------------------
+* In-memory connections, picked by the socket number of the client
+*/
+typedef struct{
+	std::string rx;		// bytes sent by the peer
+	size_t pos;			// first one not consumed
+	size_t span;		// most bytes handed over by a peekSpan()
+	std::string tx;		// bytes written to the peer
+} tsTestConn;
+
+static tsTestConn conns[1];
+
+WiFiClient::WiFiClient() : _sock(255), _replyTimeout(0) {}
+WiFiClient::WiFiClient(uint8_t sock) : _sock(sock), _replyTimeout(0) {}
+
+int WiFiClient::peekSpan(const uint8_t** data)
+{
+	tsTestConn& c = conns[_sock];
+
+	*data = (const uint8_t*)c.rx.data() + c.pos;
+	return min(c.rx.size() - c.pos, c.span);
+}
+
+void WiFiClient::consume(size_t n)
+{
+	conns[_sock].pos += n;
+}
+
+int WiFiClient::read(uint8_t* buf, size_t size)
+{
+	const uint8_t* data;
+	size_t n = min((size_t)peekSpan(&data), size);
+
+	memcpy(buf, data, n);
+	consume(n);
+	return n;
+}
+
+int WiFiClient::read()
+{
+	uint8_t b;
+
+	return (read(&b, 1) == 1) ? b : -1;
+}
+
+int WiFiClient::peek()
+{
+	const uint8_t* data;
+
+	return (peekSpan(&data) > 0) ? data[0] : -1;
+}
+
+int WiFiClient::available()
+{
+	return conns[_sock].rx.size() - conns[_sock].pos;
+}
+
+size_t WiFiClient::writev(const tsIoVec* iov, uint8_t cnt)
+{
+	size_t n = 0;
+
+	for(uint8_t i = 0; i < cnt; i++){
+		conns[_sock].tx.append((const char*)iov[i].data, iov[i].len);
+		n += iov[i].len;
+	}
+	return n;
+}
+
+size_t WiFiClient::write(const uint8_t* buf, size_t size)
+{
+	conns[_sock].tx.append((const char*)buf, size);
+	return size;
+}
+
+size_t WiFiClient::write(uint8_t b) { return write(&b, 1); }
+int WiFiClient::connect(IPAddress, uint16_t) { return 0; }
+int WiFiClient::connect(const char*, uint16_t) { return 0; }
+void WiFiClient::flush() {}
+void WiFiClient::stop() {}
+uint8_t WiFiClient::connected() { return 1; }
+WiFiClient::operator bool() { return true; }
+
+// Stream of the core wants the clock, the parser never waits
+unsigned long millis(void)
+{
+	return 0;
+}
+
+// the avr libc conversions of WString, arduino_sim.cpp has the full ones
+extern "C" char* ltoa(long value, char* str, int radix)
+{
+	sprintf(str, (radix == 16) ? "%lx" : "%ld", value);
+	return str;
+}
+
+extern "C" char* ultoa(unsigned long value, char* str, int radix)
+{
+	sprintf(str, (radix == 16) ? "%lx" : "%lu", value);
+	return str;
+}
+
+extern "C" char* itoa(int value, char* str, int radix) { return ltoa(value, str, radix); }
+extern "C" char* utoa(unsigned int value, char* str, int radix) { return ultoa(value, str, radix); }
+
+extern "C" char* dtostrf(double val, signed char width, unsigned char prec, char* s)
+{
+	sprintf(s, "%*.*f", width, prec, val);
+	return s;
+}
+
+// -----------------------------------------------------------------
+static WiFiClient start(const std::string& rx, size_t span)
+{
+	conns[0].rx = rx;
+	conns[0].pos = 0;
+	conns[0].span = span;
+	conns[0].tx.clear();
+	return WiFiClient(0);
+}
+
+// whole body of the current request, -1 if readBody() failed
+static int body(WiFiHttpRequest& req, WiFiClient& client, std::string& out)
+{
+	uint8_t buf[5];
+	int n;
+
+	out.clear();
+	while((n = req.readBody(client, buf, sizeof(buf))) > 0)
+		out.append((const char*)buf, n);
+	return n;
+}
+
+// body of a chunked response, the text after it goes to rest
+static bool dechunk(const std::string& in, std::string& out, std::string& rest)
+{
+	size_t p = 0;
+
+	out.clear();
+	while(1){
+		size_t eol = in.find("\r\n", p);
+		if(eol == std::string::npos)
+			return false;
+		unsigned long n = strtoul(in.substr(p, eol - p).c_str(), NULL, 16);
+		p = eol + 2;
+		if(n == 0)
+			break;
+		if(in.compare(p + n, 2, "\r\n") != 0)
+			return false;
+		out.append(in, p, n);
+		p += n + 2;
+	}
+	// no trailer
+	if(in.compare(p, 2, "\r\n") != 0)
+		return false;
+	rest = in.substr(p + 2);
+	return true;
+}
+
+/* -----------------------------------------------------------------
+* Requests answered with an error code by feed(), whole or byte by byte
+*/
+static void testErrors(size_t span)
+{
+	static const struct{
+		const char* text;
+		uint16_t code;
+	} cases[] = {
+		// request smuggling: both framings
+		{ "POST / HTTP/1.1\r\nContent-Length: 3\r\nTransfer-Encoding: chunked\r\n\r\n", 400 },
+		{ "POST / HTTP/1.1\r\nTransfer-Encoding: chunked\r\nContent-Length: 3\r\n\r\n", 400 },
+		{ "POST / HTTP/1.1\r\nContent-Length: 3\r\nContent-Length: 3\r\n\r\n", 400 },
+		{ "POST / HTTP/1.1\r\nContent-Length: 3 4\r\n\r\n", 400 },
+		// chunked has to be the last coding
+		{ "POST / HTTP/1.1\r\nTransfer-Encoding: gzip\r\n\r\n", 501 },
+		{ "POST / HTTP/1.1\r\nTransfer-Encoding: chunked, gzip\r\n\r\n", 501 },
+		{ "GET / HTTP/2.0\r\n\r\n", 505 },
+		{ "GET / HTTX/1.1\r\n\r\n", 400 },
+		{ "GET /a\x01 HTTP/1.1\r\n\r\n", 400 },
+		{ "GET a HTTP/1.1\r\n\r\n", 400 },
+		{ "GET / HTTP/1.1\r\nHost: a\r\n folded\r\n\r\n", 400 },
+		{ "GET / HTTP/1.1\r\nBad Name: a\r\n\r\n", 400 },
+		// %00 would cut the segment
+		{ "GET /a%00b HTTP/1.1\r\n\r\n", 400 },
+		{ "GET /a%4 HTTP/1.1\r\n\r\n", 400 },
+		{ "GET /a%zz HTTP/1.1\r\n\r\n", 400 },
+		{ "GET /1/2/3/4/5/6/7 HTTP/1.1\r\n\r\n", 414 },
+	};
+
+	for(size_t i = 0; i < sizeof(cases) / sizeof(cases[0]); i++){
+		WiFiHttpRequest req;
+		size_t len = strlen(cases[i].text);
+		size_t used = 0, n;
+
+		do{
+			n = req.feed((const uint8_t*)&cases[i].text[used], min(len - used, span));
+			used += n;
+		}while(n > 0 && used < len && req.error() == 0);
+		CHECK(req.error() == cases[i].code);
+		CHECK(used <= len);
+	}
+
+	// path, query and collected header longer than WIFI_HTTP_BUF_LEN
+	std::string longText(WIFI_HTTP_BUF_LEN + 1, 'a');
+	std::string over[3] = {
+		"GET /" + longText + " HTTP/1.1\r\n\r\n",
+		"GET /?" + longText + " HTTP/1.1\r\n\r\n",
+		"GET / HTTP/1.1\r\nHost: " + longText + "\r\n\r\n",
+	};
+	uint16_t codes[3] = { 414, 414, 431 };
+
+	for(uint8_t i = 0; i < 3; i++){
+		WiFiHttpRequest req;
+		WiFiClient client = start(over[i], span);
+
+		req.collect(F("host"));
+		CHECK(req.parse(client) == HTTP_ERROR);
+		CHECK(req.error() == codes[i]);
+	}
+}
+
+/* -----------------------------------------------------------------
+* Request line, segments, query and headers
+*/
+static void testHeaders(size_t span)
+{
+	WiFiHttpRequest req;
+	const char* text = "PUT /a%20b/%2Fx//%41?q=%20&x HTTP/1.1\r\n"
+					   "hOsT:  jolly.local  \r\n"
+					   "X-Unknown: 1\r\n"
+					   "Connection: upgrade, Close\r\n\r\n"
+					   "body";
+	WiFiClient client = start(text, span);
+
+	req.collect(F("Host"));
+	req.collect(F("Accept"));
+	CHECK(req.parse(client) == HTTP_HEADERS);
+	CHECK(req.method() == HTTP_PUT);
+	CHECK(req.segments() == 3);
+	CHECK(req.segment(0) != NULL && !strcmp(req.segment(0), "a b"));
+	CHECK(req.segment(1) != NULL && !strcmp(req.segment(1), "/x"));
+	CHECK(req.segmentIs(2, F("A")));
+	CHECK(req.segment(3) == NULL);
+	// the query is left encoded
+	CHECK(req.query() != NULL && !strcmp(req.query(), "q=%20&x"));
+	CHECK(req.header(0) != NULL && !strcmp(req.header(0), "jolly.local"));
+	CHECK(req.header(1) == NULL);
+	CHECK(!req.keepAlive());
+	CHECK(!req.chunked() && req.contentLength() == 0);
+	CHECK(req.bodyDone());
+	// the bytes after the headers are left in the socket
+	CHECK(conns[0].rx.size() - conns[0].pos == 4);
+
+	// the same out of a buffer of the sketch
+	WiFiHttpRequest fed;
+	size_t len = strlen(text);
+	CHECK(fed.feed((const uint8_t*)text, len) == len - 4);
+	CHECK(fed.error() == 0 && fed.segments() == 3);
+
+	// unknown method, HTTP/1.0 closes by default
+	client = start("BREW /pot HTTP/1.0\r\n\r\n", span);
+	req.reset();
+	CHECK(req.parse(client) == HTTP_HEADERS);
+	CHECK(req.method() == HTTP_UNKNOWN);
+	CHECK(!req.keepAlive());
+
+	// not complete yet
+	WiFiHttpRequest part;
+	client = start("GET /x HTTP/1.1\r\nHost: a\r\n", span);
+	CHECK(part.parse(client) == HTTP_MORE);
+	conns[0].rx += "\r\n";
+	CHECK(part.parse(client) == HTTP_HEADERS);
+	CHECK(part.keepAlive());
+}
+
+/* -----------------------------------------------------------------
+* Content-Length bodies, read or skipped by the next parse() on a
+* keep-alive connection
+*/
+static void testLength(size_t span)
+{
+	WiFiHttpRequest req;
+	std::string out;
+	WiFiClient client = start("POST /one HTTP/1.1\r\nContent-Length: 11\r\n\r\nhello world"
+							  "GET /two HTTP/1.1\r\n\r\n", span);
+
+	CHECK(req.parse(client) == HTTP_HEADERS);
+	CHECK(req.contentLength() == 11 && !req.chunked());
+	CHECK(body(req, client, out) == 0);
+	CHECK(out == "hello world");
+	CHECK(req.bodyDone());
+	CHECK(req.parse(client) == HTTP_HEADERS);
+	CHECK(req.segmentIs(0, F("two")));
+
+	// body left unread, part of it still to come
+	client = start("POST /one HTTP/1.1\r\nContent-Length: 11\r\n\r\nhello", span);
+	req.reset();
+	CHECK(req.parse(client) == HTTP_HEADERS);
+	CHECK(req.parse(client) == HTTP_MORE);
+	conns[0].rx += " world";
+	CHECK(req.parse(client) == HTTP_MORE);
+	conns[0].rx += "DELETE /three HTTP/1.1\r\n\r\n";
+	CHECK(req.parse(client) == HTTP_HEADERS);
+	CHECK(req.method() == HTTP_DELETE);
+	CHECK(req.segmentIs(0, F("three")));
+	CHECK(conns[0].pos == conns[0].rx.size());
+}
+
+/* -----------------------------------------------------------------
+* Chunked bodies with extensions and trailer
+*/
+static void testChunked(size_t span)
+{
+	WiFiHttpRequest req;
+	std::string out;
+	const char* chunked = "POST /c HTTP/1.1\r\nTransfer-Encoding: gzip , Chunked\r\n\r\n"
+						  "4;name=value\r\nWiki\r\n5 ; x\r\npedia\r\nE\r\n in\r\n\r\nchunks.\r\n"
+						  "0\r\nExpires: never\r\nX-A: b\r\n\r\n";
+	WiFiClient client = start(std::string(chunked) + "GET /next HTTP/1.1\r\n\r\n", span);
+
+	CHECK(req.parse(client) == HTTP_HEADERS);
+	CHECK(req.chunked());
+	CHECK(body(req, client, out) == 0);
+	CHECK(out == "Wikipedia in\r\n\r\nchunks.");
+	CHECK(req.bodyDone());
+	CHECK(req.parse(client) == HTTP_HEADERS);
+	CHECK(req.segmentIs(0, F("next")));
+
+	// skipped without reading it, trailer included
+	client = start(std::string(chunked) + "GET /after HTTP/1.1\r\n\r\n", span);
+	req.reset();
+	CHECK(req.parse(client) == HTTP_HEADERS);
+	CHECK(req.parse(client) == HTTP_HEADERS);
+	CHECK(req.segmentIs(0, F("after")));
+
+	// malformed chunk size lines
+	static const struct{
+		const char* chunks;
+		uint16_t code;
+	} bad[] = {
+		{ "zz\r\n", 400 },
+		{ ";ext\r\n", 400 },
+		{ "4x\r\n", 400 },
+		{ "100000000\r\n", 413 },
+		{ "2\r\nabXY", 400 },
+	};
+	for(size_t i = 0; i < sizeof(bad) / sizeof(bad[0]); i++){
+		client = start(std::string("POST / HTTP/1.1\r\nTransfer-Encoding: chunked\r\n\r\n") + bad[i].chunks, span);
+		req.reset();
+		CHECK(req.parse(client) == HTTP_HEADERS);
+		int ret = body(req, client, out);
+		CHECK(ret == -1);
+		CHECK(req.error() == bad[i].code);
+		CHECK(!req.bodyDone());
+	}
+}
+
+/* -----------------------------------------------------------------
+* Responses: Content-Length when the body fits WIFI_HTTP_BODY_LEN, chunked
+* past it on a keep-alive connection, streamed up to the close otherwise
+*/
+static void testResponse(size_t span)
+{
+	const char* head = "HTTP/1.1 200 OK\r\nContent-Type: text/plain\r\n";
+	std::string text, out, rest;
+
+	for(size_t i = 0; i < 3 * WIFI_HTTP_BODY_LEN + 10; i++)
+		text += 'a' + i % 26;
+
+	for(uint8_t keepAlive = 0; keepAlive < 2; keepAlive++){
+		const char* conn = keepAlive ? "Connection: keep-alive\r\n" : "Connection: close\r\n";
+		size_t sizes[] = { 0, 2, WIFI_HTTP_BODY_LEN, WIFI_HTTP_BODY_LEN + 1, 2 * WIFI_HTTP_BODY_LEN, text.size() };
+
+		for(size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++){
+			size_t size = sizes[s];
+			WiFiClient client = start("", span);
+			WiFiHttpResponse resp(client);
+
+			resp.begin(200, keepAlive);
+			CHECK(resp.header(F("Content-Type: text/plain")));
+			// the body written span bytes at a time
+			for(size_t n = 0; n < size; n += span)
+				CHECK(resp.write((const uint8_t*)&text[n], min(size - n, span)) == min(size - n, span));
+			CHECK(resp.end());
+
+			std::string& tx = conns[0].tx;
+			std::string fixed = std::string(head) + conn + "Content-Length: " + std::to_string(size) + "\r\n\r\n";
+			if(size <= WIFI_HTTP_BODY_LEN)
+				CHECK(tx == fixed + text.substr(0, size));
+			else if(keepAlive){
+				std::string start = std::string(head) + conn + "Transfer-Encoding: chunked\r\n\r\n";
+				CHECK(tx.compare(0, start.size(), start) == 0);
+				CHECK(dechunk(tx.substr(start.size()), out, rest));
+				CHECK(out == text.substr(0, size));
+				CHECK(rest.empty());
+			}
+			else
+				CHECK(tx == std::string(head) + conn + "\r\n" + text.substr(0, size));
+		}
+	}
+
+	// status code without a known reason
+	WiFiClient client = start("", span);
+	WiFiHttpResponse resp(client);
+	resp.begin(299);
+	CHECK(resp.end());
+	CHECK(conns[0].tx == "HTTP/1.1 299 \r\nConnection: close\r\nContent-Length: 0\r\n\r\n");
+}
+
+// -----------------------------------------------------------------
+int main(void)
+{
+	size_t spans[] = { 1, 3, 7, 512 };
+
+	for(size_t i = 0; i < sizeof(spans) / sizeof(spans[0]); i++){
+		testErrors(spans[i]);
+		testHeaders(spans[i]);
+		testLength(spans[i]);
+		testChunked(spans[i]);
+		testResponse(spans[i]);
+	}
+	printf("%u checks, %u failed\n", checks, failed);
+	return failed ? 1 : 0;
+}
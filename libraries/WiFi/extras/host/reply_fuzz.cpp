@@ -0,0 +1,254 @@
+/*
+This library is free software; you can redistribute it and/or
+modify it under the terms of the GNU Lesser General Public
+License as published by the Free Software Foundation; either
+version 2.1 of the License, or (at your option) any later version.
+
+This library is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public
+License along with this library; if not, write to the Free Software
+Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+/* -----------------------------------------------------------------
+* Fuzz harness of the reply decoder (utility/reply.cpp), see README.md
+*
+* Each input is a frame as read from the esp. It is copied into a buffer of
+* its own size, so that the sanitizers catch any read past the bytes given
+* to the decoder, and the replies accepted are checked against the layout
+* the library relies on.
+*
+* Built with libFuzzer (-DWIFI_LIBFUZZER) the engine drives the harness.
+* Otherwise main() runs the files given on the command line, or mutates
+* valid replies with a fixed seed.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <vector>
+
+#include "utility/reply.h"
+#include "utility/spi/spi_drv.h"
+
+// last byte of the frame read by the handler of the reply
+static const uint8_t handlerEnd[] = {
+	0,		// RH_NONE
+	0,		// RH_READY
+	5,		// RH_CAPS
+	5,		// RH_STATUS
+	5,		// RH_CONNECT
+	7,		// RH_SOCK_STATE
+	8,		// RH_SOCK_AVAIL
+	12,		// RH_SOCK_EVENT
+};
+
+static uint32_t results[3];
+static uint32_t packets;
+
+#define CHECK(cond)		do{ if(!(cond)){ fprintf(stderr, "reply_fuzz: %s failed at line %d\n", #cond, __LINE__); abort(); } }while(0)
+
+// -----------------------------------------------------------------
+static void checkReply(const uint8_t* frame, uint8_t avail, const tsReply* reply)
+{
+	CHECK(reply->totalLen >= 5 && reply->totalLen <= avail);
+	CHECK(frame[reply->totalLen - 1] == END_CMD);
+	CHECK(reply->hnd < sizeof(handlerEnd));
+	// RH_CAPS reads the bytes of its parameter, 2 at most
+	uint8_t end = (reply->hnd == RH_CAPS) ? 4 + ((frame[4] < 2) ? frame[4] : 2) : handlerEnd[reply->hnd];
+	CHECK(end < reply->totalLen - 1);
+	if(reply->data != NULL){
+		// the data handed over, and to the pending requests, end before END_CMD
+		CHECK(reply->data >= frame + 4);
+		CHECK(reply->data + reply->dataLen <= frame + reply->totalLen - 1);
+	}
+}
+
+// -----------------------------------------------------------------
+extern "C" int LLVMFuzzerTestOneInput(const uint8_t* data, size_t size)
+{
+	uint8_t first = (size < SPI_BUF_LEN) ? size : SPI_BUF_LEN;
+	uint8_t* frame = (uint8_t*)malloc(first ? first : 1);
+	teReplyParse parsed;
+	tsReply reply;
+	uint32_t len;
+
+	memcpy(frame, data, first);
+	parsed = replyParse(frame, first, &reply);
+	if(parsed == REPLY_MORE){
+		// the second frame follows the first one in the receive buffer, read whole
+		CHECK(frame[2] > first && frame[2] <= REPLY_MAX_LEN);
+		frame = (uint8_t*)realloc(frame, REPLY_MAX_LEN);
+		memset(frame, 0, REPLY_MAX_LEN);
+		memcpy(frame, data, (size < REPLY_MAX_LEN) ? size : REPLY_MAX_LEN);
+		parsed = replyParse(frame, REPLY_MAX_LEN, &reply);
+		CHECK(parsed != REPLY_MORE);
+		if(parsed == REPLY_OK)
+			checkReply(frame, REPLY_MAX_LEN, &reply);
+	}
+	else if(parsed == REPLY_OK)
+		checkReply(frame, first, &reply);
+	results[parsed]++;
+
+	if(replyPacket(frame, first, &len)){
+		CHECK(len <= 0x7FFFFFF0);
+		CHECK(len + 7 > first || frame[len + 6] == END_CMD);
+		packets++;
+	}
+
+	free(frame);
+	return 0;
+}
+
+#ifndef WIFI_LIBFUZZER
+
+/* -----------------------------------------------------------------
+* valid replies the mutations start from
+*/
+static std::vector<uint8_t> reply(uint8_t cmd, std::vector<std::vector<uint8_t>> params)
+{
+	std::vector<uint8_t> f = { START_CMD, (uint8_t)(cmd | (REPLY_FLAG)), 0, (uint8_t)params.size() };
+
+	for(auto& p : params){
+		f.push_back(p.size());
+		f.insert(f.end(), p.begin(), p.end());
+	}
+	f.push_back(END_CMD);
+	f[2] = f.size();
+	return f;
+}
+
+static std::vector<uint8_t> packet(uint8_t cmd, uint32_t len, uint8_t fill)
+{
+	std::vector<uint8_t> f = { DATA_PKT, (uint8_t)(cmd | (REPLY_FLAG)),
+							   (uint8_t)len, (uint8_t)(len >> 8), (uint8_t)(len >> 16), (uint8_t)(len >> 24) };
+
+	for(uint32_t i = 0; i < len && f.size() < REPLY_MAX_LEN - 1; i++)
+		f.push_back(fill + i);
+	f.push_back(END_CMD);
+	return f;
+}
+
+static std::vector<std::vector<uint8_t>> seeds(void)
+{
+	std::vector<uint8_t> ssid(40, 'a');
+
+	return {
+		reply(AVAIL_DATA_TCP_CMD, { { 1 }, { 0x20, 0x01 } }),
+		reply(SOCK_EVENT_NOTIFY, { { 2 }, { 0x03 }, { 4 }, { 0x10, 0x00 } }),
+		reply(GET_CLIENT_STATE_TCP_CMD, { { 0 }, { 4 } }),
+		reply(GET_STATE_TCP_CMD, { { 1 } }),
+		reply(GET_DATA_TCP_CMD, { { 'x' } }),
+		reply(BATCH_CMD, { { 1 }, { 0xc4, 0xff, 0xff, 0xff }, { 3 } }),
+		reply(PARSE_PACKET_UDP, { { 0x10, 0x00 }, { 127, 0, 0, 1 }, { 0x1f, 0x90 }, { 'a', 'b', 'c' } }),
+		reply(GET_REMOTE_DATA_CMD, { { 127, 0, 0, 1 }, { 0x1f, 0x90 } }),
+		reply(GET_CURR_RSSI_CMD, { { 0xd8, 0xff, 0xff, 0xff } }),
+		reply(GET_CONN_STATUS, { { 3 } }),
+		reply(CONNECT_SECURED_AP, { { 3 } }),
+		reply(GET_IPADDR_CMD, { { 192, 168, 1, 2 }, { 255, 255, 255, 0 }, { 192, 168, 1, 1 } }),
+		reply(GET_CURR_SSID_CMD, { ssid }),
+		reply(GET_MACADDR_CMD, { { 2, 0, 0, 0, 0, 1 } }),
+		reply(GET_FW_VERSION_CMD, { { '0', '.', '1', '.', '0' } }),
+		reply(GET_CAPS_CMD, { { 0x1f } }),
+		reply(GET_CAPS_CMD, { { 0xff, 0x01 } }),
+		reply(ESP_READY, { }),
+		packet(GET_DATABUF_TCP_CMD, 20, 'a'),
+		packet(GET_SCAN_LIST_CMD, 300, 0),
+	};
+}
+
+// -----------------------------------------------------------------
+static uint32_t rnd(void)
+{
+	static uint32_t x = 0x2545f491;
+
+	x ^= x << 13;
+	x ^= x >> 17;
+	x ^= x << 5;
+	return x;
+}
+
+static void mutate(std::vector<uint8_t>& f)
+{
+	uint8_t n = 1 + rnd() % 4;
+
+	for(uint8_t i = 0; i < n; i++){
+		uint8_t pos = f.empty() ? 0 : rnd() % f.size();
+		switch(rnd() % 6){
+			case 0:
+				if(!f.empty())
+					f[pos] = rnd();
+			break;
+			case 1:
+				if(!f.empty())
+					f[pos] ^= 1 << (rnd() % 8);
+			break;
+			case 2:
+				// lengths and parameter counts are where the decoder goes wrong
+				if(f.size() > 4)
+					f[2 + rnd() % 3] = rnd();
+			break;
+			case 3:
+				f.resize(rnd() % (REPLY_MAX_LEN + 1));
+			break;
+			case 4:
+				f.insert(f.begin() + pos, rnd());
+			break;
+			case 5:
+				if(!f.empty())
+					f[pos] = END_CMD;
+			break;
+		}
+	}
+}
+
+// -----------------------------------------------------------------
+int main(int argc, char** argv)
+{
+	std::vector<std::vector<uint8_t>> seed = seeds();
+	uint32_t runs = 1000000;
+	int files = 0;
+
+	for(int i = 1; i < argc; i++){
+		if(!strcmp(argv[i], "-n") && i + 1 < argc){
+			runs = strtoul(argv[++i], NULL, 0);
+			continue;
+		}
+		FILE* fp = fopen(argv[i], "rb");
+		if(fp == NULL){
+			perror(argv[i]);
+			return 1;
+		}
+		std::vector<uint8_t> f(REPLY_MAX_LEN);
+		f.resize(fread(f.data(), 1, f.size(), fp));
+		fclose(fp);
+		LLVMFuzzerTestOneInput(f.data(), f.size());
+		files++;
+	}
+	if(files){
+		printf("%d files: %u ok, %u more, %u bad\n", files, results[REPLY_OK], results[REPLY_MORE], results[REPLY_BAD]);
+		return 0;
+	}
+
+	// the seeds have to be accepted as they are
+	for(auto& f : seed){
+		uint32_t ok = results[REPLY_OK], pkts = packets;
+		LLVMFuzzerTestOneInput(f.data(), f.size());
+		CHECK(results[REPLY_OK] == ok + 1 || packets == pkts + 1);
+	}
+
+	for(uint32_t i = 0; i < runs; i++){
+		std::vector<uint8_t> f = seed[rnd() % seed.size()];
+		mutate(f);
+		LLVMFuzzerTestOneInput(f.data(), f.size());
+	}
+	printf("%u frames: %u ok, %u more, %u bad, %u packets\n", runs, results[REPLY_OK], results[REPLY_MORE],
+		   results[REPLY_BAD], packets);
+	return 0;
+}
+
+#endif
@@ -0,0 +1,64 @@
+/*
+  Host replacement of the Arduino core header used to build the WiFi library
+  on a PC against the esp simulator (see esp_sim.h). Time is virtual: it only
+  moves forward when the library calls the timing, pin or SPI functions.
+*/
+
+#ifndef Arduino_h
+#define Arduino_h
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "avr/pgmspace.h"
+#include "avr/io.h"
+#include "avr/interrupt.h"
+
+typedef uint8_t byte;
+typedef bool boolean;
+typedef unsigned int word;
+
+#define HIGH 0x1
+#define LOW  0x0
+
+#define INPUT 0x0
+#define OUTPUT 0x1
+#define INPUT_PULLUP 0x2
+
+#define DEC 10
+#define HEX 16
+#define OCT 8
+#define BIN 2
+
+#ifndef _BV
+#define _BV(bit) (1 << (bit))
+#endif
+
+// functions instead of the core macros, which would break the C++ library headers
+#ifdef __cplusplus
+template<class A, class B> inline A min(A a, B b) { return (a < (A)b) ? a : (A)b; }
+template<class A, class B> inline A max(A a, B b) { return (a > (A)b) ? a : (A)b; }
+#else
+#define min(a,b) ((a)<(b)?(a):(b))
+#define max(a,b) ((a)>(b)?(a):(b))
+#endif
+#define constrain(amt,low,high) ((amt)<(low)?(low):((amt)>(high)?(high):(amt)))
+
+unsigned long millis(void);
+unsigned long micros(void);
+void delay(unsigned long ms);
+void delayMicroseconds(unsigned int us);
+void yield(void);
+
+void pinMode(uint8_t pin, uint8_t mode);
+void digitalWrite(uint8_t pin, uint8_t val);
+int digitalRead(uint8_t pin);
+
+#ifdef __cplusplus
+#include "WString.h"
+#include "HardwareSerial.h"
+#endif
+
+#endif
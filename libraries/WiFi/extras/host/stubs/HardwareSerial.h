@@ -0,0 +1,26 @@
+/*
+  Host replacement of the serial port: output goes to stdout, no input
+*/
+
+#ifndef HardwareSerial_h
+#define HardwareSerial_h
+
+#include "Stream.h"
+
+class HardwareSerial : public Stream
+{
+public:
+	void begin(unsigned long baud) { (void)baud; }
+	void end() {}
+	virtual int available(void) { return 0; }
+	virtual int peek(void) { return -1; }
+	virtual int read(void) { return -1; }
+	virtual void flush(void) {}
+	virtual size_t write(uint8_t c);
+	using Print::write;
+	operator bool() { return true; }
+};
+
+extern HardwareSerial Serial;
+
+#endif
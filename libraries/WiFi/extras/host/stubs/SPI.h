@@ -0,0 +1,35 @@
+/*
+  Host replacement of the SPI library: bytes are exchanged with the esp simulator
+*/
+
+#ifndef _SPI_H_INCLUDED
+#define _SPI_H_INCLUDED
+
+#include <Arduino.h>
+
+#define SPCR SPCR0
+#define SPSR SPSR0
+#define SPDR SPDR0
+
+#define SPI_MODE0 0x00
+
+class SPISettings {
+public:
+	SPISettings() {}
+	SPISettings(uint32_t clock, uint8_t bitOrder, uint8_t dataMode) { (void)clock; (void)bitOrder; (void)dataMode; }
+};
+
+class SPIClass {
+public:
+	static void begin();
+	static void end();
+	static void beginTransaction(SPISettings settings) { (void)settings; }
+	static void endTransaction(void) {}
+	static uint8_t transfer(uint8_t data);
+	static void transfer(void *buf, size_t count);
+	static void usingInterrupt(uint8_t interruptNumber) { (void)interruptNumber; }
+};
+
+extern SPIClass SPI;
+
+#endif
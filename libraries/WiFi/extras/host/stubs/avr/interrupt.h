@@ -0,0 +1,14 @@
+#ifndef _AVR_INTERRUPT_H_
+#define _AVR_INTERRUPT_H_
+
+#include "avr/io.h"
+
+void sim_cli(void);
+void sim_sei(void);
+
+#define cli()			sim_cli()
+#define sei()			sim_sei()
+#define noInterrupts()	cli()
+#define interrupts()	sei()
+
+#endif
@@ -0,0 +1,41 @@
+/*
+  Registers and interrupt vectors of the ATmega328PB used by the WiFi library,
+  emulated by arduino_sim.cpp
+*/
+
+#ifndef _AVR_IO_H_
+#define _AVR_IO_H_
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+/*
+* Writing the SPI data register starts a transfer with the simulated esp,
+* the transfer complete interrupt follows one byte time later if SPIE is set
+*/
+struct SimSpiDataReg {
+	SimSpiDataReg& operator=(uint8_t b);
+	operator uint8_t() const;
+};
+extern SimSpiDataReg SPDR0;
+#endif
+
+extern volatile uint8_t SPCR0;
+extern volatile uint8_t SPSR0;
+extern volatile uint8_t PCICR;
+extern volatile uint8_t PCMSK3;
+
+#define SPIE	7
+#define SPE		6
+#define DORD	5
+#define MSTR	4
+#define SPIF	7
+#define PCIE3	3
+#define PCINT24	0
+
+#define PCINT3_vect		__vector_pcint3
+#define SPI0_STC_vect	__vector_spi0_stc
+
+#define ISR(vector, ...) extern "C" void vector(void); extern "C" void vector(void)
+
+#endif
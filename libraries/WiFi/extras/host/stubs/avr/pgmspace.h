@@ -0,0 +1,26 @@
+#ifndef __PGMSPACE_H_
+#define __PGMSPACE_H_
+
+#include <stdint.h>
+#include <string.h>
+
+// program memory is plain memory on the host
+#define PROGMEM
+#define PGM_P			const char*
+#define PSTR(s)			(s)
+#define pgm_read_byte(p)	(*(const uint8_t*)(p))
+#define pgm_read_word(p)	(*(const uint16_t*)(p))
+#define pgm_read_dword(p)	(*(const uint32_t*)(p))
+#define pgm_read_ptr(p)		(*(void* const*)(p))
+#define memcpy_P		memcpy
+#define strlen_P		strlen
+#define strcpy_P		strcpy
+#define strncpy_P		strncpy
+#define strcmp_P		strcmp
+#define strncmp_P		strncmp
+#define strncasecmp_P	strncasecmp
+#define strstr_P		strstr
+
+typedef char prog_char;
+
+#endif
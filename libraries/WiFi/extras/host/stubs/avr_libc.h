@@ -0,0 +1,25 @@
+/*
+  avr-libc extensions of stdlib.h used by the Arduino core, forced into every
+  translation unit of the host build
+*/
+
+#ifndef AVR_LIBC_H
+#define AVR_LIBC_H
+
+#include "avr/interrupt.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+char* itoa(int value, char* str, int radix);
+char* ltoa(long value, char* str, int radix);
+char* utoa(unsigned int value, char* str, int radix);
+char* ultoa(unsigned long value, char* str, int radix);
+char* dtostrf(double val, signed char width, unsigned char prec, char* s);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,3 @@
+#ifndef Pins_Arduino_h
+#define Pins_Arduino_h
+#endif
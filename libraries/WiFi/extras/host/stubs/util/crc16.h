@@ -0,0 +1,20 @@
+#ifndef _UTIL_CRC16_H_
+#define _UTIL_CRC16_H_
+
+#include <stdint.h>
+
+// C version of the avr-libc inline assembly, polynomial x^8 + x^2 + x + 1
+static inline uint8_t _crc8_ccitt_update(uint8_t inCrc, uint8_t inData)
+{
+	uint8_t data = inCrc ^ inData;
+
+	for(uint8_t i = 0; i < 8; i++){
+		if(data & 0x80)
+			data = (data << 1) ^ 0x07;
+		else
+			data <<= 1;
+	}
+	return data;
+}
+
+#endif
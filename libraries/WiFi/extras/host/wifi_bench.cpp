@@ -0,0 +1,1087 @@
+/*
+  This library is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Lesser General Public
+  License as published by the Free Software Foundation; either
+  version 2.1 of the License, or (at your option) any later version.
+
+  This library is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with this library; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+/*
+  Throughput and latency benchmark of the WiFi library running against the
+  simulated esp. Times are in virtual 328 time (see arduino_sim.cpp), the
+  peers of the sockets are real loopback sockets of the host.
+
+  usage: wifi_bench [--csv] [--full-frames] [--no-window] [--no-duplex] [--no-events] [--no-multi]
+                    [--no-stop-server] [--no-udp-parse] [--no-batch] [--no-scan-list]
+  --full-frames models an esp firmware without variable length frames
+  --no-window models an esp firmware without windowed transfers
+  --no-duplex models an esp firmware without duplex writes
+  --no-events models an esp firmware without socket events
+  --no-multi models an esp firmware without SEND_DATA_MULTI_CMD
+  --no-stop-server models an esp firmware that keeps listening after WiFiServer::end()
+  --no-udp-parse models an esp firmware without PARSE_PACKET_UDP
+  --no-batch models an esp firmware without BATCH_CMD
+  --no-scan-list models an esp firmware without GET_SCAN_LIST_CMD
+  exit status is 1 if some transfer didn't deliver the expected data
+*/
+
+// library headers first, the host socket and time headers define some of its names as macros
+#include <WiFi.h>
+#include <WiFiUdp.h>
+#include <WiFiHttp.h>
+#include "esp_sim.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <string>
+#include <vector>
+
+
+#define PEER_WAIT_MS	3000
+
+/*  -----------------------------------------------------------------
+* Host side of a connection used by a benchmark
+*/
+typedef struct{
+	int listenFd;
+	int fd;
+	bool udp;
+	bool closed;
+	std::string rx;
+	std::string tx;
+	size_t txPos;
+	uint32_t dgrams;
+}tsPeer;
+
+static std::vector<tsPeer*> peers;
+static bool csv = false;
+static int failures = 0;
+
+static tsSimStats stats0;
+static uint64_t time0;
+
+// -----------------------------------------------------------------
+static void setNonBlocking(int fd)
+{
+	fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK);
+}
+
+// -----------------------------------------------------------------
+static uint16_t boundPort(int fd)
+{
+	struct sockaddr_in sa;
+	socklen_t len = sizeof(sa);
+	getsockname(fd, (struct sockaddr*)&sa, &len);
+	return ntohs(sa.sin_port);
+}
+
+// -----------------------------------------------------------------
+static int loopbackSocket(int type, uint16_t port)
+{
+	struct sockaddr_in sa;
+	int one = 1;
+	int fd = socket(AF_INET, type, 0);
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sin_family = AF_INET;
+	sa.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	sa.sin_port = htons(port);
+	setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+	bind(fd, (struct sockaddr*)&sa, sizeof(sa));
+	setNonBlocking(fd);
+	return fd;
+}
+
+// -----------------------------------------------------------------
+static uint16_t freePort(void)
+{
+	int fd = loopbackSocket(SOCK_STREAM, 0);
+	uint16_t port = boundPort(fd);
+	close(fd);
+	return port;
+}
+
+// -----------------------------------------------------------------
+static tsPeer* newPeer(void)
+{
+	tsPeer* p = new tsPeer();
+	p->listenFd = -1;
+	p->fd = -1;
+	p->udp = false;
+	p->closed = false;
+	p->txPos = 0;
+	p->dgrams = 0;
+	peers.push_back(p);
+	return p;
+}
+
+// -----------------------------------------------------------------
+static void freePeers(void)
+{
+	for(size_t i = 0; i < peers.size(); i++){
+		if(peers[i]->fd >= 0)
+			close(peers[i]->fd);
+		if(peers[i]->listenFd >= 0)
+			close(peers[i]->listenFd);
+		delete peers[i];
+	}
+	peers.clear();
+}
+
+/* -----------------------------------------------------------------
+* Moves the data of the peers, called by the esp every time it looks at the network
+*/
+static void peersPoll(void)
+{
+	char buf[4096];
+
+	for(size_t i = 0; i < peers.size(); i++){
+		tsPeer* p = peers[i];
+
+		if(p->listenFd >= 0 && p->fd < 0){
+			p->fd = accept(p->listenFd, NULL, NULL);
+			if(p->fd >= 0)
+				setNonBlocking(p->fd);
+		}
+		if(p->fd < 0)
+			continue;
+
+		while(p->txPos < p->tx.size() && !p->udp){
+			ssize_t ret = send(p->fd, p->tx.data() + p->txPos, p->tx.size() - p->txPos, MSG_NOSIGNAL);
+			if(ret <= 0)
+				break;
+			p->txPos += ret;
+		}
+		while(!p->closed){
+			ssize_t ret = recv(p->fd, buf, sizeof(buf), 0);
+			if(ret == 0 && !p->udp)
+				p->closed = true;
+			if(ret <= 0)
+				break;
+			p->rx.append(buf, ret);
+			p->dgrams++;
+		}
+	}
+}
+
+/* -----------------------------------------------------------------
+* Lets the host network deliver what the esp has sent, waiting for the
+* peer to reach the expected amount of data
+*/
+static bool peerWait(tsPeer* p, size_t rxLen, bool closed = false)
+{
+	struct timespec ts = { 0, 100000 };
+
+	for(uint32_t i = 0; i < PEER_WAIT_MS * 10; i++){
+		espSim.pollNetwork();
+		if(p->rx.size() >= rxLen && (!closed || p->closed))
+			return true;
+		nanosleep(&ts, NULL);
+	}
+	return false;
+}
+
+// -----------------------------------------------------------------
+static std::string pattern(size_t len, uint8_t seed)
+{
+	std::string s(len, 0);
+	for(size_t i = 0; i < len; i++)
+		s[i] = 'a' + (i + seed) % 26;
+	return s;
+}
+
+/* -----------------------------------------------------------------
+* Benchmark bookkeeping
+*/
+static void benchStart(void)
+{
+	stats0 = simStats;
+	time0 = sim_nanos();
+}
+
+static void benchHeader(void)
+{
+	if(csv)
+		printf("benchmark,payload_bytes,time_us,kbytes_per_s,spi_bytes_per_payload_byte,packets,ok\n");
+	else{
+		printf("%-24s %9s %11s %9s %11s %8s\n", "benchmark", "payload", "time(ms)", "KB/s", "spi/byte", "packets");
+		printf("------------------------------------------------------------------------------\n");
+	}
+}
+
+static void benchEnd(const char* name, uint64_t payload, bool ok)
+{
+	double us = (sim_nanos() - time0) / 1000.0;
+	uint64_t spi = simStats.spiBytes - stats0.spiBytes;
+	uint32_t packets = simStats.packets - stats0.packets;
+	double kbs = (us > 0) ? (payload / 1024.0) / (us / 1000000.0) : 0;
+	double ratio = payload ? (double)spi / payload : 0;
+
+	if(!ok)
+		failures++;
+	if(csv)
+		printf("%s,%llu,%.0f,%.2f,%.2f,%u,%d\n", name, (unsigned long long)payload, us, kbs, ratio, packets, ok);
+	else
+		printf("%-24s %9llu %11.2f %9.2f %11.2f %8u%s\n", name, (unsigned long long)payload, us / 1000.0, kbs, ratio, packets, ok ? "" : "  FAILED");
+}
+
+static void latencyHeader(void)
+{
+	if(csv)
+		printf("\ncommand,calls,avg_us,spi_bytes_per_call,packets_per_call\n");
+	else{
+		printf("\n%-24s %9s %11s %9s %11s\n", "command", "calls", "avg(us)", "spi/call", "pkt/call");
+		printf("------------------------------------------------------------------------------\n");
+	}
+}
+
+static void latencyEnd(const char* name, uint32_t calls)
+{
+	double us = (sim_nanos() - time0) / 1000.0;
+	uint64_t spi = simStats.spiBytes - stats0.spiBytes;
+	uint32_t packets = simStats.packets - stats0.packets;
+
+	if(csv)
+		printf("%s,%u,%.1f,%.1f,%.2f\n", name, calls, us / calls, (double)spi / calls, (double)packets / calls);
+	else
+		printf("%-24s %9u %11.1f %9.1f %11.2f\n", name, calls, us / calls, (double)spi / calls, (double)packets / calls);
+}
+
+static void stallHeader(void)
+{
+	if(csv)
+		printf("\nesp_stall,reads,avg_us,max_us\n");
+	else{
+		printf("\n%-24s %9s %11s %9s\n", "esp stall", "reads", "avg(us)", "max(us)");
+		printf("------------------------------------------------------------------------------\n");
+	}
+}
+
+static void stallEnd(const char* name)
+{
+	uint32_t reads = simStats.srWaits - stats0.srWaits;
+	double avg = reads ? (simStats.srWaitNs - stats0.srWaitNs) / 1000.0 / reads : 0;
+	double max = simStats.srWaitMaxNs / 1000.0;
+
+	if(csv)
+		printf("%s,%u,%.1f,%.1f\n", name, reads, avg, max);
+	else
+		printf("%-24s %9u %11.1f %9.1f\n", name, reads, avg, max);
+}
+
+static void restHeader(void)
+{
+	if(csv)
+		printf("\nrest_endpoint,requests,avg_us,requests_per_s,spi_bytes_per_request,packets_per_request,ok\n");
+	else{
+		printf("\n%-24s %9s %11s %9s %11s %8s\n", "rest endpoint", "requests", "avg(us)", "req/s", "spi/req", "pkt/req");
+		printf("------------------------------------------------------------------------------\n");
+	}
+}
+
+static void restEnd(const char* name, uint32_t requests, bool ok)
+{
+	double us = (sim_nanos() - time0) / 1000.0;
+	uint64_t spi = simStats.spiBytes - stats0.spiBytes;
+	uint32_t packets = simStats.packets - stats0.packets;
+	double avg = requests ? us / requests : 0;
+	double rps = (us > 0) ? requests / (us / 1000000.0) : 0;
+
+	if(!ok)
+		failures++;
+	if(csv)
+		printf("%s,%u,%.1f,%.1f,%.1f,%.2f,%d\n", name, requests, avg, rps, requests ? (double)spi / requests : 0,
+			   requests ? (double)packets / requests : 0, ok);
+	else
+		printf("%-24s %9u %11.1f %9.1f %11.1f %8.2f%s\n", name, requests, avg, rps, requests ? (double)spi / requests : 0,
+			   requests ? (double)packets / requests : 0, ok ? "" : "  FAILED");
+}
+
+/* -----------------------------------------------------------------
+* TCP transmission: the library connects to a host sink
+*/
+typedef enum { wr_byte, wr_println, wr_chunk, wr_async, wr_parts, wr_writev, wr_print_F, wr_flash } teWriteMode;
+
+// response header kept in flash, sent before each chunk by wr_parts and wr_writev
+static const char httpHdr[] PROGMEM = "HTTP/1.1 200 OK\r\nContent-Type: text/plain\r\n\r\n";
+
+static void benchTcpWrite(const char* name, teWriteMode mode, size_t total, size_t chunk)
+{
+	tsPeer* sink = newPeer();
+	sink->listenFd = loopbackSocket(SOCK_STREAM, 0);
+	listen(sink->listenFd, 1);
+
+	WiFiClient client;
+	std::string data = pattern(total, 0);
+	std::string expected;
+
+	if(!client.connect(IPAddress(127, 0, 0, 1), boundPort(sink->listenFd))){
+		benchEnd(name, 0, false);
+		freePeers();
+		return;
+	}
+
+	benchStart();
+	switch(mode){
+		case wr_byte:
+			for(size_t i = 0; i < total; i++)
+				client.write((uint8_t)data[i]);
+			expected = data;
+		break;
+		case wr_println:
+			for(size_t i = 0; expected.size() < total; i++){
+				client.println(i);
+				expected += std::to_string(i) + "\r\n";
+			}
+		break;
+		case wr_chunk:
+			for(size_t i = 0; i < total; i += chunk)
+				client.write((const uint8_t*)data.data() + i, min(chunk, total - i));
+			expected = data;
+		break;
+		case wr_async:
+			for(size_t i = 0; i < total; i += chunk){
+				client.writeAsync((const uint8_t*)data.data() + i, min(chunk, total - i));
+				while(client.writeBusy());
+			}
+			expected = data;
+		break;
+		case wr_parts:
+		case wr_writev:
+			// header + body + trailer, as three writes or as a single writev
+			for(size_t i = 0; i < total; i += chunk){
+				size_t n = min(chunk, total - i);
+				tsIoVec iov[3] = {
+					{ (const uint8_t*)httpHdr, (uint16_t)strlen_P(httpHdr), true },
+					{ (const uint8_t*)data.data() + i, (uint16_t)n, false },
+					{ (const uint8_t*)"\r\n", 2, false },
+				};
+				if(mode == wr_writev)
+					client.writev(iov, 3);
+				else{
+					client.write(iov[0].data, iov[0].len);
+					client.write(iov[1].data, n);
+					client.write(iov[2].data, 2);
+				}
+				expected += std::string(httpHdr) + data.substr(i, n) + "\r\n";
+			}
+		break;
+		case wr_print_F:
+		case wr_flash:
+			// a page kept in flash, printed by Print (byte by byte) or by WiFiClient
+			if(mode == wr_flash)
+				client.print((const __FlashStringHelper*)data.c_str());
+			else
+				static_cast<Print&>(client).print((const __FlashStringHelper*)data.c_str());
+			expected = data;
+		break;
+	}
+	client.flush();
+	benchEnd(name, expected.size(), peerWait(sink, expected.size()) && sink->rx == expected);
+
+	client.stop();
+	freePeers();
+}
+
+/* -----------------------------------------------------------------
+* TCP reception: a host source sends total bytes to the library
+*/
+static void benchTcpRead(const char* name, size_t total, size_t chunk)
+{
+	tsPeer* src = newPeer();
+	src->listenFd = loopbackSocket(SOCK_STREAM, 0);
+	listen(src->listenFd, 1);
+	src->tx = pattern(total, 3);
+
+	WiFiClient client;
+	std::string got;
+	uint8_t buf[512];
+
+	if(!client.connect(IPAddress(127, 0, 0, 1), boundPort(src->listenFd))){
+		benchEnd(name, 0, false);
+		freePeers();
+		return;
+	}
+	peerWait(src, 0);
+
+	benchStart();
+	uint32_t start = millis();
+	while(got.size() < total && (millis() - start) < 20000){
+		if(client.available() <= 0)
+			continue;
+		if(chunk == 1){
+			int c = client.read();
+			if(c >= 0)
+				got += (char)c;
+		}
+		else{
+			int n = client.read(buf, min(chunk, sizeof(buf)));
+			if(n > 0)
+				got.append((char*)buf, n);
+		}
+	}
+	benchEnd(name, got.size(), got == src->tx);
+
+	client.stop();
+	freePeers();
+}
+
+/* -----------------------------------------------------------------
+* UDP transmission and reception
+*/
+static void benchUdpSend(const char* name, uint32_t count, size_t size)
+{
+	tsPeer* sink = newPeer();
+	sink->udp = true;
+	sink->fd = loopbackSocket(SOCK_DGRAM, 0);
+
+	WiFiUDP udp;
+	std::string data = pattern(size, 5);
+	udp.begin(freePort());
+
+	benchStart();
+	for(uint32_t i = 0; i < count; i++){
+		udp.beginPacket(IPAddress(127, 0, 0, 1), boundPort(sink->fd));
+		udp.write((const uint8_t*)data.data(), size);
+		udp.endPacket();
+	}
+	bool ok = peerWait(sink, count * size);
+	benchEnd(name, count * size, ok && sink->dgrams == count);
+
+	udp.stop();
+	freePeers();
+}
+
+static void benchUdpRecv(const char* name, uint32_t count, size_t size)
+{
+	uint16_t port = freePort();
+	WiFiUDP udp;
+	std::string data = pattern(size, 7);
+	std::string got;
+	uint8_t buf[512];
+
+	udp.begin(port);
+
+	int fd = loopbackSocket(SOCK_DGRAM, 0);
+	struct sockaddr_in sa;
+	memset(&sa, 0, sizeof(sa));
+	sa.sin_family = AF_INET;
+	sa.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	sa.sin_port = htons(port);
+	for(uint32_t i = 0; i < count; i++)
+		sendto(fd, data.data(), size, 0, (struct sockaddr*)&sa, sizeof(sa));
+
+	benchStart();
+	uint32_t start = millis();
+	while(got.size() < count * size && (millis() - start) < 20000){
+		if(udp.parsePacket() <= 0)
+			continue;
+		int n = udp.read(buf, sizeof(buf));
+		if(n > 0)
+			got.append((char*)buf, n);
+	}
+	std::string expected;
+	for(uint32_t i = 0; i < count; i++)
+		expected += data;
+	benchEnd(name, got.size(), got == expected);
+
+	udp.stop();
+	close(fd);
+}
+
+/* -----------------------------------------------------------------
+* UDP request/response service (NTP-like): a host client sends a request
+* of size bytes, the library answers to the sender with the same bytes
+*/
+static void benchUdpService(const char* name, uint32_t count, size_t size)
+{
+	uint16_t port = freePort();
+	WiFiUDP udp;
+	std::string data = pattern(size, 11);
+	uint32_t answered = 0;
+	uint8_t buf[512];
+
+	udp.begin(port);
+
+	int fd = loopbackSocket(SOCK_DGRAM, 0);
+	struct sockaddr_in sa;
+	memset(&sa, 0, sizeof(sa));
+	sa.sin_family = AF_INET;
+	sa.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	sa.sin_port = htons(port);
+
+	benchStart();
+	for(uint32_t i = 0; i < count; i++){
+		sendto(fd, data.data(), size, 0, (struct sockaddr*)&sa, sizeof(sa));
+
+		uint32_t start = millis();
+		int len = 0;
+		while(len <= 0 && (millis() - start) < PEER_WAIT_MS)
+			len = udp.parsePacket();
+		int n = udp.read(buf, sizeof(buf));
+		udp.beginPacket(udp.remoteIP(), udp.remotePort());
+		udp.write(buf, (n > 0) ? n : 0);
+		udp.endPacket();
+
+		ssize_t ret = -1;
+		start = millis();
+		while(ret < 0 && (millis() - start) < PEER_WAIT_MS)
+			ret = recv(fd, buf, sizeof(buf), 0);
+		if(ret == (ssize_t)size && !memcmp(buf, data.data(), size))
+			answered++;
+	}
+	benchEnd(name, count * size, answered == count);
+
+	udp.stop();
+	close(fd);
+}
+
+/* -----------------------------------------------------------------
+* Broadcast: WiFiServer::write of count messages to every client. Each
+* WiFiServer started on the port takes a client.
+*/
+static void benchBroadcast(const char* name, uint8_t clients, uint32_t count, size_t size)
+{
+	uint16_t port = freePort();
+	std::vector<WiFiServer> servers;
+	WiFiClient accepted[MAX_SOCK_NUM];
+	tsPeer* listeners[MAX_SOCK_NUM];
+	std::string data = pattern(size, 5);
+	std::string expected;
+	bool ok = true;
+
+	servers.reserve(clients);
+	for(uint8_t i = 0; i < clients; i++){
+		servers.emplace_back(port);
+		servers[i].begin();
+	}
+	for(uint8_t i = 0; i < clients; i++){
+		struct sockaddr_in sa;
+		memset(&sa, 0, sizeof(sa));
+		sa.sin_family = AF_INET;
+		sa.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+		sa.sin_port = htons(port);
+		listeners[i] = newPeer();
+		listeners[i]->fd = socket(AF_INET, SOCK_STREAM, 0);
+		if(connect(listeners[i]->fd, (struct sockaddr*)&sa, sizeof(sa)) != 0)
+			ok = false;
+		setNonBlocking(listeners[i]->fd);
+	}
+	// wait for the esp to accept all of them
+	uint32_t start = millis();
+	for(uint8_t i = 0; i < clients && ok; i++){
+		while(!(accepted[i] = servers[i].available()) && (millis() - start) < PEER_WAIT_MS);
+		ok = accepted[i];
+	}
+
+	benchStart();
+	for(uint32_t i = 0; i < count && ok; i++){
+		servers[0].write((const uint8_t*)data.data(), size);
+		expected += data;
+	}
+	for(uint8_t i = 0; i < clients && ok; i++)
+		ok = peerWait(listeners[i], expected.size()) && listeners[i]->rx == expected;
+	benchEnd(name, expected.size() * clients, ok);
+
+	servers[0].end();
+	freePeers();
+}
+
+/* -----------------------------------------------------------------
+* Web server loop as in the WiFiWebServer example: a host client asks
+* for a page, the library reads the request and prints the answer
+*/
+static void benchWebServer(const char* name, uint32_t lines)
+{
+	uint16_t port = freePort();
+	WiFiServer server(port);
+	server.begin();
+
+	tsPeer* browser = newPeer();
+	struct sockaddr_in sa;
+	memset(&sa, 0, sizeof(sa));
+	sa.sin_family = AF_INET;
+	sa.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	sa.sin_port = htons(port);
+	browser->fd = socket(AF_INET, SOCK_STREAM, 0);
+	if(connect(browser->fd, (struct sockaddr*)&sa, sizeof(sa)) != 0){
+		benchEnd(name, 0, false);
+		server.end();
+		freePeers();
+		return;
+	}
+	setNonBlocking(browser->fd);
+	browser->tx = "GET / HTTP/1.1\r\nHost: jolly\r\n\r\n";
+
+	benchStart();
+	bool served = false;
+	uint32_t start = millis();
+	while(!served && (millis() - start) < 20000){
+		WiFiClient client = server.available();
+		if(!client)
+			continue;
+
+		bool blank = true;
+		while(client.connected() && (millis() - start) < 20000){
+			if(!client.available())
+				continue;
+			char c = client.read();
+			if(c == '\n' && blank){
+				client.println("HTTP/1.1 200 OK");
+				client.println("Content-Type: text/html");
+				client.println("Connection: close");
+				client.println();
+				client.println("<!DOCTYPE HTML>");
+				client.println("<html>");
+				for(uint32_t i = 0; i < lines; i++){
+					client.print("analog input ");
+					client.print(i);
+					client.print(" is ");
+					client.print(i * 37 % 1024);
+					client.println("<br />");
+				}
+				client.println("</html>");
+				break;
+			}
+			if(c == '\n')
+				blank = true;
+			else if(c != '\r')
+				blank = false;
+		}
+		delay(1);
+		client.stop();
+		served = true;
+	}
+	bool ok = served && peerWait(browser, 1) && browser->rx.find("</html>") != std::string::npos;
+	benchEnd(name, browser->rx.size(), ok);
+
+	server.end();
+	freePeers();
+}
+
+/* -----------------------------------------------------------------
+* REST pin control as in the WiFiRestServer example: a host client asks for
+* /jolly/digital/9/1 and the library answers. rest_string is the example as
+* it was before WiFiHttpRequest, reading the request a character at a time
+* into String objects; rest_parser parses it with WiFiHttpRequest, and
+* rest_keepalive does the same over a single connection kept open.
+*/
+typedef enum { rest_string, rest_parser, rest_keepalive } teRestMode;
+
+static const char restClose[] = "GET /jolly/digital/9/1 HTTP/1.1\r\nHost: jolly\r\nAccept: */*\r\nConnection: close\r\n\r\n";
+static const char restKeepAlive[] = "GET /jolly/digital/9/1 HTTP/1.1\r\nHost: jolly\r\nAccept: */*\r\n\r\n";
+
+static bool restListen(WiFiClient& client, String service)
+{
+	String currentLine = "";
+
+	while(client.connected()){
+		if(client.available() > 0){
+			char c = client.read();
+			currentLine += c;
+			if(c == '\n'){
+				client.println("HTTP/1.1 200 OK");
+				client.println();
+				return false;
+			}
+			else if(currentLine.endsWith(service + "/"))
+				return true;
+		}
+	}
+	return false;
+}
+
+static void restStringDigital(WiFiClient& client)
+{
+	String pinNumber;
+	char c = client.read();
+
+	while(c != ' ' && c != '/'){
+		pinNumber += c;
+		c = client.read();
+	}
+	int pin = pinNumber.toInt();
+	int value = client.parseInt();
+	digitalWrite(pin, value);
+
+	client.flush();
+	client.print("HTTP/1.1 200 OK\r\nAccess-Control-Allow-Origin: *\r\n\r\nPin D" + String(pin) + " set to: " + String(value));
+}
+
+static void restString(WiFiClient& client)
+{
+	if(restListen(client, "jolly")){
+		String command = client.readStringUntil('/');
+		if(command == "digital")
+			restStringDigital(client);
+	}
+}
+
+// one request parsed and answered, false if it doesn't come
+static bool restParser(WiFiClient& client, WiFiHttpRequest& request, uint32_t start)
+{
+	teHttpParse ret;
+
+	while((ret = request.parse(client)) == HTTP_MORE && client.connected() && (millis() - start) < 20000);
+
+	WiFiHttpResponse response(client);
+	if(ret != HTTP_HEADERS){
+		response.begin(ret == HTTP_ERROR ? request.error() : 408);
+		response.end();
+		return false;
+	}
+	response.begin(200, request.keepAlive());
+	response.header(F("Access-Control-Allow-Origin: *"));
+	if(request.segmentIs(0, F("jolly")) && request.segmentIs(1, F("digital")) && request.segment(3) != NULL){
+		int pin = atoi(request.segment(2));
+		int value = atoi(request.segment(3));
+		digitalWrite(pin, value);
+		response.print(F("Pin D"));
+		response.print(pin);
+		response.print(F(" set to: "));
+		response.print(value);
+	}
+	return response.end();
+}
+
+static tsPeer* restConnect(uint16_t port)
+{
+	struct sockaddr_in sa;
+	tsPeer* browser = newPeer();
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sin_family = AF_INET;
+	sa.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	sa.sin_port = htons(port);
+	browser->fd = socket(AF_INET, SOCK_STREAM, 0);
+	if(connect(browser->fd, (struct sockaddr*)&sa, sizeof(sa)) != 0)
+		return NULL;
+	setNonBlocking(browser->fd);
+	return browser;
+}
+
+static void benchRest(const char* name, teRestMode mode, uint32_t requests)
+{
+	uint16_t port = freePort();
+	WiFiServer server(port);
+	WiFiHttpRequest request;
+	WiFiClient client;
+	tsPeer* browser = NULL;
+	std::string expected;
+	uint32_t served = 0;
+	bool ok = true;
+
+	switch(mode){
+		case rest_string:
+			expected = "HTTP/1.1 200 OK\r\nAccess-Control-Allow-Origin: *\r\n\r\nPin D9 set to: 1";
+		break;
+		case rest_parser:
+			expected = "HTTP/1.1 200 OK\r\nAccess-Control-Allow-Origin: *\r\nConnection: close\r\nContent-Length: 16\r\n\r\nPin D9 set to: 1";
+		break;
+		case rest_keepalive:
+			expected = "HTTP/1.1 200 OK\r\nAccess-Control-Allow-Origin: *\r\nConnection: keep-alive\r\nContent-Length: 16\r\n\r\nPin D9 set to: 1";
+		break;
+	}
+
+	server.begin();
+	benchStart();
+	uint32_t start = millis();
+	while(served < requests && ok){
+		// a connection per request, or one kept open for all of them
+		if(browser == NULL || mode != rest_keepalive){
+			browser = restConnect(port);
+			if(browser == NULL){
+				ok = false;
+				break;
+			}
+			request.reset();
+			while(!(client = server.available()) && (millis() - start) < 20000);
+		}
+		size_t rx0 = browser->rx.size();
+		browser->tx += (mode == rest_keepalive) ? restKeepAlive : restClose;
+
+		if(mode == rest_string){
+			while(client.connected() && !client.available() && (millis() - start) < 20000);
+			restString(client);
+		}
+		else
+			ok = restParser(client, request, start);
+
+		if(mode != rest_keepalive){
+			delay(1);
+			client.stop();
+		}
+		ok = ok && peerWait(browser, rx0 + expected.size(), mode != rest_keepalive) && browser->rx.compare(rx0, std::string::npos, expected) == 0;
+		served++;
+	}
+	client.stop();
+	restEnd(name, served, ok);
+
+	server.end();
+	freePeers();
+}
+
+/* -----------------------------------------------------------------
+* Network scan and read of all the results
+*/
+static void benchScan(const char* name)
+{
+	char ssid[WL_SSID_MAX_LENGTH + 1];
+	int32_t rssi;
+	uint8_t enc;
+	std::string names;
+
+	benchStart();
+	int8_t n = WiFi.scanNetworks();
+	bool ok = (n > 0);
+	for(int8_t i = 0; i < n; i++){
+		ok &= (WiFi.getScannedNetwork(i, ssid, rssi, enc) == 1) && rssi < 0;
+		names += ssid;
+		names += ',';
+	}
+	benchEnd(name, names.size(), ok && names.find(",a-network-name-of-32-characters!,") != std::string::npos);
+}
+
+/* -----------------------------------------------------------------
+* Runs a benchmark that changes the state of the library in a child
+* process, so that the following ones are not affected. The capabilities
+* in drop are taken off the esp firmware and the link set up again, to
+* measure the fallback of the library.
+*/
+static void benchIsolated(const std::function<void(void)>& bench, uint16_t drop = 0)
+{
+	int status;
+
+	fflush(stdout);
+	pid_t pid = fork();
+	if(pid == 0){
+		if(drop){
+			espSim.fwCaps &= ~drop;
+			commDrv.off();
+			WiFi.init(AP_STA_MODE);
+		}
+		bench();
+		fflush(stdout);
+		_exit(failures ? 1 : 0);
+	}
+	if(pid < 0 || waitpid(pid, &status, 0) != pid || !WIFEXITED(status) || WEXITSTATUS(status) != 0)
+		failures++;
+}
+
+// completion callback of the async requests, the table slot is released by the library
+static void releaseCb(int8_t req)
+{
+	(void)req;
+}
+
+/* -----------------------------------------------------------------
+* Cost of the single commands
+*/
+static void benchLatency(uint32_t calls)
+{
+	IPAddress ip;
+
+	latencyHeader();
+
+	benchStart();
+	for(uint32_t i = 0; i < calls; i++)
+		WiFi.firmwareVersion();
+	latencyEnd("firmwareVersion", calls);
+
+	benchStart();
+	for(uint32_t i = 0; i < calls; i++)
+		WiFi.localIP();
+	latencyEnd("localIP", calls);
+
+	benchStart();
+	for(uint32_t i = 0; i < calls; i++)
+		WiFi.RSSI();
+	latencyEnd("RSSI", calls);
+
+	// requests in flight with 200 us of application work after each one:
+	// the reply of a request is pending when the next one is written
+	benchStart();
+	for(uint32_t i = 0; i < calls; i++){
+		int8_t req = WiFi.requestAsync(GET_CURR_RSSI_CMD, NO_SOCKET_AVAIL, releaseCb);
+		if(req < 0)
+			failures++;
+		delayMicroseconds(200);
+	}
+	// the last one waits for all the previous replies
+	int8_t last = WiFi.requestAsync(GET_CURR_RSSI_CMD);
+	while(WiFi.requestState(last) == REQ_PENDING);
+	WiFi.requestRelease(last);
+	latencyEnd("RSSI (async + 200us)", calls);
+
+	benchStart();
+	for(uint32_t i = 0; i < calls; i++){
+		WiFi.dnsCacheFlush();
+		WiFi.hostByName("localhost", ip);
+	}
+	latencyEnd("hostByName", calls);
+
+	benchStart();
+	for(uint32_t i = 0; i < calls; i++)
+		WiFi.hostByName("localhost", ip);
+	latencyEnd("hostByName (cached)", calls);
+
+	uint16_t port = freePort();
+	WiFiServer server(port);
+	server.begin();
+	benchStart();
+	for(uint32_t i = 0; i < calls; i++)
+		server.available();
+	latencyEnd("WiFiServer::available", calls);
+
+	tsPeer* peer = newPeer();
+	peer->listenFd = loopbackSocket(SOCK_STREAM, 0);
+	listen(peer->listenFd, 1);
+	WiFiClient client;
+	client.connect(IPAddress(127, 0, 0, 1), boundPort(peer->listenFd));
+
+	benchStart();
+	for(uint32_t i = 0; i < calls; i++)
+		client.available();
+	latencyEnd("WiFiClient::available", calls);
+
+	benchStart();
+	for(uint32_t i = 0; i < calls; i++)
+		client.status();
+	latencyEnd("WiFiClient::status", calls);
+
+	benchStart();
+	client.stop();
+	latencyEnd("WiFiClient::stop", 1);
+
+	server.end();
+	freePeers();
+}
+
+/* -----------------------------------------------------------------
+* Time the esp keeps a frame announced by the SR before the 328 reads it,
+* when the sketch works for busyUs without calling the library after each
+* request. With WIFI_ISR_RX the frame is read from the SR interrupt.
+*/
+static void benchStall(const char* name, uint32_t calls, uint32_t busyUs)
+{
+	benchStart();
+	simStats.srWaitMaxNs = 0;
+	for(uint32_t i = 0; i < calls; i++){
+		int8_t req = WiFi.requestAsync(GET_CURR_RSSI_CMD);
+		if(req < 0){
+			failures++;
+			continue;
+		}
+		delayMicroseconds(busyUs);
+		while(WiFi.requestState(req) == REQ_PENDING);
+		WiFi.requestRelease(req);
+	}
+	stallEnd(name);
+}
+
+// -----------------------------------------------------------------
+int main(int argc, char** argv)
+{
+	for(int i = 1; i < argc; i++){
+		if(!strcmp(argv[i], "--csv"))
+			csv = true;
+		else if(!strcmp(argv[i], "--full-frames"))
+			espSim.supported[GET_CAPS_CMD] = false;
+		else if(!strcmp(argv[i], "--no-window"))
+			espSim.fwCaps &= ~WIFI_CAP_WINDOW;
+		else if(!strcmp(argv[i], "--no-duplex"))
+			espSim.fwCaps &= ~WIFI_CAP_DUPLEX;
+		else if(!strcmp(argv[i], "--no-events"))
+			espSim.fwCaps &= ~WIFI_CAP_SOCK_EVENTS;
+		else if(!strcmp(argv[i], "--no-multi"))
+			espSim.fwCaps &= ~WIFI_CAP_SEND_MULTI;
+		else if(!strcmp(argv[i], "--no-stop-server"))
+			espSim.fwCaps &= ~WIFI_CAP_STOP_SERVER;
+		else if(!strcmp(argv[i], "--no-udp-parse"))
+			espSim.fwCaps &= ~WIFI_CAP_UDP_PARSE;
+		else if(!strcmp(argv[i], "--no-batch"))
+			espSim.fwCaps &= ~WIFI_CAP_BATCH;
+		else if(!strcmp(argv[i], "--no-scan-list"))
+			espSim.fwCaps &= ~WIFI_CAP_SCAN_LIST;
+		else{
+			fprintf(stderr, "usage: %s [--csv] [--full-frames] [--no-window] [--no-duplex] [--no-events] [--no-multi]\n"
+					"       [--no-stop-server] [--no-udp-parse] [--no-batch] [--no-scan-list]\n", argv[0]);
+			return 2;
+		}
+	}
+
+	espSim.netHook = peersPoll;
+	WiFi.init(AP_STA_MODE);
+
+	benchHeader();
+	benchTcpWrite("tcp write(byte)", wr_byte, 2048, 1);
+	benchTcpWrite("tcp println(int)", wr_println, 2048, 0);
+	benchTcpWrite("tcp write(64)", wr_chunk, 16384, 64);
+	benchTcpWrite("tcp write(512)", wr_chunk, 16384, 512);
+	benchTcpWrite("tcp writeAsync(512)", wr_async, 16384, 512);
+	benchTcpWrite("tcp hdr+512+crlf", wr_parts, 16384, 512);
+	benchTcpWrite("tcp writev(hdr,512,crlf)", wr_writev, 16384, 512);
+	benchTcpWrite("tcp Print::print(F())", wr_print_F, 4096, 0);
+	benchTcpWrite("tcp print(F())", wr_flash, 4096, 0);
+	// segments longer than 8KB: more than 255 frames
+	benchTcpWrite("tcp print(F()) 8192", wr_flash, 8192, 0);
+	benchTcpWrite("tcp writev(hdr,8192,crlf)", wr_writev, 8192, 8192);
+	// one frame out of 16 lost: windowed transfers send it again
+	espSim.winDropEvery = 16;
+	benchTcpWrite("tcp write(512) lossy", wr_chunk, 16384, 512);
+	espSim.winDropEvery = 0;
+	benchTcpRead("tcp read()", 4096, 1);
+	benchTcpRead("tcp read(256)", 16384, 256);
+	benchUdpSend("udp send(256)", 16, 256);
+	benchUdpRecv("udp recv(256)", 16, 256);
+	benchUdpService("udp request/reply(48)", 16, 48);
+	benchIsolated([](){ benchUdpService("udp req/reply, no parse", 16, 48); }, WIFI_CAP_UDP_PARSE);
+	benchBroadcast("server write(128) x3", 3, 32, 128);
+	benchWebServer("web server page", 20);
+	// without events and batch WiFiServer::available() asks socket by socket
+	benchIsolated([](){ benchWebServer("web page, no batch", 20); }, WIFI_CAP_BATCH | WIFI_CAP_SOCK_EVENTS);
+	benchIsolated([](){ benchScan("scan per network"); }, WIFI_CAP_SCAN_LIST);
+	benchScan("scan list");
+
+	benchLatency(32);
+
+	stallHeader();
+	benchStall("reply, loop polling", 32, 0);
+	benchStall("reply, loop busy 2ms", 32, 2000);
+
+	restHeader();
+	benchRest("rest String", rest_string, 16);
+	benchRest("rest WiFiHttpRequest", rest_parser, 16);
+	benchRest("rest keep-alive", rest_keepalive, 16);
+	benchIsolated([](){ benchRest("rest String, no batch", rest_string, 16); }, WIFI_CAP_BATCH | WIFI_CAP_SOCK_EVENTS);
+	benchIsolated([](){ benchRest("rest parser, no batch", rest_parser, 16); }, WIFI_CAP_BATCH | WIFI_CAP_SOCK_EVENTS);
+
+#ifdef WIFI_RAM_REPORT
+	if(!csv)
+		printf("\nstatic RAM of the library: %u bytes\n", (unsigned)WiFi.staticRam);
+#endif
+#ifdef WIFI_SPI_STATS
+	if(!csv){
+		printf("\n");
+		WiFi.printLinkStats(Serial);
+	}
+#endif
+
+	return failures ? 1 : 0;
+}
@@ -16,13 +16,65 @@ Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
 
 #include <WiFi.h>
 #include "utility/packager.h"
+#include "utility/reply.h"
 #include "utility/spi/spi_drv.h"
 
-// XXX: don't make assumptions about the value of MAX_SOCK_NUM.
 uint8_t		WiFiClass::hostname[MAX_HOSTNAME_LEN] {0};
-uint8_t 	WiFiClass::_state[MAX_SOCK_NUM] = { 0, 0, 0, 0 };
-uint16_t 	WiFiClass::_server_port[MAX_SOCK_NUM] = { 0, 0, 0, 0 };
-uint16_t	WiFiClass::_client_data[MAX_SOCK_NUM] = { 0, 0, 0, 0};
+// all zero: CLOSED and CONN_NONE
+uint8_t 	WiFiClass::_sockState[MAX_SOCK_NUM];
+uint16_t 	WiFiClass::_server_port[MAX_SOCK_NUM];
+uint16_t	WiFiClass::_client_data[MAX_SOCK_NUM];
+tSockMask	WiFiClass::_sockFree = SOCK_MASK_ALL;
+tSockMask	WiFiClass::_sockBound = 0;
+tsSockRxBuf	WiFiClass::_sockRxBuf[MAX_SOCK_NUM];
+tsSockTxBuf	WiFiClass::_sockTxBuf[MAX_SOCK_NUM];
+volatile uint8_t WiFiClass::_sockEvents[MAX_SOCK_NUM];
+
+static_assert((WIFI_SOCK_RX_BUF_LEN & (WIFI_SOCK_RX_BUF_LEN - 1)) == 0 && WIFI_SOCK_RX_BUF_LEN <= 128,
+			  "WIFI_SOCK_RX_BUF_LEN must be a power of two not greater than 128");
+static_assert(MAX_SOCK_NUM >= 1 && MAX_SOCK_NUM <= 16, "MAX_SOCK_NUM must be between 1 and 16");
+static_assert(WIFI_SOCK_RAM <= WIFI_SOCK_RAM_MAX, "socket table larger than WIFI_SOCK_RAM_MAX");
+
+// strings returned by SSID() and firmwareVersion()
+#ifdef WIFI_LOW_MEMORY
+#define WIFI_SSID_STR	((char*)WiFiClass::hostname)
+#define WIFI_FW_STR		((char*)WiFiClass::hostname)
+#define WIFI_STR_RAM	(MAX_HOSTNAME_LEN)
+static_assert(MAX_HOSTNAME_LEN >= WL_SSID_MAX_LENGTH && MAX_HOSTNAME_LEN >= WL_FW_VER_LENGTH,
+			  "the hostname buffer holds the SSID and the firmware version with WIFI_LOW_MEMORY");
+#else
+#define WIFI_SSID_STR	Packager::_ssid
+#define WIFI_FW_STR		Packager::fwVersion
+#define WIFI_STR_RAM	(MAX_HOSTNAME_LEN + WL_SSID_MAX_LENGTH + WL_FW_VER_LENGTH)
+#endif
+
+// static RAM of the library on the AVR, the scan list is allocated by scanNetworks() only.
+// Read it at run time from WiFiClass::staticRam, cap it with WIFI_LIB_RAM_MAX
+#ifdef WIFI_ISR_RX
+#define WIFI_LIB_RAM	(WIFI_SOCK_RAM + WIFI_SPI_BUF_RAM + WIFI_ISR_RX_FRAMES * (SPI_BUF_LEN + 1) + \
+						 WIFI_REQ_RAM + WIFI_DNS_RAM + WIFI_STR_RAM)
+#else
+#define WIFI_LIB_RAM	(WIFI_SOCK_RAM + WIFI_SPI_BUF_RAM + WIFI_REQ_RAM + WIFI_DNS_RAM + WIFI_STR_RAM)
+#endif
+
+// Define WIFI_LIB_RAM_MAX to fail the build when the whole static RAM of the library
+// (WiFi.staticRam) is larger (bytes)
+#ifdef WIFI_LIB_RAM_MAX
+static_assert(WIFI_LIB_RAM <= WIFI_LIB_RAM_MAX, "static RAM of the library larger than WIFI_LIB_RAM_MAX");
+#endif
+const uint16_t WiFiClass::staticRam = WIFI_LIB_RAM;
+
+#ifdef WIFI_RAM_REPORT
+#define WIFI_STR(x)		#x
+#define WIFI_XSTR(x)	WIFI_STR(x)
+#pragma message("WiFi socket table: " WIFI_XSTR(MAX_SOCK_NUM) " sockets of 14 + " WIFI_XSTR(WIFI_SOCK_RX_BUF_LEN) \
+				" rx + " WIFI_XSTR(WIFI_SOCK_TX_BUF_LEN) " tx bytes")
+#pragma message("WiFi buffers: SPI " WIFI_XSTR(WIFI_SPI_BUF_RAM) ", requests " WIFI_XSTR(WIFI_REQ_RAM) \
+				", DNS cache " WIFI_XSTR(WIFI_DNS_RAM) ", strings " WIFI_XSTR(WIFI_STR_RAM) " bytes")
+#endif
+
+// sockets polled by a single batch: 5 reply bytes each, all in one frame
+#define POLL_BATCH_SOCKS	((SPI_BUF_LEN - 5) / 5)
 
 bool WiFiClass::gotResponse = false;
 uint8_t WiFiClass::responseType = 0x00;
@@ -31,50 +83,127 @@ uint8_t* WiFiClass::data = NULL;
 wl_status_t WiFiClass::connectionStatus = WL_NO_WIFI_MODULE_COMM;
 bool WiFiClass::notify = false;
 volatile tsDataPacket WiFiClass::dataPkt;
-volatile tsNewCmd WiFiClass::cmdPkt;
 int32_t WiFiClass::pktLen;
+tsRequest WiFiClass::_req[WIFI_MAX_PENDING_REQ];
+tsScanResult* WiFiClass::_scanList = NULL;
+bool WiFiClass::_scanListOwned = false;
+uint8_t WiFiClass::_scanCount = 0;
+tsDnsEntry WiFiClass::_dnsCache[WIFI_DNS_CACHE_LEN];
+uint32_t WiFiClass::_timeout = GENERAL_TIMEOUT;
+tpIdleHook WiFiClass::_idleHook = NULL;
+bool WiFiClass::_inIdle = false;
+uint8_t WiFiClass::_lastWait = WAIT_REPLY;
+#ifdef WIFI_LOW_MEMORY
+uint8_t WiFiClass::_lostReply = NONE;
+#endif
 
 
 /* -----------------------------------------------------------------
-* static callback that handles the data coming from the SPI driver
-* calling the packet decoder to fire the right callback group
+* work done on a command reply validated by replyParse()
 */
-static void wifiDrvCB(void)
+void handleReply(const uint8_t* frame, uint8_t hnd)
 {
-	volatile uint8_t ret = 0;
-	
-	// read the data out from the SPI interface and put them into a buffer
-	ret = commDrv.readDataISR(commDrv._rxBuf);
-	// decode the 32 byte long packet
-	if(ret == 0)
-		return;
+	uint8_t sock = frame[5];
+
+	switch(hnd){
+		case RH_READY:
+			commDrv.espStatus = esp_idle;
+		break;
+		case RH_CAPS:
+			// [1 or 2, caps]: the esp enables only the capabilities offered by the 328
+			commDrv._caps = (frame[4] > 0) ? frame[5] : 0;
+			if(frame[4] > 1)
+				commDrv._caps |= (uint16_t)frame[6] << 8;
+			commDrv._caps &= WIFI_HOST_CAPS;
+			commDrv._capsReplied = true;
+		break;
+		case RH_CONNECT:
+			WiFiClass::notify = true;
+			// fall through
+		case RH_STATUS:
+			WiFiClass::connectionStatus = (wl_status_t)frame[5];
+		break;
+		case RH_SOCK_STATE:
+			if(sock < MAX_SOCK_NUM)
+				WiFiClass::setSockState(sock, frame[7]);
+		break;
+		case RH_SOCK_AVAIL:
+			if(sock < MAX_SOCK_NUM)
+				memcpy((uint8_t*)&WiFiClass::_client_data[sock], &frame[7], 2);
+		break;
+		case RH_SOCK_EVENT:
+			if(sock < MAX_SOCK_NUM){
+				WiFiClass::_sockEvents[sock] |= frame[7];
+				WiFiClass::setSockState(sock, frame[9]);
+				memcpy((uint8_t*)&WiFiClass::_client_data[sock], &frame[11], 2);
+			}
+		break;
+	}
+}
 
-	WiFiClass::gotResponse = false;
-	WiFiClass::responseType = NONE;
+/* -----------------------------------------------------------------
+* callback that handles the data coming from the SPI driver
+* calling the packet decoder to fire the right callback group
+*/
+void wifiDrvCB(void)
+{
+	uint8_t* frame = commDrv._rxBuf;
+	teReplyParse parsed = REPLY_BAD;
+	tsReply reply;
 
-	uint8_t cmd = commDrv._rxBuf[1] - 0x80;
+	// read the data out from the SPI interface and put them into a buffer,
+	// a frame that starts a new packet is sized by its header
+	if(commDrv.readDataISR(frame, WiFiClass::dataPkt.totalLen == 0) == 0)
+		return;
 
-	// check asynch events at first
-	if(commDrv._rxBuf[0] == START_CMD){
-		if(cmd == CONNECT_SECURED_AP || cmd == CONNECT_OPEN_AP || cmd == DISCONNECT_CMD){
-			WiFiClass::gotResponse = true;
-			WiFiClass::responseType = cmd;
-			WiFiClass::connectionStatus = (wl_status_t)commDrv._rxBuf[5];
-			WiFiClass::notify = true;
-			if(commDrv.multiRead) // manually trigger an ISR to keep read going if an asynchronous event occurred when multiRead is set
-				commDrv._interruptReq = true;
-			return 0;
+	SPI_STAT(if(WiFiClass::dataPkt.totalLen == 0) commDrv._statReply(frame));
+
+	if(frame[0] == START_CMD){
+		parsed = replyParse(frame, SPI_BUF_LEN, &reply);
+		if(parsed == REPLY_MORE && WiFiClass::dataPkt.totalLen == 0){
+			delayMicroseconds(100);
+#ifdef WIFI_LOW_MEMORY
+			// the second frame goes over the first half of the command waiting to be
+			// written: keep it aside while the reply is handled
+			if(commDrv._txStaged){
+				uint8_t staged[SPI_BUF_LEN];
+
+				memcpy(staged, commDrv.wifiBuf, SPI_BUF_LEN);
+				commDrv.readDataISR(frame + SPI_BUF_LEN);
+				if(replyParse(frame, sizeof(commDrv._rxBuf), &reply) == REPLY_OK){
+					handleReply(frame, reply.hnd);
+					// a pending request gets a copy of the reply. The frame is given back to the
+					// command before a blocking call could read it: the call asks again (WAIT_LOST)
+					if(reply.data != NULL){
+						WiFiClass::_completeRequest(reply.cmd, (reply.flags & RD_SOCK) ? frame[5] : -1, reply.data,
+													reply.totalLen - 1 - (reply.data - frame));
+						WiFiClass::_lostReply = reply.cmd;
+					}
+				}
+				memcpy(commDrv.wifiBuf, staged, SPI_BUF_LEN);
+				return;
+			}
+#endif
+			commDrv.readDataISR(frame + SPI_BUF_LEN);
+			parsed = replyParse(frame, sizeof(commDrv._rxBuf), &reply);
 		}
 	}
 
-	// check multipacket continuation
-	if(WiFiClass::dataPkt.totalLen > 0) {
-		WiFiClass::cmdPkt.dataPtr = commDrv._rxBuf;
-		WiFiClass::cmdPkt.cmdType = WiFiClass::dataPkt.cmdType;
-		WiFiClass::cmdPkt.cmd = WiFiClass::dataPkt.cmd;
-		
+	// socket events can arrive between a request and its reply: leave the response flags alone
+	if(parsed == REPLY_OK && (reply.flags & RD_EVENT) && WiFiClass::dataPkt.totalLen == 0){
+		handleReply(frame, reply.hnd);
+		if(commDrv.multiRead)
+			commDrv._interruptReq = true;
+		return;
+	}
+
+	WiFiClass::gotResponse = false;
+	WiFiClass::responseType = NONE;
+
+	// check multipacket continuation, only asynchronous events can come in between
+	if(WiFiClass::dataPkt.totalLen > 0 && !(parsed == REPLY_OK && (reply.flags & RD_ASYNC))) {
 		for(uint8_t i=0; i<SPI_BUF_LEN; i++){
-			if(commDrv._rxBuf[i] == END_CMD){
+			if(frame[i] == END_CMD){
 				commDrv.rxIndex = i;
 				if(WiFiClass::dataPkt.receivedLen + commDrv.rxIndex == WiFiClass::dataPkt.totalLen - 1){
 					commDrv._disableDevice();
@@ -99,183 +228,61 @@ static void wifiDrvCB(void)
 
 		WiFiClass::gotResponse = true;
 		WiFiClass::responseType = WiFiClass::dataPkt.cmd;
-		WiFiClass::data = (uint8_t*)(commDrv._rxBuf);
+		WiFiClass::data = frame;
 		WiFiClass::dataLen = commDrv.payloadSize;
 		return;
 	}
 
 	// check multipacket start
-	else if(commDrv._rxBuf[0] == DATA_PKT) {
-		// cast the buffer to the packet structure
-		memset((tsDataPacket*)&WiFiClass::dataPkt, 0, sizeof(tsDataPacket));
-		memcpy((tsDataPacket*)&WiFiClass::dataPkt, commDrv._rxBuf, sizeof(tsDataPacket));
-		WiFiClass::dataPkt.cmd -= 0x80;
+	if(frame[0] == DATA_PKT) {
+		uint32_t len;
 
-		// 32 byte - (cmdType (1 byte) + cmd (1 byte) + totalLen (4 byte)) = 32 - 6 = 26
+		if(!replyPacket(frame, SPI_BUF_LEN, &len))
+			return;
+
+		// 1 - start, 1 - cmdType, 4 - len, 1 - endCmd
+		WiFiClass::dataPkt.cmdType = DATA_PKT;
+		WiFiClass::dataPkt.cmd = frame[1] - 0x80;
+		WiFiClass::dataPkt.totalLen = len + 7;
 		WiFiClass::dataPkt.receivedLen = SPI_BUF_LEN;
 		WiFiClass::dataPkt.endReceived = false;
-		
-		WiFiClass::cmdPkt.dataPtr = (uint8_t*)(commDrv._rxBuf + 6);
-		WiFiClass::pktLen = (int32_t)(commDrv._rxBuf[2] + (commDrv._rxBuf[3] << 8) + (commDrv._rxBuf[4] << 16) + (commDrv._rxBuf[5] << 24));
-		WiFiClass::dataPkt.totalLen = WiFiClass::pktLen + 7; // 1 - start, 1 - cmdType, 4 - len, 1 - endCmd
-
-		WiFiClass::dataLen = SPI_BUF_LEN - 6; // do not consider END_CMD
+		WiFiClass::pktLen = (int32_t)len;
+		// 32 byte - (cmdType (1 byte) + cmd (1 byte) + totalLen (4 byte)) = 32 - 6 = 26
+		WiFiClass::dataLen = SPI_BUF_LEN - 6;
 
-		if(WiFiClass::dataPkt.totalLen <= SPI_BUF_LEN){ // data are contained in a single packet control the packet footer.
-			bool ret = 0;
-			if(commDrv._rxBuf[WiFiClass::dataPkt.totalLen - 1] != END_CMD){
-				ret = 1;
-			}
-			WiFiClass::dataLen = WiFiClass::dataPkt.totalLen - 7;
+		// data are contained in a single packet, its footer has been checked
+		if(WiFiClass::dataPkt.totalLen <= SPI_BUF_LEN){
+			WiFiClass::dataLen = len;
 			WiFiClass::dataPkt.totalLen = 0;
 			WiFiClass::dataPkt.receivedLen = 0;
 			WiFiClass::dataPkt.endReceived = true;
-			
-			if(ret){
-				return;
-			}
 		}
 
 		WiFiClass::gotResponse = true;
 		WiFiClass::responseType = WiFiClass::dataPkt.cmd;
-		WiFiClass::data = (uint8_t*)(WiFiClass::cmdPkt.dataPtr);
+		WiFiClass::data = frame + 6;
 		return;
 	}
 
 	// check single packet
-	else if (commDrv._rxBuf[0] == START_CMD) {
-		// cast the buffer to the packet structure
-		memset((tsNewCmd*)&WiFiClass::cmdPkt, 0, sizeof(tsNewCmd));
-		memcpy((tsNewCmd*)&WiFiClass::cmdPkt, commDrv._rxBuf, sizeof(tsNewCmd));
-		// remove the REPLY_FLAG
-		WiFiClass::cmdPkt.cmd -= 0x80;
-		WiFiClass::cmdPkt.dataPtr = (uint8_t*)(commDrv._rxBuf + 4);
-
-		switch(WiFiClass::cmdPkt.cmd){
-			case ESP_READY:
-				commDrv.espStatus = esp_idle;
-			break;
-			case GET_CONN_STATUS:
-				// check the number of parameters of the command
-				if(WiFiClass::cmdPkt.nParam == PARAM_NUMS_1 && commDrv._rxBuf[WiFiClass::cmdPkt.totalLen - 1] == END_CMD){
-					WiFiClass::gotResponse = true;
-					WiFiClass::responseType = WiFiClass::cmdPkt.cmd;
-					// extract the data from the data pointer
-					WiFiClass::data = (uint8_t*)(WiFiClass::cmdPkt.dataPtr + 1);
-					WiFiClass::connectionStatus = (wl_status_t)(WiFiClass::data[0]);
-				}
-			break;
-			case GET_HOSTNAME:
-			case SET_HOSTNAME:
-			case GET_MACADDR_CMD:
-			case GET_FW_VERSION_CMD:
-				if(WiFiClass::cmdPkt.nParam == PARAM_NUMS_1 && commDrv._rxBuf[WiFiClass::cmdPkt.totalLen - 1] == END_CMD){
-					WiFiClass::gotResponse = true;
-					WiFiClass::responseType = WiFiClass::cmdPkt.cmd;
-					// extract the data from the data pointer
-					WiFiClass::data = (uint8_t*)(WiFiClass::cmdPkt.dataPtr);
-				}
-			break;
-			case START_SCAN_NETWORKS:{
-                // check the parameter len
-				uint8_t paramLen = (WiFiClass::cmdPkt.dataPtr[0] > WL_NETWORKS_LIST_MAXNUM) ? WL_NETWORKS_LIST_MAXNUM : WiFiClass::cmdPkt.dataPtr[0];
-                if (paramLen == PARAM_NUMS_1 && commDrv._rxBuf[WiFiClass::cmdPkt.totalLen - 1] == END_CMD) {
-					// set gotResponse flag to true to signal that esp replied us
-                    WiFiClass::gotResponse = true;
-                    WiFiClass::responseType = WiFiClass::cmdPkt.cmd;
-                    // extract the data from the data pointer
-                    WiFiClass::data = (uint8_t*)(WiFiClass::cmdPkt.dataPtr + 1);
-					WiFiClass::dataLen = paramLen;
-				}
-			}break;
-			case CONNECT_SECURED_AP:
-			case CONNECT_OPEN_AP:
-			case DISCONNECT_CMD:
-			case SET_KEY_CMD:
-				if(WiFiClass::cmdPkt.nParam == PARAM_NUMS_1 && commDrv._rxBuf[WiFiClass::cmdPkt.totalLen - 1] == END_CMD){
-					// set gotResponse flag to true to signal that esp replied us
-					WiFiClass::gotResponse = true;
-					WiFiClass::responseType = WiFiClass::cmdPkt.cmd;
-					// extract the data from the data pointer
-					WiFiClass::data = (uint8_t*)(WiFiClass::cmdPkt.dataPtr + 1);
-					WiFiClass::connectionStatus = (wl_status_t)(WiFiClass::cmdPkt.dataPtr[1]);
-					WiFiClass::notify = true;
-				}
-			break;
-			case GET_CURR_SSID_CMD:
-				if(WiFiClass::cmdPkt.nParam == PARAM_NUMS_1){
-					// set gotResponse flag to true to signal that esp replied us
-					WiFiClass::gotResponse = true;
-					WiFiClass::responseType = WiFiClass::cmdPkt.cmd;
-					if(WiFiClass::cmdPkt.totalLen > SPI_BUF_LEN){
-						delayMicroseconds(100);
-						commDrv.readDataISR(commDrv._rxBuf + SPI_BUF_LEN);
-					}
-					// extract the data from the data pointer
-					WiFiClass::data = (uint8_t*)(WiFiClass::cmdPkt.dataPtr);
-				}
-			break;
-			case START_CLIENT_TCP_CMD:
-			case GET_HOST_BY_NAME_CMD:
-			case START_SERVER_TCP_CMD:
-			case STOP_CLIENT_TCP_CMD:
-			case GET_CURR_BSSID_CMD:
-			case GET_STATE_TCP_CMD:
-			case GET_CURR_ENCT_CMD:
-			case GET_CURR_RSSI_CMD:
-			case SEND_DATA_UDP_CMD:
-			case GET_IDX_RSSI_CMD:
-			case GET_IDX_ENCT_CMD:
-			case GET_DATA_TCP_CMD:
-				if(WiFiClass::cmdPkt.nParam == PARAM_NUMS_1 && commDrv._rxBuf[WiFiClass::cmdPkt.totalLen - 1] == END_CMD){
-					WiFiClass::gotResponse = true;
-					WiFiClass::responseType = WiFiClass::cmdPkt.cmd;
-					// extract the data from the data pointer
-					WiFiClass::data = (uint8_t*)(WiFiClass::cmdPkt.dataPtr + 1);
-					WiFiClass::dataLen = WiFiClass::cmdPkt.dataPtr[0];
-				}
-			break;
-			case GET_REMOTE_DATA_CMD:
-				if((WiFiClass::cmdPkt.nParam == PARAM_NUMS_1 || WiFiClass::cmdPkt.nParam == PARAM_NUMS_2) && commDrv._rxBuf[WiFiClass::cmdPkt.totalLen - 1] == END_CMD){
-					WiFiClass::gotResponse = true;
-					WiFiClass::responseType = WiFiClass::cmdPkt.cmd;
-					// extract the data from the data pointer
-					WiFiClass::data = (uint8_t*)(WiFiClass::cmdPkt.dataPtr + 1);
-					WiFiClass::dataLen = WiFiClass::cmdPkt.dataPtr[0];
-				}
-			break;
-			case GET_IPADDR_CMD:
-				if(WiFiClass::cmdPkt.nParam == PARAM_NUMS_3 && commDrv._rxBuf[WiFiClass::cmdPkt.totalLen - 1] == END_CMD){
-					WiFiClass::gotResponse = true;
-					WiFiClass::responseType = WiFiClass::cmdPkt.cmd;
-					// extract the data from the data pointer
-					WiFiClass::data = (uint8_t*)(WiFiClass::cmdPkt.dataPtr);
-				}
-			break;
-			case GET_CLIENT_STATE_TCP_CMD:
-				if(WiFiClass::cmdPkt.nParam == PARAM_NUMS_2 && commDrv._rxBuf[WiFiClass::cmdPkt.totalLen - 1] == END_CMD){
-					WiFiClass::gotResponse = true;
-					WiFiClass::responseType = WiFiClass::cmdPkt.cmd;
-					// dataPtr[1] contains socket number, dataPtr[3] contains status of the client attached to that socket
-					WiFiClass::_state[WiFiClass::cmdPkt.dataPtr[1]] = WiFiClass::cmdPkt.dataPtr[3];
-					WiFiClass::data = (uint8_t*)(WiFiClass::cmdPkt.dataPtr + 1);
-				}
-			break;
-			case AVAIL_DATA_TCP_CMD:
-				if(WiFiClass::cmdPkt.nParam == PARAM_NUMS_2 && commDrv._rxBuf[WiFiClass::cmdPkt.totalLen - 1] == END_CMD){
-					WiFiClass::gotResponse = true;
-					WiFiClass::responseType = WiFiClass::cmdPkt.cmd;
-					WiFiClass::data = (uint8_t*)(WiFiClass::cmdPkt.dataPtr);
-				}
-			break;
-		}
-	}
+	if(parsed != REPLY_OK)
+		return;
+
+	handleReply(frame, reply.hnd);
+	if((reply.flags & RD_ASYNC) && commDrv.multiRead) // keep the read going if an asynchronous event occurred when multiRead is set
+		commDrv._interruptReq = true;
+	if(reply.data == NULL)
+		return;
+
+	WiFiClass::gotResponse = true;
+	WiFiClass::responseType = reply.cmd;
+	WiFiClass::data = (uint8_t*)reply.data;
+	WiFiClass::dataLen = reply.dataLen;
 
-	WiFiClass::cmdPkt.cmdType = 0;
-	WiFiClass::cmdPkt.cmd = 0;
-	WiFiClass::cmdPkt.dataPtr = NULL;
-	WiFiClass::cmdPkt.nParam = 0;
-	WiFiClass::cmdPkt.totalLen = 0;
+	// hand the reply over to the request waiting for it, if any
+	// socket replies carry the socket number in their first parameter
+	WiFiClass::_completeRequest(reply.cmd, (reply.flags & RD_SOCK) ? frame[5] : -1, reply.data,
+								reply.totalLen - 1 - (reply.data - frame));
 }
 
 
@@ -293,8 +300,95 @@ WiFiClass::WiFiClass()
 void WiFiClass::handleEvents(void)
 {
 	commDrv.handleSPIEvents();
+	_serviceRequests();
+	_serviceTxBufs();
 }
 
+/* -----------------------------------------------------------------
+* Single wait of the blocking API: services the esp events until the
+* reply to cmd arrives or timeout ms expire
+*/
+bool WiFiClass::waitResponse(uint8_t cmd, uint32_t timeout)
+{
+	uint32_t start = millis();
+
+	if(timeout == 0)
+		timeout = _timeout;
+#ifdef WIFI_LOW_MEMORY
+	_lostReply = NONE;
+#endif
+
+	while(1){
+		handleEvents();
+		if(gotResponse && responseType == cmd){
+			_lastWait = WAIT_REPLY;
+			return true;
+		}
+#ifdef WIFI_LOW_MEMORY
+		if(_lostReply == cmd){
+			_lastWait = WAIT_LOST;
+			return false;
+		}
+#endif
+		if((millis() - start) >= timeout)
+			break;
+		idle();
+	}
+	_lastWait = WAIT_TIMEOUT;
+	return false;
+}
+
+/* -----------------------------------------------------------------
+* Wait of the blocking API for the next frame of the data packet that
+* answers cmd, until timeout ms from start expire
+*
+* return: bytes of the frame in data, 0 on timeout
+*/
+uint16_t WiFiClass::waitData(uint8_t cmd, uint32_t start, uint32_t timeout)
+{
+	while(1){
+		uint16_t len = getAvailableData(cmd);
+		if(len != 0){
+			_lastWait = WAIT_REPLY;
+			return len;
+		}
+		if((millis() - start) >= timeout)
+			break;
+		idle();
+	}
+	_lastWait = WAIT_TIMEOUT;
+	return 0;
+}
+
+/* -----------------------------------------------------------------
+* Lets the rest of the sketch run while waiting for the esp. A hook that
+* calls the blocking API doesn't get called again from the nested waits
+*/
+void WiFiClass::idle(void)
+{
+	yield();
+	if(_idleHook == NULL || _inIdle)
+		return;
+	_inIdle = true;
+	_idleHook();
+	_inIdle = false;
+}
+
+#ifdef WIFI_SPI_STATS
+/* -----------------------------------------------------------------
+* Prints the statistics of the SPI link collected since init() or the last reset
+*/
+void WiFiClass::printLinkStats(Print& out)
+{
+	commDrv.printStats(out);
+}
+
+void WiFiClass::resetLinkStats(void)
+{
+	commDrv.resetStats();
+}
+#endif
+
 /* -----------------------------------------------------------------
 * Initializes the wifi class receiving the relative callback and 
 * registering it
@@ -308,30 +402,20 @@ void WiFiClass::init(teConnectionMode connectionMode)
 	commDrv.begin();
 	commDrv.registerCB(wifiDrvCB);
 	
-	uint8_t ret = WL_NO_WIFI_MODULE_COMM;
-	
 	// TODO check the connection status
-	bool ESPConnected = commDrv.establishESPConnection();
+	commDrv.establishESPConnection();
 	
 	gotResponse = false;
 	responseType = NONE;
 	
-	uint32_t start = millis() + 1000;
-	
-	while(start > millis()){
-		handleEvents();
-		if(gotResponse && responseType == GET_CONN_STATUS){
-			ret = *data;
-			if(ret != WL_NO_WIFI_MODULE_COMM)
-				return;
-		}
-	}
+	// give the esp a second to report its status
+	waitResponse(GET_CONN_STATUS, 1000);
 }
 
 /*
 *
 */
-uint16_t WiFiClass::getAvailableData()
+uint16_t WiFiClass::getAvailableData(uint8_t cmd)
 {
 	gotResponse = false;
 	responseType = NONE;
@@ -342,82 +426,732 @@ uint16_t WiFiClass::getAvailableData()
 	else if(dataPkt.totalLen > dataPkt.receivedLen) {
 		wifiDrvCB();
 	}
-	else{
-		dataPkt.cmdType = 0;
-		dataPkt.cmd = NONE;
-		dataPkt.totalLen = 0;
-		dataPkt.receivedLen = 0;
-		dataPkt.endReceived = false;
+	else{
+		dataPkt.cmdType = 0;
+		dataPkt.cmd = NONE;
+		dataPkt.totalLen = 0;
+		dataPkt.receivedLen = 0;
+		dataPkt.endReceived = false;
+	}
+	if(gotResponse && responseType == cmd)
+	return dataLen;
+	return 0;
+}
+
+// -----------------------------------------------------------------
+char* WiFiClass::getHostname()
+{
+	handleEvents();
+	
+	gotResponse = false;
+	responseType = NONE;
+	
+	if(!Packager::getHostname()){ // packet has not been sent. Maybe an interrupt occurred in the meantime
+		// launch interrupt management function, then try to send request again
+		handleEvents();
+		if(!Packager::getHostname()) // exit if another error occurs
+			return NULL;
+	}
+
+	// Poll response until timeout
+	if(waitResponse(GET_HOSTNAME)){
+		uint8_t len = (data[0] < MAX_HOSTNAME_LEN) ? data[0] : MAX_HOSTNAME_LEN - 1;
+		memset(hostname, 0, MAX_HOSTNAME_LEN);
+		memcpy(hostname, (void*)&data[1], len);
+		return (char *)hostname;
+	}
+	return NULL;
+}
+
+// -----------------------------------------------------------------
+bool WiFiClass::setHostname(char* name)
+{
+	handleEvents();
+	
+	gotResponse = false;
+	responseType = NONE;
+	
+	if(!Packager::setHostname(name)){ // packet has not been sent. Maybe an interrupt occurred in the meantime
+		// launch interrupt management function, then try to send request again
+		handleEvents();
+		if(!Packager::setHostname(name)) // exit if another error occurs
+			return false;
+	}
+
+	// Poll response until timeout
+	if(waitResponse(SET_HOSTNAME)){
+		return(data[0]);
+	}
+	return false;
+}
+
+// -----------------------------------------------------------------
+uint8_t WiFiClass::getSocket()
+{
+	return _sockFree ? firstSock(_sockFree) : NO_SOCKET_AVAIL;
+}
+
+// -----------------------------------------------------------------
+void WiFiClass::_updateFree(uint8_t sock)
+{
+	tSockMask bit = (tSockMask)1 << sock;
+
+	// a socket left listening by WiFiServer::end() on an esp without WIFI_CAP_STOP_SERVER can be
+	// taken again: starting a server or a client on it closes the old listener
+	if(_server_port[sock] == 0 && (sockState(sock) == CLOSED || sockState(sock) == LISTEN) && connState(sock) != CONN_PENDING)
+		_sockFree |= bit;
+	else
+		_sockFree &= ~bit;
+}
+
+// -----------------------------------------------------------------
+void WiFiClass::setSockState(uint8_t sock, uint8_t state)
+{
+	_sockState[sock] = (_sockState[sock] & 0xF0) | (state & 0x0F);
+	_updateFree(sock);
+}
+
+// -----------------------------------------------------------------
+void WiFiClass::setConnState(uint8_t sock, uint8_t state)
+{
+	_sockState[sock] = (_sockState[sock] & 0x0F) | (state << 4);
+	_updateFree(sock);
+}
+
+// -----------------------------------------------------------------
+void WiFiClass::bindSocket(uint8_t sock, uint16_t port)
+{
+	tSockMask bit = (tSockMask)1 << sock;
+
+	_server_port[sock] = port;
+	if(port)
+		_sockBound |= bit;
+	else
+		_sockBound &= ~bit;
+	_updateFree(sock);
+}
+
+// -----------------------------------------------------------------
+int WiFiClass::availData(uint8_t sock, uint32_t timeout)
+{
+	handleEvents();
+
+	gotResponse = false;
+	responseType = NONE;
+
+	if(!Packager::getAvailable(sock)){ // packet has not been sent. Maybe an interrupt occurred in the meantime
+		// launch interrupt management function, then try to send request again
+		handleEvents();
+		if(!Packager::getAvailable(sock)) // exit if another error occurs
+			return -1;
+	}
+
+	// Poll flags until we got a response or timeout occurs
+	if(waitResponse(AVAIL_DATA_TCP_CMD, timeout)){
+		// copy int value
+		memcpy((uint8_t*)&_client_data[sock], &data[3], 2);
+		return _client_data[sock];
+	}
+	return -1;
+}
+
+// -----------------------------------------------------------------
+int WiFiClass::udpParse(uint8_t sock, uint8_t* remoteIp, uint16_t* remotePort, uint32_t timeout)
+{
+	// the reply has to fit in a frame: 17 bytes of packet and parameter headers
+	uint8_t maxFirst = min(SPI_BUF_LEN - 17, WIFI_SOCK_RX_BUF_LEN);
+
+	if(!udpParseSupported())
+		return -1;
+
+	handleEvents();
+
+	gotResponse = false;
+	responseType = NONE;
+
+	if(!Packager::parsePacketUdp(sock, maxFirst)){ // packet has not been sent. Maybe an interrupt occurred in the meantime
+		// launch interrupt management function, then try to send request again
+		handleEvents();
+		if(!Packager::parsePacketUdp(sock, maxFirst)) // exit if another error occurs
+			return -1;
+	}
+
+	// Poll flags until we got a response or timeout occurs
+	if(waitResponse(PARSE_PACKET_UDP, timeout)){
+		uint8_t* ptr = data;
+		uint16_t size;
+
+		if(dataLen < 12 || ptr[0] != 2 || ptr[3] != 4 || ptr[8] != 2 || 12u + ptr[11] > dataLen)
+			return -1;
+
+		memcpy((uint8_t*)&size, &ptr[1], 2);
+		memcpy(remoteIp, &ptr[4], 4);
+		*remotePort = ((uint16_t)ptr[9] << 8) | ptr[10];
+
+		// the bytes of the previous datagram are gone, queue the first ones of this one
+		rxBufClear(sock);
+		uint8_t sent = (size < ptr[11]) ? size : ptr[11];
+		// never more than asked for: maxFirst fits the receive buffer
+		uint8_t n = (sent < maxFirst) ? sent : maxFirst;
+		for(uint8_t i = 0; i < n; i++)
+			_sockRxBuf[sock].buf[i] = ptr[12 + i];
+		_sockRxBuf[sock].count = n;
+		// the bytes sent in the reply have left the esp
+		_client_data[sock] = size - sent;
+		return size;
+	}
+	return -1;
+}
+
+// -----------------------------------------------------------------
+bool WiFiClass::udpParseSupported(void)
+{
+	return (commDrv.caps() & WIFI_CAP_UDP_PARSE) != 0;
+}
+
+// -----------------------------------------------------------------
+bool WiFiClass::sockEvents(void)
+{
+	return (commDrv.caps() & WIFI_CAP_SOCK_EVENTS) != 0;
+}
+
+// -----------------------------------------------------------------
+int WiFiClass::getDataBuf(uint8_t sock, uint8_t* buf, uint16_t len, uint32_t timeout)
+{
+	tsSockRxBuf* rx = &_sockRxBuf[sock];
+
+	handleEvents();
+
+	gotResponse = false;
+	responseType = NONE;
+
+	if(!Packager::getDataBuf(sock, len)){ // packet has not been sent. Maybe an interrupt occurred in the meantime
+		// launch interrupt management function, then try to send request again
+		handleEvents();
+		if(!Packager::getDataBuf(sock, len)) // exit if another error occurs
+			return -1;
+	}
+
+	// the whole packet has to arrive within timeout
+	uint32_t start = millis();
+	if(timeout == 0)
+		timeout = _timeout;
+	if(waitResponse(GET_DATABUF_TCP_CMD, timeout)){
+		uint16_t receivedBytes = 0;
+		uint16_t chunkSize;
+		int32_t totalLen = pktLen;
+
+		if(totalLen <= 0){ // No data was read. Maybe an error occurred. Restore available flag and exit
+			_client_data[sock] = 0;
+			return -1;
+		}
+		if(totalLen > len)
+			totalLen = len;
+
+		// the first frame carries 26 bytes at most, the following ones 32
+		chunkSize = (totalLen < SPI_BUF_LEN - 6) ? totalLen : SPI_BUF_LEN - 6;
+		while(1){
+			if(buf != NULL){
+				memcpy(&buf[receivedBytes], (void *)data, chunkSize);
+			}
+			else{
+				for(uint16_t i = 0; i < chunkSize; i++){
+					rx->buf[(rx->head + rx->count) & (WIFI_SOCK_RX_BUF_LEN - 1)] = data[i];
+					rx->count++;
+				}
+			}
+			receivedBytes += chunkSize;
+
+			// stop when everything arrived or the esp closed the multi-frame transfer
+			if(receivedBytes >= totalLen || dataPkt.totalLen == 0)
+				break;
+
+			chunkSize = waitData(GET_DATABUF_TCP_CMD, start, timeout);
+			if(chunkSize == 0)
+				break;
+			if(chunkSize > totalLen - receivedBytes)
+				chunkSize = totalLen - receivedBytes;
+		}
+		commDrv.multiRead = false;
+		_client_data[sock] = (_client_data[sock] > receivedBytes) ? _client_data[sock] - receivedBytes : 0;
+		return receivedBytes;
+	}
+
+	commDrv.multiRead = false;
+	_client_data[sock] = 0;
+	return -1;
+}
+
+// -----------------------------------------------------------------
+bool WiFiClass::pollSockets(void)
+{
+	// esp firmware without batch support
+	if(!(commDrv.caps() & WIFI_CAP_BATCH))
+		return false;
+
+	// free sockets have nothing to report
+	tSockMask pending = ~_sockFree & SOCK_MASK_ALL;
+
+	while(pending){
+		tSockMask mask = 0;
+		for(uint8_t n = 0; n < POLL_BATCH_SOCKS && (pending & ~mask); n++)
+			mask |= (tSockMask)1 << firstSock(pending & ~mask);
+		if(!_pollSockets(mask))
+			return false;
+		pending &= ~mask;
+	}
+	return true;
+}
+
+// -----------------------------------------------------------------
+bool WiFiClass::_pollSockets(tSockMask mask)
+{
+	handleEvents();
+
+	gotResponse = false;
+	responseType = NONE;
+
+	if(!Packager::getSocketsStatus(mask)){ // packet has not been sent. Maybe an interrupt occurred in the meantime
+		// launch interrupt management function, then try to send request again
+		handleEvents();
+		if(!Packager::getSocketsStatus(mask)) // exit if another error occurs
+			return false;
+	}
+
+	if(waitResponse(BATCH_CMD)){
+		// replies follow the request order: client state, then available bytes of each socket of mask
+		uint8_t* ptr = data;
+		uint8_t* end = data + dataLen;
+
+		for(uint8_t sock = 0; sock < MAX_SOCK_NUM; sock++){
+			if(!(mask & ((tSockMask)1 << sock)))
+				continue;
+			if(ptr + 2 > end || ptr[0] != 1)
+				break;
+			setSockState(sock, ptr[1]);
+			ptr += 2;
+
+			if(ptr + 3 > end || ptr[0] != 2)
+				break;
+			memcpy((uint8_t*)&_client_data[sock], &ptr[1], 2);
+			ptr += 3;
+		}
+		return true;
+	}
+	return false;
+}
+
+// -----------------------------------------------------------------
+int WiFiClass::fillRxBuf(uint8_t sock, uint32_t timeout)
+{
+	uint16_t room = WIFI_SOCK_RX_BUF_LEN - _sockRxBuf[sock].count;
+
+	if(room == 0)
+		return 0;
+
+	if(_client_data[sock] == 0 && availData(sock, timeout) <= 0)
+		return 0;
+
+	// grab as much as possible with a single multi-frame transfer
+	return getDataBuf(sock, NULL, min(_client_data[sock], room), timeout);
+}
+
+// -----------------------------------------------------------------
+int WiFiClass::rxBufRead(uint8_t sock)
+{
+	tsSockRxBuf* rx = &_sockRxBuf[sock];
+
+	if(rx->count == 0)
+		return -1;
+
+	uint8_t ret = rx->buf[rx->head];
+	rx->head = (rx->head + 1) & (WIFI_SOCK_RX_BUF_LEN - 1);
+	rx->count--;
+	return ret;
+}
+
+// -----------------------------------------------------------------
+int WiFiClass::rxBufRead(uint8_t sock, uint8_t* buf, uint16_t size)
+{
+	tsSockRxBuf* rx = &_sockRxBuf[sock];
+	uint16_t n = 0;
+
+	while(n < size && rx->count > 0){
+		buf[n++] = rx->buf[rx->head];
+		rx->head = (rx->head + 1) & (WIFI_SOCK_RX_BUF_LEN - 1);
+		rx->count--;
+	}
+	return n;
+}
+
+// -----------------------------------------------------------------
+int WiFiClass::rxBufPeek(uint8_t sock)
+{
+	tsSockRxBuf* rx = &_sockRxBuf[sock];
+
+	if(rx->count == 0)
+		return -1;
+
+	return rx->buf[rx->head];
+}
+
+// -----------------------------------------------------------------
+void WiFiClass::rxBufClear(uint8_t sock)
+{
+	_sockRxBuf[sock].head = 0;
+	_sockRxBuf[sock].count = 0;
+}
+
+// -----------------------------------------------------------------
+uint8_t WiFiClass::rxBufSpan(uint8_t sock, const uint8_t** data)
+{
+	tsSockRxBuf* rx = &_sockRxBuf[sock];
+	uint16_t toEnd = WIFI_SOCK_RX_BUF_LEN - rx->head;
+
+	*data = &rx->buf[rx->head];
+	return (rx->count < toEnd) ? rx->count : toEnd;
+}
+
+// -----------------------------------------------------------------
+void WiFiClass::rxBufSkip(uint8_t sock, uint8_t n)
+{
+	tsSockRxBuf* rx = &_sockRxBuf[sock];
+
+	if(n > rx->count)
+		n = rx->count;
+	rx->head = (rx->head + n) & (WIFI_SOCK_RX_BUF_LEN - 1);
+	rx->count -= n;
+}
+
+// -----------------------------------------------------------------
+size_t WiFiClass::txBufWrite(uint8_t sock, const uint8_t* buf, size_t size)
+{
+	tsSockTxBuf* tx = &_sockTxBuf[sock];
+
+	// not enough room: send what is already queued to keep the byte order
+	if(tx->len + size > WIFI_SOCK_TX_BUF_LEN){
+		if(!txBufFlush(sock))
+			return 0;
+	}
+
+	// too big to be buffered: send it straight away
+	if(size >= WIFI_SOCK_TX_BUF_LEN){
+		handleEvents();
+		if(!Packager::sendData(sock, buf, size)) { // packet has not been sent. Maybe an interrupt occurred in the meantime
+			// launch interrupt management function, then try to send request again
+			handleEvents();
+			if(!Packager::sendData(sock, buf, size)) // exit if another error occurs
+				return 0;
+		}
+		return size;
+	}
+
+	if(tx->len == 0)
+		tx->stamp = millis();
+	memcpy(&tx->buf[tx->len], buf, size);
+	tx->len += size;
+
+	if(tx->len == WIFI_SOCK_TX_BUF_LEN)
+		txBufFlush(sock);
+
+	return size;
+}
+
+// -----------------------------------------------------------------
+size_t WiFiClass::txBufWriteV(uint8_t sock, const tsIoVec* iov, uint8_t cnt)
+{
+	tsSockTxBuf* tx = &_sockTxBuf[sock];
+	uint32_t size = 0;
+
+	for(uint8_t i = 0; i < cnt; i++)
+		size += iov[i].len;
+
+	// small enough: collect it like any other write
+	if(tx->len + size < WIFI_SOCK_TX_BUF_LEN){
+		if(tx->len == 0)
+			tx->stamp = millis();
+		for(uint8_t i = 0; i < cnt; i++){
+			if(iov[i].progmem)
+				memcpy_P(&tx->buf[tx->len], iov[i].data, iov[i].len);
+			else
+				memcpy(&tx->buf[tx->len], iov[i].data, iov[i].len);
+			tx->len += iov[i].len;
+		}
+		return size;
+	}
+
+	// queued bytes have to go out before these ones
+	if(!txBufFlush(sock))
+		return 0;
+
+	handleEvents();
+	if(!Packager::sendDataV(sock, iov, cnt, size)) { // packet has not been sent. Maybe an interrupt occurred in the meantime
+		// launch interrupt management function, then try to send request again
+		handleEvents();
+		if(!Packager::sendDataV(sock, iov, cnt, size)) // exit if another error occurs
+			return 0;
+	}
+	return size;
+}
+
+// -----------------------------------------------------------------
+bool WiFiClass::txBufFlush(uint8_t sock)
+{
+	tsSockTxBuf* tx = &_sockTxBuf[sock];
+
+	if(tx->len == 0)
+		return true;
+
+	if(!Packager::sendData(sock, tx->buf, tx->len)) { // packet has not been sent. Maybe an interrupt occurred in the meantime
+		// launch interrupt management function, then try to send request again
+		commDrv.handleSPIEvents();
+		if(!Packager::sendData(sock, tx->buf, tx->len)) // exit if another error occurs
+			return false;
+	}
+	tx->len = 0;
+	return true;
+}
+
+// -----------------------------------------------------------------
+void WiFiClass::txBufClear(uint8_t sock)
+{
+	_sockTxBuf[sock].len = 0;
+}
+
+/* -----------------------------------------------------------------
+* Sends the transmit buffers that have been waiting longer than WIFI_TX_FLUSH_MS
+*/
+void WiFiClass::_serviceTxBufs(void)
+{
+	static bool inService = false;
+
+	if(inService)
+		return;
+	inService = true;
+
+	for(uint8_t i = 0; i < MAX_SOCK_NUM; i++){
+		if(_sockTxBuf[i].len > 0 && (millis() - _sockTxBuf[i].stamp) >= WIFI_TX_FLUSH_MS)
+			txBufFlush(i);
+	}
+
+	inService = false;
+}
+
+// -----------------------------------------------------------------
+int8_t WiFiClass::_allocRequest(uint8_t cmd, uint8_t sock, tpReqCallback cb)
+{
+	for(int8_t i = 0; i < WIFI_MAX_PENDING_REQ; i++){
+		if(_req[i].state == REQ_FREE){
+			_req[i].cmd = cmd;
+			_req[i].sock = sock;
+			_req[i].len = 0;
+			_req[i].cb = cb;
+			_req[i].stamp = millis();
+			_req[i].state = REQ_PENDING;
+			return i;
+		}
+	}
+	return -1;
+}
+
+// -----------------------------------------------------------------
+bool WiFiClass::_sendRequest(uint8_t cmd, uint8_t sock)
+{
+	switch(cmd){
+		case GET_CONN_STATUS:
+			return Packager::getConnectionStatus();
+		case GET_IPADDR_CMD:
+			return Packager::getNetworkData();
+		case GET_CURR_RSSI_CMD:
+			return Packager::getCurrentRSSI();
+		case GET_CURR_ENCT_CMD:
+			return Packager::getCurrentEncryptionType();
+		case GET_FW_VERSION_CMD:
+			return Packager::getFwVersion();
+		case AVAIL_DATA_TCP_CMD:
+			return Packager::getAvailable(sock);
+		case GET_CLIENT_STATE_TCP_CMD:
+			return Packager::getClientState(sock);
+		case GET_STATE_TCP_CMD:
+			return Packager::getServerState(sock);
+		case STOP_CLIENT_TCP_CMD:
+			return Packager::stopClient(sock);
+	}
+	return false;
+}
+
+/* -----------------------------------------------------------------
+* Called by the decoder for every reply: completes the oldest request waiting
+* for cmd (and for sock when the reply carries the socket number)
+*/
+void WiFiClass::_completeRequest(uint8_t cmd, int16_t sock, const uint8_t* reply, uint8_t len)
+{
+	int8_t found = -1;
+
+	for(int8_t i = 0; i < WIFI_MAX_PENDING_REQ; i++){
+		if(_req[i].state != REQ_PENDING || _req[i].cmd != cmd)
+			continue;
+		if(sock >= 0 && _req[i].sock != sock)
+			continue;
+		if(found < 0 || (int32_t)(_req[i].stamp - _req[found].stamp) < 0)
+			found = i;
+	}
+	if(found < 0)
+		return;
+
+	// connections started by WiFiClient::connectAsync() have nobody polling the request
+	if(cmd == START_CLIENT_TCP_CMD){
+		_connectDone(found, len > 0 && reply[0] != 0);
+		return;
+	}
+
+	if(len > WIFI_REQ_DATA_LEN)
+		len = WIFI_REQ_DATA_LEN;
+	memcpy(_req[found].data, reply, len);
+	_req[found].len = len;
+	_req[found].state = REQ_DONE;
+}
+
+/* -----------------------------------------------------------------
+* Expires the requests without a reply and fires the callbacks of the
+* completed ones
+*/
+void WiFiClass::_serviceRequests(void)
+{
+	static bool inService = false;
+
+	if(inService)
+		return;
+	inService = true;
+
+	for(int8_t i = 0; i < WIFI_MAX_PENDING_REQ; i++){
+		if(_req[i].state == REQ_PENDING && (millis() - _req[i].stamp) >= _timeout){
+			if(_req[i].cmd == START_CLIENT_TCP_CMD){
+				// the esp could still be trying, release its socket
+				if(_req[i].sock < MAX_SOCK_NUM)
+					Packager::stopClient(_req[i].sock);
+				_connectDone(i, false);
+				continue;
+			}
+			_req[i].state = REQ_TIMEOUT;
+		}
+
+		if((_req[i].state == REQ_DONE || _req[i].state == REQ_TIMEOUT) && _req[i].cb != NULL){
+			_req[i].cb(i);
+			_req[i].state = REQ_FREE;
+		}
+	}
+
+	inService = false;
+}
+
+/* -----------------------------------------------------------------
+* End of a connection attempt: updates the state of its socket and
+* releases the request
+*/
+void WiFiClass::_connectDone(int8_t req, bool ok)
+{
+	uint8_t sock = _req[req].sock;
+
+	// the client could have been stopped in the meantime
+	if(sock < MAX_SOCK_NUM){
+		setConnState(sock, ok ? CONN_ESTABLISHED : CONN_FAILED);
+		setSockState(sock, ok ? ESTABLISHED : CLOSED);
 	}
-	if(gotResponse && responseType == GET_DATABUF_TCP_CMD)
-	return dataLen;
-	return 0;
+	_req[req].state = REQ_FREE;
 }
 
 // -----------------------------------------------------------------
-char* WiFiClass::getHostname()
+int8_t WiFiClass::requestAsync(uint8_t cmd, uint8_t sock, tpReqCallback cb)
 {
-	handleEvents();
-	
-	gotResponse = false;
-	responseType = NONE;
-	
-	if(!Packager::getHostname()){ // packet has not been sent. Maybe an interrupt occurred in the meantime
-		// launch interrupt management function, then try to send request again
+	// pending frames of the esp are read by the write itself, or received
+	// during it with duplex writes: events are handled only to free a slot
+	int8_t req = _allocRequest(cmd, sock, cb);
+	if(req < 0){
 		handleEvents();
-		if(!Packager::getHostname()) // exit if another error occurs
-			return NULL;
+		req = _allocRequest(cmd, sock, cb);
+		if(req < 0)
+			return -1;
 	}
 
-	// Poll response for the next 10 seconds
-	uint32_t start = millis();
-	while(((millis() - start) < GENERAL_TIMEOUT)){
+	if(!_sendRequest(cmd, sock)){ // packet has not been sent. Maybe an interrupt occurred in the meantime
+		// launch interrupt management function, then try to send request again
 		handleEvents();
-		if(gotResponse && responseType == GET_HOSTNAME){
-			uint8_t len = data[0];
-			memset(hostname, 0, MAX_HOSTNAME_LEN);
-			memcpy(hostname, (void*)&data[1], len);
-			return (char *)hostname;
+		if(!_sendRequest(cmd, sock)){ // exit if another error occurs
+			_req[req].state = REQ_FREE;
+			return -1;
 		}
 	}
-	return NULL;
+	return req;
 }
 
 // -----------------------------------------------------------------
-bool WiFiClass::setHostname(char* name)
+int8_t WiFiClass::hostByNameAsync(const char* aHostname, tpReqCallback cb)
 {
-	handleEvents();
-	
-	gotResponse = false;
-	responseType = NONE;
-	
-	if(!Packager::setHostname(name)){ // packet has not been sent. Maybe an interrupt occurred in the meantime
-		// launch interrupt management function, then try to send request again
+	// as in requestAsync, events are handled only to free a slot
+	int8_t req = _allocRequest(GET_HOST_BY_NAME_CMD, NO_SOCKET_AVAIL, cb);
+	if(req < 0){
 		handleEvents();
-		if(!Packager::setHostname(name)) // exit if another error occurs
-			return false;
+		req = _allocRequest(GET_HOST_BY_NAME_CMD, NO_SOCKET_AVAIL, cb);
+		if(req < 0)
+			return -1;
 	}
 
-	// Poll response for the next 10 seconds
-	uint32_t start = millis();
-	while(((millis() - start) < GENERAL_TIMEOUT)){
+	// cached names get the same reply the esp would send
+	tsDnsEntry* entry = _dnsLookup(aHostname);
+	if(entry != NULL){
+		if(entry->addr != 0){
+			memcpy(_req[req].data, &entry->addr, WL_IPV4_LENGTH);
+			_req[req].len = WL_IPV4_LENGTH;
+		}
+		else{
+			_req[req].data[0] = 0;
+			_req[req].len = 1;
+		}
+		_req[req].state = REQ_DONE;
+		return req;
+	}
+
+	if(!Packager::getHostByName(aHostname)){ // packet has not been sent. Maybe an interrupt occurred in the meantime
+		// launch interrupt management function, then try to send request again
 		handleEvents();
-		if(gotResponse && responseType == SET_HOSTNAME){
-			return(data[0]);
+		if(!Packager::getHostByName(aHostname)){ // exit if another error occurs
+			_req[req].state = REQ_FREE;
+			return -1;
 		}
 	}
-	return false;
+	return req;
 }
 
 // -----------------------------------------------------------------
-uint8_t WiFiClass::getSocket()
+uint8_t WiFiClass::requestState(int8_t req)
 {
-	for (uint8_t i = 0; i < MAX_SOCK_NUM; ++i) {
-		if (WiFiClass::_server_port[i] == 0) {
-			return i;
-		}
-	}
-	return NO_SOCKET_AVAIL;
+	if(req < 0 || req >= WIFI_MAX_PENDING_REQ)
+		return REQ_FREE;
+
+	handleEvents();
+	return _req[req].state;
+}
+
+// -----------------------------------------------------------------
+uint8_t WiFiClass::requestResult(int8_t req, uint8_t* buf, uint8_t len)
+{
+	if(req < 0 || req >= WIFI_MAX_PENDING_REQ || _req[req].state != REQ_DONE)
+		return 0;
+
+	if(len > _req[req].len)
+		len = _req[req].len;
+	memcpy(buf, _req[req].data, len);
+	return len;
+}
+
+// -----------------------------------------------------------------
+void WiFiClass::requestRelease(int8_t req)
+{
+	if(req < 0 || req >= WIFI_MAX_PENDING_REQ)
+		return;
+
+	_req[req].state = REQ_FREE;
 }
 
 // -----------------------------------------------------------------
@@ -435,15 +1169,12 @@ char* WiFiClass::firmwareVersion()
 			return NULL;
 	}
 
-	// Poll response for the next 10 seconds
-	uint32_t start = millis();
-	while(((millis() - start) < GENERAL_TIMEOUT)){
-		handleEvents();
-		if(gotResponse && responseType == GET_FW_VERSION_CMD){
-			uint8_t len = data[0];
-			memcpy(Packager::fwVersion, (void*)&data[1], len);
-			return (char *)Packager::fwVersion;
-		}
+	// Poll response until timeout
+	if(waitResponse(GET_FW_VERSION_CMD)){
+		uint8_t len = (data[0] < WL_FW_VER_LENGTH) ? data[0] : WL_FW_VER_LENGTH - 1;
+		memcpy(WIFI_FW_STR, (void*)&data[1], len);
+		WIFI_FW_STR[len] = 0;
+		return (char *)WIFI_FW_STR;
 	}
 	return NULL;
 }
@@ -482,14 +1213,18 @@ wl_status_t WiFiClass::begin()
 		return (wl_status_t)status;
 	}
 
-	// Poll response for the next 10 seconds. If nothing happens return WL_CONNECT_FAILED
+	// Poll response until timeout. If nothing happens return WL_CONNECT_FAILED
+	// the esp answers as for an open or a secured network
 	uint32_t start = millis();
-	while(((millis() - start) < GENERAL_TIMEOUT)){
+	_lastWait = WAIT_TIMEOUT;
+	while(((millis() - start) < _timeout)){
 		handleEvents();
 		if(gotResponse && (responseType == CONNECT_OPEN_AP || responseType == CONNECT_SECURED_AP)){
+			_lastWait = WAIT_REPLY;
 			status = data[0];
 			break;
 		}
+		idle();
 	}
 
 	return (wl_status_t)status;
@@ -512,14 +1247,9 @@ wl_status_t WiFiClass::begin(char* ssid)
 		return (wl_status_t)status;
 	}	
 
-	// Poll response for the next 10 seconds. If nothing happens return WL_CONNECT_FAILED
-	uint32_t start = millis();
-	while(((millis() - start) < GENERAL_TIMEOUT)){
-		handleEvents();
-		if(gotResponse && responseType == CONNECT_OPEN_AP){
-			status = data[0];
-			break;
-		}
+	// Poll response until timeout. If nothing happens return WL_CONNECT_FAILED
+	if(waitResponse(CONNECT_OPEN_AP)){
+		status = data[0];
 	}
 
 	return (wl_status_t)status;
@@ -541,14 +1271,9 @@ wl_status_t WiFiClass::begin(char* ssid, uint8_t key_idx, const char *key)
 		return (wl_status_t)status;
 	}
 
-	// Poll response for the next 10 seconds. If nothing happens return WL_CONNECT_FAILED
-	uint32_t start = millis();
-	while(((millis() - start) < GENERAL_TIMEOUT)){
-		handleEvents();
-		if(gotResponse && responseType == SET_KEY_CMD){
-			status = data[0];
-			break;
-		}
+	// Poll response until timeout. If nothing happens return WL_CONNECT_FAILED
+	if(waitResponse(SET_KEY_CMD)){
+		status = data[0];
 	}
 
 	return (wl_status_t)status;
@@ -570,14 +1295,9 @@ wl_status_t WiFiClass::begin(char* ssid, const char *passphrase)
 			return (wl_status_t)status;
 	}
 
-	// Poll response for the next 10 seconds. If nothing happens return WL_CONNECT_FAILED
-	uint32_t start = millis();
-	while(((millis() - start) < GENERAL_TIMEOUT)){
-		handleEvents();
-		if(gotResponse && responseType == CONNECT_SECURED_AP){
-			status = data[0];
-			break;
-		}
+	// Poll response until timeout. If nothing happens return WL_CONNECT_FAILED
+	if(waitResponse(CONNECT_SECURED_AP)){
+		status = data[0];
 	}
 
 	return (wl_status_t)status;
@@ -630,13 +1350,9 @@ int WiFiClass::disconnect()
 		return -1;
 	}
 
-	// Poll response for the next 10 seconds
-	uint32_t start = millis();
-	while(((millis() - start) < GENERAL_TIMEOUT)){
-		handleEvents();
-		if(gotResponse && responseType == DISCONNECT_CMD){
-			return (int)data[0];
-		}
+	// Poll response until timeout
+	if(waitResponse(DISCONNECT_CMD)){
+		return (int)data[0];
 	}
 
 	return -1;
@@ -657,15 +1373,10 @@ void WiFiClass::macAddress(uint8_t* mac)
 		return;
 	}
 
-	// Poll response for the next 10 seconds
-	uint32_t start = millis();
-	while(((millis() - start) < GENERAL_TIMEOUT)){
-		handleEvents();
-		if(gotResponse && responseType == GET_MACADDR_CMD){
-			uint8_t len = data[0];
-			memcpy(mac, (void*)&data[1], len);
-			break;
-		}
+	// Poll response until timeout
+	if(waitResponse(GET_MACADDR_CMD)){
+		uint8_t len = data[0];
+		memcpy(mac, (void*)&data[1], len);
 	}
 }
 
@@ -685,16 +1396,11 @@ IPAddress WiFiClass::localIP()
 			return IPAddress(addr);
 	}
 
-	// Poll response for the next 10 seconds
-	uint32_t start = millis();
-	while(((millis() - start) < GENERAL_TIMEOUT)){
-		handleEvents();
-		if(gotResponse && responseType == GET_IPADDR_CMD){
-			// local ip is the first of the three parameters returned with GET_IPADDR_CMD command
-			memcpy((uint8_t*)&addr, (uint8_t*)&data[1], data[0]);
-			
-			break;
-		}
+	// Poll response until timeout
+	if(waitResponse(GET_IPADDR_CMD)){
+		// local ip is the first of the three parameters returned with GET_IPADDR_CMD command
+		// [4, ip], [4, mask], [4, gateway]: the length of the reply is checked by replyParse()
+		memcpy((uint8_t*)&addr, (uint8_t*)&data[1], WL_IPV4_LENGTH);
 	}
 	
 	IPAddress ret(addr);
@@ -713,17 +1419,10 @@ IPAddress WiFiClass::subnetMask()
 
 	Packager::getNetworkData();
 
-	// Poll response for the next 10 seconds
-	uint32_t start = millis();
-	while(((millis() - start) < GENERAL_TIMEOUT)){
-		handleEvents();
-		if(gotResponse && responseType == GET_IPADDR_CMD){
-			// subnet mask is the second of the three parameters returned with GET_IPADDR_CMD command
-			uint8_t firstDataLen = data[0];
-			dataLen = data[firstDataLen + 1];
-			memcpy((uint8_t*)&mask, (void*)&data[firstDataLen + 2], dataLen);
-			break;
-		}
+	// Poll response until timeout
+	if(waitResponse(GET_IPADDR_CMD)){
+		// subnet mask is the second of the three parameters returned with GET_IPADDR_CMD command
+		memcpy((uint8_t*)&mask, (void*)&data[WL_IPV4_LENGTH + 2], WL_IPV4_LENGTH);
 	}
 
 	IPAddress ret(mask);
@@ -742,18 +1441,10 @@ IPAddress WiFiClass::gatewayIP()
 
 	Packager::getNetworkData();
 
-	// Poll response for the next 10 seconds
-	uint32_t start = millis();
-	while(((millis() - start) < GENERAL_TIMEOUT)){
-		handleEvents();
-		if(gotResponse && responseType == GET_IPADDR_CMD){
-			// gateway ip is the second of the three parameters returned with GET_IPADDR_CMD command
-			// skip first two data in order to retrieve the third.
-			uint8_t secondDataLen = data[0] + data[data[0] + 1];
-			dataLen = data[secondDataLen + 1];
-			memcpy((uint8_t*)&gateway, (void*)&data[secondDataLen + 2], dataLen);
-			break;
-		}
+	// Poll response until timeout
+	if(waitResponse(GET_IPADDR_CMD)){
+		// gateway ip is the third of the three parameters returned with GET_IPADDR_CMD command
+		memcpy((uint8_t*)&gateway, (void*)&data[2 * WL_IPV4_LENGTH + 3], WL_IPV4_LENGTH);
 	}
 	IPAddress ret(gateway);
 
@@ -763,28 +1454,29 @@ IPAddress WiFiClass::gatewayIP()
 // ----------------------------------------------------------------- ok
 char* WiFiClass::SSID()
 {
-	handleEvents();
-	
-	gotResponse = false;
-	responseType = NONE;
-
-	if(!Packager::getCurrentSSID()){ // packet has not been sent. Maybe an interrupt occurred in the meantime
-		// launch interrupt management function, then try to send request again
+	// the two-frame reply can be lost under a command being written (WAIT_LOST): ask once more
+	for(uint8_t i = 0; i < 2; i++){
 		handleEvents();
-		if(!Packager::getCurrentSSID()) // exit if another error occurs
-		return NULL;
-	}
 
-	// Poll response for the next 10 seconds
-	uint32_t start = millis();
-	while(((millis() - start) < GENERAL_TIMEOUT)){
-		handleEvents();
-		if(gotResponse && responseType == GET_CURR_SSID_CMD){
-			uint8_t len = data[0];
-			memset(Packager::_ssid, 0, WL_SSID_MAX_LENGTH);
-			memcpy(Packager::_ssid, (void*)&data[1], len);
-			return (char *)Packager::_ssid;
+		gotResponse = false;
+		responseType = NONE;
+
+		if(!Packager::getCurrentSSID()){ // packet has not been sent. Maybe an interrupt occurred in the meantime
+			// launch interrupt management function, then try to send request again
+			handleEvents();
+			if(!Packager::getCurrentSSID()) // exit if another error occurs
+			return NULL;
+		}
+
+		// Poll response until timeout
+		if(waitResponse(GET_CURR_SSID_CMD)){
+			uint8_t len = (data[0] < WL_SSID_MAX_LENGTH) ? data[0] : WL_SSID_MAX_LENGTH - 1;
+			memset(WIFI_SSID_STR, 0, WL_SSID_MAX_LENGTH);
+			memcpy(WIFI_SSID_STR, (void*)&data[1], len);
+			return (char *)WIFI_SSID_STR;
 		}
+		if(_lastWait != WAIT_LOST)
+			break;
 	}
 	return NULL;
 }
@@ -804,14 +1496,10 @@ bool WiFiClass::BSSID(uint8_t* bssid)
 			return false;
 	}
 
-	// Poll response for the next 10 seconds
-	uint32_t start = millis();
-	while(((millis() - start) < GENERAL_TIMEOUT)){
-		handleEvents();
-		if(gotResponse && responseType == GET_CURR_BSSID_CMD){
-			memcpy(bssid, (void *)data, WL_MAC_ADDR_LENGTH);
-			return true;
-		}
+	// Poll response until timeout
+	if(waitResponse(GET_CURR_BSSID_CMD)){
+		memcpy(bssid, (void *)data, WL_MAC_ADDR_LENGTH);
+		return true;
 	}
 
 	return false;
@@ -833,15 +1521,10 @@ int32_t WiFiClass::RSSI()
 			return rssi;
 	}
 
-	// Poll response for the next 10 seconds
-	uint32_t start = millis();
-	while(((millis() - start) < GENERAL_TIMEOUT)){
-		handleEvents();
-		if(gotResponse && responseType == GET_CURR_RSSI_CMD){
-			// copy 4 consecutive byte in the response to get the resulting int32_t
-			memcpy(&rssi, (void *)data, 4);
-			break;
-		}
+	// Poll response until timeout
+	if(waitResponse(GET_CURR_RSSI_CMD)){
+		// copy 4 consecutive byte in the response to get the resulting int32_t
+		memcpy(&rssi, (void *)data, 4);
 	}
 
 	return rssi;
@@ -863,27 +1546,23 @@ uint8_t WiFiClass::encryptionType()
 			return enc;
 	}
 	
-	// Poll response for the next 10 seconds
-	uint32_t start = millis();
-	while(((millis() - start) < GENERAL_TIMEOUT)){
-		handleEvents();
-		if(gotResponse && responseType == GET_CURR_ENCT_CMD){
-			enc = *data;
-			break;
-		}
+	// Poll response until timeout
+	if(waitResponse(GET_CURR_ENCT_CMD)){
+		enc = *data;
 	}
 
 	return enc;
 }
 
 // ----------------------------------------------------------------- ok
-int8_t WiFiClass::scanNetworks()
+int8_t WiFiClass::scanNetworks(tsScanResult* list, uint8_t maxItems)
 {
 	handleEvents();
 	uint8_t networksNumber = 0;
 	
 	gotResponse = false;
 	responseType = NONE;
+	_scanCount = 0;
 
 	if(!Packager::startScanNetworks()){ // packet has not been sent. Maybe an interrupt occurred in the meantime
 		// launch interrupt management function, then try to send request again
@@ -892,21 +1571,175 @@ int8_t WiFiClass::scanNetworks()
 			return networksNumber;
 	}
 	
-	// Poll response for the next 10 seconds. If nothing happens return
-	uint32_t start = millis();
-	while(((millis() - start) < GENERAL_TIMEOUT)){
-		handleEvents();
-		if(gotResponse && responseType == START_SCAN_NETWORKS){
-			networksNumber = *data;
-			break;
+	// Poll response until timeout. If nothing happens return
+	if(waitResponse(START_SCAN_NETWORKS)){
+		networksNumber = *data;
+	}
+
+	if(networksNumber == 0)
+		return networksNumber;
+
+	// the results go in the caller list or in the one allocated at the first scan
+	if(list != NULL){
+		scanDelete();
+		_scanList = list;
+	}
+	else{
+		if(_scanList == NULL || !_scanListOwned){
+			_scanList = (tsScanResult*)malloc(WL_NETWORKS_LIST_MAXNUM * sizeof(tsScanResult));
+			_scanListOwned = (_scanList != NULL);
+		}
+		maxItems = WL_NETWORKS_LIST_MAXNUM;
+	}
+	if(_scanList == NULL)
+		return networksNumber;
+	if(maxItems > networksNumber)
+		maxItems = networksNumber;
+
+	// read the whole list at once, firmware without GET_SCAN_LIST_CMD is asked network by network
+	if(commDrv.caps() & WIFI_CAP_SCAN_LIST)
+		_scanCount = _getScanList(_scanList, maxItems);
+	else{
+		for(uint8_t i = 0; i < maxItems; i++){
+			char ssid[WL_SSID_MAX_LENGTH + 1];
+			int32_t rssi;
+			uint8_t enc;
+
+			if(!_getScannedNetwork(i, ssid, rssi, enc))
+				break;
+			memcpy(_scanList[i].ssid, ssid, sizeof(ssid));
+			_scanList[i].ssid[WL_SSID_MAX_LENGTH] = 0;
+			_scanList[i].rssi = (int8_t)constrain(rssi, -128, 127);
+			_scanList[i].enc = enc;
+			_scanCount++;
 		}
 	}
 	
 	return networksNumber;
 }
 
-// ----------------------------------------------------------------- ok
+// -----------------------------------------------------------------
+void WiFiClass::scanDelete()
+{
+	if(_scanListOwned)
+		free(_scanList);
+	_scanList = NULL;
+	_scanListOwned = false;
+	_scanCount = 0;
+}
+
+/* -----------------------------------------------------------------
+* Reads the scan results with a single data packet:
+* count (1 byte), then [rssi (1 byte), enc (1 byte), ssid len (1 byte), ssid]
+* for each network. Records may be split across the frames of the packet.
+*/
+uint8_t WiFiClass::_getScanList(tsScanResult* list, uint8_t maxItems)
+{
+	uint8_t found = 0;
+
+	handleEvents();
+
+	gotResponse = false;
+	responseType = NONE;
+
+	if(!Packager::getScanList(maxItems)){ // packet has not been sent. Maybe an interrupt occurred in the meantime
+		// launch interrupt management function, then try to send request again
+		handleEvents();
+		if(!Packager::getScanList(maxItems)) // exit if another error occurs
+			return 0;
+	}
+
+	// the whole packet has to arrive within the timeout
+	uint32_t start = millis();
+	if(waitResponse(GET_SCAN_LIST_CMD)){
+		uint16_t receivedBytes = 0;
+		uint16_t chunkSize;
+		int32_t totalLen = pktLen;
+		int16_t count = -1;
+		uint8_t field = 0;
+		uint8_t ssidLen = 0;
+		uint8_t pos = 0;
+
+		if(totalLen <= 0)
+			return 0;
+
+		// the first frame carries 26 bytes at most, the following ones 32
+		chunkSize = (totalLen < SPI_BUF_LEN - 6) ? totalLen : SPI_BUF_LEN - 6;
+		while(1){
+			for(uint16_t i = 0; i < chunkSize; i++){
+				uint8_t b = data[i];
+				// networks over maxItems are parsed but not stored
+				tsScanResult* net = (found < maxItems) ? &list[found] : NULL;
+
+				if(count < 0){
+					count = b;
+					continue;
+				}
+				switch(field){
+					case 0:
+						if(net != NULL)
+							net->rssi = (int8_t)b;
+						field = 1;
+					break;
+					case 1:
+						if(net != NULL)
+							net->enc = b;
+						field = 2;
+					break;
+					case 2:
+						ssidLen = b;
+						pos = 0;
+						if(net != NULL)
+							memset(net->ssid, 0, sizeof(net->ssid));
+						if(ssidLen == 0){
+							found++;
+							field = 0;
+						}
+						else
+							field = 3;
+					break;
+					case 3:
+						if(net != NULL && pos < WL_SSID_MAX_LENGTH)
+							net->ssid[pos] = b;
+						if(++pos == ssidLen){
+							found++;
+							field = 0;
+						}
+					break;
+				}
+			}
+			receivedBytes += chunkSize;
+
+			// stop when everything arrived or the esp closed the multi-frame transfer
+			if(receivedBytes >= totalLen || dataPkt.totalLen == 0)
+				break;
+
+			chunkSize = waitData(GET_SCAN_LIST_CMD, start, _timeout);
+			if(chunkSize == 0)
+				break;
+			if(chunkSize > totalLen - receivedBytes)
+				chunkSize = totalLen - receivedBytes;
+		}
+		commDrv.multiRead = false;
+		return (found < maxItems) ? found : maxItems;
+	}
+	return 0;
+}
+
+// -----------------------------------------------------------------
 uint8_t WiFiClass::getScannedNetwork(uint8_t netNum, char *ssid, int32_t& rssi, uint8_t& enc)
+{
+	if(netNum < _scanCount){
+		memcpy(ssid, _scanList[netNum].ssid, WL_SSID_MAX_LENGTH + 1);
+		rssi = _scanList[netNum].rssi;
+		enc = _scanList[netNum].enc;
+		return 1;
+	}
+	return _getScannedNetwork(netNum, ssid, rssi, enc);
+}
+
+// ----------------------------------------------------------------- ok
+uint8_t WiFiClass::_getScannedNetwork(uint8_t netNum, char *ssid, int32_t& rssi, uint8_t& enc)
 {
 	handleEvents();
 	
@@ -920,62 +1753,48 @@ uint8_t WiFiClass::getScannedNetwork(uint8_t netNum, char *ssid, int32_t& rssi,
 			return 0;
 	}
 	
-	// Poll response for the next 10 seconds. If nothing happens return
-	uint32_t start = millis();
-	while(((millis() - start) < GENERAL_TIMEOUT)){
-		handleEvents();
-		if(gotResponse && responseType == SCAN_NETWORKS_RESULT){
-			uint16_t receivedBytes;
-			uint8_t chunkSize = 0;
-			int32_t totalLen = pktLen;	//payload size
-			uint8_t skipSize = 14;
-			
-			if(totalLen < 26){
-				receivedBytes = totalLen;
-			}
-			else{
-				receivedBytes = 26;
-				skipSize = 13;
-			}
-			
-			uint8_t len = data[6];
-			uint8_t cpyLen = SPI_BUF_LEN - skipSize;
-			uint8_t which = data[0];
-			
-			rssi = (int32_t)(data[1] + (data[2] << 8) + (data[3] << 16) + (data[4] << 24));
-			enc = data[5];
-			memset(ssid, 0, 33);
-			if(len < SPI_BUF_LEN - skipSize)
-				cpyLen = len;
-
-			memcpy(ssid, (uint8_t*)(data + 7), cpyLen);
-
-			if(len > SPI_BUF_LEN - skipSize){
-				start = millis();
-				gotResponse = false;
-				responseType = NONE;
-				while(((millis() - start) < GENERAL_TIMEOUT)){
-					handleEvents();
-					if(gotResponse && responseType == SCAN_NETWORKS_RESULT){
-						memcpy((uint8_t*)(ssid + cpyLen), (uint8_t*)(data), commDrv.payloadSize);
-						return 1;
-					}
-				}				
-			}
-			else
+	// Poll response until timeout. If nothing happens return
+	if(waitResponse(SCAN_NETWORKS_RESULT)){
+		uint8_t skipSize = (pktLen < 26) ? 14 : 13;
+		
+		uint8_t len = data[6];
+		uint8_t cpyLen = SPI_BUF_LEN - skipSize;
+		
+		rssi = (int32_t)(data[1] + (data[2] << 8) + (data[3] << 16) + (data[4] << 24));
+		enc = data[5];
+		memset(ssid, 0, 33);
+		if(len < SPI_BUF_LEN - skipSize)
+			cpyLen = len;
+
+		memcpy(ssid, (uint8_t*)(data + 7), cpyLen);
+
+		if(len > SPI_BUF_LEN - skipSize){
+			gotResponse = false;
+			responseType = NONE;
+			if(waitResponse(SCAN_NETWORKS_RESULT)){
+				memcpy((uint8_t*)(ssid + cpyLen), (uint8_t*)(data), commDrv.payloadSize);
 				return 1;
+			}
 		}
+		else
+			return 1;
 	}
 	return 0;
 }
 
+
 char* WiFiClass::SSID(uint8_t networkItem)
 {
-	return Packager::getSSIDNetoworks(networkItem);
+	if(networkItem < _scanCount)
+		return _scanList[networkItem].ssid;
+	return NULL;
 }
 
 int32_t WiFiClass::RSSI(uint8_t networkItem)
 {
+	if(networkItem < _scanCount)
+		return _scanList[networkItem].rssi;
+
 	handleEvents();
 	int32_t rssi = 0;
 	
@@ -989,15 +1808,10 @@ int32_t WiFiClass::RSSI(uint8_t networkItem)
 			return rssi;
 	}
 
-	// Poll response for the next 10 seconds
-	uint32_t start = millis();
-	while(((millis() - start) < GENERAL_TIMEOUT)){
-		handleEvents();
-		if(gotResponse && responseType == GET_IDX_RSSI_CMD){
-			// copy 4 consecutive byte in the response to get the resulting int32_t
-			memcpy(&rssi, (void *)data, 4);
-			break;
-		}
+	// Poll response until timeout
+	if(waitResponse(GET_IDX_RSSI_CMD)){
+		// copy 4 consecutive byte in the response to get the resulting int32_t
+		memcpy(&rssi, (void *)data, 4);
 	}
 
 		return rssi;
@@ -1005,6 +1819,9 @@ int32_t WiFiClass::RSSI(uint8_t networkItem)
 
 uint8_t WiFiClass::encryptionType(uint8_t networkItem)
 {
+	if(networkItem < _scanCount)
+		return _scanList[networkItem].enc;
+
 	handleEvents();
 	uint8_t enc = ENC_TYPE_UNKNOW;
 	
@@ -1018,14 +1835,9 @@ uint8_t WiFiClass::encryptionType(uint8_t networkItem)
 			return enc;
 	}
 
-	// Poll response for the next 10 seconds
-	uint32_t start = millis();
-	while(((millis() - start) < GENERAL_TIMEOUT)){
-		handleEvents();
-		if(gotResponse && responseType == GET_IDX_ENCT_CMD){
-			enc = *data;
-			break;
-		}
+	// Poll response until timeout
+	if(waitResponse(GET_IDX_ENCT_CMD)){
+		enc = *data;
 	}
 	return enc;
 }
@@ -1045,13 +1857,9 @@ wl_status_t WiFiClass::status()
 				return (wl_status_t)connectionStatus;
 		}
 		
-		uint32_t start = millis();
-		while(((millis() - start) < GENERAL_TIMEOUT)){
-			handleEvents();
-			if(gotResponse && responseType == GET_CONN_STATUS){
-				connectionStatus = (wl_status_t)(*data);
-				return connectionStatus;
-			}
+		if(waitResponse(GET_CONN_STATUS)){
+			connectionStatus = (wl_status_t)(*data);
+			return connectionStatus;
 		}
 	}
 
@@ -1065,7 +1873,21 @@ int WiFiClass::hostByName(const char* aHostname, IPAddress& aResult)
 {
 	uint8_t  _ipAddr[WL_IPV4_LENGTH];
 	IPAddress dummy(0xFF,0xFF,0xFF,0xFF);
+	IPAddress numeric;
 	int result = 0;
+
+	// numeric addresses don't need the esp
+	if(numeric.fromString(aHostname)){
+		aResult = numeric;
+		return 1;
+	}
+
+	tsDnsEntry* entry = _dnsLookup(aHostname);
+	if(entry != NULL){
+		aResult = entry->addr;
+		return (entry->addr != 0);
+	}
+
 	handleEvents();
 	
 	gotResponse = false;
@@ -1078,24 +1900,103 @@ int WiFiClass::hostByName(const char* aHostname, IPAddress& aResult)
 			return result;
 	}
 
-	// Poll response for the next 10 seconds. If nothing happens return 0
-	uint32_t start = millis();
-	while(((millis() - start) < GENERAL_TIMEOUT)){
-		handleEvents();
-		if(gotResponse && responseType == GET_HOST_BY_NAME_CMD){
-			if(dataLen == 1) // we got an error, return
-				return 0;
-
-			memcpy((void*)_ipAddr, (void*)data, dataLen);
-			aResult = _ipAddr;
-			result = (aResult != dummy);
-			break;
+	// Poll response until timeout. If nothing happens return 0
+	if(waitResponse(GET_HOST_BY_NAME_CMD)){
+		if(dataLen == 1){ // we got an error, return
+			_dnsStore(aHostname, 0, WIFI_DNS_NEG_TTL);
+			return 0;
 		}
+
+		memcpy((void*)_ipAddr, (void*)data, dataLen);
+		aResult = _ipAddr;
+		result = (aResult != dummy);
+		if(result)
+			_dnsStore(aHostname, aResult, WIFI_DNS_TTL);
+		else
+			_dnsStore(aHostname, 0, WIFI_DNS_NEG_TTL);
 	}
 
 	return result;
 }
 
+/* -----------------------------------------------------------------
+* Entry of the DNS cache for the given name, NULL if the name is not
+* cached or its entry expired
+*/
+tsDnsEntry* WiFiClass::_dnsLookup(const char* name)
+{
+	if(strlen(name) > WIFI_DNS_NAME_LEN)
+		return NULL;
+
+	for(uint8_t i = 0; i < WIFI_DNS_CACHE_LEN; i++){
+		tsDnsEntry* entry = &_dnsCache[i];
+
+		if(entry->name[0] == 0 || strncasecmp(entry->name, name, WIFI_DNS_NAME_LEN) != 0)
+			continue;
+		if((millis() - entry->stamp) / 1000 >= entry->ttl){
+			entry->name[0] = 0;
+			return NULL;
+		}
+		entry->used = millis();
+		return entry;
+	}
+	return NULL;
+}
+
+/* -----------------------------------------------------------------
+* Stores a name in the DNS cache, replacing its old entry, a free one or
+* the least recently used one
+*/
+void WiFiClass::_dnsStore(const char* name, uint32_t addr, uint16_t ttl)
+{
+	tsDnsEntry* entry = NULL;
+	size_t len = strlen(name);
+
+	if(len > WIFI_DNS_NAME_LEN)
+		return;
+
+	for(uint8_t i = 0; i < WIFI_DNS_CACHE_LEN && entry == NULL; i++){
+		if(_dnsCache[i].name[0] != 0 && strncasecmp(_dnsCache[i].name, name, WIFI_DNS_NAME_LEN) == 0)
+			entry = &_dnsCache[i];
+	}
+	for(uint8_t i = 0; i < WIFI_DNS_CACHE_LEN && entry == NULL; i++){
+		if(_dnsCache[i].name[0] == 0)
+			entry = &_dnsCache[i];
+	}
+	if(entry == NULL){
+		entry = &_dnsCache[0];
+		for(uint8_t i = 1; i < WIFI_DNS_CACHE_LEN; i++){
+			if((millis() - _dnsCache[i].used) > (millis() - entry->used))
+				entry = &_dnsCache[i];
+		}
+	}
+
+	// a name of WIFI_DNS_NAME_LEN characters is kept without terminator
+	memset(entry->name, 0, WIFI_DNS_NAME_LEN);
+	memcpy(entry->name, name, len);
+	entry->addr = addr;
+	entry->stamp = entry->used = millis();
+	entry->ttl = ttl;
+}
+
+// -----------------------------------------------------------------
+void WiFiClass::dnsCacheAdd(const char* aHostname, IPAddress aAddress, uint16_t ttl)
+{
+	_dnsStore(aHostname, aAddress, ttl);
+}
+
+// -----------------------------------------------------------------
+void WiFiClass::dnsCacheFlush(const char* aHostname)
+{
+	if(aHostname != NULL && strlen(aHostname) > WIFI_DNS_NAME_LEN)
+		return;
+
+	for(uint8_t i = 0; i < WIFI_DNS_CACHE_LEN; i++){
+		if(aHostname == NULL || strncasecmp(_dnsCache[i].name, aHostname, WIFI_DNS_NAME_LEN) == 0)
+			_dnsCache[i].name[0] = 0;
+	}
+}
+
 
 void WiFiClass::disableWebPanel()
 {
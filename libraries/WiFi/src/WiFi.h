@@ -53,6 +53,82 @@ typedef enum
 	AP_STA_MODE,
 } teConnectionMode;
 
+/*  -----------------------------------------------------------------
+* Receive ring buffer of a socket. It is filled in bulk from the esp
+* so that byte-wise read() and peek() are served from RAM.
+*/
+typedef struct{
+	uint8_t buf[WIFI_SOCK_RX_BUF_LEN];
+	uint8_t head;
+	uint8_t count;
+}tsSockRxBuf;
+
+/*  -----------------------------------------------------------------
+* Transmit buffer of a socket. Small writes (i.e. the ones coming from Print)
+* are collected here and sent to the esp as a single data packet.
+*/
+typedef struct{
+	uint8_t buf[WIFI_SOCK_TX_BUF_LEN];
+	uint16_t len;
+	uint32_t stamp;
+}tsSockTxBuf;
+
+/*  -----------------------------------------------------------------
+* Network found by scanNetworks(). The whole list is read from the esp
+* with a single transfer.
+*/
+typedef struct{
+	char ssid[WL_SSID_MAX_LENGTH + 1];
+	int8_t rssi;
+	uint8_t enc;
+}tsScanResult;
+
+/*  -----------------------------------------------------------------
+* Entry of the DNS cache. A zero address records a name that couldn't
+* be resolved.
+*/
+typedef struct{
+	char name[WIFI_DNS_NAME_LEN];
+	uint32_t addr;
+	uint32_t stamp;
+	uint32_t used;
+	uint16_t ttl;
+}tsDnsEntry;
+
+/*  -----------------------------------------------------------------
+* Pending command of the request table. The reply bytes are the ones that
+* the blocking API finds in WiFiClass::data for the same command.
+*/
+typedef enum {
+	REQ_FREE = 0,
+	REQ_PENDING,
+	REQ_DONE,
+	REQ_TIMEOUT,
+} teReqState;
+
+typedef void (*tpReqCallback)(int8_t req);
+
+/*  -----------------------------------------------------------------
+* Outcome of the last wait for an esp reply
+*/
+typedef enum {
+	WAIT_REPLY = 0,		// the esp answered, a failed call got an error from it
+	WAIT_TIMEOUT,		// the esp didn't answer in time
+	WAIT_LOST,			// WIFI_LOW_MEMORY: the reply went over a command being written, ask again
+} teWaitResult;
+
+typedef void (*tpIdleHook)(void);
+
+typedef struct{
+	uint8_t cmd;
+	uint8_t sock;
+	volatile uint8_t state;
+	uint8_t len;
+	uint32_t stamp;
+	tpReqCallback cb;
+	uint8_t data[WIFI_REQ_DATA_LEN];
+}tsRequest;
+
 typedef struct __attribute__((__packed__))
 {
 	uint8_t cmdType;
@@ -62,26 +138,46 @@ typedef struct __attribute__((__packed__))
 	bool endReceived;
 } tsDataPacket;
 
-typedef struct __attribute__((__packed__))
-{
-	uint8_t cmdType;
-	uint8_t cmd;
-	uint8_t totalLen;
-	uint8_t nParam;
-	uint8_t* dataPtr;
-} tsNewCmd;
-
 class WiFiClass
 {
 	private:
 	volatile static tsDataPacket dataPkt;
-	volatile static tsNewCmd cmdPkt;
+	static tsRequest _req[WIFI_MAX_PENDING_REQ];
+	static tsScanResult* _scanList;
+	static bool _scanListOwned;
+	static uint8_t _scanCount;
+	static tsDnsEntry _dnsCache[WIFI_DNS_CACHE_LEN];
+	static uint32_t _timeout;
+	static tpIdleHook _idleHook;
+	static bool _inIdle;
+
+	static int8_t _allocRequest(uint8_t cmd, uint8_t sock, tpReqCallback cb);
+	static bool _sendRequest(uint8_t cmd, uint8_t sock);
+	static void _completeRequest(uint8_t cmd, int16_t sock, const uint8_t* reply, uint8_t len);
+	static void _serviceRequests(void);
+	static void _serviceTxBufs(void);
+	static void _connectDone(int8_t req, bool ok);
+	static void _updateFree(uint8_t sock);
+	static bool _pollSockets(tSockMask mask);
+	static uint8_t _getScanList(tsScanResult* list, uint8_t maxItems);
+	static uint8_t _getScannedNetwork(uint8_t netNum, char *ssid, int32_t& rssi, uint8_t& enc);
+	static tsDnsEntry* _dnsLookup(const char* name);
+	static void _dnsStore(const char* name, uint32_t addr, uint16_t ttl);
 	
 	public:
+	// with WIFI_LOW_MEMORY SSID() and firmwareVersion() return it too
 	static uint8_t hostname[MAX_HOSTNAME_LEN];
-	static uint8_t _state[MAX_SOCK_NUM];
+	// low nibble: TCP state (wl_tcp_state), high nibble: last connection attempt (teConnState)
+	static uint8_t _sockState[MAX_SOCK_NUM];
 	static uint16_t _server_port[MAX_SOCK_NUM];
 	static uint16_t _client_data[MAX_SOCK_NUM];
+	// sockets that can be allocated: closed (or left listening), not bound and without a pending connection
+	static tSockMask _sockFree;
+	// sockets taken by a server or by an UDP socket (_server_port != 0)
+	static tSockMask _sockBound;
+	static tsSockRxBuf _sockRxBuf[MAX_SOCK_NUM];
+	static tsSockTxBuf _sockTxBuf[MAX_SOCK_NUM];
+	static volatile uint8_t _sockEvents[MAX_SOCK_NUM];
 
 	static bool gotResponse;
 	static uint8_t responseType;
@@ -90,19 +186,213 @@ class WiFiClass
 	static wl_status_t connectionStatus;
 	static bool notify;
 	static int32_t pktLen;
+	static uint8_t _lastWait;
+#ifdef WIFI_LOW_MEMORY
+	// blocking reply dropped by the callback while a command was staged
+	static uint8_t _lostReply;
+#endif
+	// static RAM of the library on the AVR (bytes), see WIFI_LIB_RAM_MAX
+	static const uint16_t staticRam;
 
 	WiFiClass();
 	
 	static void handleEvents(void);
 	static void init();
 	static void init(teConnectionMode connectionMode = AP_STA_MODE);
-	static uint16_t getAvailableData();
+	static uint16_t getAvailableData(uint8_t cmd = GET_DATABUF_TCP_CMD);
 	static void cancelNetworkListMem();
 	/*
-	* Get the first socket available
+	* Wait for the reply to cmd for at most timeout ms (0: the setTimeout value).
+	* The esp events are serviced meanwhile and idle() runs between the checks.
+	*
+	* return: true when the reply arrived, false on timeout
+	*/
+	static bool waitResponse(uint8_t cmd, uint32_t timeout = 0);
+
+	/*
+	* Wait for the next frame of the data packet answering cmd, until timeout
+	* ms from start expire. Like waitResponse(), idle() runs between the checks.
+	*
+	* return: bytes of the frame, 0 on timeout
+	*/
+	static uint16_t waitData(uint8_t cmd, uint32_t start, uint32_t timeout);
+
+	/*
+	* Called by the blocking API while it waits for the esp: runs yield() and
+	* the idle hook. The hook must not call the blocking API.
+	*/
+	static void idle(void);
+	static void onIdle(tpIdleHook hook) { _idleHook = hook; }
+
+	/*
+	* Time given to the esp to answer a blocking call (GENERAL_TIMEOUT by
+	* default). WiFiClient and WiFiUDP can have their own with setTimeout
+	*/
+	static void setTimeout(uint32_t timeout) { _timeout = timeout ? timeout : GENERAL_TIMEOUT; }
+	static uint32_t getTimeout(void) { return _timeout; }
+
+	/*
+	* Outcome of the last wait (teWaitResult): tells a timeout from an error
+	* reported by the esp when a blocking call fails
+	*/
+	static uint8_t lastWait(void) { return _lastWait; }
+
+#ifdef WIFI_SPI_STATS
+	/*
+	* SPI link statistics: packets, frames and bytes on the wire, waits for the
+	* esp, failed transfers and the reply latency of each command
+	*/
+	static void printLinkStats(Print& out);
+	static void resetLinkStats(void);
+#endif
+
+	/*
+	* Get the first socket available, from the free sockets bitmap
 	*/
 	static uint8_t getSocket();
 
+	/*
+	* Socket state helpers. They keep the free and bound bitmaps up to date
+	*/
+	static uint8_t sockState(uint8_t sock) { return _sockState[sock] & 0x0F; }
+	static void setSockState(uint8_t sock, uint8_t state);
+	static uint8_t connState(uint8_t sock) { return _sockState[sock] >> 4; }
+	static void setConnState(uint8_t sock, uint8_t state);
+	// port 0 gives the socket back
+	static void bindSocket(uint8_t sock, uint16_t port);
+	// lowest socket of a non empty mask
+	static uint8_t firstSock(tSockMask mask) { return __builtin_ctz(mask); }
+
+	/*
+	* Ask the esp how many bytes are waiting on the socket.
+	* The value is cached in _client_data[sock]. The socket helpers wait
+	* for the esp at most timeout ms (0: the setTimeout value).
+	*
+	* return: number of bytes available on the esp, -1 on error
+	*/
+	static int availData(uint8_t sock, uint32_t timeout = 0);
+
+	/*
+	* Move the UDP socket to its next datagram, getting size and sender with a
+	* single PARSE_PACKET_UDP exchange. The first bytes of the datagram come in
+	* the same frame and are queued in the socket receive buffer.
+	*
+	* return: datagram size, 0 if nothing has been received, -1 on error or if
+	* the esp doesn't know the command
+	*/
+	static int udpParse(uint8_t sock, uint8_t* remoteIp, uint16_t* remotePort, uint32_t timeout = 0);
+
+	/*
+	* True when the esp knows PARSE_PACKET_UDP (WIFI_CAP_UDP_PARSE).
+	*/
+	static bool udpParseSupported(void);
+
+	/*
+	* True when the esp pushes the socket events (WIFI_CAP_SOCK_EVENTS).
+	* The socket state and _client_data are then kept up to date without asking the esp.
+	*/
+	static bool sockEvents(void);
+
+	/*
+	* Fetch len bytes of the socket with a single GET_DATABUF transfer.
+	* Data go to buf when not NULL, otherwise they are queued in the
+	* socket receive ring buffer.
+	*
+	* return: number of bytes received, -1 on error
+	*/
+	static int getDataBuf(uint8_t sock, uint8_t* buf, uint16_t len, uint32_t timeout = 0);
+
+	/*
+	* Refill the socket receive ring buffer from the esp
+	*
+	* return: number of bytes added, 0 if nothing is available, -1 on error
+	*/
+	static int fillRxBuf(uint8_t sock, uint32_t timeout = 0);
+
+	/*
+	* Socket receive ring buffer helpers
+	*/
+	static int rxBufRead(uint8_t sock);
+	static int rxBufRead(uint8_t sock, uint8_t* buf, uint16_t size);
+	static int rxBufPeek(uint8_t sock);
+	static void rxBufClear(uint8_t sock);
+	// bytes from the head of the ring up to its end or to the last one, left in place
+	static uint8_t rxBufSpan(uint8_t sock, const uint8_t** data);
+	static void rxBufSkip(uint8_t sock, uint8_t n);
+
+	/*
+	* Queue size bytes in the transmit buffer of the socket. The buffer is sent
+	* when full, WIFI_TX_FLUSH_MS after the first queued byte or on txBufFlush.
+	* Writes that don't fit in the buffer are sent straight away.
+	*
+	* return: bytes accepted, 0 on error
+	*/
+	static size_t txBufWrite(uint8_t sock, const uint8_t* buf, size_t size);
+
+	/*
+	* Queue or send the cnt segments of iov. Segments that fit in the transmit
+	* buffer are queued, otherwise the queued bytes are sent and then all the
+	* segments go out as a single data packet, without copies.
+	*
+	* return: bytes accepted, 0 on error
+	*/
+	static size_t txBufWriteV(uint8_t sock, const tsIoVec* iov, uint8_t cnt);
+
+	/*
+	* Send the bytes queued in the transmit buffer of the socket
+	*
+	* return: false if the data packet could not be sent
+	*/
+	static bool txBufFlush(uint8_t sock);
+	static void txBufClear(uint8_t sock);
+
+	/*
+	* Refresh client state and available bytes (_client_data) of the sockets
+	* in use, with a batch request every few sockets
+	*
+	* return: false if the esp didn't answer or doesn't support batch commands
+	*/
+	static bool pollSockets(void);
+
+	/*
+	* Send a command without waiting for its reply, so that several commands
+	* can be in flight at once. Supported commands: GET_CONN_STATUS,
+	* GET_IPADDR_CMD, GET_CURR_RSSI_CMD, GET_CURR_ENCT_CMD, GET_FW_VERSION_CMD
+	* and, on the sock socket, AVAIL_DATA_TCP_CMD, GET_CLIENT_STATE_TCP_CMD,
+	* GET_STATE_TCP_CMD, STOP_CLIENT_TCP_CMD.
+	* When cb is given it is called from handleEvents() once the reply arrives
+	* (or the request times out) and the request is released right after.
+	* Callbacks must not call the blocking API.
+	*
+	* return: request handle, -1 if the table is full or the command was not sent
+	*/
+	static int8_t requestAsync(uint8_t cmd, uint8_t sock = NO_SOCKET_AVAIL, tpReqCallback cb = NULL);
+
+	/*
+	* Asynchronous version of hostByName. The reply holds the 4 bytes of
+	* the resolved address, a single byte on error. Names in the DNS cache
+	* complete at the next handleEvents() without asking the esp, the
+	* replies of the esp are not added to the cache.
+	*/
+	static int8_t hostByNameAsync(const char* aHostname, tpReqCallback cb = NULL);
+
+	/*
+	* State of a request (teReqState)
+	*/
+	static uint8_t requestState(int8_t req);
+
+	/*
+	* Copy up to len bytes of the request reply into buf
+	*
+	* return: number of bytes copied
+	*/
+	static uint8_t requestResult(int8_t req, uint8_t* buf, uint8_t len);
+
+	/*
+	* Give the request slot back to the table
+	*/
+	static void requestRelease(int8_t req);
+
 	/*
 	* Get firmware version
 	*/
@@ -220,7 +510,8 @@ class WiFiClass
 	IPAddress gatewayIP();
 
 	/*
-	* Return the current SSID associated with the network
+	* Return the current SSID associated with the network. With WIFI_LOW_MEMORY
+	* the string is overwritten by hostname() and firmwareVersion()
 	*
 	* return: ssid string
 	*/
@@ -250,17 +541,29 @@ class WiFiClass
 	uint8_t	encryptionType();
 
 	/*
-	* Start scan WiFi networks available
+	* Start scan WiFi networks available and read the list of the results
+	*
+	* param list: array that receives the networks, NULL to use a list
+	*             allocated at the first scan (WL_NETWORKS_LIST_MAXNUM items)
+	* param maxItems: number of items of list
 	*
 	* return: Number of discovered networks
 	*/
-	int8_t scanNetworks();
+	int8_t scanNetworks(tsScanResult* list = NULL, uint8_t maxItems = WL_NETWORKS_LIST_MAXNUM);
+
+	/*
+	* Release the list allocated by scanNetworks()
+	*/
+	void scanDelete();
 	
 	char* getHostname();
 	bool setHostname(char* name);
 	
 	/*
+	* Copy the informations of a network of the last scan. ssid must be
+	* WL_SSID_MAX_LENGTH + 1 bytes long
 	*
+	* return: 1 on success, 0 otherwise
 	*/
 	uint8_t getScannedNetwork(uint8_t netNum, char *ssid, int32_t& rssi, uint8_t& enc);
 
@@ -303,7 +606,8 @@ class WiFiClass
 	void on();
 
 	/*
-	* Resolve the given hostname to an IP address.
+	* Resolve the given hostname to an IP address. Results (failures too)
+	* are kept in the DNS cache, numeric addresses are converted locally.
 	* param aHostname: Name to be resolved
 	* param aResult: IPAddress structure to store the returned IP address
 	* result: 1 if aIPAddrString was successfully converted to an IP address,
@@ -311,6 +615,17 @@ class WiFiClass
 	*/
 	int hostByName(const char* aHostname, IPAddress& aResult);
 
+	/*
+	* Add a name to the DNS cache, i.e. to pre-warm it with known addresses
+	* param ttl: lifetime of the entry (s)
+	*/
+	static void dnsCacheAdd(const char* aHostname, IPAddress aAddress, uint16_t ttl = WIFI_DNS_TTL);
+
+	/*
+	* Remove a name from the DNS cache, all the names if aHostname is NULL
+	*/
+	static void dnsCacheFlush(const char* aHostname = NULL);
+
 	/*
 	* Disable default web server at port 80 (pin control feature will be unavailable).
 	*/
@@ -319,6 +634,7 @@ class WiFiClass
 	friend class WiFiClient;
 	friend class WiFiServer;
 	friend void wifiDrvCB(void);
+	friend void handleReply(const uint8_t* frame, uint8_t hnd);
 	
 };
 
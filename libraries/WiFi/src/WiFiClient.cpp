@@ -28,16 +28,17 @@ Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
 uint8_t client_status = 0;
 int attempts_conn = 0;
 
-uint8_t _internalBuf[25];
-uint8_t _internalBufPtr = 0;
-int16_t _internalBufSz = 0;
-int16_t _espSockDataSz = 0;
 
+WiFiClient::WiFiClient() : _sock(MAX_SOCK_NUM), _replyTimeout(0) {
+}
 
-WiFiClient::WiFiClient() : _sock(MAX_SOCK_NUM) {
+WiFiClient::WiFiClient(uint8_t sock) : _sock(sock), _replyTimeout(0) {
 }
 
-WiFiClient::WiFiClient(uint8_t sock) : _sock(sock) {
+void WiFiClient::setTimeout(unsigned long timeout)
+{
+	Stream::setTimeout(timeout);
+	_replyTimeout = timeout;
 }
 
 int WiFiClient::connect(const char* host, uint16_t port) 
@@ -50,39 +51,86 @@ int WiFiClient::connect(const char* host, uint16_t port)
 }
 
 int WiFiClient::connect(IPAddress ip, uint16_t port) 
+{
+	if(!connectAsync(ip, port))
+		return 0;
+
+	// the request table gives up after WiFi.setTimeout, a client timeout can be shorter
+	uint32_t start = millis();
+	WiFiClass::_lastWait = WAIT_REPLY;
+	while(connectState() == CONN_PENDING){
+		if(_replyTimeout && (millis() - start) >= _replyTimeout){
+			stop();
+			WiFiClass::_lastWait = WAIT_TIMEOUT;
+			return 0;
+		}
+		WiFiClass::idle();
+	}
+
+	if(connectState() != CONN_ESTABLISHED){
+		_sock = 255;
+		return 0;
+	}
+	return 1;
+}
+
+int WiFiClient::connectAsync(const char* host, uint16_t port)
+{
+	IPAddress remote_addr;
+	if (WiFi.hostByName(host, remote_addr)) {
+		return connectAsync(remote_addr, port);
+	}
+	return 0;
+}
+
+int WiFiClient::connectAsync(IPAddress ip, uint16_t port)
 {
 	_sock = getFirstSocket();
-    if (_sock != NO_SOCKET_AVAIL) {
+	if (_sock == NO_SOCKET_AVAIL) {
+		Serial.println("No Socket available");
+		_sock = 255;
+		return 0;
+	}
+
+	// drop anything left over by the previous owner of the socket
+	WiFiClass::_client_data[_sock] = 0;
+	WiFiClass::rxBufClear(_sock);
+	WiFiClass::txBufClear(_sock);
+
+	// the reply is matched to the request in wifiDrvCB, which updates the socket state.
+	// As in requestAsync, events are handled only to free a slot
+	int8_t req = WiFiClass::_allocRequest(START_CLIENT_TCP_CMD, _sock, NULL);
+	if(req < 0){
+		WiFiClass::handleEvents();
+		req = WiFiClass::_allocRequest(START_CLIENT_TCP_CMD, _sock, NULL);
+	}
+	if(req < 0){
+		_sock = 255;
+		return 0;
+	}
+
+	if(!Packager::startClient(uint32_t(ip), port, _sock)){ // packet has not been sent. Maybe an interrupt occurred in the meantime
+		// launch interrupt management function, then try to send request again
 		WiFiClass::handleEvents();
-		
-		WiFiClass::gotResponse = false;
-		WiFiClass::responseType = NONE;
-    	
-		if(!Packager::startClient(uint32_t(ip), port, _sock)){ // packet has not been sent. Maybe an interrupt occurred in the meantime
-			// launch interrupt management function, then try to send request again
-			WiFiClass::handleEvents();
-			if(!Packager::startClient(uint32_t(ip), port, _sock)) // exit if another error occurs
+		if(!Packager::startClient(uint32_t(ip), port, _sock)){ // exit if another error occurs
+			WiFiClass::_req[req].state = REQ_FREE;
+			_sock = 255;
 			return 0;
 		}
+	}
 
-		// Poll flags until we got a response or timeout occurs
-		uint32_t start = millis();
-		while(((millis() - start) < GENERAL_TIMEOUT)){
-			WiFiClass::handleEvents();
-			if(WiFiClass::gotResponse && WiFiClass::responseType == START_CLIENT_TCP_CMD){
-				if(!WiFiClass::data[0]) // error while starting client
-					return 0;
-				break;
-			}
-		}
-    }
-	else{
-    	Serial.println("No Socket available");
-    	return 0;
-    }
-
-   	WiFiClass::_state[_sock] = ESTABLISHED;
-    return 1;
+	WiFiClass::setConnState(_sock, CONN_PENDING);
+	WiFiClass::setSockState(_sock, SYN_SENT);
+	return 1;
+}
+
+uint8_t WiFiClient::connectState()
+{
+	if(_sock >= MAX_SOCK_NUM)
+		return CONN_NONE;
+
+	WiFiClass::handleEvents();
+	return WiFiClass::connState(_sock);
 }
 
 size_t WiFiClient::write(uint8_t b) 
@@ -92,206 +140,193 @@ size_t WiFiClient::write(uint8_t b)
 
 size_t WiFiClient::write(const uint8_t *buf, size_t size)
 {
+	if(_sock == 255)
+		return 0;
+
+	// collect small writes, they are sent together by the transmit buffer
+	return WiFiClass::txBufWrite(_sock, buf, size);
+}
+
+size_t WiFiClient::writev(const tsIoVec *iov, uint8_t cnt)
+{
+	if(_sock == 255)
+		return 0;
+
+	return WiFiClass::txBufWriteV(_sock, iov, cnt);
+}
+
+size_t WiFiClient::write_P(const uint8_t *pgm, size_t len)
+{
+	size_t n = 0;
+
+	if(_sock == 255)
+		return 0;
+
+	// a segment is 64KB at most
+	while(n < len){
+		tsIoVec iov = { pgm + n, (uint16_t)min(len - n, (size_t)0xFFFF), true };
+		size_t ret = WiFiClass::txBufWriteV(_sock, &iov, 1);
+		if(ret == 0)
+			break;
+		n += ret;
+	}
+	return n;
+}
+
+size_t WiFiClient::print(const __FlashStringHelper *str)
+{
+	return write_P((const uint8_t*)str, strlen_P((PGM_P)str));
+}
+
+size_t WiFiClient::println(const __FlashStringHelper *str)
+{
+	if(_sock == 255)
+		return 0;
+
+	// string and line end in the same packet
+	tsIoVec iov[2] = {
+		{ (const uint8_t*)str, (uint16_t)strlen_P((PGM_P)str), true },
+		{ (const uint8_t*)"\r\n", 2, false },
+	};
+	return WiFiClass::txBufWriteV(_sock, iov, 2);
+}
+
+size_t WiFiClient::writeAsync(const uint8_t *buf, size_t size)
+{
+	// queued bytes have to go out before these ones
+	if(!WiFiClass::txBufFlush(_sock))
+		return 0;
+
 	WiFiClass::handleEvents();
-	
-	if(!Packager::sendData(_sock, buf, size)) { // packet has not been sent. Maybe an interrupt occurred in the meantime
+
+	if(!Packager::sendDataAsync(_sock, buf, size)) { // packet has not been sent. Maybe an interrupt occurred in the meantime
 		// launch interrupt management function, then try to send request again
 		WiFiClass::handleEvents();
-		if(!Packager::sendData(_sock, buf, size)) // exit if another error occurs
+		if(!Packager::sendDataAsync(_sock, buf, size)) // exit if another error occurs
 		return 0;
 	}
 	return size;
 }
 
+bool WiFiClient::writeBusy()
+{
+	// keep the pump going in case the esp raised an event between frames
+	WiFiClass::handleEvents();
+	return commDrv.pumpBusy();
+}
+
 int WiFiClient::available() 
 {
 	WiFiClass::handleEvents();
 
 	if(_sock != 255){
-		if(_internalBufSz > 0){
-			return _internalBufSz;
+		// the peer could be waiting for what we have queued before answering
+		WiFiClass::txBufFlush(_sock);
+
+		// bytes already in RAM plus the ones still waiting on the esp
+		int buffered = WiFiClass::_sockRxBuf[_sock].count;
+		// the esp tells us when new bytes arrive: the local count is all we need
+		if(buffered > 0 || WiFiClass::_client_data[_sock] > 0 || WiFiClass::sockEvents()){
+			return buffered + WiFiClass::_client_data[_sock];
 		}
 
-		if(_espSockDataSz > 0){
-			return _espSockDataSz;
-		}
-
-		WiFiClass::gotResponse = false;
-		WiFiClass::responseType = NONE;
-
-		if(!Packager::getAvailable(_sock)){ // packet has not been sent. Maybe an interrupt occurred in the meantime
-			// launch interrupt management function, then try to send request again
-			WiFiClass::handleEvents();
-			if(!Packager::getAvailable(_sock)) // exit if another error occurs
-			return -1;
-		}
-
-		// Poll flags until we got a response or timeout occurs
-		uint32_t start = millis();
-		while(((millis() - start) < GENERAL_TIMEOUT)){
-			WiFiClass::handleEvents();
-			if(WiFiClass::gotResponse && WiFiClass::responseType == AVAIL_DATA_TCP_CMD){
-				// copy int value
-				memcpy((uint8_t*)&WiFiClass::_client_data[_sock], &WiFiClass::data[3], 2);
-				_espSockDataSz = WiFiClass::_client_data[_sock];
-				return _espSockDataSz;
-			}
-		}
+		return WiFiClass::availData(_sock, _replyTimeout);
 	}
 	return -1;
 }
 
 int WiFiClient::read()
 {
-	if(_internalBufSz > 0){
-		uint8_t ret = _internalBuf[_internalBufPtr++];
-		_internalBufSz--;
-
-		return ret;
-	}
-
-	WiFiClass::handleEvents();
-	
-	WiFiClass::gotResponse = false;
-	WiFiClass::responseType = NONE;
-
-	uint16_t sz = min(_espSockDataSz, 25);
-	
-	if(!Packager::getDataBuf(_sock, sz)){ // packet has not been sent. Maybe an interrupt occurred in the meantime
-		// launch interrupt management function, then try to send request again
-		WiFiClass::handleEvents();
-		delay(1);
-		WiFiClass::handleEvents();
-		if(!Packager::getDataBuf(_sock, sz)) // exit if another error occurs
+	if(_sock == 255)
 		return -1;
-	}
 
-	// Poll flags until we got a response or timeout occurs
-	uint32_t start = millis();
-	while(((millis() - start) < GENERAL_TIMEOUT)){
-		WiFiClass::handleEvents();
-		if(WiFiClass::gotResponse && WiFiClass::responseType == GET_DATABUF_TCP_CMD){
-			_internalBufPtr = 0;
-			_internalBufSz = (int8_t)WiFiClass::pktLen;
-			memset(_internalBuf, 0, 25);
-			if(_internalBufSz <= 0){
-				_espSockDataSz = 0;
-				_internalBufSz = 0;
-				return -1;
-			}
-			memcpy(_internalBuf, (uint8_t *)WiFiClass::data, _internalBufSz);
-			
-			uint8_t ret = _internalBuf[_internalBufPtr++];
-			_espSockDataSz -= _internalBufSz;
-			_internalBufSz--;
+	WiFiClass::txBufFlush(_sock);
 
-			return ret;
-		}
+	if(WiFiClass::_sockRxBuf[_sock].count == 0){
+		if(WiFiClass::fillRxBuf(_sock, _replyTimeout) <= 0)
+			return -1;
 	}
 
-	return -1;
+	return WiFiClass::rxBufRead(_sock);
 }
 
 int WiFiClient::read(uint8_t* buf, size_t size) {
-	WiFiClass::handleEvents();
-	WiFiClass::gotResponse = false;
-	WiFiClass::responseType = NONE;
-
-	if(!Packager::getDataBuf(_sock, size)){ // packet has not been sent. Maybe an interrupt occurred in the meantime
-		// launch interrupt management function, then try to send request again
-		WiFiClass::handleEvents();
-		if(!Packager::getDataBuf(_sock, size)) // exit if another error occurs
+	if(_sock == 255)
 		return -1;
-	}
 
-	// Poll flags until we got a response or timeout occurs
-	uint32_t start = millis();
-	while(((millis() - start) < GENERAL_TIMEOUT)){
-		WiFiClass::handleEvents();
-		if(WiFiClass::gotResponse && WiFiClass::responseType == GET_DATABUF_TCP_CMD){
-			uint16_t receivedBytes;
-			uint8_t chunkSize = 0;
-			int32_t totalLen = WiFiClass::pktLen;
-			
-			if(totalLen <= 0){ // No data was read. Maybe an error occurred. Restore available flag and exit
-				WiFiClass::_client_data[_sock] = 0;
-				_espSockDataSz = 0;
-				return -1;
-			}
+	WiFiClass::txBufFlush(_sock);
+
+	// serve the buffered bytes at first
+	int receivedBytes = WiFiClass::rxBufRead(_sock, buf, size);
 
-			if(totalLen < 26)
-			receivedBytes = totalLen;
-			else
-			receivedBytes = 26;
-			
-			memcpy(buf, (uint8_t *)WiFiClass::data, receivedBytes);
-
-			while(receivedBytes < totalLen && (millis() - start) < 15000){ // wait 15 seconds at maximum for receiving the whole message. Otherwise consider that an error occurred
-				chunkSize = WiFiClass::getAvailableData();
-				if(chunkSize > 0){
-					memcpy(&buf[receivedBytes], (void *)WiFiClass::data, chunkSize);
-					receivedBytes += chunkSize;
-				}
+	if(receivedBytes < (int)size){
+		if(WiFiClass::_client_data[_sock] == 0 && receivedBytes == 0)
+			WiFiClass::availData(_sock, _replyTimeout);
+
+		uint16_t sz = min(size - receivedBytes, WiFiClass::_client_data[_sock]);
+		if(sz > 0){
+			int ret;
+			if(sz >= WIFI_SOCK_RX_BUF_LEN){
+				// big request: bypass the ring buffer
+				ret = WiFiClass::getDataBuf(_sock, &buf[receivedBytes], sz, _replyTimeout);
+			}
+			else{
+				ret = WiFiClass::fillRxBuf(_sock, _replyTimeout);
+				if(ret > 0)
+					ret = WiFiClass::rxBufRead(_sock, &buf[receivedBytes], size - receivedBytes);
 			}
-			WiFiClass::_client_data[_sock] -= receivedBytes;
-			_espSockDataSz -= receivedBytes;
-			return receivedBytes;
+			if(ret > 0)
+				receivedBytes += ret;
 		}
 	}
 
-	commDrv.multiRead = false;
-	WiFiClass::_client_data[_sock] = 0;
-	_espSockDataSz = 0;
-	return -1;
+	return (receivedBytes > 0) ? receivedBytes : -1;
 }
 
 int WiFiClient::peek() {
-	
-	if(_internalBufSz > 0){
-		uint8_t ret = _internalBuf[_internalBufPtr];
-		return ret;
-	}
+	if(_sock == 255)
+		return -1;
 
-	WiFiClass::handleEvents();
+	if(WiFiClass::_sockRxBuf[_sock].count == 0){
+		if(WiFiClass::fillRxBuf(_sock, _replyTimeout) <= 0)
+			return -1;
+	}
 
-	WiFiClass::gotResponse = false;
-	WiFiClass::responseType = NONE;
+	return WiFiClass::rxBufPeek(_sock);
+}
 
-	uint8_t sz = min(_espSockDataSz, 25);
-	
-	if(!Packager::getDataBuf(_sock, sz)){ // packet has not been sent. Maybe an interrupt occurred in the meantime
-		// launch interrupt management function, then try to send request again
-		WiFiClass::handleEvents();
-		if(!Packager::getDataBuf(_sock, sz)) // exit if another error occurs
+int WiFiClient::peekSpan(const uint8_t** data) {
+	if(_sock == 255)
 		return -1;
-	}
 
-	// Poll flags until we got a response or timeout occurs
-	uint32_t start = millis();
-	while(((millis() - start) < GENERAL_TIMEOUT)){
+	// the peer could be waiting for what we have queued before going on
+	WiFiClass::txBufFlush(_sock);
+
+	if(WiFiClass::_sockRxBuf[_sock].count == 0){
+		// nothing new on the esp: don't ask it again
 		WiFiClass::handleEvents();
-		if(WiFiClass::gotResponse && WiFiClass::responseType == GET_DATABUF_TCP_CMD){
-			_internalBufPtr = 0;
-			_internalBufSz = (int16_t)WiFiClass::dataLen;
-			memset(_internalBuf, 0, 25);
-			if(_internalBufSz <= 0){
-				_espSockDataSz = 0;
-				_internalBufSz = 0;
-				return -1;
-			}
-			memcpy(_internalBuf, (uint8_t *)WiFiClass::data, _internalBufSz);
-			
-			uint8_t ret = _internalBuf[_internalBufPtr];
-			_espSockDataSz -= _internalBufSz;
-						
-			return ret;
-		}
+		if(WiFiClass::_client_data[_sock] == 0 && WiFiClass::sockEvents())
+			return 0;
+		if(WiFiClass::fillRxBuf(_sock, _replyTimeout) <= 0)
+			return 0;
 	}
-	
-	return -1;
+
+	return WiFiClass::rxBufSpan(_sock, data);
+}
+
+void WiFiClient::consume(size_t n) {
+	if(_sock == 255)
+		return;
+
+	WiFiClass::rxBufSkip(_sock, (n < WIFI_SOCK_RX_BUF_LEN) ? n : WIFI_SOCK_RX_BUF_LEN);
 }
 
 void WiFiClient::flush() {
+  if (_sock == 255)
+    return;
+
+  // send the queued bytes, then discard the incoming ones
+  WiFiClass::txBufFlush(_sock);
   while (available() > 0)
     read();
 }
@@ -301,6 +336,17 @@ void WiFiClient::stop() {
 	if (_sock == 255)
 		return;
 
+	// don't lose the bytes still in the transmit buffer
+	WiFiClass::txBufFlush(_sock);
+	WiFiClass::txBufClear(_sock);
+
+	// a reply still on its way must not touch the next owner of the socket
+	for(int8_t i = 0; i < WIFI_MAX_PENDING_REQ; i++){
+		if(WiFiClass::_req[i].state == REQ_PENDING && WiFiClass::_req[i].cmd == START_CLIENT_TCP_CMD && WiFiClass::_req[i].sock == _sock)
+			WiFiClass::_req[i].sock = NO_SOCKET_AVAIL;
+	}
+	WiFiClass::setConnState(_sock, CONN_NONE);
+
 	WiFiClass::handleEvents();
 	
 	WiFiClass::gotResponse = false;
@@ -313,18 +359,14 @@ void WiFiClient::stop() {
 			return;
 	}
 
-    // Poll flags until we got a response or timeout occurs
-    uint32_t start = millis();
-    while(((millis() - start) < GENERAL_TIMEOUT)){
-	    WiFiClass::handleEvents();
-	    if(WiFiClass::gotResponse && WiFiClass::responseType == STOP_CLIENT_TCP_CMD){
-		    break;
-	    }
-    }
+	// Poll flags until we got a response or timeout occurs
+	WiFiClass::waitResponse(STOP_CLIENT_TCP_CMD, _replyTimeout);
 
 
-  WiFiClass::_state[_sock] = CLOSED;
-  _espSockDataSz = _internalBufPtr = _internalBufSz = 0;
+  WiFiClass::setSockState(_sock, CLOSED);
+  WiFiClass::_client_data[_sock] = 0;
+  WiFiClass::_sockEvents[_sock] = 0;
+  WiFiClass::rxBufClear(_sock);
   client_status = 0;
   _sock = 255;
 }
@@ -336,7 +378,8 @@ uint8_t WiFiClient::connected() {
   } else {
       uint8_t s;
       attempts_conn++;
-      if(client_status == 0 || attempts_conn > ATTEMPTS){    //EDIT by Andrea
+      // with the socket events status() costs nothing: don't keep a stale value
+      if(client_status == 0 || attempts_conn > ATTEMPTS || WiFiClass::sockEvents()){    //EDIT by Andrea
         client_status = status();
         s = client_status;
         attempts_conn = 0;
@@ -359,6 +402,10 @@ uint8_t WiFiClient::status() {
 
 	WiFiClass::handleEvents();
 
+	// state kept up to date by the socket events
+	if(WiFiClass::sockEvents())
+		return WiFiClass::sockState(_sock);
+
 	WiFiClass::gotResponse = false;
 	WiFiClass::responseType = NONE;
 
@@ -370,15 +417,9 @@ uint8_t WiFiClient::status() {
 	}
 
 	// Poll flags until we got a response or timeout occurs
-	uint32_t start = millis();
-	while(((millis() - start) < GENERAL_TIMEOUT)){
-		WiFiClass::handleEvents();
-		if(WiFiClass::gotResponse && WiFiClass::responseType == GET_CLIENT_STATE_TCP_CMD){
-			// state already updated in wifiDrvCB function
-			break;
-		}
-	}
-	return WiFiClass::_state[_sock];
+	// state updated in wifiDrvCB function
+	WiFiClass::waitResponse(GET_CLIENT_STATE_TCP_CMD, _replyTimeout);
+	return WiFiClass::sockState(_sock);
 }
 
 WiFiClient::operator bool() {
@@ -388,11 +429,6 @@ WiFiClient::operator bool() {
 // Private Methods
 uint8_t WiFiClient::getFirstSocket()
 {
-    for (int i = 0; i < MAX_SOCK_NUM; i++) {
-      if (WiFiClass::_state[i] == CLOSED)
-      {
-          return i;
-      }
-    }
-    return NO_SOCKET_AVAIL;
+    // closed sockets bound to a server or to an UDP socket are not free
+    return WiFiClass::getSocket();
 }
\ No newline at end of file
@@ -20,6 +20,15 @@
 #include "Print.h"
 #include "Client.h"
 #include "IPAddress.h"
+#include "utility/definitions.h"
+
+// state of the last connection attempt of a client
+typedef enum {
+	CONN_NONE = 0,
+	CONN_PENDING,
+	CONN_ESTABLISHED,
+	CONN_FAILED,
+} teConnState;
 
 class WiFiClient : public Client {
 
@@ -30,23 +39,44 @@ public:
   uint8_t status();
   virtual int connect(IPAddress ip, uint16_t port);
   virtual int connect(const char *host, uint16_t port);
+  // Start connecting and return right away, connectState() tells how it ends
+  int connectAsync(IPAddress ip, uint16_t port);
+  int connectAsync(const char *host, uint16_t port);
+  uint8_t connectState();
   virtual size_t write(uint8_t);
   virtual size_t write(const uint8_t *buf, size_t size);
+  // Start sending buf in background, buf must stay untouched until writeBusy() returns false
+  size_t writeAsync(const uint8_t *buf, size_t size);
+  bool writeBusy();
+  // Send cnt segments (RAM or PROGMEM) as one data packet, without copying them
+  size_t writev(const tsIoVec *iov, uint8_t cnt);
+  // Send len bytes stored in flash, read by the SPI driver without going through SRAM
+  size_t write_P(const uint8_t *pgm, size_t len);
+  size_t print(const __FlashStringHelper *str);
+  size_t println(const __FlashStringHelper *str);
   virtual int available();
   virtual int read();
   virtual int read(uint8_t *buf, size_t size);
   virtual int peek();
+  // Received bytes left in place, ready to be parsed: consume() the ones used
+  int peekSpan(const uint8_t **data);
+  void consume(size_t n);
   virtual void flush();
   virtual void stop();
   virtual uint8_t connected();
   virtual operator bool();
+  // Stream timeout and time given to the esp to answer the calls of this client (0: WiFi.setTimeout)
+  void setTimeout(unsigned long timeout);
 
   friend class WiFiServer;
 
   using Print::write;
+  using Print::print;
+  using Print::println;
 
 private:
   uint8_t _sock;
+  uint32_t _replyTimeout;
   uint8_t getFirstSocket();
 };
 
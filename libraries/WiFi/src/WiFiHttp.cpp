@@ -0,0 +1,951 @@
+/*
+  This library is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Lesser General Public
+  License as published by the Free Software Foundation; either
+  version 2.1 of the License, or (at your option) any later version.
+
+  This library is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with this library; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+#include "WiFiHttp.h"
+
+// offsets in the buffer are kept in a byte, 0xFF meaning none
+static_assert(WIFI_HTTP_BUF_LEN >= 16 && WIFI_HTTP_BUF_LEN < 255, "WIFI_HTTP_BUF_LEN has to be in 16..254");
+// the header names still matching are bits of a 16 bit mask (built with unsigned shifts),
+// after the 3 the parser looks at
+static_assert(WIFI_HTTP_MAX_HEADERS <= 13, "WIFI_HTTP_MAX_HEADERS can't be more than 13");
+static_assert(WIFI_HTTP_BODY_LEN > 0 && WIFI_HTTP_BODY_LEN <= 255, "WIFI_HTTP_BODY_LEN has to be in 1..255");
+
+#define NO_OFFSET		0xFF
+
+// parser states
+enum {
+	ST_METHOD = 0,
+	ST_TARGET,
+	ST_PCT_HI,			// first digit of a %XX escape
+	ST_PCT_LO,
+	ST_QUERY,
+	ST_VERSION,
+	ST_HDR_START,
+	ST_HDR_NAME,
+	ST_HDR_VALUE,
+	ST_HEADERS,			// request line and headers parsed, body not started
+	ST_BODY,
+	ST_CHUNK_DATA,
+	// chunk framing, parsed by feed() like the headers
+	ST_CHUNK_SIZE,
+	ST_CHUNK_EXT,
+	ST_CHUNK_END,
+	ST_TRAILER_START,
+	ST_TRAILER,
+	ST_DONE,
+	ST_ERROR,
+};
+
+// headers the parser looks at by itself, the collected ones follow
+#define HDR_LENGTH			0
+#define HDR_TE				1
+#define HDR_CONNECTION		2
+#define HDR_COLLECTED		3
+
+static const char _hdrLength[] PROGMEM = "content-length";
+static const char _hdrTe[] PROGMEM = "transfer-encoding";
+static const char _hdrConnection[] PROGMEM = "connection";
+
+// words looked for in the values of Transfer-Encoding and Connection
+#define WORD_CHUNKED		0x01
+#define WORD_CLOSE			0x02
+
+static const char _wordChunked[] PROGMEM = "chunked";
+static const char _wordClose[] PROGMEM = "close";
+
+// in the order of teHttpMethod
+static const char _methods[] PROGMEM = "GET\0HEAD\0POST\0PUT\0DELETE\0PATCH\0OPTIONS\0";
+static const char _version[] PROGMEM = "HTTP/1.";
+
+// -----------------------------------------------------------------
+static uint8_t lower(uint8_t c)
+{
+	return (c >= 'A' && c <= 'Z') ? c + ('a' - 'A') : c;
+}
+
+static int8_t hexValue(uint8_t c)
+{
+	if(c >= '0' && c <= '9')
+		return c - '0';
+	c = lower(c);
+	if(c >= 'a' && c <= 'f')
+		return c - 'a' + 10;
+	return -1;
+}
+
+// characters of a method or a header name
+static bool isToken(uint8_t c)
+{
+	if(c <= ' ' || c >= 0x7F)
+		return false;
+	switch(c){
+		case '"': case '(': case ')': case ',': case '/': case ':': case ';': case '<':
+		case '=': case '>': case '?': case '@': case '[': case '\\': case ']': case '{': case '}':
+			return false;
+	}
+	return true;
+}
+
+static PGM_P wordName(uint8_t word)
+{
+	return (word == WORD_CHUNKED) ? _wordChunked : _wordClose;
+}
+
+/* -----------------------------------------------------------------
+* Request parser
+*/
+WiFiHttpRequest::WiFiHttpRequest()
+{
+	_nHdr = 0;
+	_begin();
+}
+
+// -----------------------------------------------------------------
+bool WiFiHttpRequest::collect(const __FlashStringHelper* name)
+{
+	if(_nHdr >= WIFI_HTTP_MAX_HEADERS)
+		return false;
+
+	_hdrName[_nHdr] = (PGM_P)name;
+	_hdrVal[_nHdr] = NO_OFFSET;
+	_nHdr++;
+	return true;
+}
+
+// -----------------------------------------------------------------
+void WiFiHttpRequest::reset(void)
+{
+	_begin();
+}
+
+// -----------------------------------------------------------------
+void WiFiHttpRequest::_begin(void)
+{
+	_len = 0;
+	_nSeg = 0;
+	_query = NO_OFFSET;
+	memset(_hdrVal, NO_OFFSET, sizeof(_hdrVal));
+	_state = ST_METHOD;
+	_method = HTTP_UNKNOWN;
+	_flags = 0;
+	_pos = 0;
+	_cur = NO_OFFSET;
+	_match = 0;
+	_error = 0;
+	_length = 0;
+	_remain = 0;
+}
+
+// -----------------------------------------------------------------
+teHttpParse WiFiHttpRequest::parse(WiFiClient& client)
+{
+	const uint8_t* data;
+	int n;
+
+	// the previous request has been handed over: skip what is left of its body
+	if(_state >= ST_HEADERS && _state < ST_DONE){
+		uint8_t skip[16];
+
+		while(readBody(client, skip, sizeof(skip)) > 0);
+		if(_state != ST_DONE && _state != ST_ERROR)
+			return HTTP_MORE;
+	}
+	if(_state == ST_DONE)
+		_begin();
+
+	// parse the bytes where they are, in the receive buffer of the socket
+	while(_state < ST_HEADERS && (n = client.peekSpan(&data)) > 0)
+		client.consume(feed(data, n));
+
+	if(_state == ST_ERROR)
+		return HTTP_ERROR;
+	return (_state == ST_HEADERS) ? HTTP_HEADERS : HTTP_MORE;
+}
+
+// -----------------------------------------------------------------
+size_t WiFiHttpRequest::feed(const uint8_t* data, size_t len)
+{
+	size_t i = 0;
+
+	while(i < len && (_state < ST_HEADERS || (_state >= ST_CHUNK_SIZE && _state <= ST_TRAILER)))
+		_byte(data[i++]);
+	return i;
+}
+
+// -----------------------------------------------------------------
+int WiFiHttpRequest::readBody(WiFiClient& client, uint8_t* buf, size_t size)
+{
+	const uint8_t* data;
+	size_t n = 0;
+	int ret;
+
+	if(_state == ST_HEADERS)
+		_bodyStart();
+
+	while(n < size){
+		if(_state == ST_BODY || _state == ST_CHUNK_DATA){
+			ret = client.read(&buf[n], (size - n < _remain) ? size - n : _remain);
+			if(ret <= 0)
+				break;
+			n += ret;
+			_remain -= ret;
+			if(_remain == 0)
+				_state = (_state == ST_BODY) ? ST_DONE : ST_CHUNK_END;
+		}
+		else if(_state >= ST_CHUNK_SIZE && _state <= ST_TRAILER){
+			ret = client.peekSpan(&data);
+			if(ret <= 0)
+				break;
+			client.consume(feed(data, ret));
+		}
+		else
+			break;
+	}
+
+	if(_state == ST_ERROR && n == 0)
+		return -1;
+	return n;
+}
+
+// -----------------------------------------------------------------
+bool WiFiHttpRequest::bodyDone(void)
+{
+	if(_state == ST_HEADERS)
+		_bodyStart();
+	return _state == ST_DONE;
+}
+
+// -----------------------------------------------------------------
+const char* WiFiHttpRequest::segment(uint8_t i)
+{
+	return (i < _nSeg) ? &_buf[_seg[i]] : NULL;
+}
+
+bool WiFiHttpRequest::segmentIs(uint8_t i, const __FlashStringHelper* str)
+{
+	const char* s = segment(i);
+
+	return s != NULL && strcmp_P(s, (PGM_P)str) == 0;
+}
+
+const char* WiFiHttpRequest::query(void)
+{
+	return (_query == NO_OFFSET) ? NULL : &_buf[_query];
+}
+
+const char* WiFiHttpRequest::header(uint8_t i)
+{
+	return (i < _nHdr && _hdrVal[i] != NO_OFFSET) ? &_buf[_hdrVal[i]] : NULL;
+}
+
+// -----------------------------------------------------------------
+bool WiFiHttpRequest::_fail(uint16_t code)
+{
+	_error = code;
+	_state = ST_ERROR;
+	return false;
+}
+
+bool WiFiHttpRequest::_store(char c)
+{
+	if(_len >= WIFI_HTTP_BUF_LEN)
+		return false;
+
+	_buf[_len++] = c;
+	return true;
+}
+
+PGM_P WiFiHttpRequest::_name(uint8_t i)
+{
+	switch(i){
+		case HDR_LENGTH:
+			return _hdrLength;
+		case HDR_TE:
+			return _hdrTe;
+		case HDR_CONNECTION:
+			return _hdrConnection;
+	}
+	return _hdrName[i - HDR_COLLECTED];
+}
+
+// -----------------------------------------------------------------
+bool WiFiHttpRequest::_byte(uint8_t c)
+{
+	switch(_state){
+		case ST_METHOD:
+			return _parseMethod(c);
+		case ST_TARGET:
+		case ST_PCT_HI:
+		case ST_PCT_LO:
+		case ST_QUERY:
+			return _parseTarget(c);
+		case ST_VERSION:
+			return _parseVersion(c);
+		case ST_HDR_START:
+		case ST_HDR_NAME:
+			return _parseName(c);
+		case ST_HDR_VALUE:
+			return _parseValue(c);
+		case ST_CHUNK_SIZE:
+		case ST_CHUNK_EXT:
+		case ST_CHUNK_END:
+		case ST_TRAILER_START:
+		case ST_TRAILER:
+			return _parseChunk(c);
+	}
+	return false;
+}
+
+// -----------------------------------------------------------------
+bool WiFiHttpRequest::_parseMethod(uint8_t c)
+{
+	if(c == ' '){
+		if(_len == 0)
+			return _fail(400);
+
+		// an unknown method is left to the sketch (HTTP_UNKNOWN)
+		PGM_P m = _methods;
+		for(uint8_t i = HTTP_GET; pgm_read_byte(m); i++){
+			uint8_t n = strlen_P(m);
+			if(n == _len && strncmp_P(_buf, m, n) == 0){
+				_method = i;
+				break;
+			}
+			m += n + 1;
+		}
+		_len = 0;
+		_pos = 0;
+		_state = ST_TARGET;
+		return true;
+	}
+	if(!isToken(c))
+		return _fail(400);
+
+	// longer than OPTIONS: it can't match any more
+	if(_len < 8)
+		_buf[_len++] = c;
+	return true;
+}
+
+/* -----------------------------------------------------------------
+* Request target. _pos is 0 before its first character, 1 after a '/' and
+* 2 inside a segment. Each segment is stored with its NUL, the query too.
+*/
+bool WiFiHttpRequest::_parseTarget(uint8_t c)
+{
+	switch(_state){
+		case ST_PCT_HI:
+		case ST_PCT_LO:{
+			int8_t v = hexValue(c);
+
+			if(v < 0)
+				return _fail(400);
+			if(_state == ST_PCT_HI){
+				// high digit kept until the low one comes
+				_cur = v;
+				_state = ST_PCT_LO;
+				return true;
+			}
+			c = (_cur << 4) | v;
+			_cur = NO_OFFSET;
+			_state = ST_TARGET;
+			// a NUL would cut the segment
+			if(c == 0)
+				return _fail(400);
+		}
+		break;
+
+		case ST_QUERY:
+			if(c == ' '){
+				if(!_store(0))
+					return _fail(414);
+				_pos = 0;
+				_state = ST_VERSION;
+				return true;
+			}
+			if(c <= ' ' || c >= 0x7F)
+				return _fail(400);
+			return _store(c) || _fail(414);
+
+		default:
+			// origin form, or '*' for OPTIONS
+			if(_pos == 0){
+				if(c != '/' && c != '*')
+					return _fail(400);
+				_pos = 1;
+				return true;
+			}
+			if(c == ' ' || c == '?'){
+				if(_pos == 2 && !_store(0))
+					return _fail(414);
+				_pos = 0;
+				if(c == '?'){
+					_query = _len;
+					_state = ST_QUERY;
+				}
+				else
+					_state = ST_VERSION;
+				return true;
+			}
+			if(c == '/'){
+				if(_pos == 2){
+					if(!_store(0))
+						return _fail(414);
+					_pos = 1;
+				}
+				return true;
+			}
+			if(c == '%'){
+				_state = ST_PCT_HI;
+				return true;
+			}
+			if(c <= ' ' || c >= 0x7F)
+				return _fail(400);
+		break;
+	}
+
+	// character of a segment, the first one opens it
+	if(_pos != 2){
+		if(_nSeg >= WIFI_HTTP_MAX_SEGMENTS)
+			return _fail(414);
+		_seg[_nSeg++] = _len;
+		_pos = 2;
+	}
+	return _store(c) || _fail(414);
+}
+
+// -----------------------------------------------------------------
+bool WiFiHttpRequest::_parseVersion(uint8_t c)
+{
+	if(c == '\r')
+		return true;
+
+	if(_pos < sizeof(_version) - 1){
+		if(c != pgm_read_byte(&_version[_pos]))
+			// HTTP/2 and others
+			return _fail((_pos >= 5) ? 505 : 400);
+		_pos++;
+		return true;
+	}
+	if(_pos == sizeof(_version) - 1){
+		if(c < '0' || c > '9')
+			return _fail(400);
+		// 1.1 and later keep the connection open by default
+		if(c >= '1')
+			_flags |= HF_HTTP11 | HF_KEEP_ALIVE;
+		_pos++;
+		return true;
+	}
+	if(c != '\n')
+		return _fail(400);
+
+	_state = ST_HDR_START;
+	return true;
+}
+
+/* -----------------------------------------------------------------
+* Header name, matched against all the known ones at the same time: the
+* bits of _match are the names still matching the characters seen so far.
+*/
+bool WiFiHttpRequest::_parseName(uint8_t c)
+{
+	uint8_t n = HDR_COLLECTED + _nHdr;
+
+	if(_state == ST_HDR_START){
+		if(c == '\r')
+			return true;
+		if(c == '\n'){
+			_headersEnd();
+			return _state != ST_ERROR;
+		}
+		// obsolete line folding
+		if(c == ' ' || c == '\t')
+			return _fail(400);
+		_match = (uint16_t)((1UL << n) - 1);
+		_pos = 0;
+		_state = ST_HDR_NAME;
+	}
+
+	if(c == ':'){
+		if(_pos == 0)
+			return _fail(400);
+
+		_cur = NO_OFFSET;
+		for(uint8_t i = 0; i < n; i++){
+			if((_match & (uint16_t)(1U << i)) && pgm_read_byte(&_name(i)[_pos]) == 0){
+				_cur = i;
+				break;
+			}
+		}
+
+		if(_cur == HDR_LENGTH){
+			// a second length could differ from the first one
+			if(_flags & HF_LENGTH)
+				return _fail(400);
+			_length = 0;
+		}
+		else if(_cur != NO_OFFSET && _cur >= HDR_COLLECTED){
+			// the first value is kept
+			if(_hdrVal[_cur - HDR_COLLECTED] != NO_OFFSET)
+				_cur = NO_OFFSET;
+			else
+				_hdrVal[_cur - HDR_COLLECTED] = _len;
+		}
+
+		_match = (_cur == HDR_TE) ? WORD_CHUNKED : (_cur == HDR_CONNECTION) ? WORD_CLOSE : 0;
+		_pos = 0;
+		_flags = (_flags | HF_OWS) & ~HF_TOKEN_END;
+		_state = ST_HDR_VALUE;
+		return true;
+	}
+	if(!isToken(c))
+		return _fail(400);
+
+	c = lower(c);
+	for(uint8_t i = 0; i < n; i++){
+		if((_match & (uint16_t)(1U << i)) && lower(pgm_read_byte(&_name(i)[_pos])) != c)
+			_match &= (uint16_t)~(1U << i);
+	}
+	// past the longest name only the count matters
+	_pos = _match ? _pos + 1 : 1;
+	return true;
+}
+
+// -----------------------------------------------------------------
+bool WiFiHttpRequest::_parseValue(uint8_t c)
+{
+	bool ows = (c == ' ' || c == '\t');
+
+	if(c == '\r')
+		return true;
+	if(c == '\n'){
+		_valueEnd();
+		if(_state == ST_ERROR)
+			return false;
+		_state = ST_HDR_START;
+		return true;
+	}
+	if(!ows && (c < ' ' || c == 0x7F))
+		return _fail(400);
+
+	// white space before the value
+	if(ows && (_flags & HF_OWS))
+		return true;
+	_flags &= ~HF_OWS;
+
+	switch(_cur){
+		case HDR_LENGTH:
+			if(ows){
+				_flags |= HF_TOKEN_END;
+				return true;
+			}
+			if(c < '0' || c > '9' || (_flags & HF_TOKEN_END))
+				return _fail(400);
+			if(_length > 99999999)
+				return _fail(413);
+			_length = _length * 10 + (c - '0');
+			_pos = 1;
+		break;
+
+		case HDR_TE:
+		case HDR_CONNECTION:
+			_valueToken(c);
+		break;
+
+		case NO_OFFSET:
+		break;
+
+		default:
+			return _store(c) || _fail(431);
+	}
+	return true;
+}
+
+/* -----------------------------------------------------------------
+* Comma separated list of Transfer-Encoding or Connection, each element
+* matched against the words of the header in _match
+*/
+void WiFiHttpRequest::_valueToken(uint8_t c)
+{
+	if(c == ','){
+		_valueEnd();
+		_match = (_cur == HDR_TE) ? WORD_CHUNKED : WORD_CLOSE;
+		_pos = 0;
+		_flags &= ~HF_TOKEN_END;
+		return;
+	}
+	if(c == ' ' || c == '\t'){
+		if(_pos)
+			_flags |= HF_TOKEN_END;
+		return;
+	}
+	// "a b" is none of the words
+	if(_flags & HF_TOKEN_END)
+		_match = 0;
+
+	c = lower(c);
+	for(uint8_t w = WORD_CHUNKED; w <= WORD_CLOSE; w <<= 1){
+		if((_match & w) && pgm_read_byte(&wordName(w)[_pos]) != c)
+			_match &= ~w;
+	}
+	if(_pos < 255)
+		_pos++;
+}
+
+// -----------------------------------------------------------------
+void WiFiHttpRequest::_valueEnd(void)
+{
+	uint8_t word = 0;
+
+	switch(_cur){
+		case HDR_LENGTH:
+			if(_pos == 0)
+				_fail(400);
+			else
+				_flags |= HF_LENGTH;
+		break;
+
+		case HDR_TE:
+		case HDR_CONNECTION:
+			// an empty element of the list
+			if(_pos == 0)
+				break;
+			for(uint8_t w = WORD_CHUNKED; w <= WORD_CLOSE; w <<= 1){
+				if((_match & w) && pgm_read_byte(&wordName(w)[_pos]) == 0)
+					word = w;
+			}
+			if(_cur == HDR_TE){
+				// chunked has to be the last coding
+				_flags |= HF_TE_OTHER;
+				if(word == WORD_CHUNKED)
+					_flags |= HF_TE_CHUNKED;
+				else
+					_flags &= ~HF_TE_CHUNKED;
+			}
+			else if(word == WORD_CLOSE)
+				_flags &= ~HF_KEEP_ALIVE;
+		break;
+
+		case NO_OFFSET:
+		break;
+
+		default:
+			// trailing white space
+			while(_len > _hdrVal[_cur - HDR_COLLECTED] && (_buf[_len - 1] == ' ' || _buf[_len - 1] == '\t'))
+				_len--;
+			if(!_store(0))
+				_fail(431);
+		break;
+	}
+}
+
+// -----------------------------------------------------------------
+void WiFiHttpRequest::_headersEnd(void)
+{
+	if(_flags & HF_TE_OTHER){
+		if(!(_flags & HF_TE_CHUNKED)){
+			_fail(501);
+			return;
+		}
+		// both of them: a way to smuggle a request
+		if(_flags & HF_LENGTH){
+			_fail(400);
+			return;
+		}
+		_flags |= HF_CHUNKED;
+	}
+	_cur = NO_OFFSET;
+	_state = ST_HEADERS;
+}
+
+// -----------------------------------------------------------------
+void WiFiHttpRequest::_bodyStart(void)
+{
+	_remain = 0;
+	_pos = 0;
+	if(_flags & HF_CHUNKED)
+		_state = ST_CHUNK_SIZE;
+	else if(_length > 0){
+		_remain = _length;
+		_state = ST_BODY;
+	}
+	else
+		_state = ST_DONE;
+}
+
+/* -----------------------------------------------------------------
+* Chunk size line, end of the chunk data and trailer. The size is counted
+* in _remain, _pos tells if a digit has been seen.
+*/
+bool WiFiHttpRequest::_parseChunk(uint8_t c)
+{
+	switch(_state){
+		case ST_CHUNK_SIZE:{
+			int8_t v = hexValue(c);
+
+			if(c == '\r')
+				return true;
+			if(v >= 0){
+				if(_remain > 0x0FFFFFFF)
+					return _fail(413);
+				_remain = (_remain << 4) | v;
+				_pos = 1;
+				return true;
+			}
+			if(_pos == 0)
+				return _fail(400);
+			if(c == ';' || c == ' ' || c == '\t'){
+				_state = ST_CHUNK_EXT;
+				return true;
+			}
+			if(c != '\n')
+				return _fail(400);
+		}
+		break;
+
+		// chunk extensions are skipped
+		case ST_CHUNK_EXT:
+			if(c != '\n')
+				return true;
+		break;
+
+		case ST_CHUNK_END:
+			if(c == '\r')
+				return true;
+			if(c != '\n')
+				return _fail(400);
+			_remain = 0;
+			_pos = 0;
+			_state = ST_CHUNK_SIZE;
+			return true;
+
+		case ST_TRAILER_START:
+			if(c == '\r')
+				return true;
+			_state = (c == '\n') ? ST_DONE : ST_TRAILER;
+			return true;
+
+		case ST_TRAILER:
+			if(c == '\n')
+				_state = ST_TRAILER_START;
+			return true;
+	}
+
+	// end of the size line, the last chunk is empty
+	_state = _remain ? ST_CHUNK_DATA : ST_TRAILER_START;
+	return true;
+}
+
+/* -----------------------------------------------------------------
+* Response writer
+*/
+
+// "NNN Reason\r\n" of the status codes, one after the other
+static const char _reasons[] PROGMEM =
+	"200 OK\r\n\0"
+	"201 Created\r\n\0"
+	"204 No Content\r\n\0"
+	"400 Bad Request\r\n\0"
+	"404 Not Found\r\n\0"
+	"405 Method Not Allowed\r\n\0"
+	"413 Payload Too Large\r\n\0"
+	"414 URI Too Long\r\n\0"
+	"431 Request Header Fields Too Large\r\n\0"
+	"500 Internal Server Error\r\n\0"
+	"501 Not Implemented\r\n\0"
+	"505 HTTP Version Not Supported\r\n\0";
+
+static const char _statusStart[] PROGMEM = "HTTP/1.1 ";
+static const char _lineEnd[] PROGMEM = "\r\n";
+static const char _connKeepAlive[] PROGMEM = "Connection: keep-alive\r\n";
+static const char _connClose[] PROGMEM = "Connection: close\r\n";
+static const char _contentLength[] PROGMEM = "Content-Length: ";
+static const char _teChunked[] PROGMEM = "Transfer-Encoding: chunked\r\n\r\n";
+// end of the chunk data, then the last chunk
+static const char _lastChunk[] PROGMEM = "\r\n0\r\n\r\n";
+
+// -----------------------------------------------------------------
+static uint8_t numText(char* p, uint16_t n, uint8_t base)
+{
+	char digits[5];
+	uint8_t len = 0, i = 0;
+
+	do{
+		uint8_t d = n % base;
+		digits[len++] = (d < 10) ? '0' + d : 'a' + d - 10;
+		n /= base;
+	}while(n);
+
+	while(len)
+		p[i++] = digits[--len];
+	return i;
+}
+
+// -----------------------------------------------------------------
+WiFiHttpResponse::WiFiHttpResponse(WiFiClient& client) : _client(client)
+{
+	_iovCnt = 0;
+	_bodyLen = 0;
+	_keepAlive = false;
+	_sent = false;
+	_ok = true;
+}
+
+// -----------------------------------------------------------------
+void WiFiHttpResponse::begin(uint16_t code, bool keepAlive)
+{
+	PGM_P r = _reasons;
+
+	_iovCnt = 0;
+	_bodyLen = 0;
+	_keepAlive = keepAlive;
+	_sent = false;
+	_ok = true;
+
+	_add(_statusStart, sizeof(_statusStart) - 1, true);
+	while(pgm_read_byte(r)){
+		uint16_t c = (pgm_read_byte(&r[0]) - '0') * 100 + (pgm_read_byte(&r[1]) - '0') * 10 + (pgm_read_byte(&r[2]) - '0');
+		if(c == code)
+			break;
+		r += strlen_P(r) + 1;
+	}
+	if(pgm_read_byte(r)){
+		_add(r, strlen_P(r), true);
+		return;
+	}
+
+	// no reason known: the code alone
+	if(code > 999)
+		code = 500;
+	uint8_t n = numText(_num, code, 10);
+	memcpy(&_num[n], " \r\n", 3);
+	_add(_num, n + 3, false);
+}
+
+// -----------------------------------------------------------------
+bool WiFiHttpResponse::header(const __FlashStringHelper* line)
+{
+	if(_sent || _iovCnt + 2 > 2 + 2 * WIFI_HTTP_RESP_HEADERS)
+		return false;
+
+	_add(line, strlen_P((PGM_P)line), true);
+	_add(_lineEnd, 2, true);
+	return true;
+}
+
+bool WiFiHttpResponse::header(const char* line)
+{
+	if(_sent || _iovCnt + 2 > 2 + 2 * WIFI_HTTP_RESP_HEADERS)
+		return false;
+
+	_add(line, strlen(line), false);
+	_add(_lineEnd, 2, true);
+	return true;
+}
+
+// -----------------------------------------------------------------
+size_t WiFiHttpResponse::write(uint8_t b)
+{
+	return write(&b, 1);
+}
+
+size_t WiFiHttpResponse::write(const uint8_t* buf, size_t size)
+{
+	size_t n = 0;
+
+	while(n < size){
+		// full: what is there goes out, the rest of the response is streamed
+		if(_bodyLen == WIFI_HTTP_BODY_LEN && !_send(false))
+			break;
+
+		uint8_t k = (size - n < (size_t)(WIFI_HTTP_BODY_LEN - _bodyLen)) ? size - n : WIFI_HTTP_BODY_LEN - _bodyLen;
+		memcpy(&_body[_bodyLen], &buf[n], k);
+		_bodyLen += k;
+		n += k;
+	}
+	return n;
+}
+
+// -----------------------------------------------------------------
+bool WiFiHttpResponse::end(void)
+{
+	// streamed up to the connection close: nothing left to tell
+	if(_sent && !_keepAlive && _bodyLen == 0)
+		return _ok;
+
+	return _send(true);
+}
+
+// -----------------------------------------------------------------
+void WiFiHttpResponse::_add(const void* data, uint16_t len, bool progmem)
+{
+	if(_iovCnt >= sizeof(_iov) / sizeof(_iov[0]))
+		return;
+
+	_iov[_iovCnt].data = (const uint8_t*)data;
+	_iov[_iovCnt].len = len;
+	_iov[_iovCnt].progmem = progmem;
+	_iovCnt++;
+}
+
+/* -----------------------------------------------------------------
+* Send the headers not sent yet and the body collected so far as a single
+* data packet. The body is chunked once it doesn't fit in _body, unless the
+* connection is closed after the response.
+*/
+bool WiFiHttpResponse::_send(bool last)
+{
+	bool chunked = _keepAlive && (_sent || !last);
+	char* num = &_num[16];
+
+	if(!_sent){
+		_add(_keepAlive ? _connKeepAlive : _connClose, _keepAlive ? sizeof(_connKeepAlive) - 1 : sizeof(_connClose) - 1, true);
+		if(last){
+			// the whole body is here
+			uint8_t n = numText(num, _bodyLen, 10);
+			memcpy(&num[n], "\r\n\r\n", 4);
+			_add(_contentLength, sizeof(_contentLength) - 1, true);
+			_add(num, n + 4, false);
+		}
+		else if(chunked)
+			_add(_teChunked, sizeof(_teChunked) - 1, true);
+		else
+			_add(_lineEnd, 2, true);
+	}
+
+	if(_bodyLen > 0){
+		if(chunked){
+			uint8_t n = numText(num, _bodyLen, 16);
+			memcpy(&num[n], "\r\n", 2);
+			_add(num, n + 2, false);
+		}
+		_add(_body, _bodyLen, false);
+	}
+	if(chunked){
+		if(last)
+			_add(&_lastChunk[(_bodyLen > 0) ? 0 : 2], (_bodyLen > 0) ? sizeof(_lastChunk) - 1 : sizeof(_lastChunk) - 3, true);
+		else if(_bodyLen > 0)
+			_add(_lineEnd, 2, true);
+	}
+
+	if(_iovCnt > 0 && _client.writev(_iov, _iovCnt) == 0)
+		_ok = false;
+
+	_iovCnt = 0;
+	_bodyLen = 0;
+	_sent = true;
+	return _ok;
+}
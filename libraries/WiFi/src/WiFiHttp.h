@@ -0,0 +1,224 @@
+/*
+  This library is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Lesser General Public
+  License as published by the Free Software Foundation; either
+  version 2.1 of the License, or (at your option) any later version.
+
+  This library is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with this library; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+#ifndef WIFI_HTTP_H
+#define WIFI_HTTP_H
+
+#include "Arduino.h"
+#include "Print.h"
+#include "WiFiClient.h"
+#include "utility/definitions.h"
+
+typedef enum {
+	HTTP_UNKNOWN = 0,
+	HTTP_GET,
+	HTTP_HEAD,
+	HTTP_POST,
+	HTTP_PUT,
+	HTTP_DELETE,
+	HTTP_PATCH,
+	HTTP_OPTIONS,
+} teHttpMethod;
+
+typedef enum {
+	HTTP_MORE = 0,		// the request is not complete yet, call parse() again
+	HTTP_HEADERS,		// request line and headers received: the body can be read
+	HTTP_ERROR,			// malformed or too long: answer with error()
+} teHttpParse;
+
+/*  -----------------------------------------------------------------
+* Streaming HTTP/1.1 request parser. The bytes are parsed where they are, in
+* the receive buffer of the socket, and only the path segments, the query and
+* the values of the headers asked with collect() are kept, in a buffer of
+* WIFI_HTTP_BUF_LEN bytes. Nothing is allocated.
+*
+* The body (Content-Length or chunked) is left in the socket for readBody().
+* On a keep-alive connection parse() skips what is left of it and goes on
+* with the next request.
+*/
+class WiFiHttpRequest
+{
+	public:
+	WiFiHttpRequest();
+
+	/*
+	* Keep the value of the header called name (in flash, any case). The
+	* headers are numbered in the order they are added, see header()
+	*
+	* return: false if WIFI_HTTP_MAX_HEADERS are already collected
+	*/
+	bool collect(const __FlashStringHelper* name);
+
+	/*
+	* Forget the request being parsed, i.e. when a new connection starts
+	*/
+	void reset(void);
+
+	/*
+	* Parse the bytes the client has received so far, without waiting for
+	* more. Called again after HTTP_HEADERS it starts the next request.
+	*/
+	teHttpParse parse(WiFiClient& client);
+
+	/*
+	* Parse the request line and the headers out of len bytes, i.e. of a
+	* buffer filled by the sketch
+	*
+	* return: number of bytes used, the ones after the headers are left
+	*/
+	size_t feed(const uint8_t* data, size_t len);
+
+	/*
+	* Read up to size bytes of the body, without the chunk framing
+	*
+	* return: bytes read, 0 if none is available yet or the body is over
+	* (bodyDone()), -1 on a malformed chunk
+	*/
+	int readBody(WiFiClient& client, uint8_t* buf, size_t size);
+	bool bodyDone(void);
+
+	teHttpMethod method(void) { return (teHttpMethod)_method; }
+
+	/*
+	* Path segments, percent decoded: "/jolly/digital/9" has "jolly",
+	* "digital" and "9". NULL past the last one
+	*/
+	uint8_t segments(void) { return _nSeg; }
+	const char* segment(uint8_t i);
+	bool segmentIs(uint8_t i, const __FlashStringHelper* str);
+
+	// query string without the '?', NULL if the target has none
+	const char* query(void);
+
+	// value of the i-th collected header, NULL if the request hasn't it
+	const char* header(uint8_t i);
+
+	uint32_t contentLength(void) { return _length; }
+	bool chunked(void) { return _flags & HF_CHUNKED; }
+	// the client wants the connection kept open after the response
+	bool keepAlive(void) { return _flags & HF_KEEP_ALIVE; }
+
+	// status code to answer a request that gave HTTP_ERROR
+	uint16_t error(void) { return _error; }
+
+	private:
+	// request flags
+	enum {
+		HF_HTTP11 = 0x01,
+		HF_KEEP_ALIVE = 0x02,
+		HF_CHUNKED = 0x04,
+		HF_LENGTH = 0x08,
+		HF_OWS = 0x10,			// skipping the white space before a header value
+		HF_TOKEN_END = 0x20,	// white space after a token of a header value
+		HF_TE_CHUNKED = 0x40,	// the last transfer coding seen is chunked
+		HF_TE_OTHER = 0x80,		// a transfer coding has been seen
+	};
+
+	char _buf[WIFI_HTTP_BUF_LEN];
+	uint8_t _len;
+	uint8_t _seg[WIFI_HTTP_MAX_SEGMENTS];
+	uint8_t _nSeg;
+	uint8_t _query;
+	PGM_P _hdrName[WIFI_HTTP_MAX_HEADERS];
+	uint8_t _hdrVal[WIFI_HTTP_MAX_HEADERS];
+	uint8_t _nHdr;
+
+	uint8_t _state;
+	uint8_t _method;
+	uint8_t _flags;
+	uint8_t _pos;			// position in the token being matched
+	uint8_t _cur;			// header whose value is being parsed
+	uint16_t _match;		// header names, or words of a value, still matching
+	uint16_t _error;
+	uint32_t _length;
+	uint32_t _remain;		// body bytes of the packet or of the chunk still to come
+
+	void _begin(void);
+	bool _fail(uint16_t code);
+	bool _store(char c);
+	PGM_P _name(uint8_t i);
+	bool _byte(uint8_t c);
+	bool _parseMethod(uint8_t c);
+	bool _parseTarget(uint8_t c);
+	bool _parseVersion(uint8_t c);
+	bool _parseName(uint8_t c);
+	bool _parseValue(uint8_t c);
+	bool _parseChunk(uint8_t c);
+	void _valueToken(uint8_t c);
+	void _valueEnd(void);
+	void _headersEnd(void);
+	void _bodyStart(void);
+};
+
+/*  -----------------------------------------------------------------
+* HTTP response writer. Status line, headers and body are sent together as
+* a single data packet by end(), with the Content-Length filled in. A body
+* longer than WIFI_HTTP_BODY_LEN bytes goes out in chunks on a keep-alive
+* connection, and up to the connection close otherwise.
+*
+* The header lines added are not copied: the strings have to stay valid up
+* to end().
+*/
+class WiFiHttpResponse : public Print
+{
+	public:
+	WiFiHttpResponse(WiFiClient& client);
+
+	/*
+	* Start the response with its status code. keepAlive leaves the
+	* connection open for the next request (WiFiHttpRequest::keepAlive())
+	*/
+	void begin(uint16_t code, bool keepAlive = false);
+
+	/*
+	* Add a header line, without the line end, i.e. F("Content-Type: text/plain")
+	*
+	* return: false if WIFI_HTTP_RESP_HEADERS are already added
+	*/
+	bool header(const __FlashStringHelper* line);
+	bool header(const char* line);
+
+	// body bytes
+	virtual size_t write(uint8_t b);
+	virtual size_t write(const uint8_t* buf, size_t size);
+	using Print::write;
+
+	/*
+	* Send what is left of the response
+	*
+	* return: false if some part of it couldn't be sent
+	*/
+	bool end(void);
+
+	private:
+	// status line (2), headers (line and line end), connection, length (2) or chunk line
+	// and transfer coding, body, chunk end
+	tsIoVec _iov[2 + 2 * WIFI_HTTP_RESP_HEADERS + 5];
+	WiFiClient& _client;
+	uint8_t _iovCnt;
+	uint8_t _body[WIFI_HTTP_BODY_LEN];
+	uint8_t _bodyLen;
+	// reason of an unknown status code, then length in decimal or chunk size in hex
+	char _num[2 * 16];
+	bool _keepAlive;
+	bool _sent;			// status line and headers have gone out
+	bool _ok;
+
+	void _add(const void* data, uint16_t len, bool progmem);
+	bool _send(bool last);
+};
+
+#endif
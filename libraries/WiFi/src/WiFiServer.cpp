@@ -17,6 +17,7 @@
 #include <string.h>
 #include <WiFi.h>
 #include "utility/packager.h"
+#include "utility/spi/spi_drv.h"
 
 #include "WiFiServer.h"
 
@@ -44,27 +45,75 @@ void WiFiServer::begin()
 			}
 		}
 
-		// Poll response for the next 10 seconds. If nothing happens print an error
-		uint32_t start = millis();
-		while(((millis() - start) < GENERAL_TIMEOUT)){
-			WiFiClass::handleEvents();
-			if(WiFiClass::gotResponse && WiFiClass::responseType == START_SERVER_TCP_CMD){
-				if(WiFiClass::data[0] != 0){
-					WiFiClass::_server_port[_sock] = _port;
-					return;
-				}
-				break;
+		// Poll response until timeout. If nothing happens print an error
+		if(WiFiClass::waitResponse(START_SERVER_TCP_CMD)){
+			if(WiFiClass::data[0] != 0){
+				WiFiClass::bindSocket(_sock, _port);
+				return;
 			}
 		}
 		Serial.println("Error while starting server");
     }
 }
 
-WiFiClient WiFiServer::available(byte* status)
+void WiFiServer::end()
 {
+	// without WIFI_CAP_STOP_SERVER the esp keeps listening until the socket is taken again
+	bool listen = (commDrv.caps() & WIFI_CAP_STOP_SERVER) != 0;
+
 	WiFiClass::handleEvents();
-	// search for a socket with a client request
+
+	for (tSockMask m = WiFiClass::_sockBound; m; m &= m - 1) {
+		uint8_t sock = WiFiClass::firstSock(m);
+		if (WiFiClass::_server_port[sock] != _port)
+			continue;
+
+		// don't lose the bytes still queued for a client
+		WiFiClass::txBufFlush(sock);
+		WiFiClass::txBufClear(sock);
+
+		WiFiClass::gotResponse = false;
+		WiFiClass::responseType = NONE;
+
+		bool sent = Packager::stopClient(sock, listen);
+		if(!sent){ // packet has not been sent. Maybe an interrupt occurred in the meantime
+			// launch interrupt management function, then try to send request again
+			WiFiClass::handleEvents();
+			sent = Packager::stopClient(sock, listen);
+		}
+		// Poll flags until we got a response or timeout occurs
+		if(sent)
+			WiFiClass::waitResponse(STOP_CLIENT_TCP_CMD);
+
+		// released even if the esp didn't get the command: begin() and connect() start over on it
+		WiFiClass::setSockState(sock, CLOSED);
+		WiFiClass::_client_data[sock] = 0;
+		WiFiClass::_sockEvents[sock] = 0;
+		WiFiClass::rxBufClear(sock);
+		WiFiClass::bindSocket(sock, 0);
+	}
+}
+
+WiFiClient WiFiServer::available(byte*)
+{
+	WiFiClass::handleEvents();
+
+	// the socket table is kept up to date by the esp events or refreshed by a single batch request
+	if(WiFiClass::sockEvents() || WiFiClass::pollSockets()){
+		// search for a socket of ours with a client request
+		for(tSockMask m = WiFiClass::_sockBound; m; m &= m - 1){
+			uint8_t i = WiFiClass::firstSock(m);
+			if(WiFiClass::sockState(i) == ESTABLISHED && WiFiClass::_server_port[i] == _port)
+				return WiFiClient(i);
+		}
+		return WiFiClient(255);
+	}
+
+	// esp doesn't support batch requests, ask socket by socket
 	for(uint8_t i = 0; i < MAX_SOCK_NUM; i++){
+		if(WiFiClass::_server_port[i] != _port)
+			continue;
+
 		WiFiClass::gotResponse = false;
 		WiFiClass::responseType = NONE;
 
@@ -76,17 +125,10 @@ WiFiClient WiFiServer::available(byte* status)
 		}
 
 		// Poll flags until we got a response or timeout occurs
-		uint32_t start = millis();
-		while(((millis() - start) < GENERAL_TIMEOUT)){
-			WiFiClass::handleEvents();
-			if(WiFiClass::gotResponse && WiFiClass::responseType == GET_CLIENT_STATE_TCP_CMD){
-				if(WiFiClass::_state[i] == ESTABLISHED){ // there is a client request
-					if(WiFiClass::_server_port[i] == _port){ // request refers to our socket
-						WiFiClient client(i);
-						return client;
-					}
-				}
-				break;
+		if(WiFiClass::waitResponse(GET_CLIENT_STATE_TCP_CMD)){
+			if(WiFiClass::sockState(i) == ESTABLISHED){ // there is a client request
+				WiFiClient client(i);
+				return client;
 			}
 		}
 	}
@@ -108,14 +150,9 @@ uint8_t WiFiServer::status()
 		}
 	}
     
-	// Poll response for the next 10 seconds. If nothing happens return 0
-	uint32_t start = millis();
-	while(((millis() - start) < GENERAL_TIMEOUT)){
-		WiFiClass::handleEvents();
-		if(WiFiClass::gotResponse && WiFiClass::responseType == GET_STATE_TCP_CMD){
-			return WiFiClass::data[0];
-			break;
-		}
+	// Poll response until timeout. If nothing happens return 0
+	if(WiFiClass::waitResponse(GET_STATE_TCP_CMD)){
+		return WiFiClass::data[0];
 	}
 	return 0;
 }
@@ -126,12 +163,64 @@ size_t WiFiServer::write(uint8_t b)
     return write(&b, 1);
 }
 
+size_t WiFiServer::write_P(const uint8_t *pgm, size_t len)
+{
+	size_t n = 0;
+
+	WiFiClass::handleEvents();
+
+	for (int sock = 0; sock < MAX_SOCK_NUM; sock++) {
+		if (WiFiClass::_server_port[sock] == _port) {
+			WiFiClient client(sock);
+			n += client.write_P(pgm, len);
+		}
+	}
+	return n;
+}
+
+size_t WiFiServer::print(const __FlashStringHelper *str)
+{
+	return write_P((const uint8_t*)str, strlen_P((PGM_P)str));
+}
+
 size_t WiFiServer::write(const uint8_t *buffer, size_t size)
 {
 	size_t n = 0;
 
 	WiFiClass::handleEvents();
 
+#if MAX_SOCK_NUM <= 8
+	// the esp copies the data to every client: a single transfer instead of one per client
+	uint8_t mask = 0;
+	uint8_t clients = 0;
+
+	for (tSockMask m = WiFiClass::_sockBound; m; m &= m - 1) {
+		uint8_t sock = WiFiClass::firstSock(m);
+		if (WiFiClass::_server_port[sock] == _port) {
+			mask |= (1 << sock);
+			clients++;
+		}
+	}
+	if (clients > 1 && (commDrv.caps() & WIFI_CAP_SEND_MULTI)) {
+		// bytes queued for a client have to go out first
+		for (uint8_t sock = 0; sock < MAX_SOCK_NUM; sock++) {
+			if ((mask & (1 << sock)) && !WiFiClass::txBufFlush(sock)) {
+				mask &= ~(1 << sock);
+				clients--;
+			}
+		}
+		if (mask == 0)
+			return 0;
+		if(!Packager::sendDataMulti(mask, buffer, size)){ // packet has not been sent. Maybe an interrupt occurred in the meantime
+			// launch interrupt management function, then try to send request again
+			WiFiClass::handleEvents();
+			if(!Packager::sendDataMulti(mask, buffer, size)) // exit if another error occurs
+				return 0;
+		}
+		return size * clients;
+	}
+#endif
+
     for (int sock = 0; sock < MAX_SOCK_NUM; sock++) {
         if (WiFiClass::_server_port[sock] != 0) {
         	WiFiClient client(sock);
@@ -30,11 +30,17 @@ public:
   WiFiServer(uint16_t);
   WiFiClient available(uint8_t* status = NULL);
   void begin();
+  // Release the sockets of the server, the clients it accepted are closed
+  void end();
   virtual size_t write(uint8_t);
   virtual size_t write(const uint8_t *buf, size_t size);
+  // Send len bytes stored in flash to every client, without going through SRAM
+  size_t write_P(const uint8_t *pgm, size_t len);
+  size_t print(const __FlashStringHelper *str);
   uint8_t status();
 
   using Print::write;
+  using Print::print;
 };
 
 #endif
@@ -24,14 +24,15 @@ extern "C" {
 #include "WiFiUdp.h"
 #include "utility/spi/spi_drv.h"
 
-uint16_t _espSockDataSzUdp = 0;
-uint8_t _internalBufUdp[25];
-uint8_t _internalBufPtrUdp = 0;
-uint16_t _internalBufSzUdp = 0;
-
 
 /* Constructor */
-WiFiUDP::WiFiUDP() : _sock(NO_SOCKET_AVAIL) {}
+WiFiUDP::WiFiUDP() : _sock(NO_SOCKET_AVAIL), _remoteValid(false), _replyTimeout(0) {}
+
+void WiFiUDP::setTimeout(unsigned long timeout)
+{
+	Stream::setTimeout(timeout);
+	_replyTimeout = timeout;
+}
 
 /* Start WiFiUDP socket, listening at local port PORT */
 uint8_t WiFiUDP::begin(uint16_t port) {
@@ -39,6 +40,9 @@ uint8_t WiFiUDP::begin(uint16_t port) {
 	uint8_t sock = WiFiClass::getSocket();
 	if (sock != NO_SOCKET_AVAIL)
 	{
+		WiFiClass::_client_data[sock] = 0;
+		WiFiClass::rxBufClear(sock);
+
 		if(!Packager::startServer(port, sock, UDP_MODE)){ // packet has not been sent. Maybe an interrupt occurred in the meantime
 			// launch interrupt management function, then try to send request again
 			WiFiClass::handleEvents();
@@ -46,17 +50,13 @@ uint8_t WiFiUDP::begin(uint16_t port) {
 			return 0;
 		}
 
-		// Poll response for the next 10 seconds
-		uint32_t start = millis();
-		while(((millis() - start) < GENERAL_TIMEOUT)){
-			WiFiClass::handleEvents();
-			if(WiFiClass::gotResponse && WiFiClass::responseType == START_SERVER_TCP_CMD){
-				if(WiFiClass::data[0] != 0){
-					WiFiClass::_server_port[sock] = port;
-					_sock = sock;
-					_port = port;
-					return 1;
-				}
+		// Poll response until timeout
+		if(WiFiClass::waitResponse(START_SERVER_TCP_CMD, _replyTimeout)){
+			if(WiFiClass::data[0] != 0){
+				WiFiClass::bindSocket(sock, port);
+				_sock = sock;
+				_port = port;
+				return 1;
 			}
 		}
 	}
@@ -69,33 +69,12 @@ int WiFiUDP::available() {
 	WiFiClass::handleEvents();
 
 	if(_sock != NO_SOCKET_AVAIL){
-		if(_internalBufSzUdp > 0)
-			return _internalBufSzUdp;
-
-		if(_espSockDataSzUdp > 0)
-			return _espSockDataSzUdp;
-
-		WiFiClass::gotResponse = false;
-		WiFiClass::responseType = NONE;
-
-		if(!Packager::getAvailable(_sock)){ // packet has not been sent. Maybe an interrupt occurred in the meantime
-			// launch interrupt management function, then try to send request again
-			WiFiClass::handleEvents();
-			if(!Packager::getAvailable(_sock)) // exit if another error occurs
-			return -1;
-		}
+		// bytes already in RAM plus the ones still waiting on the esp
+		int buffered = WiFiClass::_sockRxBuf[_sock].count;
+		if(buffered > 0 || WiFiClass::_client_data[_sock] > 0)
+			return buffered + WiFiClass::_client_data[_sock];
 
-		// Poll flags until we got a response or timeout occurs
-		uint32_t start = millis();
-		while(((millis() - start) < GENERAL_TIMEOUT)){
-			WiFiClass::handleEvents();
-			if(WiFiClass::gotResponse && WiFiClass::responseType == AVAIL_DATA_TCP_CMD){
-				// copy int value
-				memcpy((uint8_t*)&WiFiClass::_client_data[_sock], &WiFiClass::data[3], 2);
-				_espSockDataSzUdp = WiFiClass::_client_data[_sock];
-				return _espSockDataSzUdp;
-			}
-		}
+		return WiFiClass::availData(_sock, _replyTimeout);
 	}
 	return -1;
 }
@@ -118,16 +97,14 @@ void WiFiUDP::stop(){
 	}
 
 	// Poll flags until we got a response or timeout occurs
-	uint32_t start = millis();
-	while(((millis() - start) < GENERAL_TIMEOUT)){
-		WiFiClass::handleEvents();
-		if(WiFiClass::gotResponse && WiFiClass::responseType == STOP_CLIENT_TCP_CMD){
-			break;
-		}
-	}
+	WiFiClass::waitResponse(STOP_CLIENT_TCP_CMD, _replyTimeout);
 
-	WiFiClass::_state[_sock] = CLOSED;
-	_espSockDataSzUdp = _internalBufPtrUdp = _internalBufSzUdp = 0;
+	WiFiClass::setSockState(_sock, CLOSED);
+	WiFiClass::_client_data[_sock] = 0;
+	// the socket can be taken again by begin()
+	WiFiClass::bindSocket(_sock, 0);
+	WiFiClass::rxBufClear(_sock);
+	_remoteValid = false;
 	_sock = NO_SOCKET_AVAIL;
 }
 
@@ -160,16 +137,11 @@ int WiFiUDP::beginPacket(IPAddress ip, uint16_t port)
 	}
 
 	// Poll flags until we got a response or timeout occurs
-	uint32_t start = millis();
-	while(((millis() - start) < GENERAL_TIMEOUT)){
-		WiFiClass::handleEvents();
-		if(WiFiClass::gotResponse && WiFiClass::responseType == START_CLIENT_TCP_CMD){
-			if(!WiFiClass::data[0]) // error while starting client
-				return 0;
-			break;
-		}
+	if(WiFiClass::waitResponse(START_CLIENT_TCP_CMD, _replyTimeout)){
+		if(!WiFiClass::data[0]) // error while starting client
+			return 0;
 	}
-	WiFiClass::_state[_sock] = ESTABLISHED;
+	WiFiClass::setSockState(_sock, ESTABLISHED);
 	return 1;
   }
   return 0;
@@ -190,17 +162,12 @@ int WiFiUDP::endPacket()
 	}
 
 	// Poll flags until we got a response or timeout occurs
-	uint32_t start = millis();
-	while(((millis() - start) < GENERAL_TIMEOUT)){
-		WiFiClass::handleEvents();
-		if(WiFiClass::gotResponse && WiFiClass::responseType == SEND_DATA_UDP_CMD){
-			if(WiFiClass::data[0] == 1){
-				//reset data available
-				_internalBufSzUdp = 0;
-				_espSockDataSzUdp = 0;
-				return 1;
-			}
-			break;
+	if(WiFiClass::waitResponse(SEND_DATA_UDP_CMD, _replyTimeout)){
+		if(WiFiClass::data[0] == 1){
+			//reset data available
+			WiFiClass::_client_data[_sock] = 0;
+			WiFiClass::rxBufClear(_sock);
+			return 1;
 		}
 	}
 	return 0;
@@ -225,162 +192,99 @@ size_t WiFiUDP::write(const uint8_t *buffer, size_t size)
 	return size;
 }
 
-int WiFiUDP::parsePacket()
+size_t WiFiUDP::writev(const tsIoVec *iov, uint8_t cnt)
 {
-	return available();
-}
+	uint32_t size = 0;
+
+	for(uint8_t i = 0; i < cnt; i++)
+		size += iov[i].len;
 
-int WiFiUDP::read()
-{
-	if(_internalBufSzUdp > 0){
-		uint8_t ret = _internalBufUdp[_internalBufPtrUdp++];
-		_internalBufSzUdp--;
-		
-		return ret;
-	}
-	
 	WiFiClass::handleEvents();
-	
-	WiFiClass::gotResponse = false;
-	WiFiClass::responseType = NONE;
 
-	uint16_t sz = min(_espSockDataSzUdp, 25);
-	
-	if(!Packager::getDataBuf(_sock, sz)){ // packet has not been sent. Maybe an interrupt occurred in the meantime
+	if(!Packager::sendDataV(_sock, iov, cnt, size)) { // packet has not been sent. Maybe an interrupt occurred in the meantime
 		// launch interrupt management function, then try to send request again
 		WiFiClass::handleEvents();
-		if(!Packager::getDataBuf(_sock, sz)) // exit if another error occurs
-			return -1;
+		if(!Packager::sendDataV(_sock, iov, cnt, size)) // exit if another error occurs
+		return 0;
 	}
-	
-	// Poll flags until we got a response or timeout occurs
-	uint32_t start = millis();
-	while(((millis() - start) < GENERAL_TIMEOUT)){
-		WiFiClass::handleEvents();
-		if(WiFiClass::gotResponse && WiFiClass::responseType == GET_DATABUF_TCP_CMD){
-			_internalBufPtrUdp = 0;
-			_internalBufSzUdp = (int16_t)WiFiClass::pktLen;
-			memset(_internalBufUdp, 0, 25);
-			if(_internalBufSzUdp <= 0){
-				_espSockDataSzUdp = 0;
-				_internalBufSzUdp = 0;
-				return -1;
-			}
-			memcpy(_internalBufUdp, (uint8_t *)WiFiClass::data, _internalBufSzUdp);
-				
-			uint8_t ret = _internalBufUdp[_internalBufPtrUdp++];
-			_espSockDataSzUdp -= _internalBufSzUdp;
-			_internalBufSzUdp--;
-				
-			return ret;
+	return size;
+}
 
-		}
+int WiFiUDP::parsePacket()
+{
+	if(_sock == NO_SOCKET_AVAIL)
+		return 0;
+
+	// size, sender and first bytes of the next datagram with a single exchange
+	int size = WiFiClass::udpParse(_sock, _remoteIp, &_remotePort, _replyTimeout);
+	if(size >= 0){
+		_remoteValid = (size > 0);
+		return size;
 	}
-	
-	return -1;
+
+	// esp firmware without PARSE_PACKET_UDP
+	_remoteValid = false;
+	if(WiFiClass::udpParseSupported())
+		return 0;
+	return available();
 }
 
-int WiFiUDP::read(unsigned char* buffer, size_t len)
+int WiFiUDP::read()
 {
-	WiFiClass::handleEvents();
-	
-	WiFiClass::gotResponse = false;
-	WiFiClass::responseType = NONE;
-
-	
-	if(!Packager::getDataBuf(_sock, len)){ // packet has not been sent. Maybe an interrupt occurred in the meantime
-		// launch interrupt management function, then try to send request again
-		WiFiClass::handleEvents();
-		if(!Packager::getDataBuf(_sock, len)) // exit if another error occurs
+	if(_sock == NO_SOCKET_AVAIL)
 		return -1;
+
+	if(WiFiClass::_sockRxBuf[_sock].count == 0){
+		if(WiFiClass::fillRxBuf(_sock, _replyTimeout) <= 0)
+			return -1;
 	}
-	
-	// Poll flags until we got a response or timeout occurs
-	uint32_t start = millis();
-	while(((millis() - start) < GENERAL_TIMEOUT)){
-		WiFiClass::handleEvents();
-		if(WiFiClass::gotResponse && WiFiClass::responseType == GET_DATABUF_TCP_CMD){
 
-			uint16_t receivedBytes;
-			uint8_t chunkSize = 0;
-			uint32_t totalLen = WiFiClass::pktLen;
+	return WiFiClass::rxBufRead(_sock);
+}
 
-			if(totalLen <= 0){ // No data was read. Maybe an error occurred. Restore available flag and exit
-				WiFiClass::_client_data[_sock] = 0;
-				_espSockDataSzUdp = 0;
-				return -1;
-			}
+int WiFiUDP::read(unsigned char* buffer, size_t len)
+{
+	if(_sock == NO_SOCKET_AVAIL)
+		return -1;
 
-			if(totalLen < 26)
-				receivedBytes = totalLen;
-			else
-				receivedBytes = 26;
+	// serve the buffered bytes at first
+	int receivedBytes = WiFiClass::rxBufRead(_sock, buffer, len);
 
-			memcpy(buffer, (uint8_t *)WiFiClass::data, receivedBytes);
+	if(receivedBytes < (int)len){
+		if(WiFiClass::_client_data[_sock] == 0 && receivedBytes == 0)
+			WiFiClass::availData(_sock, _replyTimeout);
 
-			while(receivedBytes < totalLen && (millis() - start) < 15000){ // wait 15 seconds at maximum for receiving the whole message. Otherwise consider that an error occurred
-				chunkSize = WiFiClass::getAvailableData();
-				if(chunkSize > 0){
-					memcpy(&buffer[receivedBytes], (void *)WiFiClass::data, chunkSize);
-					receivedBytes += chunkSize;
-				}
+		uint16_t sz = min(len - receivedBytes, WiFiClass::_client_data[_sock]);
+		if(sz > 0){
+			int ret;
+			if(sz >= WIFI_SOCK_RX_BUF_LEN){
+				// big request: bypass the ring buffer
+				ret = WiFiClass::getDataBuf(_sock, &buffer[receivedBytes], sz, _replyTimeout);
 			}
-			WiFiClass::_client_data[_sock] -= receivedBytes;
-			_espSockDataSzUdp -= receivedBytes;
-			return receivedBytes;
+			else{
+				ret = WiFiClass::fillRxBuf(_sock, _replyTimeout);
+				if(ret > 0)
+					ret = WiFiClass::rxBufRead(_sock, &buffer[receivedBytes], len - receivedBytes);
+			}
+			if(ret > 0)
+				receivedBytes += ret;
 		}
 	}
-	commDrv.multiRead = false;
-	WiFiClass::_client_data[_sock] = 0;
-	_espSockDataSzUdp = 0;
-	return -1;
+
+	return (receivedBytes > 0) ? receivedBytes : -1;
 }
 
 int WiFiUDP::peek()
 {
-	if(_internalBufSzUdp > 0){
-		uint8_t ret = _internalBufUdp[_internalBufPtrUdp];
-		return ret;
-	}
-
-	WiFiClass::handleEvents();
-
-	WiFiClass::gotResponse = false;
-	WiFiClass::responseType = NONE;
-
-	uint8_t sz = min(_espSockDataSzUdp, 25);
-	
-	if(!Packager::getDataBuf(_sock, sz)){ // packet has not been sent. Maybe an interrupt occurred in the meantime
-		// launch interrupt management function, then try to send request again
-		WiFiClass::handleEvents();
-		if(!Packager::getDataBuf(_sock, sz)) // exit if another error occurs
+	if(_sock == NO_SOCKET_AVAIL)
 		return -1;
-	}
 
-	// Poll flags until we got a response or timeout occurs
-	uint32_t start = millis();
-	while(((millis() - start) < GENERAL_TIMEOUT)){
-		WiFiClass::handleEvents();
-		if(WiFiClass::gotResponse && WiFiClass::responseType == GET_DATABUF_TCP_CMD){
-			_internalBufPtrUdp = 0;
-			_internalBufSzUdp = (int16_t)WiFiClass::dataLen;
-			memset(_internalBufUdp, 0, 25);
-			if(_internalBufSzUdp <= 0){
-				_espSockDataSzUdp = 0;
-				_internalBufSzUdp = 0;
-				return -1;
-			}
-			memcpy(_internalBufUdp, (uint8_t *)WiFiClass::data, _internalBufSzUdp);
-			
-			uint8_t ret = _internalBufUdp[_internalBufPtrUdp];
-			_espSockDataSzUdp -= _internalBufSzUdp;
-			
-			return ret;
-
-		}
+	if(WiFiClass::_sockRxBuf[_sock].count == 0){
+		if(WiFiClass::fillRxBuf(_sock, _replyTimeout) <= 0)
+			return -1;
 	}
-	
-	return -1;
+
+	return WiFiClass::rxBufPeek(_sock);
 }
 
 void WiFiUDP::flush()
@@ -391,7 +295,11 @@ void WiFiUDP::flush()
 
 IPAddress  WiFiUDP::remoteIP()
 {
-	uint8_t _remoteIp[4] = {0};
+	uint8_t remoteIp[4] = {0};
+
+	// sender given by parsePacket
+	if(_remoteValid)
+		return IPAddress(_remoteIp);
 
 	WiFiClass::handleEvents();
 
@@ -402,23 +310,18 @@ IPAddress  WiFiUDP::remoteIP()
 		// launch interrupt management function, then try to send request again
 		WiFiClass::handleEvents();
 		if(!Packager::getRemoteData(_sock)){ // exit if another error occurs
-			IPAddress ip(_remoteIp);
+			IPAddress ip(remoteIp);
 			return ip;
 		}
 	}
 
 	// Poll flags until we got a response or timeout occurs
-	uint32_t start = millis();
-	while(((millis() - start) < GENERAL_TIMEOUT)){
-		WiFiClass::handleEvents();
-		if(WiFiClass::gotResponse && WiFiClass::responseType == GET_REMOTE_DATA_CMD){
-			if(WiFiClass::dataLen == 4){ // parse received ip address
-				memcpy(_remoteIp, (void*)WiFiClass::data, 4);
-			}
-			break;
+	if(WiFiClass::waitResponse(GET_REMOTE_DATA_CMD, _replyTimeout)){
+		if(WiFiClass::dataLen == 4){ // parse received ip address
+			memcpy(remoteIp, (void*)WiFiClass::data, 4);
 		}
 	}
-	IPAddress ip(_remoteIp);
+	IPAddress ip(remoteIp);
 	return ip;
 }
 
@@ -426,6 +329,10 @@ uint16_t  WiFiUDP::remotePort()
 {
 	uint16_t port = 0;
 
+	// sender given by parsePacket
+	if(_remoteValid)
+		return _remotePort;
+
 	WiFiClass::handleEvents();
 
 	WiFiClass::gotResponse = false;
@@ -439,14 +346,9 @@ uint16_t  WiFiUDP::remotePort()
 	}
 
 	// Poll flags until we got a response or timeout occurs
-	uint32_t start = millis();
-	while(((millis() - start) < GENERAL_TIMEOUT)){
-		WiFiClass::handleEvents();
-		if(WiFiClass::gotResponse && WiFiClass::responseType == GET_REMOTE_DATA_CMD){
-			if(WiFiClass::dataLen == 4){ // response seems ok, we've got Ip as first parameter and port as second one
-				port = (WiFiClass::data[5]<<8) + WiFiClass::data[6];
-			}
-			break;
+	if(WiFiClass::waitResponse(GET_REMOTE_DATA_CMD, _replyTimeout)){
+		if(WiFiClass::dataLen == 4){ // response seems ok, we've got Ip as first parameter and port as second one
+			port = (WiFiClass::data[5]<<8) + WiFiClass::data[6];
 		}
 	}
 	return port;
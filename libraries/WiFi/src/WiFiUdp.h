@@ -18,6 +18,7 @@
 #define wifiudp_h
 
 #include <Udp.h>
+#include "utility/definitions.h"
 
 #define UDP_TX_PACKET_MAX_SIZE 24
 
@@ -25,11 +26,18 @@ class WiFiUDP : public UDP {
 private:
   uint8_t _sock;  // socket ID for Wiz5100
   uint16_t _port; // local port to listen on
+  // sender of the current datagram, given by parsePacket
+  uint8_t _remoteIp[4];
+  uint16_t _remotePort;
+  bool _remoteValid;
+  uint32_t _replyTimeout;
 
 public:
   WiFiUDP();  // Constructor
   virtual uint8_t begin(uint16_t);	// initialize, start listening on specified port. Returns 1 if successful, 0 if there are no sockets available to use
   virtual void stop();  // Finish with the UDP socket
+  // Stream timeout and time given to the esp to answer the calls of this socket (0: WiFi.setTimeout)
+  void setTimeout(unsigned long timeout);
 
   // Sending UDP packets
   
@@ -46,6 +54,8 @@ public:
   virtual size_t write(uint8_t);
   // Write size bytes from buffer into the packet
   virtual size_t write(const uint8_t *buffer, size_t size);
+  // Write cnt segments (RAM or PROGMEM) into the packet with a single transfer
+  size_t writev(const tsIoVec *iov, uint8_t cnt);
   
   using Print::write;
 
@@ -36,8 +36,146 @@
 #define WL_IPV4_LENGTH 4
 // Maximum size of a SSID list
 #define WL_NETWORKS_LIST_MAXNUM	10
-// Maxmium number of socket
+
+// Build with WIFI_LOW_MEMORY defined to trade throughput and cache sizes for static RAM:
+// the SPI receive, transmit and duplex buffers share one area, hostname(), SSID() and
+// firmwareVersion() return the same string buffer, and the tables below get smaller defaults.
+// A two-frame reply (SSID) that arrives while a command waits in the shared buffer to be
+// written goes over that command: the callback keeps its first 32 bytes on the stack, a pending
+// request of the asynchronous table (requestAsync()) gets a copy and a blocking SSID() asks again
+
+// Maxmium number of socket (16 max). The esp firmware must handle as many.
+// 8 sockets fit WIFI_SOCK_RAM_MAX with the default buffers (882 bytes); 16 don't (1764 bytes,
+// 1252 with WIFI_LOW_MEMORY): lower WIFI_SOCK_RX_BUF_LEN + WIFI_SOCK_TX_BUF_LEN to 48 or less (32 + 16:
+// 996 bytes) or raise WIFI_SOCK_RAM_MAX
+#ifndef MAX_SOCK_NUM
 #define	MAX_SOCK_NUM		4
+#endif
+// One bit per socket
+#if MAX_SOCK_NUM <= 8
+typedef uint8_t tSockMask;
+#else
+typedef uint16_t tSockMask;
+#endif
+#define SOCK_MASK_ALL		((tSockMask)((1UL << MAX_SOCK_NUM) - 1))
+// Size of the receive ring buffer of each socket (power of two, 128 max)
+#ifndef WIFI_SOCK_RX_BUF_LEN
+#define WIFI_SOCK_RX_BUF_LEN	32
+#endif
+// Size of the transmit coalescing buffer of each socket (1 disables coalescing)
+#ifndef WIFI_SOCK_TX_BUF_LEN
+#ifdef WIFI_LOW_MEMORY
+#define WIFI_SOCK_TX_BUF_LEN	32
+#else
+#define WIFI_SOCK_TX_BUF_LEN	64
+#endif
+#endif
+// RAM taken by the socket table on the AVR: packed state, server port, available
+// bytes, events and the rx/tx buffers of each socket, plus the free and bound bitmaps.
+// Build with WIFI_RAM_REPORT defined to get the parts of the static RAM printed at compile time
+#define WIFI_SOCK_RAM		(MAX_SOCK_NUM * (14 + WIFI_SOCK_RX_BUF_LEN + WIFI_SOCK_TX_BUF_LEN) + 2 * ((MAX_SOCK_NUM + 7) / 8))
+// Largest socket table accepted at compile time (bytes)
+#ifndef WIFI_SOCK_RAM_MAX
+#define WIFI_SOCK_RAM_MAX		1024
+#endif
+// Time after which the bytes left in a transmit buffer are sent anyway (ms)
+#ifndef WIFI_TX_FLUSH_MS
+#define WIFI_TX_FLUSH_MS		10
+#endif
+// Maximum number of commands waiting for a reply at the same time
+#ifndef WIFI_MAX_PENDING_REQ
+#ifdef WIFI_LOW_MEMORY
+#define WIFI_MAX_PENDING_REQ	2
+#else
+#define WIFI_MAX_PENDING_REQ	4
+#endif
+#endif
+// Reply bytes kept for each pending command
+#define WIFI_REQ_DATA_LEN		8
+// RAM taken by the request table on the AVR
+#define WIFI_REQ_RAM		(WIFI_MAX_PENDING_REQ * (10 + WIFI_REQ_DATA_LEN))
+// Number of hostnames kept by the DNS cache of hostByName
+#ifndef WIFI_DNS_CACHE_LEN
+#ifdef WIFI_LOW_MEMORY
+#define WIFI_DNS_CACHE_LEN		1
+#else
+#define WIFI_DNS_CACHE_LEN		4
+#endif
+#endif
+// Longest hostname kept by the DNS cache, longer ones are always resolved by the esp
+#ifndef WIFI_DNS_NAME_LEN
+#define WIFI_DNS_NAME_LEN		32
+#endif
+// RAM taken by the DNS cache on the AVR
+#define WIFI_DNS_RAM		(WIFI_DNS_CACHE_LEN * (WIFI_DNS_NAME_LEN + 14))
+// Lifetime of the resolved and of the failed names in the DNS cache (s).
+// The esp doesn't report the TTL of the DNS records
+#ifndef WIFI_DNS_TTL
+#define WIFI_DNS_TTL			300
+#endif
+#ifndef WIFI_DNS_NEG_TTL
+#define WIFI_DNS_NEG_TTL		10
+#endif
+// Time given to the esp to answer GET_CAPS_CMD before falling back to the basic protocol
+#define WIFI_PROBE_TIMEOUT	500
+// Protocol capabilities exchanged with GET_CAPS_CMD when the link is established,
+// 16 bits sent little endian
+#define WIFI_CAP_VARLEN		0x01	// frames carry only the bytes of the packet, no zero padding
+#define WIFI_CAP_WINDOW		0x02	// multi-frame data packets are sent in windows acknowledged by the status register
+#define WIFI_CAP_DUPLEX		0x04	// the esp shifts its pending frame out on MISO during a single frame write
+#define WIFI_CAP_SOCK_EVENTS	0x08	// the esp pushes SOCK_EVENT_NOTIFY when a TCP socket changes
+#define WIFI_CAP_SEND_MULTI	0x10	// the esp knows SEND_DATA_MULTI_CMD
+#define WIFI_CAP_STOP_SERVER	0x20	// STOP_CLIENT_TCP_CMD with a second parameter set to 1 also closes the listening socket
+#define WIFI_CAP_UDP_PARSE	0x40	// the esp knows PARSE_PACKET_UDP
+#define WIFI_CAP_BATCH		0x80	// the esp knows BATCH_CMD
+#define WIFI_CAP_SCAN_LIST	0x0100	// the esp knows GET_SCAN_LIST_CMD
+#ifndef WIFI_HOST_CAPS
+#define WIFI_HOST_CAPS		(WIFI_CAP_VARLEN | WIFI_CAP_WINDOW | WIFI_CAP_DUPLEX | WIFI_CAP_SOCK_EVENTS | WIFI_CAP_SEND_MULTI | \
+							 WIFI_CAP_STOP_SERVER | WIFI_CAP_UDP_PARSE | WIFI_CAP_BATCH | WIFI_CAP_SCAN_LIST)
+#endif
+// Flags of SOCK_EVENT_NOTIFY, collected in WiFiClass::_sockEvents
+#define SOCK_EV_DATA		0x01	// new bytes available
+#define SOCK_EV_CLOSED		0x02	// the peer closed the connection
+#define SOCK_EV_ACCEPTED	0x04	// a server socket accepted a client
+#define SOCK_EV_SENT		0x08	// the esp sent out everything written on the socket
+// Frames of a windowed transfer written back to back before reading the ack (1..9)
+#ifndef WIFI_SPI_WINDOW
+#define WIFI_SPI_WINDOW		4
+#endif
+// Build with WIFI_ISR_RX defined to read the frames of the esp from the SR interrupt, as soon
+// as it raises the signal, instead of from handleEvents(). Frames kept until decoded (power of two)
+#ifndef WIFI_ISR_RX_FRAMES
+#ifdef WIFI_LOW_MEMORY
+#define WIFI_ISR_RX_FRAMES	2
+#else
+#define WIFI_ISR_RX_FRAMES	4
+#endif
+#endif
+// Build with WIFI_SPI_STATS defined to collect the SPI link statistics (WiFi.printLinkStats()).
+// Commands with their own latency histogram, the first ones written after a reset
+#ifndef WIFI_SPI_STATS_CMDS
+#define WIFI_SPI_STATS_CMDS	8
+#endif
+// HTTP request parser (WiFiHttp.h): bytes kept for the path segments, the query
+// and the values of the collected headers (254 max)
+#ifndef WIFI_HTTP_BUF_LEN
+#define WIFI_HTTP_BUF_LEN		64
+#endif
+// Path segments and collected headers of a request
+#ifndef WIFI_HTTP_MAX_SEGMENTS
+#define WIFI_HTTP_MAX_SEGMENTS	6
+#endif
+#ifndef WIFI_HTTP_MAX_HEADERS
+#define WIFI_HTTP_MAX_HEADERS	4
+#endif
+// HTTP response writer: body bytes collected before sending, longer bodies go out
+// in several packets. Header lines added by the sketch
+#ifndef WIFI_HTTP_BODY_LEN
+#define WIFI_HTTP_BODY_LEN		64
+#endif
+#ifndef WIFI_HTTP_RESP_HEADERS
+#define WIFI_HTTP_RESP_HEADERS	4
+#endif
 //Maximum number of attempts to establish wifi connection
 #define WL_MAX_ATTEMPT_CONNECTION	100
 
@@ -81,6 +219,7 @@ enum {
 	GET_IDX_SSID_CMD	= 0x31,
 	GET_IDX_RSSI_CMD	= 0x32,
 	GET_IDX_ENCT_CMD	= 0x33,
+	SOCK_EVENT_NOTIFY	= 0x34,
 	GET_HOST_BY_NAME_CMD= 0x35,
 	START_SCAN_NETWORKS	= 0x36,
 	GET_FW_VERSION_CMD	= 0x37,
@@ -90,6 +229,8 @@ enum {
 	GET_HOSTNAME		= 0x3B,
 	SET_HOSTNAME		= 0x3C,
 	DISABLE_WEBPANEL	= 0x3D,
+	BATCH_CMD			= 0x3E,
+	GET_CAPS_CMD		= 0x3F,
 	
 	TEST_DATA_TXRX		= 0x40,
 
@@ -98,6 +239,9 @@ enum {
 	SEND_DATA_TCP_CMD		= 0x44,
     GET_DATABUF_TCP_CMD		= 0x45,
     INSERT_DATABUF_CMD		= 0x46,
+    GET_SCAN_LIST_CMD		= 0x47,
+    SEND_DATA_MULTI_CMD		= 0x49,
+    PARSE_PACKET_UDP		= 0x4A,
 };
 
 
@@ -147,6 +291,14 @@ typedef enum {
   WL_DISCONNECTED
 } wl_status_t;
 
+/* Segment of a scatter-gather write (WiFiClient::writev, WiFiUDP::writev).
+   progmem tells that data points to flash (PROGMEM, F() strings) */
+typedef struct {
+  const uint8_t* data;
+  uint16_t len;
+  bool progmem;
+} tsIoVec;
+
 /* Encryption modes */
 enum wl_enc_type {  /* Values map to 802.11 encryption suites... */
   ENC_TYPE_WEP  = 5,
@@ -31,40 +31,143 @@ extern "C" {
 	#include "utility/definitions.h"
 }
 
-// Array of data to cache the information related to the networks discovered
-char Packager::_networkSsid[][WL_SSID_MAX_LENGTH] = {{"1"},{"2"},{"3"},{"4"},{"5"}};
-
+#ifndef WIFI_LOW_MEMORY
 // Cached values of retrieved data
 char Packager::_ssid[] = {0};
 
 // Firmware version
 char Packager::fwVersion[] = {0};
+#endif
+
+/* -----------------------------------------------------------------
+* Command frames with a layout fixed at compile time:
+* START_CMD, cmd, len, nParam, [len, value]..., END_CMD
+*
+* CmdFrame<cmd, L...> has a parameter for each value length L. Length,
+* parameter count and offsets are constants, the constructor stores the
+* fixed bytes and only the values are written at run time:
+*
+*	CmdFrame<GET_DATA_TCP_CMD, 1, 2>().set8<0>(sock).set16<1>(peek).send();
+*/
+template<uint8_t... L> struct CmdParams;
+
+template<> struct CmdParams<>
+{
+	static const uint8_t size = 0;
+	static void lens(uint8_t* p) { (void)p; }
+};
+
+template<uint8_t H, uint8_t... T> struct CmdParams<H, T...>
+{
+	static const uint8_t size = H + 1 + CmdParams<T...>::size;
+	static void lens(uint8_t* p) { p[0] = H; CmdParams<T...>::lens(p + H + 1); }
+};
+
+// offset in the frame and length of the value of parameter I
+template<uint8_t I, uint8_t... L> struct CmdParam;
+
+template<uint8_t H, uint8_t... T> struct CmdParam<0, H, T...>
+{
+	static const uint8_t off = 5;
+	static const uint8_t len = H;
+};
+
+template<uint8_t I, uint8_t H, uint8_t... T> struct CmdParam<I, H, T...>
+{
+	static const uint8_t off = H + 1 + CmdParam<I - 1, T...>::off;
+	static const uint8_t len = CmdParam<I - 1, T...>::len;
+};
+
+template<uint8_t CMD, uint8_t... L> class CmdFrame
+{
+	public:
+	static const uint8_t LEN = 5 + CmdParams<L...>::size;
+	static_assert(LEN <= SPI_BUF_LEN, "command frame longer than a SPI frame");
+
+	CmdFrame()
+	{
+		_buf[0] = START_CMD;
+		_buf[1] = CMD;
+		_buf[2] = LEN;
+		_buf[3] = sizeof...(L);
+		CmdParams<L...>::lens(_buf + 4);
+		_buf[LEN - 1] = END_CMD;
+	}
+
+	// value as it is in memory
+	template<uint8_t I> CmdFrame& set(const void* v)
+	{
+		memcpy(_buf + CmdParam<I, L...>::off, v, CmdParam<I, L...>::len);
+		return *this;
+	}
+
+	template<uint8_t I> CmdFrame& set8(uint8_t v)
+	{
+		static_assert(CmdParam<I, L...>::len == 1, "not a 1 byte parameter");
+		_buf[CmdParam<I, L...>::off] = v;
+		return *this;
+	}
+
+	// big-endian, as sendParam(uint16_t)
+	template<uint8_t I> CmdFrame& set16(uint16_t v)
+	{
+		static_assert(CmdParam<I, L...>::len == 2, "not a 2 bytes parameter");
+		_buf[CmdParam<I, L...>::off] = v >> 8;
+		_buf[CmdParam<I, L...>::off + 1] = v & 0xFF;
+		return *this;
+	}
+
+	bool send(void) { return commDrv.sendFrame(_buf, LEN); }
+
+	private:
+	uint8_t _buf[LEN];
+};
+
+/* -----------------------------------------------------------------
+* Commands without variable bytes, written out straight from flash
+*/
+#define CMD_FRAME_0(cmd)		{ START_CMD, (cmd), 5, PARAM_NUMS_0, END_CMD }
+#define CMD_FRAME_DUMMY(cmd)	{ START_CMD, (cmd), 7, PARAM_NUMS_1, 1, DUMMY_DATA, END_CMD }
+
+static const uint8_t _autoConnectFrame[] PROGMEM = CMD_FRAME_0(AUTOCONNECT_TO_STA);
+static const uint8_t _cancelNetListFrame[] PROGMEM = CMD_FRAME_0(CANCEL_NETWORK_LIST);
+static const uint8_t _connStatusFrame[] PROGMEM = CMD_FRAME_0(GET_CONN_STATUS);
+static const uint8_t _hostnameFrame[] PROGMEM = CMD_FRAME_0(GET_HOSTNAME);
+static const uint8_t _scanFrame[] PROGMEM = CMD_FRAME_0(START_SCAN_NETWORKS);
+static const uint8_t _fwVersionFrame[] PROGMEM = CMD_FRAME_0(GET_FW_VERSION_CMD);
+static const uint8_t _webPanelFrame[] PROGMEM = CMD_FRAME_0(DISABLE_WEBPANEL);
+static const uint8_t _networkDataFrame[] PROGMEM = CMD_FRAME_DUMMY(GET_IPADDR_CMD);
+static const uint8_t _disconnectFrame[] PROGMEM = CMD_FRAME_DUMMY(DISCONNECT_CMD);
+static const uint8_t _macFrame[] PROGMEM = CMD_FRAME_DUMMY(GET_MACADDR_CMD);
+static const uint8_t _ssidFrame[] PROGMEM = CMD_FRAME_DUMMY(GET_CURR_SSID_CMD);
+static const uint8_t _bssidFrame[] PROGMEM = CMD_FRAME_DUMMY(GET_CURR_BSSID_CMD);
+static const uint8_t _rssiFrame[] PROGMEM = CMD_FRAME_DUMMY(GET_CURR_RSSI_CMD);
+static const uint8_t _enctFrame[] PROGMEM = CMD_FRAME_DUMMY(GET_CURR_ENCT_CMD);
+
+#define sendFrame_P(frame)		commDrv.sendFrame((frame), sizeof(frame), true)
+
 
 
 // ----------------------------------------------------------------- 
 bool Packager::getNetworkData()
 {
-	uint8_t _dummy = DUMMY_DATA;
-
-	commDrv.sendCmd(GET_IPADDR_CMD, PARAM_NUMS_1);
-	return commDrv.sendParam(&_dummy, sizeof(_dummy), LAST_PARAM);
+	return sendFrame_P(_networkDataFrame);
 }
 
 bool Packager::getRemoteData(uint8_t sock)
 {
-	commDrv.sendCmd(GET_REMOTE_DATA_CMD, PARAM_NUMS_1);
-	return commDrv.sendParam(&sock, sizeof(sock), LAST_PARAM);
+	return CmdFrame<GET_REMOTE_DATA_CMD, 1>().set8<0>(sock).send();
 }
 
 // -----------------------------------------------------------------
 bool Packager::wifiAutoConnect()
 {
-	return commDrv.sendCmd(AUTOCONNECT_TO_STA, PARAM_NUMS_0);
+	return sendFrame_P(_autoConnectFrame);
 }
 
 void Packager::wifiCancelNetList()
 {
-	commDrv.sendCmd(CANCEL_NETWORK_LIST, PARAM_NUMS_0);
+	sendFrame_P(_cancelNetListFrame);
 }
 
 // -----------------------------------------------------------------
@@ -94,41 +197,33 @@ bool Packager::wifiSetKey(char* ssid, uint8_t ssid_len, uint8_t key_idx, const v
 // -----------------------------------------------------------------
 bool Packager::config(uint8_t validParams, uint32_t local_ip, uint32_t gateway, uint32_t subnet)
 {
-	commDrv.sendCmd(SET_IP_CONFIG_CMD, PARAM_NUMS_4);
-	commDrv.sendParam((uint8_t*)&validParams, 1, NO_LAST_PARAM);
-	commDrv.sendParam((uint8_t*)&local_ip, 4, NO_LAST_PARAM);
-	commDrv.sendParam((uint8_t*)&gateway, 4, NO_LAST_PARAM);
-	return commDrv.sendParam((uint8_t*)&subnet, 4, LAST_PARAM);
+	return CmdFrame<SET_IP_CONFIG_CMD, 1, 4, 4, 4>().set8<0>(validParams)
+		.set<1>(&local_ip).set<2>(&gateway).set<3>(&subnet).send();
 }
 
 // -----------------------------------------------------------------
 bool Packager::setDNS(uint8_t validParams, uint32_t dns_server1, uint32_t dns_server2)
 {
-	commDrv.sendCmd(SET_DNS_CONFIG_CMD, PARAM_NUMS_3);
-	commDrv.sendParam((uint8_t*)&validParams, 1, NO_LAST_PARAM);
-	commDrv.sendParam((uint8_t*)&dns_server1, 4, NO_LAST_PARAM);
-	return commDrv.sendParam((uint8_t*)&dns_server2, 4, LAST_PARAM);
+	return CmdFrame<SET_DNS_CONFIG_CMD, 1, 4, 4>().set8<0>(validParams)
+		.set<1>(&dns_server1).set<2>(&dns_server2).send();
 }
 
 // -----------------------------------------------------------------
 bool Packager::disconnect()
 {
-	uint8_t _dummy = DUMMY_DATA;
-	
-	commDrv.sendCmd(DISCONNECT_CMD, PARAM_NUMS_1);
-	return commDrv.sendParam(&_dummy, 1, LAST_PARAM);
+	return sendFrame_P(_disconnectFrame);
 }
 
 // ----------------------------------------------------------------- ok
 bool Packager::getConnectionStatus()
 {
-	return commDrv.sendCmd(GET_CONN_STATUS, PARAM_NUMS_0);
+	return sendFrame_P(_connStatusFrame);
 }
 
 // -----------------------------------------------------------------
 bool Packager::getHostname()
 {
-	return commDrv.sendCmd(GET_HOSTNAME, PARAM_NUMS_0);
+	return sendFrame_P(_hostnameFrame);
 }
 
 // -----------------------------------------------------------------
@@ -141,68 +236,49 @@ bool Packager::setHostname(const char* name)
 // ----------------------------------------------------------------- ok
 bool Packager::getMacAddress()
 {
-	uint8_t _dummy = DUMMY_DATA;
-	
-	commDrv.sendCmd(GET_MACADDR_CMD, PARAM_NUMS_1);
-	return commDrv.sendParam(&_dummy, 1, LAST_PARAM);
+	return sendFrame_P(_macFrame);
 }
 
 // ----------------------------------------------------------------- ok
 bool Packager::getCurrentSSID()
 {
-	uint8_t _dummy = DUMMY_DATA;
-	
-	commDrv.sendCmd(GET_CURR_SSID_CMD, PARAM_NUMS_1);
-	return commDrv.sendParam(&_dummy, 1, LAST_PARAM);
+	return sendFrame_P(_ssidFrame);
 }
 
 // ----------------------------------------------------------------- ok
 bool Packager::getCurrentBSSID()
 {
-	uint8_t _dummy = DUMMY_DATA;
-
-	commDrv.sendCmd(GET_CURR_BSSID_CMD, PARAM_NUMS_1);
-	return commDrv.sendParam(&_dummy, 1, LAST_PARAM);
+	return sendFrame_P(_bssidFrame);
 }
 
 // ----------------------------------------------------------------- ok
 bool Packager::getCurrentRSSI()
 {
-	uint8_t _dummy = DUMMY_DATA;
-	
-	commDrv.sendCmd(GET_CURR_RSSI_CMD, PARAM_NUMS_1);
-	return commDrv.sendParam(&_dummy, 1, LAST_PARAM);
+	return sendFrame_P(_rssiFrame);
 }
 
 // ----------------------------------------------------------------- ok
 bool Packager::getCurrentEncryptionType()
 {
-	uint8_t _dummy = DUMMY_DATA;
-	
-	commDrv.sendCmd(GET_CURR_ENCT_CMD, PARAM_NUMS_1);
-	return commDrv.sendParam(&_dummy, 1, LAST_PARAM);
+	return sendFrame_P(_enctFrame);
 }
 
 // -----------------------------------------------------------------
 bool Packager::startScanNetworks()
 {
-	return commDrv.sendCmd(START_SCAN_NETWORKS, PARAM_NUMS_0);
+	return sendFrame_P(_scanFrame);
 }
 
 // -----------------------------------------------------------------
 bool Packager::getScanNetworks(uint8_t which)
 {
-	commDrv.sendCmd(SCAN_NETWORKS_RESULT, PARAM_NUMS_1);
-	return commDrv.sendParam(&which, 1, LAST_PARAM);
+	return CmdFrame<SCAN_NETWORKS_RESULT, 1>().set8<0>(which).send();
 }
 
 // -----------------------------------------------------------------
-char* Packager::getSSIDNetoworks(uint8_t networkItem)
+bool Packager::getScanList(uint8_t maxItems)
 {
-	if (networkItem >= WL_NETWORKS_LIST_MAXNUM)
-	return NULL;
-
-	return _networkSsid[networkItem];
+	return CmdFrame<GET_SCAN_LIST_CMD, 1>().set8<0>(maxItems).send();
 }
 
 // -----------------------------------------------------------------
@@ -211,8 +287,7 @@ bool Packager::getEncTypeNetowrks(uint8_t networkItem)
 	if (networkItem >= WL_NETWORKS_LIST_MAXNUM)
 	return false;
 	
-	commDrv.sendCmd(GET_IDX_ENCT_CMD, PARAM_NUMS_1);
-	return commDrv.sendParam(&networkItem, 1, LAST_PARAM);
+	return CmdFrame<GET_IDX_ENCT_CMD, 1>().set8<0>(networkItem).send();
 }
 
 // -----------------------------------------------------------------
@@ -221,8 +296,7 @@ bool Packager::getRSSINetoworks(uint8_t networkItem)
 	if (networkItem >= WL_NETWORKS_LIST_MAXNUM)
 	return false;
 	
-	commDrv.sendCmd(GET_IDX_RSSI_CMD, PARAM_NUMS_1);
-	return commDrv.sendParam(&networkItem, 1, LAST_PARAM);
+	return CmdFrame<GET_IDX_RSSI_CMD, 1>().set8<0>(networkItem).send();
 }
 
 // -----------------------------------------------------------------
@@ -235,69 +309,78 @@ bool Packager::getHostByName(const char* aHostname)
 // -----------------------------------------------------------------
 bool Packager::getFwVersion()
 {
-	return commDrv.sendCmd(GET_FW_VERSION_CMD, PARAM_NUMS_0);
+	return sendFrame_P(_fwVersionFrame);
 }
 
 // -----------------------------------------------------------------
 bool Packager::startServer(uint16_t port, uint8_t sock, uint8_t protMode)
 {
-    commDrv.sendCmd(START_SERVER_TCP_CMD, PARAM_NUMS_3);
-    commDrv.sendParam(port);
-    commDrv.sendParam(&sock, 1);
-    return commDrv.sendParam(&protMode, 1, LAST_PARAM);
+    return CmdFrame<START_SERVER_TCP_CMD, 2, 1, 1>().set16<0>(port).set8<1>(sock).set8<2>(protMode).send();
 }
 
 // -----------------------------------------------------------------
 bool Packager::startClient(uint32_t ipAddress, uint16_t port, uint8_t sock, uint8_t protMode)
 {
-    commDrv.sendCmd(START_CLIENT_TCP_CMD, PARAM_NUMS_4);
-    commDrv.sendParam((uint8_t*)&ipAddress, sizeof(ipAddress));
-    commDrv.sendParam(port);
-    commDrv.sendParam(&sock, 1);
-    return commDrv.sendParam(&protMode, 1, LAST_PARAM);
+    return CmdFrame<START_CLIENT_TCP_CMD, 4, 2, 1, 1>().set<0>(&ipAddress).set16<1>(port)
+		.set8<2>(sock).set8<3>(protMode).send();
 }
 
 // -----------------------------------------------------------------
-bool Packager::stopClient(uint8_t sock)
+bool Packager::stopClient(uint8_t sock, bool listen)
 {
-    commDrv.sendCmd(STOP_CLIENT_TCP_CMD, PARAM_NUMS_1);
-    return commDrv.sendParam(&sock, 1, LAST_PARAM);
+	if(listen)
+		return CmdFrame<STOP_CLIENT_TCP_CMD, 1, 1>().set8<0>(sock).set8<1>(1).send();
+    return CmdFrame<STOP_CLIENT_TCP_CMD, 1>().set8<0>(sock).send();
 }
 
 
 // -----------------------------------------------------------------
 bool Packager::getServerState(uint8_t sock)
 {
-    commDrv.sendCmd(GET_STATE_TCP_CMD, PARAM_NUMS_1);
-    return commDrv.sendParam(&sock, sizeof(sock), LAST_PARAM);
+    return CmdFrame<GET_STATE_TCP_CMD, 1>().set8<0>(sock).send();
 }
 
 // -----------------------------------------------------------------
 bool Packager::getClientState(uint8_t sock)
 {
-    commDrv.sendCmd(GET_CLIENT_STATE_TCP_CMD, PARAM_NUMS_1);
-    return commDrv.sendParam(&sock, sizeof(sock), LAST_PARAM);
+    return CmdFrame<GET_CLIENT_STATE_TCP_CMD, 1>().set8<0>(sock).send();
 }
 
 // -----------------------------------------------------------------
 bool Packager::disableWebPanel()
 {
-	return commDrv.sendCmd(DISABLE_WEBPANEL, PARAM_NUMS_0);
+	return sendFrame_P(_webPanelFrame);
 }
 
 // -----------------------------------------------------------------
 bool Packager::getAvailable(uint8_t sock){
-	commDrv.sendCmd(AVAIL_DATA_TCP_CMD, PARAM_NUMS_1);
-	return commDrv.sendParam(&sock, sizeof(sock), LAST_PARAM);
+	return CmdFrame<AVAIL_DATA_TCP_CMD, 1>().set8<0>(sock).send();
+}
+
+// -----------------------------------------------------------------
+bool Packager::getSocketsStatus(tSockMask mask)
+{
+	commDrv.beginBatch();
+	for(uint8_t sock = 0; sock < MAX_SOCK_NUM; sock++){
+		if(!(mask & ((tSockMask)1 << sock)))
+			continue;
+		getClientState(sock);
+		getAvailable(sock);
+	}
+	return commDrv.endBatch();
 }
 
 
+// -----------------------------------------------------------------
+bool Packager::parsePacketUdp(uint8_t sock, uint8_t maxFirst)
+{
+	return CmdFrame<PARSE_PACKET_UDP, 1, 1>().set8<0>(sock).set8<1>(maxFirst).send();
+}
+
 // -----------------------------------------------------------------
 bool Packager::getData(uint8_t sock, uint8_t peek)
 {
-    commDrv.sendCmd(GET_DATA_TCP_CMD, PARAM_NUMS_2);
-    commDrv.sendParam(&sock, sizeof(sock));
-    return commDrv.sendParam(peek, LAST_PARAM);
+    return CmdFrame<GET_DATA_TCP_CMD, 1, 2>().set8<0>(sock).set16<1>(peek).send();
 }
 
 // -----------------------------------------------------------------
@@ -318,8 +401,7 @@ bool Packager::getDataBuf(uint8_t sock, uint16_t _dataLen)
 // -----------------------------------------------------------------
 bool Packager::sendUdpData(uint8_t sock)
 {
-    commDrv.sendCmd(SEND_DATA_UDP_CMD, PARAM_NUMS_1);
-    return commDrv.sendParam(&sock, sizeof(sock), LAST_PARAM);
+    return CmdFrame<SEND_DATA_UDP_CMD, 1>().set8<0>(sock).send();
 }
 
 // -----------------------------------------------------------------
@@ -329,9 +411,60 @@ bool Packager::sendData(uint8_t sock, const uint8_t *data, uint16_t len)
 	dataPkt.cmdType = DATA_PKT;
 	dataPkt.cmd = SEND_DATA_TCP_CMD;
 	// data len + header + footer
-	dataPkt.totalLen = (uint32_t)(len + 8);
+	dataPkt.totalLen = (uint32_t)len + 8;
 	dataPkt.sockNum = sock;
 	dataPkt.dataPtr = (uint16_t*)data;
 
 	return commDrv.writeServerData((uint8_t*)&dataPkt, dataPkt.totalLen);	
-}
\ No newline at end of file
+}
+
+// -----------------------------------------------------------------
+bool Packager::sendDataMulti(uint8_t sockMask, const uint8_t *data, uint16_t len)
+{
+	tsNewData dataPkt;
+	dataPkt.cmdType = DATA_PKT;
+	dataPkt.cmd = SEND_DATA_MULTI_CMD;
+	// data len + header + footer
+	dataPkt.totalLen = (uint32_t)len + 8;
+	// the socket mask takes the place of the socket number
+	dataPkt.sockNum = sockMask;
+	dataPkt.dataPtr = (uint16_t*)data;
+
+	return commDrv.writeServerData((uint8_t*)&dataPkt, dataPkt.totalLen);
+}
+
+// -----------------------------------------------------------------
+bool Packager::sendDataV(uint8_t sock, const tsIoVec *iov, uint8_t cnt, uint32_t len)
+{
+	// data len + header + footer
+	uint32_t totalLen = len + 8;
+	uint8_t hdr[DATA_PKT_HDR_LEN];
+
+	hdr[0] = DATA_PKT;
+	hdr[1] = SEND_DATA_TCP_CMD;
+	hdr[2] = totalLen & 0xFF;
+	hdr[3] = (totalLen >> 8) & 0xFF;
+	hdr[4] = (totalLen >> 16) & 0xFF;
+	hdr[5] = (totalLen >> 24) & 0xFF;
+	hdr[6] = sock;
+
+	return commDrv.writeServerDataV(hdr, iov, cnt, totalLen);
+}
+
+// -----------------------------------------------------------------
+bool Packager::sendDataAsync(uint8_t sock, const uint8_t *data, uint16_t len)
+{
+	// data len + header + footer
+	uint32_t totalLen = (uint32_t)len + 8;
+	uint8_t hdr[DATA_PKT_HDR_LEN];
+
+	hdr[0] = DATA_PKT;
+	hdr[1] = SEND_DATA_TCP_CMD;
+	hdr[2] = totalLen & 0xFF;
+	hdr[3] = (totalLen >> 8) & 0xFF;
+	hdr[4] = (totalLen >> 16) & 0xFF;
+	hdr[5] = (totalLen >> 24) & 0xFF;
+	hdr[6] = sock;
+
+	return commDrv.writeServerDataAsync(hdr, data, totalLen);
+}
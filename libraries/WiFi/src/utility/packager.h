@@ -41,14 +41,13 @@ typedef enum eProtMode {TCP_MODE, UDP_MODE}tProtMode;
 class Packager
 {
 private:
-	// settings of requested network
-	static char 	_networkSsid[WL_NETWORKS_LIST_MAXNUM][WL_SSID_MAX_LENGTH];
-	
+#ifndef WIFI_LOW_MEMORY
 	// firmware version string in the format a.b.c
 	static char 	fwVersion[WL_FW_VER_LENGTH];
 
 	// settings of current selected network
 	static char 	_ssid[WL_SSID_MAX_LENGTH];
+#endif
 
 	/*
 	 * Get network Data information
@@ -193,13 +192,11 @@ public:
 	static bool getScanNetworks(uint8_t which);
 
     /*
-     * Return the SSID discovered during the network scan.
+     * Get the whole list of the networks discovered during the scan
      *
-     * param networkItem: specify from which network item want to get the information
-	 *
-     * return: ssid string of the specified item on the networks scanned list
+     * param maxItems: maximum number of networks to send back
      */
-    static char* getSSIDNetoworks(uint8_t networkItem);
+    static bool getScanList(uint8_t maxItems);
 
     /*
      * Return the RSSI of the networks discovered during the scanNetworks
@@ -229,7 +226,8 @@ public:
 
 	static bool startClient(uint32_t ipAddress, uint16_t port, uint8_t sock, uint8_t protMode=TCP_MODE);
 
-	static bool stopClient(uint8_t sock);
+	// listen: the esp closes the listening socket of a server too (WIFI_CAP_STOP_SERVER)
+	static bool stopClient(uint8_t sock, bool listen = false);
                                                                                   
     static bool getServerState(uint8_t sock);
 
@@ -239,12 +237,41 @@ public:
 
 	static bool getAvailable(uint8_t sock);
 
+    /*
+     * Ask in a single batch packet the client state and the available bytes
+     * of every socket of mask
+     */
+    static bool getSocketsStatus(tSockMask mask);
+
     static bool getData(uint8_t sock, uint8_t peek = 0);
 
+    /*
+     * Move to the next UDP datagram and ask its size, its sender and up to
+     * maxFirst of its bytes
+     */
+    static bool parsePacketUdp(uint8_t sock, uint8_t maxFirst);
+
     static bool getDataBuf(uint8_t sock, uint16_t len = 25);
 
     static bool sendData(uint8_t sock, const uint8_t *data, uint16_t len);
 
+    /*
+     * Send the same data on every socket of sockMask (bit n for socket n),
+     * the esp makes the copies
+     */
+    static bool sendDataMulti(uint8_t sockMask, const uint8_t *data, uint16_t len);
+
+    /*
+     * Send the cnt segments of iov as a single data packet of len payload bytes
+     */
+    static bool sendDataV(uint8_t sock, const tsIoVec *iov, uint8_t cnt, uint32_t len);
+
+    /*
+     * Start an interrupt driven transmission of data on the socket.
+     * data must stay valid until SpiDrv::pumpBusy() returns false.
+     */
+    static bool sendDataAsync(uint8_t sock, const uint8_t *data, uint16_t len);
+
     static bool sendUdpData(uint8_t sock);
 
     friend class WiFiUDP;
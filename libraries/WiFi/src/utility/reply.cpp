@@ -0,0 +1,154 @@
+/*
+  This library is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Lesser General Public
+  License as published by the Free Software Foundation; either
+  version 2.1 of the License, or (at your option) any later version.
+
+  This library is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with this library; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+#include "Arduino.h"
+#include "utility/reply.h"
+
+// accepted number of parameters
+#define RP(n)		(1 << (n))
+
+/* -----------------------------------------------------------------
+* Replies of the esp to the commands, the most frequent ones first.
+* Commands missing here get no reply or a data packet.
+*/
+static const tsReplyDesc _replyTable[] PROGMEM = {
+	//  cmd						params				len	flags							handler
+	{ AVAIL_DATA_TCP_CMD,		RP(2),				10,	RS_RAW | RD_SOCK,				RH_SOCK_AVAIL },
+	{ SOCK_EVENT_NOTIFY,		RP(4),				14,	RS_NONE | RD_EVENT,				RH_SOCK_EVENT },
+	{ GET_CLIENT_STATE_TCP_CMD,	RP(2),				9,	RS_PARAM | RD_SOCK,				RH_SOCK_STATE },
+	{ GET_STATE_TCP_CMD,		RP(1),				0,	RS_PARAM,						RH_NONE },
+	{ GET_DATA_TCP_CMD,			RP(1),				0,	RS_PARAM,						RH_NONE },
+	{ BATCH_CMD,				0,					0,	RS_RAW,							RH_NONE },
+	{ PARSE_PACKET_UDP,			RP(4),				0,	RS_RAW,							RH_NONE },
+	{ GET_REMOTE_DATA_CMD,		RP(1) | RP(2),		0,	RS_PARAM,						RH_NONE },
+	{ SEND_DATA_UDP_CMD,		RP(1),				0,	RS_PARAM,						RH_NONE },
+	{ START_CLIENT_TCP_CMD,		RP(1),				0,	RS_PARAM,						RH_NONE },
+	{ STOP_CLIENT_TCP_CMD,		RP(1),				0,	RS_PARAM,						RH_NONE },
+	{ START_SERVER_TCP_CMD,		RP(1),				0,	RS_PARAM,						RH_NONE },
+	{ GET_HOST_BY_NAME_CMD,		RP(1),				0,	RS_PARAM,						RH_NONE },
+	{ GET_CURR_RSSI_CMD,		RP(1),				0,	RS_PARAM,						RH_NONE },
+	{ GET_CURR_ENCT_CMD,		RP(1),				0,	RS_PARAM,						RH_NONE },
+	{ GET_CURR_BSSID_CMD,		RP(1),				0,	RS_PARAM,						RH_NONE },
+	{ GET_IDX_RSSI_CMD,			RP(1),				0,	RS_PARAM,						RH_NONE },
+	{ GET_IDX_ENCT_CMD,			RP(1),				0,	RS_PARAM,						RH_NONE },
+	{ GET_CONN_STATUS,			RP(1),				7,	RS_PARAM,						RH_STATUS },
+	{ CONNECT_OPEN_AP,			RP(1),				7,	RS_PARAM | RD_ASYNC,			RH_CONNECT },
+	{ CONNECT_SECURED_AP,		RP(1),				7,	RS_PARAM | RD_ASYNC,			RH_CONNECT },
+	{ DISCONNECT_CMD,			RP(1),				7,	RS_PARAM | RD_ASYNC,			RH_CONNECT },
+	{ SET_KEY_CMD,				RP(1),				7,	RS_PARAM,						RH_CONNECT },
+	{ GET_IPADDR_CMD,			RP(3),				20,	RS_RAW,							RH_NONE },
+	{ GET_CURR_SSID_CMD,		RP(1),				0,	RS_RAW | RD_LONG,				RH_NONE },
+	{ GET_HOSTNAME,				RP(1),				0,	RS_RAW,							RH_NONE },
+	{ SET_HOSTNAME,				RP(1),				0,	RS_RAW,							RH_NONE },
+	{ GET_MACADDR_CMD,			RP(1),				12,	RS_RAW,							RH_NONE },
+	{ GET_FW_VERSION_CMD,		RP(1),				0,	RS_RAW,							RH_NONE },
+	{ START_SCAN_NETWORKS,		RP(1),				7,	RS_PARAM,						RH_NONE },
+	{ GET_CAPS_CMD,				RP(1),				0,	RS_NONE,						RH_CAPS },
+	{ ESP_READY,				0,					0,	RS_NONE,						RH_READY },
+};
+
+// -----------------------------------------------------------------
+static const tsReplyDesc* _replyDesc(uint8_t cmd)
+{
+	for(uint8_t i = 0; i < sizeof(_replyTable) / sizeof(_replyTable[0]); i++){
+		if(pgm_read_byte(&_replyTable[i].cmd) == cmd)
+			return &_replyTable[i];
+	}
+	return NULL;
+}
+
+// -----------------------------------------------------------------
+teReplyParse replyParse(const uint8_t* frame, uint8_t avail, tsReply* reply)
+{
+	const tsReplyDesc* desc;
+	uint8_t flags, len, fixed, params, nParam;
+	uint16_t p;
+
+	// START_CMD, cmd | REPLY_FLAG, len, nParam, [len, bytes]..., END_CMD
+	if(avail < 5 || frame[0] != START_CMD || (frame[1] & (REPLY_FLAG)) == 0)
+		return REPLY_BAD;
+	desc = _replyDesc(frame[1] & ~(REPLY_FLAG));
+	if(desc == NULL)
+		return REPLY_BAD;
+
+	flags = pgm_read_byte(&desc->flags);
+	len = frame[2];
+	if(len < 5)
+		return REPLY_BAD;
+	if(len > avail)
+		return ((flags & RD_LONG) && len <= REPLY_MAX_LEN) ? REPLY_MORE : REPLY_BAD;
+	if(frame[len - 1] != END_CMD)
+		return REPLY_BAD;
+
+	fixed = pgm_read_byte(&desc->len);
+	if(fixed != 0 && len != fixed)
+		return REPLY_BAD;
+
+	nParam = frame[3];
+	params = pgm_read_byte(&desc->params);
+	if(params != 0 && (nParam > 7 || (params & RP(nParam)) == 0))
+		return REPLY_BAD;
+	if((flags & RS_MASK) == RS_PARAM && nParam == 0)
+		return REPLY_BAD;
+
+	// every parameter ends before END_CMD
+	p = 4;
+	for(uint8_t i = 0; i < nParam; i++){
+		if(p >= len - 1)
+			return REPLY_BAD;
+		p += frame[p] + 1;
+	}
+	if(p > len - 1)
+		return REPLY_BAD;
+
+	reply->cmd = frame[1] & ~(REPLY_FLAG);
+	reply->flags = flags;
+	reply->hnd = pgm_read_byte(&desc->hnd);
+	reply->totalLen = len;
+	switch(flags & RS_MASK){
+		case RS_PARAM:
+			reply->data = frame + 5;
+			reply->dataLen = frame[4];
+		break;
+		case RS_RAW:
+			reply->data = frame + 4;
+			reply->dataLen = len - 5;
+		break;
+		default:
+			reply->data = NULL;
+			reply->dataLen = 0;
+		break;
+	}
+	return REPLY_OK;
+}
+
+// -----------------------------------------------------------------
+bool replyPacket(const uint8_t* frame, uint8_t avail, uint32_t* len)
+{
+	uint32_t n;
+
+	// DATA_PKT, cmd | REPLY_FLAG, len (4 bytes), payload, END_CMD
+	if(avail < 7 || frame[0] != DATA_PKT)
+		return false;
+	n = (uint32_t)frame[2] + ((uint32_t)frame[3] << 8) + ((uint32_t)frame[4] << 16) + ((uint32_t)frame[5] << 24);
+	// the length is kept in an int32_t with the header added
+	if(n > 0x7FFFFFF0)
+		return false;
+	if(n + 7 <= avail && frame[n + 6] != END_CMD)
+		return false;
+	*len = n;
+	return true;
+}
@@ -0,0 +1,90 @@
+/*
+  This library is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Lesser General Public
+  License as published by the Free Software Foundation; either
+  version 2.1 of the License, or (at your option) any later version.
+
+  This library is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with this library; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+#ifndef REPLY_H
+#define REPLY_H
+
+#include <inttypes.h>
+#include "utility/definitions.h"
+
+// longest command reply: it can go on in a second frame (RD_LONG)
+#define REPLY_MAX_LEN		64
+
+// shape of the data handed to the call waiting for the reply
+#define RS_NONE			0x00	// no data, the reply is only handled (RH_*)
+#define RS_PARAM		0x01	// value of the first parameter: data after its length byte, dataLen the length
+#define RS_RAW			0x02	// all the parameters with their length bytes
+#define RS_MASK			0x03
+// reply options
+#define RD_SOCK			0x04	// socket number in the first parameter, matched by the pending requests
+#define RD_ASYNC		0x08	// sent by the esp on its own too, even between the frames of a packet
+#define RD_EVENT		0x10	// notification: leaves the response flags of the blocking calls alone
+#define RD_LONG			0x20	// can go on in a second frame
+
+// work done on the reply before handing its data over
+typedef enum {
+	RH_NONE = 0,
+	RH_READY,			// the esp is ready
+	RH_CAPS,			// capabilities enabled by the esp
+	RH_STATUS,			// connection status
+	RH_CONNECT,			// connection status, notified to the sketch
+	RH_SOCK_STATE,		// [1, sock], [1, wl_tcp_state]
+	RH_SOCK_AVAIL,		// [1, sock], [2, available bytes]
+	RH_SOCK_EVENT,		// [1, sock], [1, flags], [1, wl_tcp_state], [2, available bytes]
+} teReplyHandler;
+
+typedef enum {
+	REPLY_BAD = 0,		// malformed or unknown reply
+	REPLY_OK,
+	REPLY_MORE,			// RD_LONG reply longer than the bytes given: read its second frame
+} teReplyParse;
+
+// expected shape of the reply to a command, in flash
+typedef struct{
+	uint8_t cmd;
+	uint8_t params;		// bit n set: n parameters accepted, 0 any number
+	uint8_t len;		// total length of a fixed size reply, 0 variable
+	uint8_t flags;		// RS_* and RD_*
+	uint8_t hnd;		// teReplyHandler
+} tsReplyDesc;
+
+typedef struct{
+	uint8_t cmd;		// without REPLY_FLAG
+	uint8_t flags;
+	uint8_t hnd;
+	uint8_t totalLen;
+	const uint8_t* data;	// NULL for RS_NONE
+	uint8_t dataLen;
+} tsReply;
+
+/*
+* Validates the command reply in the first avail bytes of frame against the
+* descriptor of its command: length, footer, number of parameters and the
+* length of each one. Never reads past frame[avail - 1].
+*
+* return: REPLY_OK with reply filled, REPLY_MORE or REPLY_BAD
+*/
+teReplyParse replyParse(const uint8_t* frame, uint8_t avail, tsReply* reply);
+
+/*
+* Validates the header of a data packet in the first avail bytes of frame,
+* and its footer when the packet fits in them.
+*
+* return: true with the payload length in len
+*/
+bool replyPacket(const uint8_t* frame, uint8_t avail, uint32_t* len);
+
+#endif
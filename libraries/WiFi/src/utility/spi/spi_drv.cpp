@@ -17,6 +17,7 @@
 #include <SPI.h>
 #include "spi_drv.h"
 #include "pins_arduino.h"
+#include <util/crc16.h>
 
 static tpDriverIsr spiIsr;
 
@@ -25,6 +26,30 @@ volatile bool SpiDrv::_interruptReq;
 volatile teEspStatus SpiDrv::espStatus = esp_wait_ready;
 volatile bool SpiDrv::multiRead = false;
 volatile bool SpiDrv::multiWrite = false;
+volatile tePumpState SpiDrv::pumpState = pump_idle;
+
+uint8_t SpiDrv::_pumpHdr[DATA_PKT_HDR_LEN];
+const uint8_t* SpiDrv::_pumpData = NULL;
+volatile uint32_t SpiDrv::_pumpLen = 0;
+volatile uint32_t SpiDrv::_pumpPos = 0;
+volatile uint8_t SpiDrv::_pumpFrameIdx = 0;
+volatile bool SpiDrv::_pumpAck = false;
+volatile uint32_t SpiDrv::_pumpStamp = 0;
+volatile uint32_t SpiDrv::_pumpAckStamp = 0;
+volatile uint32_t SpiDrv::_pumpDoneStamp = 0;
+
+volatile teRxState SpiDrv::rxState = rx_idle;
+#ifdef WIFI_ISR_RX
+volatile uint8_t SpiDrv::_rxQueue[WIFI_ISR_RX_FRAMES][SPI_BUF_LEN];
+volatile uint8_t SpiDrv::_rxQueueLen[WIFI_ISR_RX_FRAMES];
+volatile uint8_t SpiDrv::_rxHead = 0;
+volatile uint8_t SpiDrv::_rxTail = 0;
+volatile uint8_t SpiDrv::_rxIdx = 0;
+volatile uint8_t SpiDrv::_rxLen = 0;
+volatile bool SpiDrv::_rxSized = false;
+volatile uint32_t SpiDrv::_rxStamp = 0;
+uint32_t SpiDrv::_rxRemain = 0;
+#endif
 
 //SPI commands to manage the WiFi library
 enum ESP_SPI_COMMANDS
@@ -35,6 +60,11 @@ enum ESP_SPI_COMMANDS
 	ESP8266_DATA_WRITE		= 0x02
 } ESP_SPI_COMMANDS;
 
+// byte of a frame written out, in RAM or in flash
+static inline uint8_t frameByte(const uint8_t *p, bool progmem)
+{
+	return progmem ? pgm_read_byte(p) : *p;
+}
 
 
 /* -----------------------------------------------------------------
@@ -50,6 +80,10 @@ void _SRcallback(void)
 	if (digitalRead(SLAVEREADY) == HIGH) {
 		if(!SpiDrv::multiWrite && !SpiDrv::multiRead){
 			SpiDrv::espStatus = esp_busy;	// could it be an isr or an ack
+#ifdef WIFI_ISR_RX
+			// read the frame now if the bus is free, otherwise the main context does
+			if(!commDrv._rxStart())
+#endif
 			SpiDrv::_interruptReq = true;	// assume it is an isr
 		}
 		else{
@@ -57,14 +91,114 @@ void _SRcallback(void)
 				SpiDrv::_interruptReq = true;	// assume it is an isr
 			}
 			srLevelInMultipacket = HIGH;
+			// the frame pump is waiting for the ack pulse of the last frame
+			if(SpiDrv::pumpState == pump_wait_ack){
+				SpiDrv::_pumpAck = true;
+				SpiDrv::_pumpAckStamp = micros();
+			}
 		}	
 	}
 	else {
 		SpiDrv::espStatus = esp_idle;
 		if(SpiDrv::multiWrite || SpiDrv::multiRead)
 			srLevelInMultipacket = LOW;
+		// ack pulse is over: the esp is ready for the next frame
+		if(SpiDrv::pumpState == pump_wait_ack && SpiDrv::_pumpAck){
+			SpiDrv::_pumpAck = false;
+			commDrv._pumpStartFrame();
+		}
+#ifdef WIFI_ISR_RX
+		// the esp took the frame as read
+		if(SpiDrv::rxState == rx_wait_sr)
+			commDrv._rxDone();
+#endif
+	}
+}
+
+/* -----------------------------------------------------------------
+* SPI serial transfer complete callback, it moves the frame pump one byte ahead.
+* Each frame is made of the data write command, a dummy byte and SPI_BUF_LEN
+* bytes of the data packet (header, payload, END_CMD and zero padding).
+* With variable length frames the last one ends at END_CMD.
+*/
+void _pumpIsr(void)
+{
+	uint8_t b;
+
+	if(SpiDrv::pumpState != pump_frame && SpiDrv::pumpState != pump_wait_ack)
+		return;
+
+	if(SpiDrv::_pumpFrameIdx >= SPI_BUF_LEN + 2 ||
+		((commDrv._caps & WIFI_CAP_VARLEN) && SpiDrv::_pumpFrameIdx > 1 && SpiDrv::_pumpPos >= SpiDrv::_pumpLen)){
+		// the whole frame has been shifted out (or the packet is over and no padding is needed)
+		SPCR &= ~_BV(SPIE);
+		if(SpiDrv::_pumpPos >= SpiDrv::_pumpLen)
+			commDrv._pumpStop(pump_done);
+		return;
+	}
+
+	if(SpiDrv::_pumpFrameIdx == 1){
+		b = DUMMY_DATA;
+	}
+	else{
+		uint32_t pos = SpiDrv::_pumpPos++;
+		if(pos < DATA_PKT_HDR_LEN)
+			b = SpiDrv::_pumpHdr[pos];
+		else if(pos < SpiDrv::_pumpLen - 1)
+			b = SpiDrv::_pumpData[pos - DATA_PKT_HDR_LEN];
+		else if(pos == SpiDrv::_pumpLen - 1)
+			b = END_CMD;
+		else
+			b = 0;
+	}
+	SpiDrv::_pumpFrameIdx++;
+
+	// last byte of a frame: from now on the SR edge belongs to the frame ack
+	if(SpiDrv::_pumpFrameIdx == SPI_BUF_LEN + 2 && SpiDrv::_pumpPos < SpiDrv::_pumpLen){
+		SpiDrv::pumpState = pump_wait_ack;
+		SpiDrv::_pumpStamp = millis();
+	}
+
+	SPDR = b;
+}
+
+#ifdef WIFI_ISR_RX
+/* -----------------------------------------------------------------
+* SPI serial transfer complete callback of an interrupt driven read: the data
+* read command, a dummy byte and the bytes of the frame. A frame that starts
+* a packet is sized by its header as readDataISR() does.
+*/
+void _rxIsr(void)
+{
+	uint8_t i = SpiDrv::_rxIdx++;
+
+	if(i >= 2){
+		volatile uint8_t* frame = SpiDrv::_rxQueue[SpiDrv::_rxHead & (WIFI_ISR_RX_FRAMES - 1)];
+		uint8_t n = i - 1;
+
+		frame[n - 1] = SPDR;
+		if(SpiDrv::_rxSized && (n == 4 || n == 6)){
+			uint32_t pktLen = SPI_BUF_LEN;
+			if(frame[0] == START_CMD)
+				pktLen = frame[2];
+			else if(frame[0] == DATA_PKT && n == 4)
+				pktLen = 0;		// 4 bytes long length, known after two more bytes
+			else if(frame[0] == DATA_PKT)
+				pktLen = (uint32_t)frame[2] + ((uint32_t)frame[3] << 8) + ((uint32_t)frame[4] << 16) + ((uint32_t)frame[5] << 24) + DATA_PKT_HDR_LEN;
+			if(pktLen != 0){
+				SpiDrv::_rxLen = (pktLen < n) ? n : (pktLen > SPI_BUF_LEN) ? SPI_BUF_LEN : pktLen;
+				SpiDrv::_rxSized = false;
+			}
+		}
+		if(n >= SpiDrv::_rxLen){
+			SPCR &= ~_BV(SPIE);
+			commDrv._rxEnd();
+			return;
+		}
 	}
+	SPDR = (i == 0) ? DUMMY_DATA : 0;
 }
+#endif
 
 /* -----------------------------------------------------------------
 * the 328p addresses the esp via SPI interf. When the CS signal is active 
@@ -72,8 +206,21 @@ void _SRcallback(void)
 */
 void SpiDrv::_enableDevice(void)
 {
+#ifdef WIFI_ISR_RX
+	// the bus is free once the interrupt driven read is over
+	noInterrupts();
+	while(rxState != rx_idle){
+		interrupts();
+		_rxService();
+		noInterrupts();
+	}
+	digitalWrite(_ss_pin, LOW);
+	_ss_status = ss_low;
+	interrupts();
+#else
 	digitalWrite(_ss_pin, LOW);
 	_ss_status = ss_low;
+#endif
 }
 
 /* -----------------------------------------------------------------
@@ -103,6 +250,8 @@ bool SpiDrv::_checkEspStatusTimeout(teEspStatus checkStat)
 	
 	uint32_t t_check = millis() + ESP_SR_TIMEOUT;
 	uint32_t t_hold = 0;
+	bool ready = false;
+	SPI_STAT(uint32_t start = micros());
 	
 	while (t_check > millis() && espStatus != esp_idle){
 		// the ESP has something for the 328
@@ -114,19 +263,22 @@ bool SpiDrv::_checkEspStatusTimeout(teEspStatus checkStat)
 				handleSPIEvents();
 			}
 			//Has it finished?
-			if(espStatus == esp_idle)
+			if(espStatus == esp_idle){
 				// let's write.
-				return true;
+				ready = true;
+				break;
+			}
 		}
 	}
 	
 	// is ESP ready to get a write?
 	if(espStatus == esp_idle){
 		// let's write
-		return true;
+		ready = true;
 	}
 	
-	return false;
+	SPI_STAT(_statWait(start, ready));
+	return ready;
 }
 
 /* -----------------------------------------------------------------
@@ -139,9 +291,27 @@ bool SpiDrv::_checkEspStatusTimeout(teEspStatus checkStat)
 */
 bool SpiDrv::_checkSRpinStatusTimeout(bool checkStat)
 {
+	SPI_STAT(uint32_t start = micros());
 	t = millis();
 	while (t + ESP_SR_TIMEOUT > millis() && digitalRead(_sr_pin) != checkStat);
-	return (checkStat == digitalRead(_sr_pin));
+	bool ok = (checkStat == digitalRead(_sr_pin));
+	SPI_STAT(_statWait(start, ok));
+	return ok;
+}
+
+/* -----------------------------------------------------------------
+* Records the outcome of a transfer. Nothing reads it back yet, with
+* WIFI_SPI_STATS the failures are counted
+*/
+void SpiDrv::_setStatus(teSPI_Stat status)
+{
+	_spi_status = status;
+#ifdef WIFI_SPI_STATS
+	if(status == SPItimeout)
+		_stats.timeouts++;
+	else if(status == SPIerror)
+		_stats.errors++;
+#endif
 }
 
 /* -----------------------------------------------------------------
@@ -166,6 +336,7 @@ bool SpiDrv::_txBufAppendByte(uint8_t b)
 		wifiBuf[_txIndex++] = b;
 		return true;
 	}
+	_batchOverflow = true;
 	return false;
 }
 
@@ -190,6 +361,10 @@ void SpiDrv::_txBufSetOverallLen(bool dataPkt)
 */
 bool SpiDrv::_txBufFinalizePacket(bool dataPkt)
 {
+	// inside a batch the commands are written out all together by endBatch
+	if(_batching)
+		return !_batchOverflow;
+
 	// add the END_CMD to the buffer
 	_txBufAppendByte(END_CMD);
 	
@@ -200,6 +375,224 @@ bool SpiDrv::_txBufFinalizePacket(bool dataPkt)
 
 }
 
+/* -----------------------------------------------------------------
+* Starts shifting out the next frame of the pump. Called with the SS signal
+* asserted, both from the main context and from the SR pin interrupt.
+*/
+void SpiDrv::_pumpStartFrame(void)
+{
+	_pumpFrameIdx = 1;
+	pumpState = pump_frame;
+	_pumpStamp = millis();
+	SPCR |= _BV(SPIE);
+	SPDR = ESP8266_DATA_WRITE;
+}
+
+/* -----------------------------------------------------------------
+* Terminates the frame pump releasing the SPI interface
+*/
+void SpiDrv::_pumpStop(tePumpState state)
+{
+	SPCR &= ~_BV(SPIE);
+	multiWrite = false;
+	_pumpDoneStamp = micros();
+	pumpState = state;
+	_disableDevice();
+}
+
+/* -----------------------------------------------------------------
+* Watches the frame pump from the main context: an SR signal that stays HIGH
+* after a frame is an asynchronous event that has to be read before going on,
+* while no SR activity at all within ESP_SR_TIMEOUT is an error.
+*/
+void SpiDrv::_pumpService(void)
+{
+	bool event = false;
+
+	noInterrupts();
+	if(pumpState == pump_wait_ack && _pumpAck && srLevelInMultipacket == HIGH && (micros() - _pumpAckStamp) > 25){
+		// the SR pin did not go back low: it is not an ack
+		_pumpAck = false;
+		event = true;
+	}
+	interrupts();
+
+	if(event){
+		// read the event and check if SR goes low (inside the read function)
+		if(spiIsr)
+			spiIsr();
+
+		if(_ss_status == ss_high)
+			_enableDevice();
+
+		// after the read the SR is still HIGH, we have and error
+		if(srLevelInMultipacket == HIGH){
+			_setStatus(SPIerror);
+			_pumpStop(pump_error);
+		}
+		else
+			_pumpStartFrame();
+		return;
+	}
+
+	// the ISR writes the 32 bit stamp and can end the pump meanwhile
+	noInterrupts();
+	bool stalled = pumpBusy() && (millis() - _pumpStamp) > ESP_SR_TIMEOUT;
+	interrupts();
+
+	if(stalled){
+		_setStatus(SPItimeout);
+		_pumpStop(pump_error);
+	}
+}
+
+/* -----------------------------------------------------------------
+* Blocks until the frame pump has released the SPI interface. The esp needs
+* about 1 ms to process the last frame before accepting a new command.
+*/
+void SpiDrv::_waitPump(void)
+{
+	while(pumpBusy())
+		_pumpService();
+
+	if(pumpState == pump_done){
+		while((micros() - _pumpDoneStamp) < 1000);
+		pumpState = pump_idle;
+	}
+}
+
+/* -----------------------------------------------------------------
+* Returns true while a data packet is being shifted out by the frame pump
+*/
+bool SpiDrv::pumpBusy(void)
+{
+	return (pumpState == pump_frame || pumpState == pump_wait_ack);
+}
+
+#ifdef WIFI_ISR_RX
+/* -----------------------------------------------------------------
+* Starts an interrupt driven read of the frame announced by the SR signal.
+* Called with the interrupts disabled, from the SR interrupt or from the main
+* context once a slot of the queue is free.
+*
+* return: (boolean)
+*		  true if the read started
+*		  false if the bus is taken or the queue is full: the main context reads the frame.
+*/
+bool SpiDrv::_rxStart(void)
+{
+	// a frame received during a duplex write is older than the ones the esp is announcing
+	if(rxState != rx_idle || _ss_status != ss_high || pumpBusy() || _duplexReady ||
+		(uint8_t)(_rxHead - _rxTail) >= WIFI_ISR_RX_FRAMES)
+		return false;
+
+	_rxIdx = 0;
+	_rxLen = SPI_BUF_LEN;
+	_rxSized = (_rxRemain == 0) && (_caps & WIFI_CAP_VARLEN);
+	_rxStamp = millis();
+	rxState = rx_frame;
+
+	digitalWrite(_ss_pin, LOW);
+	_ss_status = ss_low;
+	SPCR |= _BV(SPIE);
+	SPDR = ESP8266_DATA_READ;
+	return true;
+}
+
+/* -----------------------------------------------------------------
+* All the bytes of the frame have been clocked: the esp lowers the SR when it
+* has taken the frame as read
+*/
+void SpiDrv::_rxEnd(void)
+{
+	volatile uint8_t* frame = _rxQueue[_rxHead & (WIFI_ISR_RX_FRAMES - 1)];
+
+	for(uint8_t i = _rxLen; i < SPI_BUF_LEN; i++)
+		frame[i] = 0;
+	_rxQueueLen[_rxHead & (WIFI_ISR_RX_FRAMES - 1)] = _rxLen;
+
+	// a short frame ends with the CS rising edge
+	if(_rxLen < SPI_BUF_LEN)
+		_disableDevice();
+
+	rxState = rx_wait_sr;
+	if(espStatus == esp_idle)
+		_rxDone();
+}
+
+/* -----------------------------------------------------------------
+* Releases the bus and hands the frame over to the main context
+*/
+void SpiDrv::_rxDone(void)
+{
+	if(_ss_status == ss_low)
+		_disableDevice();
+
+	_rxTrack(_rxQueue[_rxHead & (WIFI_ISR_RX_FRAMES - 1)], _rxLen);
+	_rxHead++;
+	rxState = rx_idle;
+}
+
+/* -----------------------------------------------------------------
+* Watches the interrupt driven read from the main context. An esp that doesn't
+* lower the SR within ESP_SR_TIMEOUT gets the frame as read anyway, as in
+* readDataISR(); a frame that stops being clocked is dropped.
+*/
+void SpiDrv::_rxService(void)
+{
+	bool stalled;
+
+	noInterrupts();
+	stalled = (rxState != rx_idle) && (millis() - _rxStamp) > ESP_SR_TIMEOUT;
+	if(stalled){
+		SPCR &= ~_BV(SPIE);
+		if(rxState == rx_wait_sr)
+			_rxDone();
+		else{
+			_disableDevice();
+			rxState = rx_idle;
+		}
+	}
+	interrupts();
+
+	if(stalled)
+		_setStatus(SPItimeout);
+}
+
+/* -----------------------------------------------------------------
+* Follows the packets across the frames read, by the interrupt or by the main
+* context, so that only a frame starting a packet is sized by its header
+*/
+void SpiDrv::_rxTrack(const volatile uint8_t *frame, uint8_t len)
+{
+	uint32_t pktLen = 0;
+
+	if(_rxRemain > 0){
+		_rxRemain = (_rxRemain > SPI_BUF_LEN) ? _rxRemain - SPI_BUF_LEN : 0;
+		return;
+	}
+
+	if(frame[0] == START_CMD)
+		pktLen = frame[2];
+	else if(frame[0] == DATA_PKT && len >= 6)
+		pktLen = (uint32_t)frame[2] + ((uint32_t)frame[3] << 8) + ((uint32_t)frame[4] << 16) + ((uint32_t)frame[5] << 24) + DATA_PKT_HDR_LEN;
+	_rxRemain = (pktLen > SPI_BUF_LEN) ? pktLen - SPI_BUF_LEN : 0;
+}
+#endif
+
+/* -----------------------------------------------------------------
+* Returns true if the esp has a frame for the callback: announced by the SR
+* signal or, with WIFI_ISR_RX, already read by the interrupt
+*/
+bool SpiDrv::_framePending(void)
+{
+#ifdef WIFI_ISR_RX
+	if(rxState != rx_idle || _rxTail != _rxHead)
+		return true;
+#endif
+	return (espStatus == esp_busy);
+}
+
 /*
 *
 */
@@ -207,6 +600,8 @@ bool SpiDrv::_askStatusInit(uint8_t attempts)
 {
 	uint32_t timeout;
 	
+	_waitPump();
+
 	while(attempts > 0){
 		attempts--;
 		_enableDevice();
@@ -230,7 +625,7 @@ bool SpiDrv::_askStatusInit(uint8_t attempts)
 	
 		timeout = millis() + 100;
 		while(timeout > millis()) {
-			if(espStatus == esp_busy){
+			if(_framePending()){
 				handleSPIEvents();
 				_disableDevice();
 				return true;
@@ -257,15 +652,14 @@ SpiDrv::SpiDrv(void)
 */
 void SpiDrv::begin()
 {
-	_spi_status = SPIerror;	//currently unused
+	_spi_status = SPIerror;
+	SPI_STAT(resetStats());
 	espStatus = esp_idle;
 	_ss_status = ss_high;
 	_interruptReq = false;
 	rxIndex = _txIndex = payloadSize = 0;
 	repetedError = 10;
 
-	pSpiDrv = this;
-
 	memset(wifiBuf, 0, SPI_TXBUF_LEN);
 
 	// this sets the sr pin from esp to 328 and attaches to it a PINCHANGE interrupt.
@@ -287,6 +681,9 @@ void SpiDrv::off()
 	espStatus = esp_wait_ready;
 	// NOTE: it requires to call the init to re-initialize the ESP module.
 	_espFirstLink = false;
+	// a restarted esp talks with full frames until the capabilities are exchanged again
+	_caps = 0;
+	_duplexReady = false;
 }
 
 void SpiDrv::on()
@@ -325,6 +722,8 @@ int SpiDrv::readStatus(bool ctrlReq)
 {
 	uint32_t ret = 0;
 
+	_waitPump();
+
 	// if needed pull-down the ss signal
 	if(ctrlReq)
 	_enableDevice();
@@ -338,9 +737,11 @@ int SpiDrv::readStatus(bool ctrlReq)
 		((uint32_t)(SPI.transfer(0)) << 8) |
 		((uint32_t)(SPI.transfer(0)) << 16) |
 		((uint32_t)(SPI.transfer(0)) << 24));
+		SPI_STAT(_stats.txWire += 5);
+		_setStatus(SPIok);
 	}
 	else
-	_spi_status = SPItimeout; //TODO what to do? reset device? TODO
+	_setStatus(SPItimeout);
 
 	if(!ctrlReq)
 	return((int)ret);
@@ -349,10 +750,8 @@ int SpiDrv::readStatus(bool ctrlReq)
 	_disableDevice();
 
 	// wait fot the sr to go low = idle (not busy in this case)
-	if(_checkSRpinStatusTimeout(LOW))
-	_spi_status = SPIerror; //TODO what to do? reset device? TODO
-
-	_spi_status = SPIok;
+	if(!_checkSRpinStatusTimeout(LOW))
+	_setStatus(SPIerror);
 
 	return ((int)ret);
 }
@@ -363,6 +762,8 @@ int SpiDrv::readStatus(bool ctrlReq)
 */
 void SpiDrv::writeStatus(uint32_t status, bool ctrlReq, bool checkLevel)
 {
+
+	_waitPump();
 	// if needed pull-down the ss signal
 	if(ctrlReq)
 	_enableDevice();
@@ -376,18 +777,19 @@ void SpiDrv::writeStatus(uint32_t status, bool ctrlReq, bool checkLevel)
 		SPI.transfer((status >> 8) & 0xFF);
 		SPI.transfer((status >> 16) & 0xFF);
 		SPI.transfer((status >> 24) & 0xFF);
+		SPI_STAT(_stats.txWire += 5);
+		_setStatus(SPIok);
 	}
 	else
-	_spi_status = SPItimeout; //TODO what to do? reset device? TODO
+	_setStatus(SPItimeout);
 
 	// If require pull-up the ss signal
 	if(ctrlReq)
 	_disableDevice();
 
-	if(_checkSRpinStatusTimeout(checkLevel))
-	_spi_status = SPIerror; //TODO what to do? reset device? TODO
-
-	_spi_status = SPIok;
+	// the esp leaves the level once it has taken the new status
+	if(!_checkSRpinStatusTimeout(!checkLevel))
+	_setStatus(SPIerror);
 }
 
 /*
@@ -395,13 +797,45 @@ void SpiDrv::writeStatus(uint32_t status, bool ctrlReq, bool checkLevel)
 */
 bool SpiDrv::establishESPConnection()
 {
-	uint32_t timeout = millis() + 1000;
 	if(_espFirstLink == false){
 		_espFirstLink = _askStatusInit(WL_MAX_ATTEMPT_CONNECTION);
+		if(_espFirstLink)
+			_askCaps();
 	}
 	return _espFirstLink;
 }
 
+/* -----------------------------------------------------------------
+* Exchanges the protocol capabilities with the esp: the 328 sends the ones
+* it supports (WIFI_HOST_CAPS) and the esp replies with the ones it enables.
+* A firmware that reads only the first byte replies with one byte, so the
+* capabilities over 0x80 stay off. A firmware that doesn't know GET_CAPS_CMD
+* doesn't reply and the link keeps using the basic protocol (full 32 bytes frames).
+*/
+void SpiDrv::_askCaps(void)
+{
+	uint8_t hostCaps[2] = { (uint8_t)(WIFI_HOST_CAPS & 0xFF), (uint8_t)(WIFI_HOST_CAPS >> 8) };
+
+	_caps = 0;
+	_capsReplied = false;
+
+	sendCmd(GET_CAPS_CMD, PARAM_NUMS_1);
+	if(!sendParam(hostCaps, sizeof(hostCaps), LAST_PARAM))
+		return;
+
+	uint32_t start = millis();
+	while(!_capsReplied && (millis() - start) < WIFI_PROBE_TIMEOUT)
+		handleSPIEvents();
+}
+
+/* -----------------------------------------------------------------
+* Returns the protocol capabilities enabled on the link (WIFI_CAP_xxx)
+*/
+uint16_t SpiDrv::caps(void)
+{
+	return _caps;
+}
+
 /* Cmd Struct Message
 *  _________________________________________________________________________________ 
 * | START CMD | C/R  | CMD  |[TOT LEN]| N.PARAM | PARAM LEN | PARAM  | .. | END CMD |
@@ -426,6 +860,8 @@ uint32_t SpiDrv::sendData(uint8_t cmd, uint8_t* data, uint32_t len)
 	uint8_t nPacket = (len - txBytes) >> 5;
 	uint8_t lastBytes = (len - txBytes) - (nPacket << 5);
 
+	_waitPump();
+
 	_enableDevice();
 	
 	// wait for the sr signal high - esp is ready
@@ -485,6 +921,14 @@ uint32_t SpiDrv::sendData(uint8_t cmd, uint8_t* data, uint32_t len)
 */
 bool SpiDrv::sendCmd(uint8_t cmd, uint8_t numParam)
 {
+	if(_batching){
+		// append the sub-command and update the number of commands in the batch
+		_txBufAppendByte(cmd & ~(REPLY_FLAG));
+		_txBufAppendByte(numParam);
+		wifiBuf[3]++;
+		return !_batchOverflow;
+	}
+
 	// init the buffer (32 bytes) with the START_CMD
 	_txBufInitWByte(START_CMD);
 	// attach the cmd + the complement of the REPLY_FLAG
@@ -502,6 +946,41 @@ bool SpiDrv::sendCmd(uint8_t cmd, uint8_t numParam)
 	return true;
 }
 
+/* -----------------------------------------------------------------
+* Starts collecting the following commands in a single BATCH_CMD packet:
+* START_CMD, BATCH_CMD, len, cmdNum, [cmd, nParam, [paramLen, param]...]..., END_CMD
+* Data packets can't be part of a batch.
+*/
+void SpiDrv::beginBatch(void)
+{
+	_txBufInitWByte(START_CMD);
+	_txBufAppendByte(BATCH_CMD);
+	// put the space for the overall len - 1 byte
+	_txBufAppendByte(0);
+	// number of commands in the batch
+	_txBufAppendByte(0);
+
+	_batchOverflow = false;
+	_batching = true;
+}
+
+/* -----------------------------------------------------------------
+* Closes the batch and writes it out to esp
+*
+* return: (boolean)
+*		  true batch sent
+*		  false batch too long or write error.
+*/
+bool SpiDrv::endBatch(void)
+{
+	_batching = false;
+
+	if(_batchOverflow || wifiBuf[3] == 0)
+		return false;
+
+	return _txBufFinalizePacket();
+}
+
 /* -----------------------------------------------------------------
 * Prepares the _wifiBuf to be sent as a new data pkt to esp
 * It requires also the number of attached parameters.
@@ -576,22 +1055,42 @@ bool SpiDrv::sendParam(uint8_t *param, uint8_t param_len, uint8_t lastParam)
 	return true;
 }
 
+/* -----------------------------------------------------------------
+* Writes out a command frame built by the caller, in RAM or in flash
+* (progmem). Inside a batch only its command and parameters are appended.
+*/
+bool SpiDrv::sendFrame(const uint8_t *frame, uint8_t len, bool progmem)
+{
+	if(_batching){
+		// START_CMD, len and END_CMD belong to the batch: cmd, nParam, [len, param]...
+		_txBufAppendByte(frameByte(frame + 1, progmem));
+		for(uint8_t i = 3; i < len - 1; i++)
+			_txBufAppendByte(frameByte(frame + i, progmem));
+		wifiBuf[3]++;
+		return !_batchOverflow;
+	}
+	return writeData(frame, len, progmem);
+}
+
 /* -----------------------------------------------------------------
 * Writes to the esp a pre-allocated buffer (mainly used for _wifiBuf)
 *
 * params: uint8_t* data:	the buffer pointer
 *		  uint16_t len:		number of parameters to read
-*		  bool ctrlReq:		used to control the ss signal based on the calling function structure
+*		  bool progmem:		the buffer is in flash
 */
-bool SpiDrv::writeData(uint8_t *data, uint32_t len)
+bool SpiDrv::writeData(const uint8_t *data, uint32_t len, bool progmem)
 {
-	// calculate the number of packets required to send all the data (rounded to the floor)
-	uint8_t pktNum = (uint8_t)(len >> 5);
+	// calculate the number of packets required to send all the data (rounded to the floor),
+	// a flash segment can be 64KB long: more than 255 of them
+	uint16_t pktNum = (uint16_t)(len >> 5);
 	// evaluate the extra-bytes from the floor to the real dimension that will become part of a zero-filled packet
-	uint16_t extraByteNum = len - (pktNum << 5);
+	uint8_t extraByteNum = (uint8_t)(len & (SPI_BUF_LEN - 1));
 	uint32_t byteWritten = 0;
 	bool ret = true;
 	
+	_waitPump();
+
 	if(pktNum > 0)
 		multiWrite = true;
 	else
@@ -602,8 +1101,19 @@ bool SpiDrv::writeData(uint8_t *data, uint32_t len)
 
 	_enableDevice();
 
+	// a pending frame of the esp is received while writing instead of being read first
+	bool duplex = _duplexStart(pktNum == 0);
+	bool ready;
+
 	// wait for the sr signal high - esp is ready
-	if(_checkEspStatusTimeout(esp_idle)){
+#ifdef WIFI_LOW_MEMORY
+	_txStaged = (data == wifiBuf);
+#endif
+	ready = duplex || _checkEspStatusTimeout(esp_idle);
+#ifdef WIFI_LOW_MEMORY
+	_txStaged = false;
+#endif
+	if(ready){
 		if(_ss_status == HIGH){ // if in the meanwhile a read occurred, SS has become HIGH
 			_enableDevice();
 		}
@@ -615,25 +1125,29 @@ bool SpiDrv::writeData(uint8_t *data, uint32_t len)
 			SPI.transfer((uint8_t)(DUMMY_DATA));
 			
 			for (uint8_t j = 0; j < SPI_BUF_LEN; j++) {
-				SPI.transfer(data[j + byteWritten]);
+				SPI.transfer(frameByte(data + j + byteWritten, progmem));
 			}
 			byteWritten += SPI_BUF_LEN;
 			
 			// check ack
 			uint32_t timeout = millis() + 5000;
+			SPI_STAT(uint32_t start = micros());
 			// wait for the SR to go HIGH
 			while(srLevelInMultipacket != HIGH && timeout > millis());
+			SPI_STAT(_statWait(start, srLevelInMultipacket == HIGH));
 			// if the SR is HIGH before the end of the timeout..
 			if(srLevelInMultipacket == HIGH){
 				// wait for the ack pulse to go back low
 				delayMicroseconds(25);
 				// if it doesn't go low -> we could have an async event.
 				if(srLevelInMultipacket == HIGH){
+					SPI_STAT(_stats.events++);
 					_interruptReq = true;
 					// read the event and check if SR goes low (inside the read function)
 					handleSPIEvents();
 					// after the read the SR is still HIGH, we have and error
 					if(srLevelInMultipacket == HIGH){
+						_setStatus(SPIerror);
 						multiWrite = false;
 						_disableDevice();
 						return false;
@@ -642,6 +1156,7 @@ bool SpiDrv::writeData(uint8_t *data, uint32_t len)
 			}
 			// timeout is over...and I have an error
 			else{
+				_setStatus(SPItimeout);
 				multiWrite = false;
 				_disableDevice();
 				return false;
@@ -654,15 +1169,25 @@ bool SpiDrv::writeData(uint8_t *data, uint32_t len)
 			
 			for (uint8_t j = 0; j < SPI_BUF_LEN; j++) {
 				if (j < extraByteNum) {
-					SPI.transfer(data[j + byteWritten]);
+					_txByte(frameByte(data + j + byteWritten, progmem));
 				}
+				else if(_caps & WIFI_CAP_VARLEN)
+					break;		// the esp takes the frame end from the CS rising edge
 				else
-				SPI.transfer(0);
+				_txByte(0);
 			}
+			if(duplex)
+				_duplexEnd();
 		}
+#ifdef WIFI_SPI_STATS
+		uint8_t hdr[2];
+		hdr[0] = frameByte(data, progmem);
+		hdr[1] = frameByte(data + 1, progmem);
+		_statTx(hdr, len);
+#endif
 	}
 	else{
-		_spi_status = SPItimeout;
+		_setStatus(SPItimeout);
 		ret = false;
 	}
 	
@@ -671,26 +1196,95 @@ bool SpiDrv::writeData(uint8_t *data, uint32_t len)
 		multiWrite = false;
 
 	_disableDevice();
+
+	// the frame received during the write goes where a read before it would have gone
+	if(duplex)
+		handleSPIEvents();
 		
 	return ret;
 }
 
+/* -----------------------------------------------------------------
+* Starts reading the payload of a data packet out of a list of segments
+*/
+void SpiDrv::_iovBegin(const tsIoVec* iov, uint8_t cnt)
+{
+	_iov = iov;
+	_iovCnt = cnt;
+	_iovSeg = 0;
+	_iovOff = 0;
+	_iovPos = 0;
+}
+
+/* -----------------------------------------------------------------
+* Payload byte at position pos. Reading forward costs nothing, going back
+* (windowed frames sent again) restarts from the first segment.
+*/
+uint8_t SpiDrv::_iovByte(uint32_t pos)
+{
+	if(pos < _iovPos)
+		_iovBegin(_iov, _iovCnt);
+
+	while(_iovSeg < _iovCnt){
+		const tsIoVec* v = &_iov[_iovSeg];
+		if(pos - _iovPos < (uint32_t)(v->len - _iovOff)){
+			_iovOff += (uint16_t)(pos - _iovPos);
+			_iovPos = pos;
+			return v->progmem ? pgm_read_byte(v->data + _iovOff) : v->data[_iovOff];
+		}
+		_iovPos += v->len - _iovOff;
+		_iovSeg++;
+		_iovOff = 0;
+	}
+	return 0;
+}
+
 bool SpiDrv::writeServerData(uint8_t *data, uint32_t len)
 {
-	uint8_t pktNum = (uint8_t)(len >> 5);
+	// retrieve the address at which we have stored the data to be sent
+	// start (1 byte), cmd (1 byte), size (4 bytes), sock (1 byte)
+	memcpy(&_iovOne.data, &data[DATA_PKT_HDR_LEN], sizeof(_iovOne.data));
+	_iovOne.len = len - DATA_PKT_HDR_LEN - 1;
+	_iovOne.progmem = false;
+	_iovBegin(&_iovOne, 1);
+
+	return _writeServerData(data, len);
+}
+
+/* -----------------------------------------------------------------
+* Writes a data packet whose payload is made of cnt segments, as a single
+* frame sequence.
+*
+* params: uint8_t* hdr:		DATA_PKT_HDR_LEN bytes of packet header
+*		  tsIoVec* iov:		payload segments, in RAM or flash
+*		  uint32_t len:		overall packet length (header + payload + END_CMD)
+*/
+bool SpiDrv::writeServerDataV(const uint8_t *hdr, const tsIoVec *iov, uint8_t cnt, uint32_t len)
+{
+	_iovBegin(iov, cnt);
+
+	return _writeServerData(hdr, len);
+}
+
+// -----------------------------------------------------------------
+bool SpiDrv::_writeServerData(const uint8_t *data, uint32_t len)
+{
+	uint16_t pktNum = (uint16_t)(len >> 5);
 	// evaluate the extra-bytes from the floor to the real dimension that will become part of a zero-filled packet
-	uint8_t extraByteNum = (uint8_t)(len - (pktNum << 5));
+	uint8_t extraByteNum = (uint8_t)(len & (SPI_BUF_LEN - 1));
 	uint32_t byteWritten = 0;
 	// start (1 byte), cmd (1 byte), size (4 bytes), sock (1 byte)
 	uint8_t dataOffset = 7;
 	uint8_t nextPktSz = 0;
 	
 	bool ret = true;
-	uint16_t j = 0;
-	
-	// retrieve the address at which we have stored the data to be sent
-	volatile uint16_t addrMem = (uint16_t)(data[dataOffset] + (data[dataOffset + 1] << 8));
+	uint32_t j = 0;
 	
+	_waitPump();
+
+	if((_caps & WIFI_CAP_WINDOW) && len > SPI_BUF_LEN)
+		return _writeWindowed(data, len);
+
 	if(pktNum > 0)
 		multiWrite = true;
 	else
@@ -701,8 +1295,11 @@ bool SpiDrv::writeServerData(uint8_t *data, uint32_t len)
 	
 	_enableDevice();
 
+	// a pending frame of the esp is received while writing instead of being read first
+	bool duplex = _duplexStart(len <= SPI_BUF_LEN);
+
 	// wait for the ESP idle
-	if(_checkEspStatusTimeout(esp_idle)){
+	if(duplex || _checkEspStatusTimeout(esp_idle)){
 		if(_ss_status == HIGH){ // if in the meanwhile a read occurred, SS has become HIGH
 			_enableDevice();
 		}
@@ -713,7 +1310,7 @@ bool SpiDrv::writeServerData(uint8_t *data, uint32_t len)
 
 		// send header
 		for (j = 0; j < dataOffset; j++) {
-			SPI.transfer(data[j]);
+			_txByte(data[j]);
 		}
 		
 		byteWritten = 7;
@@ -723,32 +1320,41 @@ bool SpiDrv::writeServerData(uint8_t *data, uint32_t len)
 		// write out the data
 		while(byteWritten < len){
 			for(uint8_t k=0; k<nextPktSz; k++, j++){
-				if((len-1) - (byteWritten + k) > 0)
-					SPI.transfer(*(uint8_t*)(addrMem + j));
-				else if(len - (byteWritten + k) > 0){
-					SPI.transfer(END_CMD);
+				if((byteWritten + k) < (len - 1))
+					_txByte(_iovByte(j));
+				else if((byteWritten + k) < len){
+					_txByte(END_CMD);
 				}
+				else if(_caps & WIFI_CAP_VARLEN)
+					break;
 				else
-					SPI.transfer(0);
+					_txByte(0);
 			}
 			byteWritten += nextPktSz;
 			
 			
-			if(byteWritten >= len)
+			if(byteWritten >= len){
+				if(duplex)
+					_duplexEnd();
+				SPI_STAT(_statTx(data, len));
 				break;
+			}
 			
 			if((byteWritten % SPI_BUF_LEN) == 0){
 				nextPktSz = SPI_BUF_LEN;
 				// check ack
 				uint32_t timeout = millis() + 1000;
+				SPI_STAT(uint32_t start = micros());
 				// wait for the SR to go HIGH
 				while(srLevelInMultipacket != HIGH && timeout > millis());
+				SPI_STAT(_statWait(start, srLevelInMultipacket == HIGH));
 				// if the SR is HIGH before the end of the timeout..
 				if(srLevelInMultipacket == HIGH){
 					// wait for the ack pulse to go back low
 					delayMicroseconds(25);
 					// if it doesn't go low -> we could have an async event.
 					if(srLevelInMultipacket == HIGH){
+						SPI_STAT(_stats.events++);
 						_interruptReq = true;
 						// read the event and check if SR goes low (inside the read function)
 						handleSPIEvents();
@@ -758,6 +1364,7 @@ bool SpiDrv::writeServerData(uint8_t *data, uint32_t len)
 						
 						// after the read the SR is still HIGH, we have and error
 						if(srLevelInMultipacket == HIGH){
+							_setStatus(SPIerror);
 							multiWrite = false;
 							_disableDevice();
 							
@@ -767,6 +1374,7 @@ bool SpiDrv::writeServerData(uint8_t *data, uint32_t len)
 				}
 				// timeout is over...and I have an error
 				else{
+					_setStatus(SPItimeout);
 					multiWrite = false;
 					_disableDevice();
 
@@ -779,6 +1387,8 @@ bool SpiDrv::writeServerData(uint8_t *data, uint32_t len)
 			}
 		}
 	}
+	else
+		_setStatus(SPItimeout);
 
 	// if we were in a multipacket case, reset it and exit
 	if(multiWrite)
@@ -788,20 +1398,351 @@ bool SpiDrv::writeServerData(uint8_t *data, uint32_t len)
 
 	_disableDevice();
 
+	if(duplex)
+		handleSPIEvents();
+
+	return ret;
+}
+
+/* Windowed Frame
+*  _____________________________________________________
+* |  XID  |  SEQ  |   PACKET BYTES   |      CRC-8       |
+* |_______|_______|__________________|__________________|
+* | 8bit  | 8bit  |     29 bytes     | 8bit, XID..BYTES |
+* |_______|_______|__________________|__________________|
+*
+* Ack in the esp status register (little-endian)
+*  _____________________________________________________
+* |  XID  | FRAMES RECEIVED IN ORDER | FOLLOWING FRAMES |
+* |_______|__________________________|__________________|
+* | 8bit  |          16bit           |   8bit bitmap    |
+* |_______|__________________________|__________________|
+*/
+
+/* -----------------------------------------------------------------
+* Sends a multi-frame data packet in windows of WIFI_SPI_WINDOW frames written
+* back to back, without waiting for the ack pulse of each one. After a window
+* the esp status register tells which frames arrived: the ones lost or
+* corrupted (the esp checks the CRC) are sent again.
+*
+* params: uint8_t* hdr:		DATA_PKT_HDR_LEN bytes of packet header
+*		  uint32_t len:		overall packet length (header + payload + END_CMD)
+*
+* The payload is read with _iovByte.
+*
+* return: (boolean)
+*		  true if the esp received the whole packet
+*		  false otherwise.
+*/
+bool SpiDrv::_writeWindowed(const uint8_t *hdr, uint32_t len)
+{
+	uint16_t frames = (len + WIN_FRAME_DATA - 1) / WIN_FRAME_DATA;
+	uint16_t acked = 0;
+	uint8_t sack = 0;
+	uint8_t retries = 0;
+	bool ret = true;
+	SPI_STAT(uint16_t sent = 0);
+
+	// transfer ids never look like the start of a command or data packet
+	_winXid = (_winXid + 1) & 0x7F;
+	if(_winXid == 0)
+		_winXid = 1;
+
+	multiWrite = true;
+
+	_enableDevice();
+
+	// wait for the ESP idle
+	if(!_checkEspStatusTimeout(esp_idle)){
+		_setStatus(SPItimeout);
+		multiWrite = false;
+		_disableDevice();
+		return false;
+	}
+	if(_ss_status == HIGH){ // if in the meanwhile a read occurred, SS has become HIGH
+		_enableDevice();
+	}
+
+	while(acked < frames){
+		uint16_t last = (frames - acked > WIFI_SPI_WINDOW) ? acked + WIFI_SPI_WINDOW : frames;
+
+		// the first frame not acknowledged and the following ones the esp is missing
+		for(uint16_t f = acked; f < last; f++){
+			if(f > acked && (sack & (1 << (f - acked - 1))))
+				continue;
+			_winSendFrame(hdr, len, f);
+			SPI_STAT(sent++);
+			delayMicroseconds(WIN_FRAME_GAP_US);
+		}
+
+		// the esp raised the SR during the window: an async event has to be read first
+		if(srLevelInMultipacket == HIGH && !_winReadEvent()){
+			_setStatus(SPIerror);
+			ret = false;
+			break;
+		}
+
+		// read the ack out of the status register
+		SPI.transfer(ESP8266_STATUS_READ);
+		uint32_t status = (SPI.transfer(0) |
+		((uint32_t)(SPI.transfer(0)) << 8) |
+		((uint32_t)(SPI.transfer(0)) << 16) |
+		((uint32_t)(SPI.transfer(0)) << 24));
+		SPI_STAT(_stats.txWire += 5);
+		uint16_t inOrder = (uint16_t)(status >> 8);
+
+		if((status & 0xFF) != _winXid || inOrder < acked || inOrder > frames){
+			// stale or garbled ack: send the whole window again
+			inOrder = acked;
+			status = 0;
+		}
+
+		if(inOrder == acked && ++retries > WIN_MAX_RETRIES){
+			_setStatus(SPIerror);
+			ret = false;
+			break;
+		}
+		if(inOrder > acked)
+			retries = 0;
+		// no progress: the window is sent again
+		SPI_STAT(if(inOrder == acked) _stats.winRetries++);
+
+		acked = inOrder;
+		sack = (uint8_t)(status >> 24);
+	}
+	SPI_STAT(_statTx(hdr, len, sent, (uint32_t)sent * (SPI_BUF_LEN + 2)));
+
+	multiWrite = false;
+
+	delay(1);
+
+	_disableDevice();
+
 	return ret;
 }
 
+/* -----------------------------------------------------------------
+* Writes frame number 'frame' of a windowed transfer
+*/
+void SpiDrv::_winSendFrame(const uint8_t *hdr, uint32_t len, uint16_t frame)
+{
+	uint32_t pos = (uint32_t)frame * WIN_FRAME_DATA;
+	uint8_t crc = 0;
+	uint8_t b;
+
+	SPI.transfer((uint8_t)(ESP8266_DATA_WRITE));
+	SPI.transfer((uint8_t)(DUMMY_DATA));
+
+	crc = _crc8_ccitt_update(crc, _winXid);
+	SPI.transfer(_winXid);
+	b = (uint8_t)frame;
+	crc = _crc8_ccitt_update(crc, b);
+	SPI.transfer(b);
+
+	for(uint8_t k = 0; k < WIN_FRAME_DATA; k++, pos++){
+		if(pos < DATA_PKT_HDR_LEN)
+			b = hdr[pos];
+		else if(pos < len - 1)
+			b = _iovByte(pos - DATA_PKT_HDR_LEN);
+		else if(pos == len - 1)
+			b = END_CMD;
+		else
+			b = 0;
+		crc = _crc8_ccitt_update(crc, b);
+		SPI.transfer(b);
+	}
+
+	SPI.transfer(crc);
+}
+
+/* -----------------------------------------------------------------
+* Reads an async event raised in the middle of a windowed transfer
+*
+* return: (boolean)
+*		  true if the SR went back low
+*		  false otherwise.
+*/
+bool SpiDrv::_winReadEvent(void)
+{
+	// wait for the end of a possible pulse
+	delayMicroseconds(25);
+	if(srLevelInMultipacket == LOW)
+		return true;
+
+	SPI_STAT(_stats.events++);
+	_interruptReq = true;
+	// read the event and check if SR goes low (inside the read function)
+	handleSPIEvents();
+
+	if(_ss_status == HIGH)
+		_enableDevice();
+
+	// after the read the SR is still HIGH, we have and error
+	return (srLevelInMultipacket == LOW);
+}
+
+/* -----------------------------------------------------------------
+* Duplex write: when the esp has a frame ready (SR HIGH) and the packet to
+* write fits in a single frame, the esp shifts the first frame of its packet
+* out on MISO while the 328 shifts its own one in, saving the read transaction.
+* The esp takes its frame as read when the write clocked all of it. Called
+* with the CS LOW, when the esp doesn't change the SR.
+*
+* return: (boolean)
+*		  true if the frame written has to be captured
+*		  false otherwise.
+*/
+bool SpiDrv::_duplexStart(bool singleFrame)
+{
+	if(!(_caps & WIFI_CAP_DUPLEX) || !singleFrame || _duplexReady || multiRead || digitalRead(_sr_pin) != HIGH)
+		return false;
+
+	_duplexIdx = 0;
+	return true;
+}
+
+/* -----------------------------------------------------------------
+* Completes the frame of a duplex write and hands the received one over to
+* the callback, which gets it from readDataISR()
+*/
+void SpiDrv::_duplexEnd(void)
+{
+	uint8_t frameLen = SPI_BUF_LEN;
+
+	// not the start of a packet: the esp had nothing to hand over
+	if(_duplexBuf[0] != START_CMD && _duplexBuf[0] != DATA_PKT){
+		_duplexIdx = SPI_BUF_LEN;
+		return;
+	}
+
+	if(_caps & WIFI_CAP_VARLEN){
+		// clock the esp frame up to the end of its packet, as a sized read does
+		while(_duplexIdx < 6)
+			_txByte(0);
+		if(_duplexBuf[0] == START_CMD)
+			frameLen = _duplexBuf[2];
+		else{
+			uint32_t pktLen = (uint32_t)_duplexBuf[2] + ((uint32_t)_duplexBuf[3] << 8) + ((uint32_t)_duplexBuf[4] << 16) + ((uint32_t)_duplexBuf[5] << 24) + DATA_PKT_HDR_LEN;
+			frameLen = (pktLen > SPI_BUF_LEN) ? SPI_BUF_LEN : pktLen;
+		}
+		if(frameLen > SPI_BUF_LEN)
+			frameLen = SPI_BUF_LEN;
+	}
+
+	while(_duplexIdx < frameLen)
+		_txByte(0);
+	memset(_duplexBuf + _duplexIdx, 0, SPI_BUF_LEN - _duplexIdx);
+	_duplexIdx = SPI_BUF_LEN;
+
+	_duplexReady = true;
+	_interruptReq = true;
+}
+
+/* -----------------------------------------------------------------
+* Shifts out a byte of a frame, keeping the one received during a duplex write
+*/
+uint8_t SpiDrv::_txByte(uint8_t b)
+{
+	uint8_t r = SPI.transfer(b);
+
+	if(_duplexIdx < SPI_BUF_LEN)
+		_duplexBuf[_duplexIdx++] = r;
+	return r;
+}
+
+/* -----------------------------------------------------------------
+* Starts an interrupt driven transmission of a data packet. The header (hdr)
+* is copied, while the payload (data) is streamed out of the caller's memory
+* frame by frame, so it must stay valid until pumpBusy() returns false.
+*
+* params: uint8_t* hdr:		DATA_PKT_HDR_LEN bytes of packet header
+*		  uint8_t* data:	payload
+*		  uint32_t len:		overall packet length (header + payload + END_CMD)
+*
+* return: (boolean)
+*		  true if the transmission started
+*		  false otherwise.
+*/
+bool SpiDrv::writeServerDataAsync(uint8_t *hdr, const uint8_t *data, uint32_t len)
+{
+	// one packet at a time
+	_waitPump();
+
+	if(multiRead)
+		return false;
+
+	_enableDevice();
+
+	// wait for the ESP idle
+	if(!_checkEspStatusTimeout(esp_idle)){
+		_setStatus(SPItimeout);
+		_disableDevice();
+		return false;
+	}
+	if(_ss_status == HIGH){ // if in the meanwhile a read occurred, SS has become HIGH
+		_enableDevice();
+	}
+
+	memcpy(_pumpHdr, hdr, DATA_PKT_HDR_LEN);
+	_pumpData = data;
+	_pumpLen = len;
+	_pumpPos = 0;
+	_pumpAck = false;
+	multiWrite = true;
+	
+	_pumpStartFrame();
+	SPI_STAT(_statTx(hdr, len));
+
+	return true;
+}
+
 /* -----------------------------------------------------------------
 * Read data from the esp after an ISR event (32 bytes per time)
 * params: uint8_t* buffer:	data buffer to store the received data
+*		  bool sized:		the frame starts a packet. With variable length frames
+*							only the bytes of the packet are clocked, the length
+*							is taken from its header; the rest of the buffer is zeroed
 * 
 * return: (uint16_t)
 *		   byte read.
 */
-uint16_t SpiDrv::readDataISR(uint8_t *buffer)
+uint16_t SpiDrv::readDataISR(uint8_t *buffer, bool sized)
 {
 	uint16_t byteRead = SPI_BUF_LEN;
-	uint16_t ret = 0;
+	uint8_t i = 0;
+
+#ifdef WIFI_ISR_RX
+	// frames read by the interrupt come first, they are older than any other
+	while(rxState != rx_idle)
+		_rxService();
+	if(_rxTail != _rxHead){
+		uint8_t slot = _rxTail & (WIFI_ISR_RX_FRAMES - 1);
+		for(i = 0; i < SPI_BUF_LEN; i++)
+			buffer[i] = _rxQueue[slot][i];
+		byteRead = _rxQueueLen[slot];
+		_rxTail++;
+		SPI_STAT(_statRx(byteRead + 2));
+
+		// a frame left to the main context while the queue was full
+		noInterrupts();
+		if(espStatus == esp_busy && !_rxStart())
+			_interruptReq = true;
+		interrupts();
+		return byteRead;
+	}
+#endif
+
+	// frame already received during a duplex write
+	if(_duplexReady){
+		memcpy(buffer, _duplexBuf, SPI_BUF_LEN);
+		_duplexReady = false;
+		// clocked by the write
+		SPI_STAT(_statRx(0));
+		// the esp has already announced another frame
+		if(espStatus == esp_busy)
+			_interruptReq = true;
+		return SPI_BUF_LEN;
+	}
 
 	_enableDevice();
 
@@ -811,10 +1752,38 @@ uint16_t SpiDrv::readDataISR(uint8_t *buffer)
 		SPI.transfer((uint8_t)(ESP8266_DATA_READ));
 		SPI.transfer((uint8_t)(DUMMY_DATA));
 
-		// read all the 32 bytes available in the esp data out buffer
-		for (uint8_t i = 0; i < SPI_BUF_LEN; i++) {
+		if(sized && (_caps & WIFI_CAP_VARLEN)){
+			uint32_t pktLen;
+
+			// START_CMD, cmd, len, nParam or DATA_PKT, cmd, len (4 bytes)
+			for (; i < 4; i++)
+				buffer[i] = SPI.transfer(0);
+			if(buffer[0] == START_CMD)
+				pktLen = buffer[2];
+			else if(buffer[0] == DATA_PKT){
+				for (; i < 6; i++)
+					buffer[i] = SPI.transfer(0);
+				pktLen = (uint32_t)buffer[2] + ((uint32_t)buffer[3] << 8) + ((uint32_t)buffer[4] << 16) + ((uint32_t)buffer[5] << 24) + DATA_PKT_HDR_LEN;
+			}
+			else
+				pktLen = SPI_BUF_LEN;
+
+			byteRead = (pktLen < i) ? i : (pktLen > SPI_BUF_LEN) ? SPI_BUF_LEN : pktLen;
+		}
+
+		// read the rest of the frame
+		for (; i < byteRead; i++) {
 			buffer[i] = SPI.transfer(0);
 		}
+		if(byteRead < SPI_BUF_LEN){
+			memset(buffer + byteRead, 0, SPI_BUF_LEN - byteRead);
+			// a short frame ends with the CS rising edge
+			_disableDevice();
+		}
+		SPI_STAT(_statRx(byteRead + 2));
+#ifdef WIFI_ISR_RX
+		_rxTrack(buffer, byteRead);
+#endif
 	}
 	else{
 		// if the SR is still low, return with an error
@@ -827,21 +1796,26 @@ uint16_t SpiDrv::readDataISR(uint8_t *buffer)
 	
 	// after reading all the 32 byte long message we need to ensure that the SR goes low again
 	uint32_t t_hold = millis() + 1000;
+	SPI_STAT(uint32_t start = micros());
 	while(t_hold > millis()){
 		// if we are in a multipacket case...
 		if(multiRead){
-			if(srLevelInMultipacket == LOW)
+			if(srLevelInMultipacket == LOW){
+				SPI_STAT(_statWait(start, true));
 				return byteRead;
+			}
 		}
 		// if we are in a single packet case...
 		else{
 			if(espStatus == esp_idle){
+				SPI_STAT(_statWait(start, true));
 				// disable the CS and exit.
 				_disableDevice();
 				return byteRead;
 			}
 		}
 	}
+	SPI_STAT(_statWait(start, false));
 	if(multiRead)
 		multiRead = false;
 
@@ -855,6 +1829,18 @@ uint16_t SpiDrv::readDataISR(uint8_t *buffer)
 */
 void SpiDrv::handleSPIEvents(void)
 {
+	// the SPI bus belongs to the frame pump, events are read between frames
+	if(pumpBusy()){
+		_pumpService();
+		return;
+	}
+
+#ifdef WIFI_ISR_RX
+	// a frame read, or being read, by the interrupt
+	if(rxState != rx_idle || _rxTail != _rxHead)
+		_interruptReq = true;
+#endif
+
 	if(spiIsr && _interruptReq){
 		_interruptReq = false;
 		spiIsr();
@@ -869,6 +1855,205 @@ void SpiDrv::registerCB(tpDriverIsr pfIsr)
 	spiIsr = pfIsr;
 }
 
+#ifdef WIFI_SPI_STATS
+/* -----------------------------------------------------------------
+* Statistics slot of a command. With add a free slot is taken for a command
+* that has none yet.
+*
+* return: the slot, NULL if the command is not tracked
+*/
+tsSpiCmdStats* SpiDrv::_statCmd(uint8_t cmd, bool add)
+{
+	for(uint8_t i = 0; i < WIFI_SPI_STATS_CMDS; i++){
+		if(_stats.cmd[i].cmd == cmd)
+			return &_stats.cmd[i];
+		if(_stats.cmd[i].cmd == NONE){
+			if(!add)
+				return NULL;
+			_stats.cmd[i].cmd = cmd;
+			return &_stats.cmd[i];
+		}
+	}
+	return NULL;
+}
+
+/* -----------------------------------------------------------------
+* Records a packet written to the esp and starts timing its reply
+*
+* params: uint8_t* pkt:		the packet, or at least its header
+*		  uint32_t len:		overall packet length
+*		  uint16_t frames:	frames written, 0 for a plain frame sequence
+*		  uint32_t wire:	bytes clocked, when frames is not 0
+*/
+void SpiDrv::_statTx(const uint8_t *pkt, uint32_t len, uint16_t frames, uint32_t wire)
+{
+	if(frames == 0){
+		frames = (len + SPI_BUF_LEN - 1) / SPI_BUF_LEN;
+		// data write command and dummy byte, then full frames or just the packet bytes
+		wire = (uint32_t)frames * 2 + ((_caps & WIFI_CAP_VARLEN) ? len : (uint32_t)frames * SPI_BUF_LEN);
+	}
+
+	_stats.txPackets++;
+	_stats.txFrames += frames;
+	_stats.txBytes += len;
+	_stats.txWire += wire;
+	if(pkt[0] == DATA_PKT && len > DATA_PKT_HDR_LEN)
+		_stats.txData += len - DATA_PKT_HDR_LEN - 1;
+
+	tsSpiCmdStats* c = _statCmd(pkt[1] & ~(REPLY_FLAG), true);
+	if(c == NULL){
+		_stats.untracked++;
+		return;
+	}
+	c->sent++;
+	c->frames += frames;
+	// 0 means no reply pending
+	c->sentStamp = micros() | 1;
+}
+
+/* -----------------------------------------------------------------
+* Records a frame read from the esp, wire is the number of bytes clocked
+* (0 for the frames received during a duplex write)
+*/
+void SpiDrv::_statRx(uint16_t wire)
+{
+	_stats.rxFrames++;
+	_stats.rxWire += wire;
+}
+
+/* -----------------------------------------------------------------
+* Called with the first frame of each packet coming from the esp: a reply
+* to a command written before closes its round trip
+*/
+void SpiDrv::_statReply(const uint8_t *frame)
+{
+	if((frame[0] != START_CMD && frame[0] != DATA_PKT) || !(frame[1] & REPLY_FLAG))
+		return;
+
+	tsSpiCmdStats* c = _statCmd(frame[1] & ~(REPLY_FLAG), false);
+	if(c == NULL || c->sentStamp == 0)
+		return;
+
+	uint32_t us = micros() - c->sentStamp;
+	uint32_t limit = SPI_STATS_BUCKET0_US;
+	uint8_t b = 0;
+
+	c->sentStamp = 0;
+	c->replies++;
+	if(us > c->maxUs)
+		c->maxUs = us;
+	while(b < SPI_STATS_BUCKETS - 1 && us >= limit){
+		b++;
+		limit <<= 1;
+	}
+	c->hist[b]++;
+}
+
+/* -----------------------------------------------------------------
+* Records a wait for the esp started at micros() == start
+*/
+void SpiDrv::_statWait(uint32_t start, bool ok)
+{
+	uint32_t us = micros() - start;
+
+	_stats.srWaits++;
+	_stats.srWaitUs += us;
+	if(us > _stats.srMaxUs)
+		_stats.srMaxUs = us;
+	if(!ok)
+		_stats.srTimeouts++;
+}
+
+/* -----------------------------------------------------------------
+* Statistics of the SPI link collected since begin() or resetStats()
+*/
+const tsSpiStats& SpiDrv::stats(void)
+{
+	return _stats;
+}
+
+/* -----------------------------------------------------------------
+* Clears the statistics of the SPI link
+*/
+void SpiDrv::resetStats(void)
+{
+	memset(&_stats, 0, sizeof(_stats));
+}
+
+/* -----------------------------------------------------------------
+* Prints the statistics of the SPI link: overall counters, then one row per
+* command with the histogram of its reply latency (us).
+*/
+void SpiDrv::printStats(Print& out)
+{
+	out.print(F("tx: "));
+	out.print(_stats.txPackets);
+	out.print(F(" packets, "));
+	out.print(_stats.txFrames);
+	out.print(F(" frames, "));
+	out.print(_stats.txBytes);
+	out.print(F(" bytes ("));
+	out.print(_stats.txData);
+	out.print(F(" payload), "));
+	out.print(_stats.txWire);
+	out.println(F(" on the wire"));
+
+	out.print(F("rx: "));
+	out.print(_stats.rxFrames);
+	out.print(F(" frames, "));
+	out.print(_stats.rxWire);
+	out.println(F(" bytes on the wire"));
+
+	out.print(F("waits: "));
+	out.print(_stats.srWaits);
+	out.print(F(", "));
+	out.print(_stats.srWaitUs);
+	out.print(F(" us, longest "));
+	out.print(_stats.srMaxUs);
+	out.print(F(" us, "));
+	out.print(_stats.srTimeouts);
+	out.println(F(" given up"));
+
+	out.print(F("errors: "));
+	out.print(_stats.timeouts);
+	out.print(F(" timeouts, "));
+	out.print(_stats.errors);
+	out.print(F(" errors, "));
+	out.print(_stats.winRetries);
+	out.print(F(" windows sent again, "));
+	out.print(_stats.events);
+	out.print(F(" events during writes, "));
+	out.print(_stats.untracked);
+	out.println(F(" packets untracked"));
+
+	out.print(F("cmd\tsent\treplies\tframes\tmax"));
+	for(uint8_t b = 0; b < SPI_STATS_BUCKETS; b++){
+		out.print(b < SPI_STATS_BUCKETS - 1 ? F("\t<") : F("\t>="));
+		out.print((uint32_t)SPI_STATS_BUCKET0_US << (b < SPI_STATS_BUCKETS - 1 ? b : b - 1));
+	}
+	out.println();
+
+	for(uint8_t i = 0; i < WIFI_SPI_STATS_CMDS && _stats.cmd[i].cmd != NONE; i++){
+		tsSpiCmdStats* c = &_stats.cmd[i];
+		out.print(F("0x"));
+		out.print(c->cmd, HEX);
+		out.print('\t');
+		out.print(c->sent);
+		out.print('\t');
+		out.print(c->replies);
+		out.print('\t');
+		out.print(c->frames);
+		out.print('\t');
+		out.print(c->maxUs);
+		for(uint8_t b = 0; b < SPI_STATS_BUCKETS; b++){
+			out.print('\t');
+			out.print(c->hist[b]);
+		}
+		out.println();
+	}
+}
+#endif
+
 /* -----------------------------------------------------------------
 * HW interrupt that fires the sr signal callback
 */
@@ -877,4 +2062,19 @@ ISR(PCINT3_vect)
 	_SRcallback();
 }
 
+/* -----------------------------------------------------------------
+* HW interrupt that fires at the end of each byte shifted by the frame pump
+* or clocked by an interrupt driven read
+*/
+ISR(SPI0_STC_vect)
+{
+#ifdef WIFI_ISR_RX
+	if(SpiDrv::rxState == rx_frame){
+		_rxIsr();
+		return;
+	}
+#endif
+	_pumpIsr();
+}
+
 SpiDrv commDrv;
\ No newline at end of file
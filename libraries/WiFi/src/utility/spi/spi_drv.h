@@ -36,8 +36,30 @@
 #define SPI_BUF_LEN			32
 #define SPI_TXBUF_LEN		SPI_BUF_LEN << 1
 
+// RAM taken by the receive, transmit and duplex buffers, see WIFI_LOW_MEMORY
+#ifdef WIFI_LOW_MEMORY
+#define WIFI_SPI_BUF_RAM	(SPI_BUF_LEN + (SPI_TXBUF_LEN))
+#else
+#define WIFI_SPI_BUF_RAM	(SPI_BUF_LEN + 2 * (SPI_TXBUF_LEN))
+#endif
+
 #define ESP_SR_TIMEOUT      1000
 
+// windowed transfers: transfer id, sequence number, packet bytes and CRC-8 in each frame
+#define WIN_FRAME_DATA		(SPI_BUF_LEN - 3)
+// time given to the esp to fetch a frame out of the slave buffer before the next one
+#define WIN_FRAME_GAP_US	10
+// windows sent again without any progress before giving up
+#define WIN_MAX_RETRIES		8
+
+#if WIFI_SPI_WINDOW < 1 || WIFI_SPI_WINDOW > 9
+#error "WIFI_SPI_WINDOW must be between 1 and 9"
+#endif
+
+#if (WIFI_ISR_RX_FRAMES & (WIFI_ISR_RX_FRAMES - 1)) != 0 || WIFI_ISR_RX_FRAMES > 128
+#error "WIFI_ISR_RX_FRAMES must be a power of two not greater than 128"
+#endif
+
 #	define SLAVESELECT      22
 #	define SLAVEREADY       20
 
@@ -61,8 +83,70 @@ typedef enum {
 	esp_ack = 2,
 } teEspStatus;
 
+typedef enum {
+	pump_idle = 0,
+	pump_frame = 1,
+	pump_wait_ack = 2,
+	pump_done = 3,
+	pump_error = 4,
+} tePumpState;
+
+typedef enum {
+	rx_idle = 0,
+	rx_frame = 1,		// frame being clocked by the SPI interrupt
+	rx_wait_sr = 2,		// frame clocked, waiting for the esp to lower the SR
+} teRxState;
+
+// start (1 byte), cmd (1 byte), size (4 bytes), sock (1 byte)
+#define DATA_PKT_HDR_LEN	7
+
 typedef void (*tpDriverIsr)(void);
 
+#ifdef WIFI_SPI_STATS
+// reply latency histogram: bucket 0 up to SPI_STATS_BUCKET0_US, each following one twice as wide, the last one open
+#define SPI_STATS_BUCKETS		8
+#define SPI_STATS_BUCKET0_US	128
+
+// statistics of a single command
+typedef struct {
+	uint8_t cmd;
+	uint16_t sent;			// packets written
+	uint16_t replies;		// replies received after a write
+	uint32_t frames;		// frames written
+	uint32_t maxUs;			// slowest reply
+	uint32_t sentStamp;		// micros() of the last write, 0 when no reply is pending
+	uint16_t hist[SPI_STATS_BUCKETS];
+} tsSpiCmdStats;
+
+// statistics of the SPI link, collected in the main context only
+typedef struct {
+	uint32_t txPackets;		// command and data packets written
+	uint32_t txFrames;		// frames written, windowed ones sent again included
+	uint32_t txBytes;		// bytes of the packets written
+	uint32_t txData;		// payload bytes of the data packets written
+	uint32_t txWire;		// bytes clocked by the writes and by the status register accesses
+	uint32_t rxFrames;		// frames read, duplex ones included
+	uint32_t rxWire;		// bytes clocked by the reads
+	uint32_t srWaits;		// waits for the SR signal or for the esp status
+	uint32_t srWaitUs;		// time spent in them
+	uint32_t srMaxUs;		// longest one
+	uint16_t srTimeouts;	// waits given up
+	uint16_t winRetries;	// windows sent again
+	uint16_t events;		// async events read in the middle of a multi-frame write
+	uint16_t timeouts;		// transfers abandoned with SPItimeout
+	uint16_t errors;		// transfers abandoned with SPIerror
+	uint16_t untracked;		// packets of commands beyond WIFI_SPI_STATS_CMDS
+	tsSpiCmdStats cmd[WIFI_SPI_STATS_CMDS];
+} tsSpiStats;
+
+class Print;
+
+// statement compiled only with the link statistics
+#define SPI_STAT(x)		x
+#else
+#define SPI_STAT(x)
+#endif
+
 class SpiDrv
 {
 	private:
@@ -76,11 +160,29 @@ class SpiDrv
 	static volatile bool _interruptReq;
 	bool _espFirstLink = false;
 	uint8_t _txIndex;
+	bool _batching = false;
+	bool _batchOverflow;
+	// protocol capabilities enabled by both sides (WIFI_CAP_xxx)
+	uint16_t _caps = 0;
+	volatile bool _capsReplied;
+	uint8_t _winXid = 0;
+
+#ifndef WIFI_LOW_MEMORY
+	// frame received on MISO during a duplex write, handed to the callback as a read
+	uint8_t _duplexBuf[SPI_BUF_LEN];
+#else
+	// the command in wifiBuf is being written: its first half is still to be sent
+	bool _txStaged = false;
+#endif
+	uint8_t _duplexIdx = SPI_BUF_LEN;
+	volatile bool _duplexReady = false;
 
 	// function used to establish SPI communication after ESP reset
 	bool _askStatusInit(uint8_t attempts);
+	void _askCaps(void);
 	bool _checkSRpinStatusTimeout(bool checkStat);
 	bool _checkEspStatusTimeout(teEspStatus checkStat);
+	void _setStatus(teSPI_Stat status);
 	void _enableDevice(void);
 	void _disableDevice(void);
 	
@@ -89,20 +191,122 @@ class SpiDrv
 	bool _txBufFinalizePacket(bool dataPkt = false);
 	void _txBufSetOverallLen(bool dataPkt = false);
 
+	// payload of the data packet being written: segments in RAM or flash and read position
+	const tsIoVec* _iov;
+	uint8_t _iovCnt;
+	uint8_t _iovSeg;
+	uint16_t _iovOff;
+	uint32_t _iovPos;
+	tsIoVec _iovOne;
+	void _iovBegin(const tsIoVec* iov, uint8_t cnt);
+	uint8_t _iovByte(uint32_t pos);
+	bool _writeServerData(const uint8_t *hdr, uint32_t len);
+
+	// windowed transfer of a multi-frame data packet
+	bool _writeWindowed(const uint8_t *hdr, uint32_t len);
+	void _winSendFrame(const uint8_t *hdr, uint32_t len, uint16_t frame);
+	bool _winReadEvent(void);
+
+	// duplex write of a single frame packet
+	bool _duplexStart(bool singleFrame);
+	void _duplexEnd(void);
+	uint8_t _txByte(uint8_t b);
+
+	// interrupt driven frame pump
+	static uint8_t _pumpHdr[DATA_PKT_HDR_LEN];
+	static const uint8_t* _pumpData;
+	static volatile uint32_t _pumpLen;
+	static volatile uint32_t _pumpPos;
+	static volatile uint8_t _pumpFrameIdx;
+	static volatile bool _pumpAck;
+	static volatile uint32_t _pumpStamp;		// millis() of the last frame activity, for the watchdog
+	static volatile uint32_t _pumpAckStamp;
+	static volatile uint32_t _pumpDoneStamp;	// micros() at the end of the packet, for the esp settle time
+	void _pumpStartFrame(void);
+	void _pumpStop(tePumpState state);
+	void _pumpService(void);
+	void _waitPump(void);
+
+#ifdef WIFI_ISR_RX
+	// interrupt driven reads: the SR and SPI interrupts are the only producer
+	// of the frame queue, readDataISR() in the main context the only consumer
+	static volatile uint8_t _rxQueue[WIFI_ISR_RX_FRAMES][SPI_BUF_LEN];
+	static volatile uint8_t _rxQueueLen[WIFI_ISR_RX_FRAMES];
+	static volatile uint8_t _rxHead;
+	static volatile uint8_t _rxTail;
+	static volatile uint8_t _rxIdx;
+	static volatile uint8_t _rxLen;
+	static volatile bool _rxSized;
+	static volatile uint32_t _rxStamp;
+	// bytes of the packet being received still to come, 0 when the next frame starts a packet
+	static uint32_t _rxRemain;
+	bool _rxStart(void);
+	void _rxEnd(void);
+	void _rxDone(void);
+	void _rxService(void);
+	void _rxTrack(const volatile uint8_t *frame, uint8_t len);
+#endif
+	// a frame of the esp is waiting to be handed to the callback
+	bool _framePending(void);
+
+	// link statistics, see SPI_STAT
+#ifdef WIFI_SPI_STATS
+	tsSpiStats _stats;
+	tsSpiCmdStats* _statCmd(uint8_t cmd, bool add);
+	void _statTx(const uint8_t *pkt, uint32_t len, uint16_t frames = 0, uint32_t wire = 0);
+	void _statRx(uint16_t wire);
+	void _statReply(const uint8_t *frame);
+	void _statWait(uint32_t start, bool ok);
+#endif
+
 	public:
+#ifndef WIFI_LOW_MEMORY
 	uint8_t _rxBuf[SPI_TXBUF_LEN];
 	uint8_t wifiBuf[SPI_TXBUF_LEN];
+#else
+	/*
+	* One area for the three buffers, laid out by when each one is in use:
+	*  ______________________________________________
+	* |   0 .. 31    |    32 .. 63     |   64 .. 95   |
+	* |______________|_________________|______________|
+	* |            _rxBuf              |              |
+	* |              |             wifiBuf            |
+	* |              |                 |  _duplexBuf  |
+	* |______________|_________________|______________|
+	*
+	* A frame is always read into the first slot, which wifiBuf leaves alone.
+	* The duplex frame is captured only by single frame writes, which leave
+	* the second half of wifiBuf unused, and it is moved to the first slot
+	* as soon as the write ends. The second frame of a long reply read before
+	* a command in wifiBuf is written out (_txStaged) goes over its first half,
+	* which the callback keeps on the stack meanwhile.
+	*/
+	union{
+		uint8_t _rxBuf[SPI_TXBUF_LEN];
+		struct{
+			uint8_t _txSkip[SPI_BUF_LEN];
+			uint8_t wifiBuf[SPI_TXBUF_LEN];
+		};
+		struct{
+			uint8_t _duplexSkip[SPI_TXBUF_LEN];
+			uint8_t _duplexBuf[SPI_BUF_LEN];
+		};
+	};
+#endif
 	uint16_t rxIndex;
 	uint16_t payloadSize;
 	static volatile teEspStatus espStatus;
 	static volatile bool multiRead;
 	static volatile bool multiWrite;
+	static volatile tePumpState pumpState;
+	static volatile teRxState rxState;
 	
 	// ESP generic functions
 	SpiDrv();
 	void begin();
 	void end();
 	bool establishESPConnection();
+	uint16_t caps(void);
 	void reset();
 	void off();
 	void on();
@@ -121,20 +325,36 @@ class SpiDrv
 	void sendDataPkt(uint8_t cmd, uint8_t numParam);
 	bool sendParam(uint8_t *param, uint8_t param_len, uint8_t lastParam = NO_LAST_PARAM);
 	bool sendParam(uint16_t param, uint8_t lastParam = NO_LAST_PARAM, bool dataPkt = false);
+	bool sendFrame(const uint8_t *frame, uint8_t len, bool progmem = false);
+	void beginBatch(void);
+	bool endBatch(void);
 	uint32_t sendData(uint8_t cmd, uint8_t* data, uint32_t len);
 	
 	// ESP SPI Data Register functions
-	uint16_t readDataISR(uint8_t *buffer);
-	bool writeData(uint8_t *data, uint32_t len);
+	uint16_t readDataISR(uint8_t *buffer, bool sized = false);
+	bool writeData(const uint8_t *data, uint32_t len, bool progmem = false);
 	bool writeServerData(uint8_t *data, uint32_t len);
+	bool writeServerDataV(const uint8_t *hdr, const tsIoVec *iov, uint8_t cnt, uint32_t len);
+
+	// Interrupt driven data packet transmission
+	bool writeServerDataAsync(uint8_t *hdr, const uint8_t *data, uint32_t len);
+	bool pumpBusy(void);
+
+#ifdef WIFI_SPI_STATS
+	// SPI link statistics
+	const tsSpiStats& stats(void);
+	void resetStats(void);
+	void printStats(Print& out);
+#endif
 	
 	friend void wifiDrvCB(void);
+	friend void handleReply(const uint8_t* frame, uint8_t hnd);
 	friend void _SRcallback(void);
+	friend void _pumpIsr(void);
+	friend void _rxIsr(void);
 	friend class WiFiClass;
 };
 
 extern SpiDrv commDrv;
 
-static SpiDrv *pSpiDrv;
-
 #endif
\ No newline at end of file